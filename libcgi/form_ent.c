@@ -97,8 +97,12 @@ form_entry *get_fes_from_string(char *s)
 	    fe->name[i] = ' ';
 	    break;
 	case '%':
-	    fe->name[i] = dd2c(s[1], s[2]);
-	    s += 2;
+	    if (s[1] && s[2]) {
+		fe->name[i] = dd2c(s[1], s[2]);
+		s += 2;
+	    }
+	    else
+		fe->name[i] = *s;
 	    break;
 	default:
 	    fe->name[i] = *s;
@@ -124,8 +128,12 @@ form_entry *get_fes_from_string(char *s)
 		fe->val[i] = ' ';
 		break;
 	    case '%':
-		fe->val[i] = dd2c(s[1], s[2]);
-		s += 2;
+		if (s[1] && s[2]) {
+		    fe->val[i] = dd2c(s[1], s[2]);
+		    s += 2;
+		}
+		else
+		    fe->val[i] = *s;
 		break;
 	    default:
 		fe->val[i] = *s;
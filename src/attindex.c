@@ -0,0 +1,251 @@
+/*
+** The attachment index.
+**
+** Every message keeps the list of the attachments that were stored in
+** its att-NNNN directory (file name, name in the message, content type
+** and size), filled in by parsemail() as the files are written. With
+** the attachmentsindex option the lists are saved in the "attindex" file
+** of the archive, so the attachment index can be written without looking
+** at the att-NNNN directories again. Archives made before the attindex
+** file existed are scanned once, for the messages it doesn't cover.
+**
+** The file has a "first last" message number line like msgindex,
+** followed by one line per attachment:
+**
+**	msgnum <tab> size <tab> content-type <tab> name <tab> stored-as
+*/
+
+#include "hypermail.h"
+#include "setup.h"
+#include "struct.h"
+#include "parse.h"
+#include "proto.h"
+
+#ifdef HAVE_DIRENT_H
+#ifdef __LCC__
+#include "../lcc/dirent.h"
+#else
+#include <dirent.h>
+#endif
+#else
+#ifdef __LCC__
+#include <direct.h>
+#else
+#include <sys/dir.h>
+#endif
+#endif
+
+/*
+** Adds an attachment at the end of a list. Returns the new entry.
+*/
+
+struct attach *add_attachment(struct attach **list, const char *storedas,
+			      const char *name, const char *contenttype)
+{
+    struct attach *ap = (struct attach *)emalloc(sizeof(struct attach));
+    struct attach **tail;
+
+    ap->storedas = strsav((char *)storedas);
+    ap->name = strsav((char *)(name ? name : ""));
+    ap->contenttype = strsav((char *)(contenttype ? contenttype : ""));
+    ap->id = NULL;
+    ap->descr = NULL;
+    ap->size = 0;
+    ap->next = NULL;
+    for (tail = list; *tail != NULL; tail = &(*tail)->next)
+	;
+    *tail = ap;
+    return ap;
+}
+
+static void free_attachment(struct attach *ap)
+{
+    free(ap->storedas);
+    free(ap->name);
+    free(ap->contenttype);
+    free(ap);
+}
+
+/*
+** Removes the attachment stored as the last component of path,
+** used when a file is unlinked again while parsing.
+*/
+
+void remove_attachment(struct attach **list, const char *path)
+{
+    const char *base = strrchr(path, PATH_SEPARATOR);
+    struct attach *ap;
+
+    base = base ? base + 1 : path;
+    while ((ap = *list) != NULL) {
+	if (!strcmp(ap->storedas, base)) {
+	    *list = ap->next;
+	    free_attachment(ap);
+	}
+	else
+	    list = &ap->next;
+    }
+}
+
+void free_attachments(struct attach *ap)
+{
+    struct attach *next;
+
+    for (; ap != NULL; ap = next) {
+	next = ap->next;
+	free_attachment(ap);
+    }
+}
+
+char *attachmentindex_name(void)
+{
+    char *buf;
+
+    trio_asprintf(&buf, "%s%s", set_dir, "attindex");
+    return buf;
+}
+
+/*
+** Is name the .gz or .br copy of a text attachment in attdir?
+*/
+
+static int is_compressed_copy(const char *attdir, const char *name)
+{
+    size_t len = strlen(name);
+    char *orig;
+    int found;
+
+    if (len <= 3 || (strcmp(name + len - 3, ".gz")
+		     && strcmp(name + len - 3, ".br")))
+	return 0;
+    trio_asprintf(&orig, "%s%c%.*s", attdir, PATH_SEPARATOR, (int)(len - 3), name);
+    found = isfile(orig);
+    free(orig);
+    return found;
+}
+
+/*
+** Rebuilds the list of an old message from its attachment directory,
+** for archives made before there was an attindex file.
+*/
+
+static void scan_attachment_dir(struct emailinfo *em)
+{
+    char *attdir;
+    DIR *dir;
+#ifdef HAVE_DIRENT_H
+    struct dirent *entry;
+#else
+    struct direct *entry;
+#endif
+    struct attach *ap;
+    struct stat fileinfo;
+    char *filename;
+
+    trio_asprintf(&attdir, "%s%c" DIR_PREFIXER "%s", set_dir, PATH_SEPARATOR,
+		  message_name(em));
+    if ((dir = opendir(attdir)) == NULL) {
+	free(attdir);
+	return;
+    }
+    while ((entry = readdir(dir))) {
+	char *name;
+	if (!strcmp(".", entry->d_name) || !strcmp("..", entry->d_name)
+	    || !strcmp(META_DIR, entry->d_name)
+	    || is_compressed_copy(attdir, entry->d_name))
+	    continue;
+	/* parsemail() stores "NN-name" when the name is missing or taken */
+	name = entry->d_name;
+	if (isdigit((unsigned char)name[0]) && isdigit((unsigned char)name[1])
+	    && name[2] == '-')
+	    name += 3;
+	ap = add_attachment(&em->attachlist, entry->d_name, name, NULL);
+	trio_asprintf(&filename, "%s%c%s", attdir, PATH_SEPARATOR, entry->d_name);
+	ap->size = stat(filename, &fileinfo) ? -1 : (long)fileinfo.st_size;
+	free(filename);
+    }
+    closedir(dir);
+    free(attdir);
+}
+
+/*
+** Reads the attindex file into the lists of the old messages.
+*/
+
+void load_attachmentindex(void)
+{
+    char *filename;
+    FILE *fp;
+    char line[MAXLINE];
+    int startnum = 0, covered = -1;
+    int num;
+    struct emailinfo *em;
+
+    filename = attachmentindex_name();
+    fp = fopen(filename, "r");
+    free(filename);
+    if (fp) {
+	if (fgets(line, sizeof(line), fp)
+	    && sscanf(line, "%d %d", &startnum, &covered) != 2)
+	    covered = -1;
+	while (covered != -1 && fgets(line, sizeof(line), fp)) {
+	    char *field[5];
+	    char *ptr = line;
+	    int i;
+	    ptr[strcspn(ptr, "\r\n")] = '\0';
+	    for (i = 0; i < 4 && ptr; ++i) {
+		field[i] = ptr;
+		if ((ptr = strchr(ptr, '\t')) != NULL)
+		    *ptr++ = '\0';
+	    }
+	    if (!ptr || !*ptr)
+		continue;	/* damaged line */
+	    field[4] = ptr;
+	    num = atoi(field[0]);
+	    if (num > covered || !hashnumlookup(num, &em))
+		continue;
+	    add_attachment(&em->attachlist, field[4], field[3],
+			   field[2])->size = atol(field[1]);
+	}
+	fclose(fp);
+    }
+
+    for (num = covered + 1; num <= max_msgnum; ++num)
+	if (hashnumlookup(num, &em))
+	    scan_attachment_dir(em);
+}
+
+/*
+** Writes the attindex file for the messages below maxnum.
+*/
+
+void write_attachmentindex(int maxnum)
+{
+    char *filename;
+    FILE *fp;
+    int num;
+    struct emailinfo *em;
+    struct attach *ap;
+
+    filename = attachmentindex_name();
+    if ((fp = fopen(filename, "w")) == NULL) {
+	snprintf(errmsg, sizeof(errmsg), "%s \"%s\".", lang[MSG_COULD_NOT_WRITE], filename);
+	progerr(errmsg);
+    }
+    fprintf(fp, "%.04d %.04d\n", 0, maxnum - 1);
+    for (num = 0; num < maxnum; ++num) {
+	if (!hashnumlookup(num, &em))
+	    continue;
+	for (ap = em->attachlist; ap != NULL; ap = ap->next) {
+	    char *p;
+	    for (p = ap->name; *p; ++p)
+		if (*p == '\t' || *p == '\n' || *p == '\r')
+		    *p = ' ';
+	    fprintf(fp, "%d\t%ld\t%s\t%s\t%s\n", num, ap->size,
+		    ap->contenttype, ap->name, ap->storedas);
+	}
+    }
+    fclose(fp);
+    chmod(filename, set_filemode);
+    free(filename);
+}
@@ -0,0 +1,700 @@
+/*
+** The binary header cache (usebinindex).
+**
+** An alternative to the gdbm .hm2index that needs no library and no
+** parsing when it is read back. It is made of two files:
+**
+**   .hm3index    a header followed by one fixed-size record per
+**                message number: flags, dates as seconds, deletion
+**                state, the message it replies to and the offsets
+**                of its strings
+**   .hm3strings  the strings of all the records, each '\0' terminated
+**
+** Both are memory-mapped (or read in one go where there is no mmap)
+** when old headers are loaded, so a message costs one array access.
+** Updates only ever append to .hm3strings. The records are kept until
+** binindex_close(), which writes the strings, then the records of the
+** new messages, then the header with the string heap size and the last
+** message number, and only then the records that replace older ones,
+** so the messages added by an interrupted run are ignored rather than
+** half read. A run that isn't incremental writes both files anew under
+** temporary names instead, so that the heap doesn't keep the strings of
+** every earlier run.
+**
+** With mbox_checkpoint the header also remembers where the last message
+** read from the mbox began and ended, for resume_mbox().
+**
+** Each record also has the name of the message file, with its folder,
+** and the header the folder layout of the archive, so that the last
+** message number and the message file names can be taken from here
+** instead of scanning the archive directory or reading msgindex.
+**
+** With linkquotes, the "In reply to" links of a message page are kept in
+** its record once it has been read from the page, see read_reply_links(),
+** until the page is written again.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+
+#include "hypermail.h"
+#include "setup.h"
+#include "struct.h"
+#include "proto.h"
+#include "binindex.h"
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#define USE_MMAP
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define BINDEX_MAGIC     "HMBINDX4"
+#define BINDEX_BYTEORDER 0x01020304
+
+#define BINREC_PRESENT   1
+#define BINREC_REPLY     2	/* reply_to is known */
+#define BINREC_MAYBE     4	/* maybereply of crossindex() */
+#define BINREC_LINK      8	/* the reply links are known */
+
+/* the strings of a record, in this order */
+enum { BINSTR_FROMDATE, BINSTR_DATE, BINSTR_NAME, BINSTR_EMAIL,
+       BINSTR_SUBJECT, BINSTR_MSGID, BINSTR_INREPLYTO, BINSTR_CHARSET,
+       BINSTR_FILENAME, BINSTR_NUM };
+
+struct binindex_header {
+    char magic[8];
+    uint32_t byteorder;		/* files are only read where they were made */
+    uint32_t record_size;
+    int32_t max_msgnum;		/* -1 until a run has completed */
+    int32_t delete_level;
+    uint64_t heap_size;		/* bytes of .hm3strings in use */
+    int64_t mbox_start;		/* the last message read from the mbox */
+    int64_t mbox_end;
+    uint64_t mbox_sum;		/* checksum of its bytes */
+    int32_t mbox_msgnum;	/* max_msgnum after it was read */
+    int32_t msgsperfolder;	/* the folder layout, see set_layout() */
+    uint32_t folder_by_date;
+    int32_t nonsequential;
+};
+
+struct binindex_record {
+    int32_t flags;		/* zero for a message number not (yet) used */
+    int32_t msgnum;
+    int32_t is_deleted;
+    int32_t reply_to;
+    int32_t reply_links[2];	/* the "In reply to" links of its page */
+    int32_t sure_reply_link;
+    int32_t unused;
+    int64_t date;
+    int64_t fromdate;
+    int64_t exp_time;
+    uint64_t str[BINSTR_NUM];	/* offsets in .hm3strings */
+};
+
+struct binindex {
+    char *data;
+    size_t len;
+    int data_mapped;
+    char *heap;
+    size_t heap_len;
+    int heap_mapped;
+    const struct binindex_header *hdr;
+    const struct binindex_record *records;
+    int num_records;
+};
+
+char *binindex_name(const char *dir, const char *name)
+{
+    char *buf;
+
+    trio_asprintf(&buf, (*dir && dir[strlen(dir) - 1] == '/')
+		  ? "%s%s" : "%s/%s", dir, name);
+    return buf;
+}
+
+/*
+** Maps a whole file read-only. Returns NULL if it can't be read.
+*/
+
+char *map_file(const char *filename, size_t *len, int *mapped)
+{
+    int fd;
+    struct stat stbuf;
+    char *data;
+
+    if ((fd = open(filename, O_RDONLY | O_BINARY)) == -1)
+	return NULL;
+    if (fstat(fd, &stbuf) || stbuf.st_size == 0) {
+	close(fd);
+	return NULL;
+    }
+    *len = (size_t)stbuf.st_size;
+#ifdef USE_MMAP
+    data = mmap(NULL, *len, PROT_READ, MAP_SHARED, fd, 0);
+    if (data != MAP_FAILED) {
+	close(fd);
+	*mapped = 1;
+	return data;
+    }
+#endif
+    *mapped = 0;
+    data = (char *)emalloc(*len);
+    if (read(fd, data, *len) != (ssize_t)*len) {
+	free(data);
+	data = NULL;
+    }
+    close(fd);
+    return data;
+}
+
+void unmap_file(char *data, size_t len, int mapped)
+{
+    if (!data)
+	return;
+#ifdef USE_MMAP
+    if (mapped) {
+	munmap(data, len);
+	return;
+    }
+#endif
+    free(data);
+}
+
+static int header_is_valid(const struct binindex_header *hdr)
+{
+    return !memcmp(hdr->magic, BINDEX_MAGIC, sizeof(hdr->magic))
+	&& hdr->byteorder == BINDEX_BYTEORDER
+	&& hdr->record_size == sizeof(struct binindex_record)
+	&& hdr->heap_size >= 1;
+}
+
+/*
+** Maps the index of the archive in dir. Returns NULL if there is none,
+** or if it was written by another version or another kind of machine.
+*/
+
+struct binindex *binindex_map(const char *dir)
+{
+    struct binindex *bi;
+    char *filename;
+
+    bi = (struct binindex *)emalloc(sizeof(struct binindex));
+    memset(bi, 0, sizeof(struct binindex));
+
+    filename = binindex_name(dir, BIN_INDEX_NAME);
+    bi->data = map_file(filename, &bi->len, &bi->data_mapped);
+    free(filename);
+    filename = binindex_name(dir, BIN_INDEX_STRINGS_NAME);
+    bi->heap = map_file(filename, &bi->heap_len, &bi->heap_mapped);
+    free(filename);
+
+    bi->hdr = (const struct binindex_header *)bi->data;
+    if (!bi->data || !bi->heap || bi->len < sizeof(struct binindex_header)
+	|| !header_is_valid(bi->hdr) || bi->hdr->heap_size > bi->heap_len
+	/* so that every string ends within the heap */
+	|| bi->heap[bi->hdr->heap_size - 1] != '\0') {
+	binindex_unmap(bi);
+	return NULL;
+    }
+    bi->records = (const struct binindex_record *)
+	(bi->data + sizeof(struct binindex_header));
+    bi->num_records = (int)((bi->len - sizeof(struct binindex_header))
+			    / sizeof(struct binindex_record));
+    return bi;
+}
+
+int binindex_max_msgnum(struct binindex *bi)
+{
+    return bi->hdr->max_msgnum;
+}
+
+/*
+** Hashes the folder_by_date format, so that a change of it is noticed.
+*/
+
+static uint32_t layout_hash(const char *s)
+{
+    uint32_t hash = 2166136261U;
+
+    if (!s)
+	return 0;
+    while (*s) {
+	hash ^= (unsigned char)*s++;
+	hash *= 16777619U;
+    }
+    return hash;
+}
+
+static void set_layout(struct binindex_header *hdr)
+{
+    hdr->msgsperfolder = set_msgsperfolder;
+    hdr->folder_by_date = layout_hash(set_folder_by_date);
+    hdr->nonsequential = set_nonsequential;
+}
+
+/*
+** Were the file names in the index made with the folder options set
+** now?
+*/
+
+int binindex_layout_matches(struct binindex *bi)
+{
+    struct binindex_header now;
+
+    set_layout(&now);
+    return bi->hdr->msgsperfolder == now.msgsperfolder
+	&& bi->hdr->folder_by_date == now.folder_by_date
+	&& bi->hdr->nonsequential == now.nonsequential;
+}
+
+int binindex_delete_level(struct binindex *bi)
+{
+    return bi->hdr->delete_level;
+}
+
+/*
+** Gets the mbox checkpoint. Returns 0 if there is none, or if messages
+** were added some other way since it was taken.
+*/
+
+int binindex_checkpoint(struct binindex *bi, long *start, long *end,
+			uint64_t *sum)
+{
+    if (bi->hdr->mbox_end <= bi->hdr->mbox_start
+	|| bi->hdr->mbox_msgnum != bi->hdr->max_msgnum)
+	return 0;
+    *start = (long)bi->hdr->mbox_start;
+    *end = (long)bi->hdr->mbox_end;
+    *sum = bi->hdr->mbox_sum;
+    return 1;
+}
+
+/*
+** Fills in msg for message num. Returns 0 if the index has no complete
+** record for it.
+*/
+
+int binindex_fetch(struct binindex *bi, int num, struct binindex_msg *msg)
+{
+    const struct binindex_record *rec;
+    char *str[BINSTR_NUM];
+    int i;
+
+    if (num < 0 || num >= bi->num_records || num > bi->hdr->max_msgnum)
+	return 0;
+    rec = &bi->records[num];
+    if (!(rec->flags & BINREC_PRESENT) || rec->msgnum != num)
+	return 0;
+    for (i = 0; i < BINSTR_NUM; i++) {
+	if (rec->str[i] >= bi->hdr->heap_size)
+	    return 0;
+	str[i] = bi->heap + rec->str[i];
+    }
+
+    msg->msgnum = num;
+    msg->is_deleted = rec->is_deleted;
+    msg->date = (time_t)rec->date;
+    msg->fromdate = (time_t)rec->fromdate;
+    msg->exp_time = (long)rec->exp_time;
+    msg->reply_to = (rec->flags & BINREC_REPLY) ? rec->reply_to : REPLY_UNKNOWN;
+    msg->maybereply = (rec->flags & BINREC_MAYBE) != 0;
+    if (rec->flags & BINREC_LINK) {
+	msg->reply_links[0] = rec->reply_links[0];
+	msg->reply_links[1] = rec->reply_links[1];
+	msg->sure_reply_link = rec->sure_reply_link;
+    }
+    else {
+	msg->reply_links[0] = msg->reply_links[1] = REPLY_UNKNOWN;
+	msg->sure_reply_link = REPLY_UNKNOWN;
+    }
+    msg->fromdatestr = str[BINSTR_FROMDATE];
+    msg->datestr = str[BINSTR_DATE];
+    msg->name = str[BINSTR_NAME];
+    msg->email = str[BINSTR_EMAIL];
+    msg->subject = str[BINSTR_SUBJECT];
+    msg->msgid = str[BINSTR_MSGID];
+    msg->inreplyto = str[BINSTR_INREPLYTO];
+    msg->charset = str[BINSTR_CHARSET];
+    msg->filename = str[BINSTR_FILENAME];
+    return 1;
+}
+
+void binindex_unmap(struct binindex *bi)
+{
+    unmap_file(bi->data, bi->len, bi->data_mapped);
+    unmap_file(bi->heap, bi->heap_len, bi->heap_mapped);
+    free(bi);
+}
+
+/*
+** Updating.
+*/
+
+static FILE *rec_fp;
+static FILE *heap_fp;
+static struct binindex_header update_hdr;
+static int rebuilding;		/* the files are being written anew */
+static struct binindex_record *pending;	/* the records stored, by msgnum */
+static int num_pending;
+static long checkpoint_start, checkpoint_end;	/* see binindex_set_checkpoint() */
+static uint64_t checkpoint_sum;
+
+static void write_error(const char *name)
+{
+    char *filename = binindex_name(set_dir, name);
+    snprintf(errmsg, sizeof(errmsg), "%s \"%s\".", lang[MSG_COULD_NOT_WRITE], filename);
+    free(filename);
+    progerr(errmsg);
+}
+
+/*
+** The name a file of the index is written under while it is rebuilt.
+*/
+
+static char *rebuild_name(const char *name)
+{
+    char *filename = binindex_name(set_dir, name);
+    char *tmpname;
+
+    trio_asprintf(&tmpname, "%s.tmp", filename);
+    free(filename);
+    return tmpname;
+}
+
+/*
+** Creates both files, empty, under their temporary names. The heap
+** starts with the '\0' that all the empty strings point to.
+*/
+
+static int create_index(void)
+{
+    char *filename;
+
+    filename = rebuild_name(BIN_INDEX_NAME);
+    rec_fp = fopen(filename, "w+b");
+    chmod(filename, set_filemode);
+    free(filename);
+    filename = rebuild_name(BIN_INDEX_STRINGS_NAME);
+    heap_fp = fopen(filename, "w+b");
+    chmod(filename, set_filemode);
+    free(filename);
+    if (!rec_fp || !heap_fp || putc('\0', heap_fp) == EOF)
+	return 0;
+
+    memset(&update_hdr, 0, sizeof(update_hdr));
+    memcpy(update_hdr.magic, BINDEX_MAGIC, sizeof(update_hdr.magic));
+    update_hdr.byteorder = BINDEX_BYTEORDER;
+    update_hdr.record_size = sizeof(struct binindex_record);
+    update_hdr.max_msgnum = -1;
+    update_hdr.heap_size = 1;
+    update_hdr.mbox_msgnum = -1;
+    set_layout(&update_hdr);
+    return fwrite(&update_hdr, sizeof(update_hdr), 1, rec_fp) == 1;
+}
+
+/*
+** Opens the index of set_dir for update, creating it if necessary or
+** if rebuild is set. Returns 0 if that isn't possible. A new index
+** replaces the old one in binindex_close(), which then stores all the
+** messages below its max_num that weren't stored in this run.
+*/
+
+int binindex_open(int rebuild)
+{
+    char *filename;
+
+    rebuilding = 0;
+    num_pending = 0;
+    if (!rebuild) {
+	filename = binindex_name(set_dir, BIN_INDEX_NAME);
+	rec_fp = fopen(filename, "r+b");
+	free(filename);
+	filename = binindex_name(set_dir, BIN_INDEX_STRINGS_NAME);
+	heap_fp = fopen(filename, "r+b");
+	free(filename);
+	if (rec_fp && heap_fp
+	    && fread(&update_hdr, sizeof(update_hdr), 1, rec_fp) == 1
+	    && header_is_valid(&update_hdr)
+	    /* anything after heap_size was left by an interrupted run */
+	    && !fseek(heap_fp, (long)update_hdr.heap_size, SEEK_SET)) {
+	    update_hdr.delete_level = set_delete_level;
+	    set_layout(&update_hdr);
+	    return 1;
+	}
+	if (rec_fp)
+	    fclose(rec_fp);
+	if (heap_fp)
+	    fclose(heap_fp);
+    }
+    if (create_index()) {
+	update_hdr.delete_level = set_delete_level;
+	rebuilding = 1;
+	return 1;
+    }
+    if (rec_fp)
+	fclose(rec_fp);
+    if (heap_fp)
+	fclose(heap_fp);
+    rec_fp = heap_fp = NULL;
+    return 0;
+}
+
+static uint64_t store_string(const char *s)
+{
+    uint64_t offset = update_hdr.heap_size;
+    size_t len;
+
+    if (!s || !*s)
+	return 0;
+    len = strlen(s) + 1;
+    if (fwrite(s, len, 1, heap_fp) != 1)
+	write_error(BIN_INDEX_STRINGS_NAME);
+    update_hdr.heap_size += len;
+    return offset;
+}
+
+static int32_t reply_flags(struct emailinfo *ep)
+{
+    if (ep->reply_to == REPLY_UNKNOWN)
+	return 0;
+    return BINREC_REPLY | (ep->maybereply ? BINREC_MAYBE : 0);
+}
+
+static int32_t link_flags(struct emailinfo *ep)
+{
+    return ep->reply_links[0] == REPLY_UNKNOWN ? 0 : BINREC_LINK;
+}
+
+static long record_offset(int num)
+{
+    return (long)(sizeof(struct binindex_header)
+		  + (size_t)num * sizeof(struct binindex_record));
+}
+
+/*
+** The record that binindex_close() will write for message num.
+*/
+
+static struct binindex_record *pending_record(int num)
+{
+    if (num >= num_pending) {
+	int size = num_pending ? num_pending : 256;
+	while (size <= num)
+	    size *= 2;
+	pending = (struct binindex_record *)
+	    realloc(pending, size * sizeof(struct binindex_record));
+	if (!pending)
+	    progerr("Out of memory.");
+	memset(pending + num_pending, 0,
+	       (size - num_pending) * sizeof(struct binindex_record));
+	num_pending = size;
+    }
+    return &pending[num];
+}
+
+/*
+** Stores the record of a message, replacing any older one. It is
+** stored as its page is written, so the reply links of the old page are
+** forgotten.
+*/
+
+void binindex_store(struct emailinfo *ep)
+{
+    struct binindex_record rec;
+    char *filename;
+
+    if (!rec_fp || ep->msgnum < 0)
+	return;
+    memset(&rec, 0, sizeof(rec));
+    rec.flags = BINREC_PRESENT | reply_flags(ep);
+    rec.msgnum = ep->msgnum;
+    rec.is_deleted = ep->is_deleted;
+    rec.reply_to = ep->reply_to;
+    rec.date = ep->date;
+    rec.fromdate = ep->fromdate;
+    rec.exp_time = ep->exp_time;
+    rec.str[BINSTR_FROMDATE] = store_string(ep->fromdatestr);
+    rec.str[BINSTR_DATE] = store_string(ep->datestr);
+    rec.str[BINSTR_NAME] = store_string(ep->name);
+    rec.str[BINSTR_EMAIL] = store_string(ep->emailaddr);
+    rec.str[BINSTR_SUBJECT] = store_string(ep->subject);
+    rec.str[BINSTR_MSGID] = store_string(ep->msgid);
+    rec.str[BINSTR_INREPLYTO] = store_string(ep->inreplyto);
+    rec.str[BINSTR_CHARSET] = store_string(ep->charset);
+    trio_asprintf(&filename, "%s%s", ep->subdir ? ep->subdir->subdir : "",
+		  message_name(ep));
+    rec.str[BINSTR_FILENAME] = store_string(filename);
+    free(filename);
+
+    *pending_record(ep->msgnum) = rec;
+    ep->reply_links[0] = ep->reply_links[1] = REPLY_UNKNOWN;
+    ep->sure_reply_link = REPLY_UNKNOWN;
+    ep->flags &= ~(STORE_REPLY | STORE_LINK);
+}
+
+/*
+** Updates the reply_to of the messages below maxnum that were loaded
+** from the index and that crossindex() looked up again with another
+** answer, and the reply links read from their pages. Only those fields
+** of the records change, so nothing is added to the string heap and the
+** records not stored in this run are changed where they are.
+*/
+
+void binindex_store_replies(int maxnum)
+{
+    struct emailinfo **bynum;
+    struct emailinfo *ep;
+    int32_t flags, fields[4];
+    int num;
+
+    if (!rec_fp || !num_reply_updates)
+	return;
+    bynum = hashnumtable(maxnum - 1);
+    for (num = 0; num < maxnum; num++) {
+	if ((ep = bynum[num]) == NULL
+	    || !(ep->flags & (STORE_REPLY | STORE_LINK)))
+	    continue;
+	flags = BINREC_PRESENT | reply_flags(ep) | link_flags(ep);
+	fields[0] = ep->reply_to;
+	fields[1] = ep->reply_links[0];
+	fields[2] = ep->reply_links[1];
+	fields[3] = ep->sure_reply_link;
+	if (num < num_pending && pending[num].flags) {
+	    struct binindex_record *rec = &pending[num];
+	    rec->flags = flags;
+	    rec->reply_to = fields[0];
+	    rec->reply_links[0] = fields[1];
+	    rec->reply_links[1] = fields[2];
+	    rec->sure_reply_link = fields[3];
+	}
+	else if (rebuilding)
+	    ;			/* binindex_close() stores it */
+	else if (fseek(rec_fp, record_offset(num)
+		  + (long)offsetof(struct binindex_record, reply_to), SEEK_SET)
+	    || fwrite(fields, sizeof(fields), 1, rec_fp) != 1
+	    || fseek(rec_fp, record_offset(num), SEEK_SET)
+	    || fwrite(&flags, sizeof(flags), 1, rec_fp) != 1)
+	    write_error(BIN_INDEX_NAME);
+	ep->flags &= ~(STORE_REPLY | STORE_LINK);
+    }
+    free(bynum);
+    num_reply_updates = 0;
+}
+
+/*
+** Sets the mbox checkpoint that the next binindex_close() writes, once
+** the messages read up to it are in the index.
+*/
+
+void binindex_set_checkpoint(long start, long end, uint64_t sum)
+{
+    checkpoint_start = start;
+    checkpoint_end = end;
+    checkpoint_sum = sum;
+}
+
+/*
+** Writes the stored records of the messages from first to last.
+*/
+
+static void write_pending(int first, int last)
+{
+    int num;
+
+    if (last >= num_pending)
+	last = num_pending - 1;
+    for (num = first < 0 ? 0 : first; num <= last; num++)
+	if (pending[num].flags
+	    && (fseek(rec_fp, record_offset(num), SEEK_SET)
+		|| fwrite(&pending[num], sizeof(struct binindex_record), 1,
+			  rec_fp) != 1))
+	    write_error(BIN_INDEX_NAME);
+}
+
+/*
+** Puts a rebuilt file of the index in place of the old one.
+*/
+
+static void replace_file(const char *name)
+{
+    char *filename = binindex_name(set_dir, name);
+    char *tmpname = rebuild_name(name);
+
+    if (rename(tmpname, filename) == -1)
+	write_error(name);
+    free(tmpname);
+    free(filename);
+}
+
+/*
+** Commits the update: the strings first, then the records of the new
+** messages, then the header that makes them visible, and last the
+** records that replace those of older messages, whose strings are then
+** there to point to.
+*/
+
+void binindex_close(int max_num)
+{
+    int old_max = update_hdr.max_msgnum;
+    char *filename;
+
+    if (!rec_fp)
+	return;
+    if (rebuilding) {
+	struct emailinfo *ep;
+	int num;
+	for (num = 0; num <= max_num; num++)
+	    if ((num >= num_pending || !pending[num].flags)
+		&& hashnumlookup(num, &ep))
+		binindex_store(ep);
+	old_max = max_num;
+    }
+    if (fclose(heap_fp))
+	write_error(BIN_INDEX_STRINGS_NAME);
+    update_hdr.max_msgnum = max_num;
+    if (checkpoint_end > checkpoint_start) {
+	update_hdr.mbox_start = checkpoint_start;
+	update_hdr.mbox_end = checkpoint_end;
+	update_hdr.mbox_sum = checkpoint_sum;
+	update_hdr.mbox_msgnum = max_num;
+    }
+    write_pending(old_max + 1, num_pending - 1);
+    if (fflush(rec_fp)
+	|| fseek(rec_fp, 0L, SEEK_SET)
+	|| fwrite(&update_hdr, sizeof(update_hdr), 1, rec_fp) != 1
+	|| fflush(rec_fp))
+	write_error(BIN_INDEX_NAME);
+    write_pending(0, old_max);
+    if (fclose(rec_fp))
+	write_error(BIN_INDEX_NAME);
+    rec_fp = heap_fp = NULL;
+    free(pending);
+    pending = NULL;
+    num_pending = 0;
+
+    if (rebuilding) {
+	/* without an index, the next run makes one from the pages */
+	filename = binindex_name(set_dir, BIN_INDEX_NAME);
+	unlink(filename);
+	free(filename);
+	replace_file(BIN_INDEX_STRINGS_NAME);
+	replace_file(BIN_INDEX_NAME);
+	rebuilding = 0;
+    }
+}
+
+/*
+** Writes a new index with all the messages below maxnum, for archives
+** that didn't have one yet (or had a gdbm one).
+*/
+
+void binindex_write_all(int maxnum)
+{
+    if (binindex_open(TRUE))
+	binindex_close(maxnum - 1);
+}
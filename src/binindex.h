@@ -0,0 +1,55 @@
+#ifndef BINDEX_H_INCLUDED
+#define BINDEX_H_INCLUDED
+
+/*
+** binindex.c functions
+*/
+
+#include <stdint.h>
+
+#include "hypermail.h"
+
+/* the summary of one message, as binindex_fetch() returns it; the
+   strings point into the mapped index and are never NULL */
+struct binindex_msg {
+    int msgnum;
+    int is_deleted;
+    time_t date;
+    time_t fromdate;
+    long exp_time;
+    int reply_to;		/* REPLY_UNKNOWN if the index doesn't know */
+    int maybereply;
+    int reply_links[2];		/* REPLY_UNKNOWN if the page wasn't read */
+    int sure_reply_link;
+    char *fromdatestr;
+    char *datestr;
+    char *name;
+    char *email;
+    char *subject;
+    char *msgid;
+    char *inreplyto;
+    char *charset;
+    char *filename;		/* as message_name() made it, with its folder */
+};
+
+struct binindex;
+
+char *binindex_name(const char *, const char *);
+char *map_file(const char *, size_t *, int *);
+void unmap_file(char *, size_t, int);
+struct binindex *binindex_map(const char *);
+int binindex_max_msgnum(struct binindex *);
+int binindex_layout_matches(struct binindex *);
+int binindex_delete_level(struct binindex *);
+int binindex_checkpoint(struct binindex *, long *, long *, uint64_t *);
+int binindex_fetch(struct binindex *, int, struct binindex_msg *);
+void binindex_unmap(struct binindex *);
+
+int binindex_open(int);
+void binindex_store(struct emailinfo *);
+void binindex_store_replies(int);
+void binindex_set_checkpoint(long, long, uint64_t);
+void binindex_close(int);
+void binindex_write_all(int);
+
+#endif				/* BINDEX_H_INCLUDED */
@@ -38,6 +38,7 @@
 #else
 #include <sys/dir.h>
 #endif
+#include "binindex.h"
 #ifdef GDBM
 #include "gdbm.h"
 #endif
@@ -343,6 +344,47 @@ void symlink_latest()
 #endif
 }
 
+/*
+** Takes the last message number from the binary index, if its file
+** names were made for the folder layout set now and the archive agrees
+** with it: the file of that message is there and, where the name of
+** the next one is known, that one isn't. Returns -2 if the directory
+** has to be scanned instead.
+*/
+
+static int indexed_max_msgnum(void)
+{
+    struct binindex *bi;
+    struct binindex_msg msg;
+    char *filename;
+    int max_num = -2;
+
+    if ((bi = binindex_map(set_dir)) == NULL)
+	return -2;
+    if (binindex_layout_matches(bi)
+	&& binindex_fetch(bi, binindex_max_msgnum(bi), &msg)
+	&& *msg.filename) {
+	trio_asprintf(&filename, "%s%s.%s", set_dir, msg.filename, set_htmlsuffix);
+	if (isfile(filename))
+	    max_num = msg.msgnum;
+	free(filename);
+    }
+    binindex_unmap(bi);
+    if (max_num >= 0 && !set_nonsequential && !set_folder_by_date) {
+	if (set_msgsperfolder)
+	    trio_asprintf(&filename, "%s%d/%.4d.%s", set_dir,
+			  (max_num + 1) / set_msgsperfolder, max_num + 1,
+			  set_htmlsuffix);
+	else
+	    trio_asprintf(&filename, "%s%.4d.%s", set_dir, max_num + 1,
+			  set_htmlsuffix);
+	if (isfile(filename))
+	    max_num = -2;	/* written by a run that didn't complete */
+	free(filename);
+    }
+    return max_num;
+}
+
 int find_max_msgnum()
 {
     DIR *dir;
@@ -356,6 +398,11 @@ int find_max_msgnum()
     char *s_dir = strsav(set_dir);
     int len = (int)strlen(s_dir);
 
+    if (set_usebinindex && (max_num = indexed_max_msgnum()) != -2) {
+	free(s_dir);
+	return max_num;
+    }
+    max_num = -1;
     if (len > 0 && s_dir[len - 1] == PATH_SEPARATOR)
        s_dir[len - 1] = 0;
     dir = opendir(s_dir);
@@ -366,6 +413,16 @@ int find_max_msgnum()
 	return loadoldheadersfromGDBMindex(set_dir, 1) - 1;
     }
 #endif
+    if (set_folder_by_date && set_usebinindex) {
+	struct binindex *bi = binindex_map(set_dir);
+	if (bi) {
+	    max_num = binindex_max_msgnum(bi);
+	    binindex_unmap(bi);
+	}
+	closedir(dir);
+	free(s_dir);
+	return max_num;
+    }
     if (set_msgsperfolder) {
         int max_folder = -1;
 	char *tmpptr;
@@ -463,12 +520,30 @@ char **read_msgnum_id_table(int max_num)
     FILE *fp;
     char line[MAXLINE];
     char *buf;
+    struct binindex *bi;
 
     if (max_num == -1)
       return NULL;
 
 	table = (char **)calloc(sizeof(char *), max_num + 1);
 
+    /* the binary index has the same names, without parsing */
+    if (set_usebinindex && (bi = binindex_map(set_dir)) != NULL) {
+	if (binindex_layout_matches(bi) && binindex_max_msgnum(bi) >= max_num) {
+	    struct binindex_msg msg;
+	    int num;
+	    for (num = 0; num <= max_num; num++) {
+		if (binindex_fetch(bi, num, &msg) && *msg.filename) {
+		    char *name = strrchr(msg.filename, '/');
+		    table[num] = strsav(name ? name + 1 : msg.filename);
+		}
+	    }
+	    binindex_unmap(bi);
+	    return table;
+	}
+	binindex_unmap(bi);
+    }
+
     /* open the index file */
 	buf = messageindex_name();
 	fp = fopen(buf, "r");
@@ -808,6 +883,17 @@ int matches_existing(int msgnum)
       free(indexname);
   }  
 #endif
+  if (set_usebinindex) {
+      struct binindex *bi = binindex_map(set_dir);
+      struct binindex_msg msg;
+
+      if (bi) {
+	  int same = !binindex_fetch(bi, eptr->msgnum, &msg)
+	      || !strcmp(msg.msgid, eptr->msgid);
+	  binindex_unmap(bi);
+	  return same;
+      }
+  }
   if (!set_usegdbm) {
 	int msgids_are_same;
 	msgids_are_same = parse_old_html(msgnum, eptr, 0, 0, NULL, 1);
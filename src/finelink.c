@@ -26,6 +26,10 @@
 #include <string.h>
 #include <ctype.h>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 static int str_similar_str(const char *str1, const char *str2);
 static char *stripwhitespace(const char *line);
 static int new_reply_to = -1;
@@ -249,15 +253,26 @@ static int add_anchor(int msgnum, int quoting_msgnum, int quote_num, const char
 	    snprintf(errmsg, sizeof(errmsg), "Couldn't chmod \"%s\" to %o.", filename, set_filemode);
 	    progerr(errmsg);
 	}
+	compress_page(filename);
     }
     free(filename);
     free(tmpfilename);
     return matches == 1;
 }
 
-static char *unquote_and_strip(char *line)
+/* the line without prefix, which unquote() takes from the quote
+   prefix of the message it is writing */
+static char *unquote_prefix(char *line, const char *prefix)
+{
+    size_t len = strlen(prefix);
+    if (len && !strncmp(prefix, line, len))
+	line += len;
+    return line;
+}
+
+static char *unquote_and_strip(char *line, const char *prefix)
 {
-    char *p = unquote(line);
+    char *p = unquote_prefix(line, prefix);
     char *p2;
     char *cvtd_line;
     while (*p && isspace(*p))
@@ -272,6 +287,295 @@ static char *unquote_and_strip(char *line)
     return cvtd_line;
 }
 
+/*
+** The text search_for_quote() looks for: the count_quoted_lines quoted
+** lines from bp on, without the prefix, line2 being the first of them
+** unquoted and stripped.
+*/
+
+static void quote_search_text(const struct body *bp, const char *line2, int count_quoted_lines, const char *prefix, struct Push *full_line, struct Push *exact_line)
+{
+    char *p;
+    int i;
+    INIT_PUSH(*full_line);
+    INIT_PUSH(*exact_line);
+    PushString(full_line, p = stripwhitespace(line2));
+    free(p);
+    PushString(exact_line, line2);
+    for (i = 1; i < count_quoted_lines && (bp = bp->next); ++i) {
+	char *stripped = unquote_and_strip(bp->line, prefix);
+	PushByte(full_line, '\n');
+	PushString(full_line, p = stripwhitespace(stripped));
+	free(p);
+	free(stripped);
+	PushString(exact_line, unquote_prefix(bp->line, prefix));
+    }
+}
+
+/*
+** Quote matching ahead of the pages. Before writearticles() writes a
+** batch of messages, match_quotes() has the linkquotes_threads threads
+** search for their quoted lines the way handle_quoted_text() goes
+** through them: line by line in each quoted passage, until one is
+** found. Once analyze_headers() is done searching only reads the
+** bigram index, so url_replying_to() takes the results from here for
+** the lines it asks about with the same text; any other line it still
+** searches itself.
+*/
+
+struct quote_passage {
+    const struct body *bp;	/* its first line */
+    int count_lines;
+};
+
+struct quote_match {
+    const struct body *bp;	/* the line it was searched for */
+    int max_msgnum;
+    char *full_line;
+    char *exact_line;
+    String_Match match;
+    struct quote_match *next;	/* of the same message */
+    struct quote_match *hash_next;
+};
+
+struct quote_job {
+    struct emailinfo *email;
+    char prefix[80];		/* as find_quote_prefix() guessed it */
+    struct quote_passage *passages;
+    int num_passages;
+    struct quote_match *matches;
+};
+
+static struct quote_job *quote_jobs = NULL;
+static int num_quote_jobs = 0;
+static struct quote_match **quote_matches = NULL;	/* by line */
+static unsigned quote_matches_mask = 0;
+
+static unsigned quote_match_hash(const struct body *bp)
+{
+    return (unsigned)(((size_t)bp >> 4) * 2654435761u);
+}
+
+#ifdef HAVE_PTHREAD
+
+static pthread_mutex_t quote_job_lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_quote_job = 0;
+
+static int quote_threads(void)
+{
+    int threads = set_linkquotes_threads;
+#ifdef _SC_NPROCESSORS_ONLN
+    if (threads <= 0)
+	threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return threads < 1 ? 1 : threads;
+}
+
+/*
+** Finds the passages of quoted text printbody() will link, with the
+** quote prefix it will find for the message.
+*/
+
+static void plan_quote_job(struct quote_job *job, struct emailinfo *email)
+{
+    const struct body *bp;
+    int space = 0;
+    job->email = email;
+    job->passages = NULL;
+    job->num_passages = 0;
+    job->matches = NULL;
+    strncpy(job->prefix, find_quote_prefix(email->bodylist, email->inreplyto && email->inreplyto[0]), sizeof(job->prefix) - 1);
+    job->prefix[sizeof(job->prefix) - 1] = '\0';
+    for (bp = email->bodylist; bp != NULL; bp = bp->next) {
+	struct quote_passage *qp;
+	if (bp->html || bp->header)
+	    continue;
+	if (is_sig_start(bp->line))
+	    break;
+	if (!isquote(bp->line))
+	    continue;
+	if (job->num_passages == space) {
+	    struct quote_passage *more;
+	    space = space ? 2 * space : 8;
+	    more = (struct quote_passage *)emalloc(space * sizeof(struct quote_passage));
+	    if (job->num_passages)
+		memcpy(more, job->passages, job->num_passages * sizeof(struct quote_passage));
+	    free(job->passages);
+	    job->passages = more;
+	}
+	qp = &job->passages[job->num_passages++];
+	qp->bp = bp;
+	for (qp->count_lines = 1; bp->next && isquote(bp->next->line); ++qp->count_lines)
+	    bp = bp->next;
+    }
+}
+
+static void run_quote_job(struct quote_job *job)
+{
+    int i;
+    for (i = 0; i < job->num_passages; ++i) {
+	const struct body *bp = job->passages[i].bp;
+	int count_lines;
+	for (count_lines = job->passages[i].count_lines; count_lines > 0; --count_lines, bp = bp->next) {
+	    struct quote_match *m;
+	    struct Push full_line;
+	    struct Push exact_line;
+	    char *line2 = unquote_and_strip(bp->line, job->prefix);
+	    if (strlen(line2) < 5) {
+		free(line2);
+		continue;	/* handle_quoted_text() doesn't look for it */
+	    }
+	    quote_search_text(bp, line2, count_lines, job->prefix, &full_line, &exact_line);
+	    free(line2);
+	    m = (struct quote_match *)emalloc(sizeof(struct quote_match));
+	    m->bp = bp;
+	    m->max_msgnum = job->email->msgnum;
+	    m->full_line = PUSH_STRING(full_line);
+	    m->exact_line = PUSH_STRING(exact_line);
+	    search_for_quote(m->full_line, m->exact_line, m->max_msgnum, &m->match);
+	    m->next = job->matches;
+	    job->matches = m;
+	    if (m->match.msgnum >= 0)
+		break;		/* the rest of the passage isn't searched */
+	}
+    }
+}
+
+static void *quote_worker(void *arg)
+{
+    (void)arg;
+    for (;;) {
+	struct quote_job *job = NULL;
+	pthread_mutex_lock(&quote_job_lock);
+	if (next_quote_job < num_quote_jobs)
+	    job = &quote_jobs[next_quote_job++];
+	pthread_mutex_unlock(&quote_job_lock);
+	if (!job)
+	    return NULL;
+	run_quote_job(job);
+    }
+}
+
+#endif
+
+/*
+** How many messages match_quotes() takes at a time; 0 if quotes aren't
+** matched ahead.
+*/
+
+int quote_batch_size(void)
+{
+#ifdef HAVE_PTHREAD
+    int threads = quote_threads();
+    if (set_linkquotes && set_showhtml && threads > 1)
+	return 32 * threads;
+#endif
+    return 0;
+}
+
+/*
+** Looks for the quoted text of count messages ahead, forgetting what
+** was found for the ones before.
+*/
+
+void match_quotes(struct emailinfo **emails, int count)
+{
+#ifdef HAVE_PTHREAD
+    pthread_t *threads;
+    int num_threads = quote_threads() - 1;	/* and this one */
+    int started;
+    unsigned size;
+    int i;
+
+    end_quote_matches();
+    if (!count)
+	return;
+    quote_jobs = (struct quote_job *)emalloc(count * sizeof(struct quote_job));
+    for (i = 0; i < count; ++i)
+	plan_quote_job(&quote_jobs[i], emails[i]);
+    num_quote_jobs = count;
+    next_quote_job = 0;
+
+    threads = (pthread_t *)emalloc((num_threads + 1) * sizeof(pthread_t));
+    for (started = 0; started < num_threads; ++started)
+	if (pthread_create(&threads[started], NULL, quote_worker, NULL))
+	    break;		/* the ones there are do it */
+    quote_worker(NULL);
+    for (i = 0; i < started; ++i)
+	pthread_join(threads[i], NULL);
+    free(threads);
+
+    for (size = 64; size < 2 * (unsigned)count * 8; size *= 2)
+	;
+    quote_matches = (struct quote_match **)emalloc(size * sizeof(struct quote_match *));
+    memset(quote_matches, 0, size * sizeof(struct quote_match *));
+    quote_matches_mask = size - 1;
+    for (i = 0; i < count; ++i) {
+	struct quote_match *m;
+	for (m = quote_jobs[i].matches; m; m = m->next) {
+	    struct quote_match **slot = &quote_matches[quote_match_hash(m->bp) & quote_matches_mask];
+	    m->hash_next = *slot;
+	    *slot = m;
+	}
+    }
+#else
+    (void)emails;
+    (void)count;
+#endif
+}
+
+/*
+** Gives the result match_quotes() found for the line bp searched with
+** this text, if it did. It is only given once.
+*/
+
+static int take_quote_match(const struct body *bp, const char *full_line, const char *exact_line, int max_msgnum, String_Match *match_info)
+{
+    struct quote_match *m;
+    if (!quote_matches)
+	return FALSE;
+    for (m = quote_matches[quote_match_hash(bp) & quote_matches_mask]; m; m = m->hash_next) {
+	if (m->bp == bp && m->max_msgnum == max_msgnum && m->full_line
+	    && !strcmp(m->full_line, full_line ? full_line : "")
+	    && !strcmp(m->exact_line ? m->exact_line : "", exact_line ? exact_line : "")) {
+	    *match_info = m->match;
+	    m->match.last_matched_string = NULL;
+	    free(m->full_line);
+	    m->full_line = NULL;
+	    return TRUE;
+	}
+    }
+    return FALSE;
+}
+
+void end_quote_matches(void)
+{
+    int i;
+    for (i = 0; i < num_quote_jobs; ++i) {
+	struct quote_match *m = quote_jobs[i].matches;
+	while (m) {
+	    struct quote_match *next = m->next;
+	    if (m->match.last_matched_string)
+		free(m->match.last_matched_string);
+	    if (m->full_line)
+		free(m->full_line);
+	    if (m->exact_line)
+		free(m->exact_line);
+	    free(m);
+	    m = next;
+	}
+	if (quote_jobs[i].passages)
+	    free(quote_jobs[i].passages);
+    }
+    if (quote_jobs)
+	free(quote_jobs);
+    quote_jobs = NULL;
+    num_quote_jobs = 0;
+    if (quote_matches)
+	free(quote_matches);
+    quote_matches = NULL;
+}
+
 /*
 ** Find URL of the message this line of quoted text was taken from
 */
@@ -329,23 +633,11 @@ static char *url_replying_to(struct emailinfo *email, char *line1,	/* first line
 	}
     }
     {
-	int i;
 	struct Push full_line;
 	struct Push exact_line;
-	INIT_PUSH(full_line);
-	INIT_PUSH(exact_line);
-	PushString(&full_line, p = stripwhitespace(line2));
-	free(p);
-	PushString(&exact_line, line2);
-	for (i = 1; i < count_quoted_lines && (bp = bp->next); ++i) {
-	    char *stripped = unquote_and_strip(bp->line);
-	    PushByte(&full_line, '\n');
-	    PushString(&full_line, p = stripwhitespace(stripped));
-	    free(p);
-	    free(stripped);
-	    PushString(&exact_line, unquote(bp->line));
-	}
-		search_for_quote(PUSH_STRING(full_line), PUSH_STRING(exact_line), *quoting_msgnum, &match_info);
+	quote_search_text(bp, line2, count_quoted_lines, get_quote_prefix(), &full_line, &exact_line);
+	if (!take_quote_match(bp, PUSH_STRING(full_line), PUSH_STRING(exact_line), *quoting_msgnum, &match_info))
+	    search_for_quote(PUSH_STRING(full_line), PUSH_STRING(exact_line), *quoting_msgnum, &match_info);
 	free(PUSH_STRING(full_line));
 	free(PUSH_STRING(exact_line));
     }
@@ -405,7 +697,7 @@ int handle_quoted_text(FILE *fp, struct emailinfo *email, const struct body *bp,
 	++count_quoted_lines;
 	last_quoted_line = last_quoted_line->next;
     }
-    cvtd_line = unquote_and_strip(line);
+    cvtd_line = unquote_and_strip(line, get_quote_prefix());
     if (strlen(cvtd_line) < 5 && (!replace_quoted || !inquote)) {
 	char *parsed = ConvURLsString(line, email->msgid, email->subject, email->charset);
 	if (parsed) {
@@ -622,6 +914,7 @@ void replace_maybe_replies(const char *filename, struct emailinfo *ep, int new_r
 	snprintf(errmsg, sizeof(errmsg), "Couldn't rename \"%s\" to %s.", tmpfilename, filename);
 	progerr(errmsg);
     }
+    compress_page(filename);
 }
 
 /*
@@ -662,7 +955,7 @@ static char *stripwhitespace(const char *line)
     while (*line)
 	buffer[i++] = *line++;
     buffer[i] = 0;
-    while (i >= 0 && isspace(buffer[--i]))
-	buffer[i] = '\0';
+    while (i > 0 && isspace(buffer[i - 1]))
+	buffer[--i] = '\0';
     return buffer;
 }
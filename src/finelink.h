@@ -11,5 +11,8 @@ handle_quoted_text(FILE *fp, struct emailinfo *, const struct body *,
 void replace_maybe_replies(const char *, struct emailinfo *, int);
 void set_new_reply_to(int msgnum, int match_len);
 int get_new_reply_to(void);
+int quote_batch_size(void);
+void match_quotes(struct emailinfo **, int);
+void end_quote_matches(void);
 
 #endif
@@ -0,0 +1,949 @@
+/*
+** hmsearch: a CGI program that searches an archive by the index the
+** searchindex option keeps (see searchindex.c).
+**
+** The archive is the folder the web server maps the path after the
+** program name to, so http://host/cgi-bin/hmsearch/lists/foo/?q=word
+** searches the archive served as /lists/foo/. The query is made of
+**
+**   word            a message that has the word in its body or subject
+**   "some words"    the words one after the other
+**   author:name     a message from name (or author:"first last")
+**   after:date      a message from that date on (YYYY, YYYY-MM or
+**   before:date     YYYY-MM-DD), or before it
+**
+** all of which the message must match; the author, after and before
+** form fields are read as if they were in the query too. The index
+** files are mapped as they are, so nothing has to be loaded first: the
+** postings of the rarest word are decoded and the others are looked up
+** in them by galloping (exponential, then binary) search. The newest
+** messages come first, in the results.html page hypermail makes with
+** the index page header and footer of the archive.
+*/
+
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "../libcgi/cgi.h"
+#include "../config.h"
+#include "searchindex.h"
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#define USE_MMAP
+#endif
+
+#ifndef TRUE
+#define TRUE  1
+#define FALSE 0
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define RESULTS_PER_PAGE 20
+#define MAX_CLAUSES      16	/* of a query */
+#define MAX_PHRASE       16	/* words of a phrase */
+#define MAX_SHARDS       (MAX_CLAUSES * MAX_PHRASE)
+
+struct mapping {
+    unsigned char *data;
+    size_t len;
+    int mapped;
+};
+
+/* the postings of a term in one field */
+struct plist {
+    int count;
+    int *msgnums;
+    const unsigned char **positions;	/* where those of each message start */
+    const unsigned char *end;		/* of the shard they are in */
+};
+
+/* a word or phrase the messages must have, at offsets from its first word */
+struct clause {
+    int field;			/* SEARCH_FIELD_AUTHOR, or body and subject */
+    int num_terms;
+    char terms[MAX_PHRASE][SEARCH_MAX_TERM + 1];
+    int offsets[MAX_PHRASE];
+    int *msgnums;		/* the ones that match */
+    int count;
+};
+
+struct msg {
+    int flags;
+    uint64_t date;
+    const unsigned char *strings[4];	/* file name, name, email, subject */
+    uint64_t lengths[4];
+};
+
+struct block {
+    struct mapping map;
+    int first;
+    int count;
+    const unsigned char **records;
+};
+
+static char *search_dir;
+static int covered = -1;	/* the last message in the index */
+static struct clause clauses[MAX_CLAUSES];
+static int num_clauses = 0;
+static time_t after_date = 0;
+static time_t before_date = 0;
+
+/* the form fields read with the query, for the links to other pages */
+static const char *form_fields[] = { "author", "after", "before" };
+#define NUM_FORM_FIELDS (sizeof(form_fields) / sizeof(form_fields[0]))
+static char *form_values[NUM_FORM_FIELDS];
+
+static struct {
+    char name[3];
+    struct mapping map;
+} shards[MAX_SHARDS];
+static int num_shards = 0;
+
+static struct block *blocks = NULL;
+static int num_blocks = 0;
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size ? size : 1);
+
+    if (!p) {
+	printf("Out of memory.\n");
+	exit(1);
+    }
+    return p;
+}
+
+static char *index_file(const char *name)
+{
+    char *filename = xmalloc(strlen(search_dir) + strlen(name) + 1);
+
+    sprintf(filename, "%s%s", search_dir, name);
+    return filename;
+}
+
+/*
+** Maps a file of the index. Returns FALSE if there is none.
+*/
+
+static int map_index_file(const char *name, struct mapping *m)
+{
+    char *filename = index_file(name);
+    struct stat stbuf;
+    int fd;
+
+    m->data = NULL;
+    fd = open(filename, O_RDONLY | O_BINARY);
+    free(filename);
+    if (fd == -1)
+	return FALSE;
+    if (fstat(fd, &stbuf) || stbuf.st_size == 0) {
+	close(fd);
+	return FALSE;
+    }
+    m->len = (size_t)stbuf.st_size;
+#ifdef USE_MMAP
+    m->data = mmap(NULL, m->len, PROT_READ, MAP_SHARED, fd, 0);
+    if (m->data != MAP_FAILED) {
+	close(fd);
+	m->mapped = TRUE;
+	return TRUE;
+    }
+#endif
+    m->mapped = FALSE;
+    m->data = xmalloc(m->len);
+    if (read(fd, m->data, m->len) != (ssize_t)m->len) {
+	free(m->data);
+	m->data = NULL;
+    }
+    close(fd);
+    return m->data != NULL;
+}
+
+static int get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+    int shift = 0;
+
+    *v = 0;
+    while (*p < end && shift < 64) {
+	unsigned char c = *(*p)++;
+	*v |= (uint64_t)(c & 0x7f) << shift;
+	if (!(c & 0x80))
+	    return TRUE;
+	shift += 7;
+    }
+    return FALSE;
+}
+
+static const unsigned char *skip_varints(const unsigned char *p, const unsigned char *end, uint64_t n)
+{
+    while (n && p < end)
+	if (!(*p++ & 0x80))
+	    --n;
+    return p;
+}
+
+/*
+** Reading the index.
+*/
+
+static int read_meta(void)
+{
+    struct mapping m;
+    const unsigned char *p, *end;
+    uint64_t v, per_file;
+
+    if (!map_index_file(SEARCH_META_NAME, &m))
+	return FALSE;
+    p = m.data + SEARCH_MAGIC_LEN;
+    end = m.data + m.len;
+    if (m.len < SEARCH_MAGIC_LEN || memcmp(m.data, SEARCH_META_MAGIC, SEARCH_MAGIC_LEN)
+	|| !get_varint(&p, end, &v) || !get_varint(&p, end, &per_file)
+	|| per_file != SEARCH_MSGS_PER_FILE || !v)
+	return FALSE;
+    covered = (int)v - 1;
+    num_blocks = covered / SEARCH_MSGS_PER_FILE + 1;
+    blocks = xmalloc(num_blocks * sizeof(struct block));
+    memset(blocks, 0, num_blocks * sizeof(struct block));
+    return TRUE;
+}
+
+static struct mapping *get_shard(const char *term)
+{
+    char name[3 + sizeof(SEARCH_SUFFIX)];
+    int i;
+
+    for (i = 0; i < 2; ++i) {
+	int c = (unsigned char)term[i];
+	name[i] = ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z')) ? c : '_';
+    }
+    name[2] = '\0';
+    for (i = 0; i < num_shards; ++i)
+	if (!strcmp(shards[i].name, name))
+	    return &shards[i].map;
+    if (num_shards == MAX_SHARDS)
+	return NULL;
+    strcpy(shards[num_shards].name, name);
+    strcat(name, SEARCH_SUFFIX);
+    if (!map_index_file(name, &shards[num_shards].map)
+	|| shards[num_shards].map.len < SEARCH_MAGIC_LEN
+	|| memcmp(shards[num_shards].map.data, SEARCH_SHARD_MAGIC, SEARCH_MAGIC_LEN))
+	shards[num_shards].map.data = NULL;
+    return &shards[num_shards++].map;
+}
+
+/*
+** Finds the postings of term in field and decodes their message
+** numbers, from every segment of its shard. Returns FALSE if the term
+** isn't there.
+*/
+
+static int find_postings(const char *term, int field, struct plist *pl)
+{
+    struct mapping *m = get_shard(term);
+    const unsigned char *seg, *end;
+    uint64_t seg_len, num_terms, len, num_msgs, last, num_bytes;
+    size_t term_len = strlen(term);
+    int space = 0;
+
+    pl->count = 0;
+    if (!m || !m->data)
+	return FALSE;
+    pl->end = m->data + m->len;
+    seg = m->data + SEARCH_MAGIC_LEN;
+    /* a segment that isn't all there is being appended */
+    while (get_varint(&seg, m->data + m->len, &seg_len)
+	   && seg_len <= (uint64_t)(m->data + m->len - seg)) {
+	const unsigned char *p = seg;
+	end = seg + seg_len;
+	seg = end;
+	if (!get_varint(&p, end, &num_terms))
+	    continue;
+	while (num_terms--) {
+	    const unsigned char *t;
+	    int f, c;
+	    if (!get_varint(&p, end, &len) || len >= (uint64_t)(end - p))
+		break;
+	    t = p;
+	    p += len;
+	    f = *p++;
+	    if (!get_varint(&p, end, &num_msgs) || !get_varint(&p, end, &last)
+		|| !get_varint(&p, end, &num_bytes) || num_bytes > (uint64_t)(end - p))
+		break;
+	    c = memcmp(t, term, len < term_len ? len : term_len);
+	    if (!c)
+		c = len < term_len ? -1 : len > term_len ? 1 : f - field;
+	    if (c > 0)
+		break;		/* the terms are in order */
+	    if (!c) {
+		const unsigned char *q = p;
+		const unsigned char *q_end = p + num_bytes;
+		int64_t msgnum = -1;
+		uint64_t gap, n;
+		if (pl->count + num_msgs > (uint64_t)space) {
+		    int *msgnums;
+		    const unsigned char **positions;
+		    space = pl->count + (int)num_msgs;
+		    msgnums = xmalloc(space * sizeof(int));
+		    positions = xmalloc(space * sizeof(unsigned char *));
+		    if (pl->count) {
+			memcpy(msgnums, pl->msgnums, pl->count * sizeof(int));
+			memcpy(positions, pl->positions, pl->count * sizeof(unsigned char *));
+			free(pl->msgnums);
+			free(pl->positions);
+		    }
+		    pl->msgnums = msgnums;
+		    pl->positions = positions;
+		}
+		while (q < q_end && pl->count < space) {
+		    if (!get_varint(&q, q_end, &gap))
+			break;
+		    msgnum += gap;
+		    pl->msgnums[pl->count] = (int)msgnum;
+		    pl->positions[pl->count++] = q;
+		    if (!get_varint(&q, q_end, &n))
+			break;
+		    q = skip_varints(q, q_end, n);
+		}
+		break;
+	    }
+	    p += num_bytes;
+	}
+    }
+    if (!pl->count && space) {
+	free(pl->msgnums);
+	free(pl->positions);
+    }
+    return pl->count > 0;
+}
+
+static void free_postings(struct plist *pl)
+{
+    if (pl->count) {
+	free(pl->msgnums);
+	free(pl->positions);
+    }
+    pl->count = 0;
+}
+
+/*
+** The first index from lo on where a[] is key or more, or n: doubling
+** the step until it is passed, then halving it.
+*/
+
+static int gallop(const int *a, int n, int lo, int key)
+{
+    int step = 1;
+    int hi;
+
+    if (lo >= n || a[lo] >= key)
+	return lo;
+    while (lo + step < n && a[lo + step] < key) {
+	lo += step;
+	step *= 2;
+    }
+    hi = lo + step < n ? lo + step : n;
+    /* a[lo] < key and a[hi] >= key (or hi is n) */
+    while (hi - lo > 1) {
+	int mid = lo + (hi - lo) / 2;
+	if (a[mid] < key)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    return hi;
+}
+
+/*
+** Keeps the numbers of a[] that are also in b[]. Returns how many.
+*/
+
+static int intersect(int *a, int na, const int *b, int nb)
+{
+    int i, j = 0, n = 0;
+
+    for (i = 0; i < na && j < nb; ++i) {
+	j = gallop(b, nb, j, a[i]);
+	if (j < nb && b[j] == a[i])
+	    a[n++] = a[i];
+    }
+    return n;
+}
+
+static int *merge_union(const int *a, int na, const int *b, int nb, int *n)
+{
+    int *out = xmalloc((na + nb) * sizeof(int));
+    int i = 0, j = 0;
+
+    *n = 0;
+    while (i < na || j < nb) {
+	if (j == nb || (i < na && a[i] < b[j]))
+	    out[(*n)++] = a[i++];
+	else if (i == na || b[j] < a[i])
+	    out[(*n)++] = b[j++];
+	else {
+	    out[(*n)++] = a[i++];
+	    ++j;
+	}
+    }
+    return out;
+}
+
+static int read_positions(const unsigned char *p, const unsigned char *end,
+			  int *positions, int max)
+{
+    uint64_t n, d;
+    int i, pos = 0;
+
+    if (!get_varint(&p, end, &n))
+	return 0;
+    for (i = 0; i < (int)n && i < max; ++i) {
+	if (!get_varint(&p, end, &d))
+	    break;
+	pos += (int)d;
+	positions[i] = pos;
+    }
+    return i;
+}
+
+static int has_position(const int *positions, int n, int pos)
+{
+    int i = gallop(positions, n, 0, pos);
+    return i < n && positions[i] == pos;
+}
+
+/*
+** The messages that have the words of c in field in their order.
+*/
+
+#define MAX_POSITIONS 4096
+
+static int *match_phrase(struct clause *c, int field, int *count)
+{
+    struct plist lists[MAX_PHRASE];
+    int *at;
+    int *result;
+    int rarest = 0;
+    int i, j, n;
+
+    *count = 0;
+    for (i = 0; i < c->num_terms; ++i) {
+	if (!find_postings(c->terms[i], field, &lists[i])) {
+	    while (i--)
+		free_postings(&lists[i]);
+	    return NULL;
+	}
+	if (lists[i].count < lists[rarest].count)
+	    rarest = i;
+    }
+    result = xmalloc(lists[rarest].count * sizeof(int));
+    at = xmalloc(c->num_terms * sizeof(int));
+    memset(at, 0, c->num_terms * sizeof(int));
+    n = 0;
+    for (j = 0; j < lists[rarest].count; ++j) {
+	int msgnum = lists[rarest].msgnums[j];
+	int found = TRUE;
+	for (i = 0; i < c->num_terms && found; ++i) {
+	    at[i] = i == rarest ? j : gallop(lists[i].msgnums, lists[i].count, at[i], msgnum);
+	    found = at[i] < lists[i].count && lists[i].msgnums[at[i]] == msgnum;
+	}
+	if (found && c->num_terms > 1) {
+	    /* one place where each word is as far from the first as in c */
+	    static int first[MAX_POSITIONS], other[MAX_POSITIONS];
+	    int num_first = read_positions(lists[0].positions[at[0]], lists[0].end,
+					   first, MAX_POSITIONS);
+	    int k;
+	    found = FALSE;
+	    for (k = 0; k < num_first && !found; ++k) {
+		found = TRUE;
+		for (i = 1; i < c->num_terms && found; ++i) {
+		    int num_other = read_positions(lists[i].positions[at[i]], lists[i].end,
+						   other, MAX_POSITIONS);
+		    found = has_position(other, num_other, first[k] + c->offsets[i] - c->offsets[0]);
+		}
+	    }
+	}
+	if (found)
+	    result[n++] = msgnum;
+    }
+    for (i = 0; i < c->num_terms; ++i)
+	free_postings(&lists[i]);
+    free(at);
+    *count = n;
+    return result;
+}
+
+static void match_clause(struct clause *c)
+{
+    if (c->field == SEARCH_FIELD_AUTHOR)
+	c->msgnums = match_phrase(c, SEARCH_FIELD_AUTHOR, &c->count);
+    else {
+	int nb, ns;
+	int *body = match_phrase(c, SEARCH_FIELD_BODY, &nb);
+	int *subject = match_phrase(c, SEARCH_FIELD_SUBJECT, &ns);
+	c->msgnums = merge_union(body, nb, subject, ns, &c->count);
+	if (body)
+	    free(body);
+	if (subject)
+	    free(subject);
+    }
+}
+
+/*
+** The message files.
+*/
+
+static struct block *get_block(int num)
+{
+    struct block *b;
+    const unsigned char *p, *end;
+    uint64_t first, count;
+    char name[32];
+    int i;
+
+    if (num < 0 || num >= num_blocks)
+	return NULL;
+    b = &blocks[num];
+    if (b->records)
+	return b->count ? b : NULL;
+    b->records = xmalloc(SEARCH_MSGS_PER_FILE * sizeof(unsigned char *));
+    sprintf(name, "msgs-%d%s", num, SEARCH_SUFFIX);
+    if (!map_index_file(name, &b->map) || b->map.len < SEARCH_MAGIC_LEN
+	|| memcmp(b->map.data, SEARCH_MSGS_MAGIC, SEARCH_MAGIC_LEN))
+	return NULL;
+    p = b->map.data + SEARCH_MAGIC_LEN;
+    end = b->map.data + b->map.len;
+    if (!get_varint(&p, end, &first) || !get_varint(&p, end, &count)
+	|| count > SEARCH_MSGS_PER_FILE)
+	return NULL;
+    b->first = (int)first;
+    for (i = 0; i < (int)count && p < end; ++i) {
+	uint64_t v;
+	int j;
+	b->records[i] = p;
+	if (!(*p++ & SEARCH_MSG_PRESENT))
+	    continue;
+	if (!get_varint(&p, end, &v))
+	    break;
+	for (j = 0; j < 4; ++j) {
+	    if (!get_varint(&p, end, &v) || v > (uint64_t)(end - p))
+		break;
+	    p += v;
+	}
+	if (j < 4)
+	    break;
+    }
+    b->count = i;
+    return b;
+}
+
+static int get_msg(int msgnum, struct msg *m)
+{
+    struct block *b = get_block(msgnum / SEARCH_MSGS_PER_FILE);
+    const unsigned char *p, *end;
+    int i;
+
+    if (!b || msgnum - b->first < 0 || msgnum - b->first >= b->count)
+	return FALSE;
+    p = b->records[msgnum - b->first];
+    end = b->map.data + b->map.len;
+    m->flags = *p++;
+    if (!(m->flags & SEARCH_MSG_PRESENT))
+	return FALSE;
+    get_varint(&p, end, &m->date);
+    for (i = 0; i < 4; ++i) {
+	get_varint(&p, end, &m->lengths[i]);
+	m->strings[i] = p;
+	p += m->lengths[i];
+    }
+    return TRUE;
+}
+
+/*
+** The query.
+*/
+
+/* days since 1970-01-01 of a date of the Gregorian calendar */
+static long days_from_civil(long y, int m, int d)
+{
+    long era;
+    long yoe, doy, doe;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/*
+** A date as YYYY, YYYY-MM or YYYY-MM-DD, as the seconds of its start,
+** or of the start of the next day, month or year if end is set.
+*/
+
+static time_t parse_date(const char *s, int end)
+{
+    int y = 0, m = 0, d = 0;
+    int n = sscanf(s, "%d-%d-%d", &y, &m, &d);
+
+    if (n < 1 || y < 1970)
+	return 0;
+    if (n < 2 || m < 1 || m > 12) {
+	m = 1;
+	d = 1;
+	y += end;
+    }
+    else if (n < 3 || d < 1 || d > 31) {
+	d = 1;
+	if (end && ++m > 12) {
+	    m = 1;
+	    ++y;
+	}
+    }
+    else
+	d += end;
+    return (time_t)(days_from_civil(y, m, d) * 86400L);
+}
+
+/*
+** Adds the words of s as a phrase the messages must have in field.
+*/
+
+static void add_clause(const char *s, size_t len, int field)
+{
+    struct clause *c;
+    int offset = 0;
+    size_t i = 0;
+
+    if (num_clauses == MAX_CLAUSES)
+	return;
+    c = &clauses[num_clauses];
+    c->field = field;
+    c->num_terms = 0;
+    while (i < len && c->num_terms < MAX_PHRASE) {
+	size_t start;
+	while (i < len && !isalnum((unsigned char)s[i]))
+	    ++i;
+	if (i == len)
+	    break;
+	for (start = i; i < len && isalnum((unsigned char)s[i]); ++i)
+	    ;
+	/* as tokenize_body() splits them, but short and long words
+	   weren't indexed */
+	if (i - start >= 2 && i - start <= SEARCH_MAX_TERM) {
+	    size_t j;
+	    for (j = start; j < i; ++j)
+		c->terms[c->num_terms][j - start] = tolower((unsigned char)s[j]);
+	    c->terms[c->num_terms][i - start] = '\0';
+	    c->offsets[c->num_terms++] = offset;
+	}
+	++offset;
+    }
+    if (c->num_terms)
+	++num_clauses;
+}
+
+/*
+** Reads a query: words, "phrases", author:, after: and before:.
+*/
+
+static void parse_query(const char *q, int field)
+{
+    while (*q) {
+	const char *start;
+	int this_field = field;
+	while (isspace((unsigned char)*q))
+	    ++q;
+	if (!*q)
+	    break;
+	if (!strncasecmp(q, "author:", 7) || !strncasecmp(q, "from:", 5)) {
+	    q = strchr(q, ':') + 1;
+	    this_field = SEARCH_FIELD_AUTHOR;
+	}
+	else if (!strncasecmp(q, "after:", 6)) {
+	    after_date = parse_date(q + 6, FALSE);
+	    q += 6;
+	    while (*q && !isspace((unsigned char)*q))
+		++q;
+	    continue;
+	}
+	else if (!strncasecmp(q, "before:", 7)) {
+	    before_date = parse_date(q + 7, TRUE);
+	    q += 7;
+	    while (*q && !isspace((unsigned char)*q))
+		++q;
+	    continue;
+	}
+	if (*q == '"') {
+	    start = ++q;
+	    while (*q && *q != '"')
+		++q;
+	    add_clause(start, q - start, this_field);
+	    if (*q)
+		++q;
+	}
+	else {
+	    start = q;
+	    while (*q && !isspace((unsigned char)*q))
+		++q;
+	    add_clause(start, q - start, this_field);
+	}
+    }
+}
+
+static int compare_clauses(const void *a, const void *b)
+{
+    return ((const struct clause *)a)->count - ((const struct clause *)b)->count;
+}
+
+/*
+** The messages that match all the clauses, oldest first. Returns
+** NULL if there are no clauses.
+*/
+
+static int *match_query(int *count)
+{
+    int *result;
+    int i;
+
+    *count = 0;
+    if (!num_clauses)
+	return NULL;
+    for (i = 0; i < num_clauses; ++i) {
+	match_clause(&clauses[i]);
+	if (!clauses[i].count)
+	    return xmalloc(sizeof(int));
+    }
+    /* the rarest first, so the others are only looked up in it */
+    qsort(clauses, num_clauses, sizeof(struct clause), compare_clauses);
+    result = clauses[0].msgnums;
+    *count = clauses[0].count;
+    for (i = 1; i < num_clauses && *count; ++i)
+	*count = intersect(result, *count, clauses[i].msgnums, clauses[i].count);
+    return result;
+}
+
+/*
+** Output.
+*/
+
+static void put_html(const unsigned char *s, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+	switch (s[i]) {
+	case '<':
+	    fputs("&lt;", stdout);
+	    break;
+	case '>':
+	    fputs("&gt;", stdout);
+	    break;
+	case '&':
+	    fputs("&amp;", stdout);
+	    break;
+	case '"':
+	    fputs("&quot;", stdout);
+	    break;
+	default:
+	    putchar(s[i]);
+	}
+    }
+}
+
+static void put_html_string(const char *s)
+{
+    if (s)
+	put_html((const unsigned char *)s, strlen(s));
+}
+
+static void put_url_string(const char *s)
+{
+    for (; s && *s; ++s) {
+	if (isalnum((unsigned char)*s) || strchr("-_.~", *s))
+	    putchar(*s);
+	else
+	    printf("%%%02X", (unsigned char)*s);
+    }
+}
+
+/*
+** Prints the template from p to end, the query in place of its marks.
+*/
+
+static void put_template(const char *p, const char *end, const char *query)
+{
+    size_t mark_len = strlen(SEARCH_QUERY_MARK);
+
+    while (p < end) {
+	const char *mark = p;
+	while (mark < end && (*mark != SEARCH_QUERY_MARK[0]
+			      || (size_t)(end - mark) < mark_len
+			      || memcmp(mark, SEARCH_QUERY_MARK, mark_len)))
+	    ++mark;
+	fwrite(p, 1, mark - p, stdout);
+	if (mark == end)
+	    break;
+	put_html_string(query);
+	p = mark + mark_len;
+    }
+}
+
+static void print_page_link(cgi_info *ci, const char *query, int start, const char *text)
+{
+    size_t i;
+
+    printf("<a href=\"");
+    put_html_string(ci->script_name);
+    put_html_string(ci->path_info);
+    printf("?q=");
+    put_url_string(query);
+    for (i = 0; i < NUM_FORM_FIELDS; ++i)
+	if (form_values[i]) {
+	    printf("&amp;%s=", form_fields[i]);
+	    put_url_string(form_values[i]);
+	}
+    printf("&amp;start=%d\">%s</a>\n", start, text);
+}
+
+static void print_results(cgi_info *ci, const char *query, int start)
+{
+    int count;
+    int *matches = match_query(&count);
+    int total = 0;
+    int i;
+
+    printf("<form method=\"get\" action=\"");
+    put_html_string(ci->script_name);
+    put_html_string(ci->path_info);
+    printf("\"><p><input type=\"text\" name=\"q\" size=\"40\" value=\"");
+    put_html_string(query);
+    printf("\" /> <input type=\"submit\" value=\"Search\" /></p></form>\n");
+    if (!matches && !after_date && !before_date)
+	return;
+    if (!matches)		/* only a date range */
+	count = covered + 1;
+
+    printf("<div class=\"messages-list\">\n<ul>\n");
+    for (i = count; i-- > 0;) {
+	int msgnum = matches ? matches[i] : i;
+	struct msg m;
+	char date[64];
+	time_t t;
+	if (!get_msg(msgnum, &m) || (m.flags & SEARCH_MSG_DELETED)
+	    || (after_date && (time_t)m.date < after_date)
+	    || (before_date && (time_t)m.date >= before_date))
+	    continue;
+	if (total++ < start || total > start + RESULTS_PER_PAGE)
+	    continue;
+	t = (time_t)m.date;
+	strftime(date, sizeof(date), "%a %b %d %Y - %H:%M:%S GMT", gmtime(&t));
+	printf("<li><a href=\"");
+	put_html(m.strings[0], m.lengths[0]);
+	printf("\">");
+	put_html(m.strings[3], m.lengths[3]);
+	printf("</a>&nbsp;<em>");
+	put_html(m.strings[1], m.lengths[1]);
+	printf("</em>&nbsp;<em>(%s)</em></li>\n", date);
+    }
+    printf("</ul>\n");
+    if (!total)
+	printf("<p>No messages match.</p>\n");
+    else
+	printf("<p>Messages %d to %d of %d.</p>\n", start + 1,
+	       total < start + RESULTS_PER_PAGE ? total : start + RESULTS_PER_PAGE, total);
+    if (start > 0)
+	print_page_link(ci, query, start > RESULTS_PER_PAGE ? start - RESULTS_PER_PAGE : 0, "Previous");
+    if (total > start + RESULTS_PER_PAGE)
+	print_page_link(ci, query, start + RESULTS_PER_PAGE, "Next");
+    printf("</div>\n");
+}
+
+/*
+** Finds s in the bytes from p to end, which needn't end with a '\0'.
+*/
+
+static const char *find_string(const char *p, const char *end, const char *s)
+{
+    size_t len = strlen(s);
+
+    for (; (size_t)(end - p) >= len; ++p)
+	if (*p == *s && !memcmp(p, s, len))
+	    return p;
+    return NULL;
+}
+
+void cgi_main(cgi_info *ci)
+{
+    form_entry *parms = get_form_entries(ci);
+    char *query = parmval(parms, "q");
+    char *s;
+    struct mapping template;
+    const char *page, *page_end, *results, *head;
+    int start = (s = parmval(parms, "start")) ? atoi(s) : 0;
+    size_t i;
+
+    print_mimeheader("text/html");
+    if (mcode(ci) == MCODE_HEAD)
+	return;
+    if (!query)
+	query = "";
+    if (start < 0)
+	start = 0;
+    if (!ci->path_translated || !*ci->path_translated
+	|| strstr(ci->path_info ? ci->path_info : "", "..")) {
+	printf("<html><body><p>No archive to search.</p></body></html>\n");
+	return;
+    }
+    search_dir = xmalloc(strlen(ci->path_translated) + sizeof(SEARCH_INDEX_DIR) + 2);
+    sprintf(search_dir, "%s%s" SEARCH_INDEX_DIR "/", ci->path_translated,
+	    ci->path_translated[strlen(ci->path_translated) - 1] == '/' ? "" : "/");
+    if (!read_meta()) {
+	printf("<html><body><p>This archive has no search index.</p></body></html>\n");
+	return;
+    }
+    parse_query(query, SEARCH_FIELD_BODY);
+    for (i = 0; i < NUM_FORM_FIELDS; ++i)
+	if ((s = parmval(parms, (char *)form_fields[i])) != NULL && *s)
+	    form_values[i] = s;
+    if (form_values[0])
+	add_clause(form_values[0], strlen(form_values[0]), SEARCH_FIELD_AUTHOR);
+    if (form_values[1])
+	after_date = parse_date(form_values[1], FALSE);
+    if (form_values[2])
+	before_date = parse_date(form_values[2], TRUE);
+
+    if (!map_index_file(SEARCH_TEMPLATE_NAME, &template)) {
+	printf("<html><body>\n");
+	print_results(ci, query, start);
+	printf("</body></html>\n");
+	return;
+    }
+    page = (const char *)template.data;
+    page_end = page + template.len;
+    if ((results = find_string(page, page_end, SEARCH_RESULTS_MARK)) == NULL)
+	results = page_end;
+    /* the links of the archive pages are relative to the archive */
+    head = find_string(page, results, "<head>");
+    if (head) {
+	head += strlen("<head>");
+	put_template(page, head, query);
+	printf("\n<base href=\"");
+	put_html_string(ci->path_info);
+	printf("\" />");
+	page = head;
+    }
+    put_template(page, results, query);
+    print_results(ci, query, start);
+    if (results < page_end)
+	put_template(results + strlen(SEARCH_RESULTS_MARK), page_end, query);
+    free_form_entries(parms);
+}
@@ -32,8 +32,10 @@
 #include "setup.h"
 #include "parse.h"
 #include "print.h"
+#include "printfile.h"
 #include "finelink.h"
 #include "search.h"
+#include "searchindex.h"
 #include "struct.h"
 
 #ifdef HAVE_LOCALE_H
@@ -177,6 +179,7 @@ int main(int argc, char **argv)
     char **tlang, *locale_code;
     int cmd_show_variables;
     int print_usage;
+    int spooling, own_input = TRUE;
 
     int amount_old = 0;		/* number of old mails */
     int amount_new = 0;		/* number of new mails */
@@ -512,6 +515,10 @@ int main(int argc, char **argv)
 	progerr("msgsperfolder and folder_by_date may not be used at the same time!");
     }
 
+    if (set_usegdbm && set_usebinindex) {
+	progerr("usegdbm and usebinindex may not be used at the same time!");
+    }
+
     /*
      * General settings for mail command and rewriting.
      */
@@ -538,6 +545,15 @@ int main(int argc, char **argv)
 		progerr("the nonsequential mode is only available if you enabled the\n compilation" "of the fnv hash library. Try doing a\n\t./configure --enable-libfnv\n" "and recompile if you want to use this option.");
 #endif /* HAVE_LIBFNV */
 
+#ifndef HAVE_LIBZ
+    if (set_gzip_pages)
+		progerr("the gzip_pages option is only available if hypermail was\n" "compiled with zlib. Install it, run ./configure again\n" "and recompile if you want to use this option.");
+#endif
+#ifndef HAVE_LIBBROTLI
+    if (set_brotli_pages)
+		progerr("the brotli_pages option is only available if hypermail was\n" "compiled with the brotli libraries. Install them, run ./configure\n" "again and recompile if you want to use this option.");
+#endif
+
     /* 
      * A little performance speed up.  The following was being done
      * over and over in the write functions. This way it is done once.
@@ -583,6 +599,13 @@ int main(int argc, char **argv)
         cmderr(lang[MSG_CANNOT_BOTH_READ_AND_WRITE_TO_MBOX]);
     }
 
+    /*
+     * Parse the header and footer files once, now that the values
+     * they may refer to are settled.
+     */
+
+    compile_templates();
+
     gettimezone();
     getthisyear();
 
@@ -598,9 +621,30 @@ int main(int argc, char **argv)
      * Let's do it.
      */
 
-    if (set_uselock)
+    /* see lock.c */
+    spooling = set_lockspool && set_uselock && use_stdin && set_increment == 1;
+    if (spooling) {
+	int num_spooled;
+	char **spooled;
+	own_input = lock_or_spool(set_dir);
+	spooled = read_spool(&num_spooled);
+	if (!own_input && !num_spooled) {
+	    unlock_spool(argv);
+	    return (0);
+	}
+	parse_more_input(spooled, num_spooled);
+    }
+    else if (set_uselock)
 	lock_archive(set_dir);
 
+    if (set_mbox_checkpoint) {
+	if (!set_usebinindex)
+	    progerr("mbox_checkpoint option requires that the usebinindex option be on");
+	/* only read what was appended since the last run */
+	if (set_increment != 1 && !use_stdin && !set_readone && set_mbox
+	    && strcasecmp(set_mbox, "NONE") && resume_mbox(set_mbox))
+	    set_increment = 1;
+    }
     if (set_increment == -1) {
 	int save_append = set_append;
 	set_append = 0;
@@ -608,8 +652,8 @@ int main(int argc, char **argv)
 	    progerr("can not use increment = -1 option with mbox_shortened option\n");
 	amount_new = parsemail(set_mbox, use_stdin, 1, -1, set_dir, set_inlinehtml, 0);
 	set_increment = !matches_existing(set_startmsgnum);
-	if (set_increment && set_folder_by_date && !set_usegdbm)
-	    progerr("folder_by_date with incremental update requires usegdbm option");
+	if (set_increment && set_folder_by_date && !set_usegdbm && !set_usebinindex)
+	    progerr("folder_by_date with incremental update requires usegdbm or usebinindex option");
 	reinit_structs();
 	set_append = save_append;
     }
@@ -623,6 +667,8 @@ int main(int argc, char **argv)
 	max_msgnum = set_startmsgnum - 1;
 	num_displayable = loadoldheaders(set_dir);
 	amount_old = max_msgnum + 1; /* counts gaps as messages */
+	if (set_attachmentsindex)
+	    load_attachmentindex();
 
 	/* start numbering at this number */
 	num_added = parsemail(set_mbox, use_stdin, set_readone, set_increment, set_dir, set_inlinehtml, amount_old);
@@ -656,9 +702,11 @@ int main(int argc, char **argv)
     }
     else {
 	if (set_mbox_shortened) {
-	    if (!set_usegdbm) progerr("mbox_shortened option requires that the usegdbm option be on");
+	    if (!set_usegdbm && !set_usebinindex) progerr("mbox_shortened option requires that the usegdbm or usebinindex option be on");
 	    max_msgnum = set_startmsgnum - 1;
 	    loadoldheaders(set_dir);
+	    if (set_attachmentsindex)
+		load_attachmentindex();
 	}
 	amount_new = parsemail(set_mbox, use_stdin, set_readone, set_increment, set_dir, 
 			       set_inlinehtml, set_startmsgnum);	/* number from 0 */
@@ -714,13 +762,18 @@ int main(int argc, char **argv)
 	    writeauthors(amount_new, NULL);
 	if (set_attachmentsindex) {
 	    writeattachments(amount_new, NULL);
+	    write_attachmentindex(max_msgnum + 1);
 	}
+	if (set_linkquotes)
+	    save_quote_index(max_msgnum + 1);
 	if (set_writehaof) 
             writehaof(amount_new, NULL);
+	if (set_searchindex)
+	    write_search_index(max_msgnum + 1);
 	if (set_folder_by_date || set_msgsperfolder)
-	    write_toplevel_indices(amount_new);
+	    write_toplevel_indices(amount_new, amount_old);
 	if (set_monthly_index || set_yearly_index)
-	    write_summary_indices(amount_new);
+	    write_summary_indices(amount_old);
 	if (set_latest_folder)
 	    symlink_latest();
     }
@@ -728,9 +781,13 @@ int main(int argc, char **argv)
 	printf("No mails to output!\n");
     }
 
-    if (set_uselock)
+    if (spooling)
+	unlock_spool(argv);
+    else if (set_uselock)
 	unlock_archive();
 
+    free_templates();
+
     if (configfile)
 	free(configfile);
     if (ihtmlheaderfile)
@@ -124,6 +124,10 @@
 #define NOSUBJECT   "(no subject)"
 
 #define GDBM_INDEX_NAME ".hm2index"
+#define BIN_INDEX_NAME ".hm3index"
+#define BIN_INDEX_STRINGS_NAME ".hm3strings"
+#define QUOTE_TOKENS_NAME ".hm3tokens"
+#define QUOTE_BIGRAMS_NAME ".hm3bigrams"
 
 /* Name of the Hypertext Archive Overview File an XML file
  * which contains pointers to the various index files
@@ -146,6 +150,8 @@
 #define TITLESTRLEN  64
 #define HASHSIZE     673
 
+#define REPLY_UNKNOWN  -2	/* emailinfo reply_to not known yet */
+
 #define SHORTDATELEN   12
 #define TIMEZONELEN    10
 #define YEARLEN        5
@@ -268,6 +274,10 @@ struct emailsubdir {	/* used by set_folder_by_date, set_msgsperfolder */
     int count;
     char *description;		/* label to go in folders.html */
     time_t a_date; /* date of msg which first generated this subdir. not guaranteed to be earliest date in subdir */
+    int changed;		/* its index pages have to be rewritten */
+    int threads_changed;	/* its thread index has to be rewritten */
+    int index_count;		/* messages its indexes list */
+    long index_sum;		/* and the sum of their numbers */
 };
 
 struct emailinfo {
@@ -281,6 +291,9 @@ struct emailinfo {
     char *msgid;
     char *subject;
     char *unre_subject;
+    char *link_subject;		/* NULL until msg_link_subject(), */
+    char *link_name;		/* msg_link_name() and msg_mail_subject() */
+    char *mail_subject;		/* make them, see struct.c */
     char *inreplyto;
     char *charset;		/* added in 2b10 */
 
@@ -289,6 +302,18 @@ struct emailinfo {
 
 #define PRINT_THREAD  1		/* set if already used in the thread output */
 #define USED_THREAD   2		/* set if already stored in threadlist */
+#define FROM_INDEX    4		/* loaded from the usebinindex index */
+#define STORE_REPLY   8		/* reply_to changed since it was loaded */
+#define BODY_READ    16		/* body read back for the quote index */
+#define STORE_LINK   32		/* reply_links read from its page */
+
+    int reply_to;		/* what crossindex() found this replies to, -1 */
+				/* for nothing, REPLY_UNKNOWN if not looked up */
+    int maybereply;		/* its maybereply from hashreplynumlookup() */
+    int reply_links[2];		/* "In reply to" links of its page, -1 for */
+				/* none, REPLY_UNKNOWN if it wasn't read */
+    int sure_reply_link;	/* the one that isn't a maybe or to a deleted */
+				/* message, see read_reply_links() */
 
     int initial_next_in_thread;	/* msgnum written as next during normal print*/
 
@@ -307,6 +332,7 @@ struct emailinfo {
 			/* 8=filtered (required line missing), 16=deleted (other) */
     int deletion_completed; /* -1 or delete_level that reflects last time */
                             /* that file was rewritten to reflect is_deleted */
+    struct attach *attachlist;	/* files stored in the attachment directory */
 };
 
 struct header {
@@ -321,6 +347,7 @@ struct attach {
     char *id;
     char *storedas;		/* filename used for storage */
     char *descr;		/* "Content-Description" */
+    long size;			/* bytes stored */
     struct attach *next;
 };
 
@@ -399,6 +426,7 @@ VAR char *mhtmlfooterfile;
 VAR long firstdatenum;
 VAR long lastdatenum;
 VAR int max_msgnum;
+VAR int num_reply_updates;	/* old messages with STORE_REPLY or STORE_LINK */
 
 VAR char **msgnum_id_table;
 
@@ -1,49 +1,400 @@
+/*
+** Locking the archive.
+**
+** The lock is an fcntl() lock on the .hypermail.lock file of the archive,
+** so a run that finds it taken sleeps until it is released, and a run
+** that dies doesn't leave it behind. The file holds the time the lock
+** was taken, and a lock older than locktime seconds is broken as it
+** always was. Where there is no fcntl() locking, the file itself is the
+** lock and a waiting run checks for it every 30 seconds.
+**
+** With the lockspool option, a run that reads from stdin to update the
+** archive doesn't wait: it leaves its input in the .hypermail.spool
+** directory and exits. The run that has the lock reads the spooled
+** messages together with its own input, and once it has released the
+** lock, starts over if more were spooled in the meantime.
+*/
+
 #include "hypermail.h"
 #include "setup.h"
 
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#include <signal.h>
+
+#ifdef HAVE_DIRENT_H
+#ifdef __LCC__
+#include "../lcc/dirent.h"
+#else
+#include <dirent.h>
+#endif
+#else
+#ifdef __LCC__
+#include <direct.h>
+#else
+#include <sys/dir.h>
+#endif
+#endif
+
+#if defined(F_SETLKW) && !defined(__LCC__)
+#define USE_FCNTL_LOCK
+#endif
+
 #define LOCKBASE       ".hypermail.lock"
+#define SPOOLBASE      ".hypermail.spool"
 
 int i_locked_it = 0;
 
-void lock_archive(char *dir)
-{
-    FILE *fp;
-    char buffer[MAXLINE];
+#ifdef USE_FCNTL_LOCK
+static int lock_fd = -1;
+#endif
 
-    int count = 0;		/* # minutes waited */
-    i_locked_it = 0;		/* guilty until proven innocent */
+static char spooldir[MAXFILELEN];
+static char **spooled = NULL;	/* the files read_spool() found */
+static int num_spooled = 0;
 
+static void set_names(char *dir)
+{
     snprintf(lockfile, sizeof(lockfile), "%s/%s", dir, LOCKBASE);
+    snprintf(spooldir, sizeof(spooldir), "%s/%s", dir, SPOOLBASE);
+}
+
+static void lock_error(void)
+{
+    snprintf(errmsg, sizeof(errmsg), "Couldn't create lock file \"%s\".", lockfile);
+    progerr(errmsg);
+}
+
+#ifdef USE_FCNTL_LOCK
+
+static void lock_timeout(int sig)
+{
+    (void)sig;			/* only there to interrupt fcntl() */
+}
+
+/*
+** Sets a write lock on fd, waiting at most wait seconds (not at all if
+** wait is 0). Returns 0 on success.
+*/
+
+static int lock_fd_within(int fd, long wait)
+{
+    struct flock fl;
+    struct sigaction sa, old_sa;
+    int status;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    if (wait <= 0)
+	return fcntl(fd, F_SETLK, &fl);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = lock_timeout;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;		/* no SA_RESTART */
+    sigaction(SIGALRM, &sa, &old_sa);
+    alarm((unsigned int)wait);
+    status = fcntl(fd, F_SETLKW, &fl);
+    alarm(0);
+    sigaction(SIGALRM, &old_sa, NULL);
+    return status;
+}
+
+/*
+** Takes the lock, waiting for it if wait is set. Returns FALSE if
+** another run has it.
+*/
+
+static int take_lock(int wait)
+{
+    struct stat held, named;
+    char buffer[32];
+    ssize_t len;
+    int fd;
+
+    for (;;) {
+	if ((fd = open(lockfile, O_RDWR | O_CREAT, set_filemode)) == -1)
+	    lock_error();
+	if (lock_fd_within(fd, 0) == -1) {
+	    long wait_for;
+	    if (!wait) {
+		close(fd);
+		return FALSE;
+	    }
+	    if (set_showprogress)
+		fprintf(stderr, "Waiting for lock (file '%s')\n", lockfile);
+	    /* "set_locktime" is the config file item named 'locktime',
+	       default is 3600 seconds */
+	    len = read(fd, buffer, sizeof(buffer) - 1);
+	    buffer[len > 0 ? len : 0] = '\0';
+	    if (atol(buffer) > 0)
+		wait_for = atol(buffer) + set_locktime - (long)time(NULL);
+	    else		/* taken so recently it isn't written yet */
+		wait_for = set_locktime;
+	    if (lock_fd_within(fd, wait_for) == -1) {
+		close(fd);
+		remove(lockfile);	/* lock too old - break it */
+		continue;
+	    }
+	}
+	/* the run that had it may have removed the file meanwhile */
+	if (!fstat(fd, &held) && !stat(lockfile, &named)
+	    && held.st_dev == named.st_dev && held.st_ino == named.st_ino)
+	    break;
+	close(fd);
+    }
+    snprintf(buffer, sizeof(buffer), "%ld\n", (long)time(NULL));
+    if (ftruncate(fd, 0) || lseek(fd, 0, SEEK_SET)
+	|| write(fd, buffer, strlen(buffer)) != (ssize_t)strlen(buffer)) {
+	close(fd);
+	lock_error();
+    }
+    lock_fd = fd;
+    i_locked_it = 1;
+    return TRUE;
+}
+
+#else
+
+static int take_lock(int wait)
+{
+    FILE *fp;
+    char buffer[MAXLINE];
 
     while ((fp = fopen(lockfile, "r")) != NULL) {
 	fgets(buffer, MAXLINE-1, fp);
 	fclose(fp);
-	/*  
-         * "set_locktime" is the config file item named 'locktime', 
-         * default is 3600 seconds 
+	/*
+         * "set_locktime" is the config file item named 'locktime',
+         * default is 3600 seconds
          */
 	if (time(NULL) > (time_t)(atol(buffer) + set_locktime))
 	    break;		/* lock over hour old - break it */
+	if (!wait)
+	    return FALSE;
 
-	++count;
 	if (set_showprogress)
 	    fprintf(stderr, "Waiting for lock (file '%s')\n", lockfile);
 	sleep(30);
     }
-    if ((fp = fopen(lockfile, "w")) != NULL) {
-	i_locked_it = 1;
-	fprintf(fp, "%ld\n", (long)time(NULL));
-	fclose(fp);
-    }
-    else if (dir[0]) {
-	snprintf(errmsg, sizeof(errmsg), "Couldn't create lock file \"%s\".", lockfile);
-	progerr(errmsg);
-    }
+    if ((fp = fopen(lockfile, "w")) == NULL)
+	lock_error();
+    i_locked_it = 1;
+    fprintf(fp, "%ld\n", (long)time(NULL));
+    fclose(fp);
+    return TRUE;
+}
+
+#endif
+
+void lock_archive(char *dir)
+{
+    i_locked_it = 0;		/* guilty until proven innocent */
+
+    set_names(dir);
+    if (dir[0])
+	take_lock(TRUE);
 }
 
 void unlock_archive(void)
 {
-    if (lockfile && i_locked_it)
+    if (lockfile[0] && i_locked_it)
 	remove(lockfile);
+#ifdef USE_FCNTL_LOCK
+    /* removed first, so that a run waiting for this lock knows that
+       it has to take a new one */
+    if (lock_fd != -1) {
+	close(lock_fd);
+	lock_fd = -1;
+    }
+#endif
+    i_locked_it = 0;
     lockfile[0] = '\0';
 }
+
+/*
+** Copies stdin to a new file in the spool. Files are named by the time
+** the run started to spool, so they are read in the order the messages
+** came, and only appear once they are complete.
+*/
+
+static void spool_stdin(void)
+{
+    char *tmpname;
+    char *name;
+    char buffer[BUFSIZ];
+    FILE *fp;
+    size_t len;
+    int failed;
+#ifdef HAVE_SYS_TIME_H
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+#else
+    struct {
+	time_t tv_sec;
+	long tv_usec;
+    } now;
+
+    now.tv_sec = time(NULL);
+    now.tv_usec = 0;
+#endif
+
+#ifdef __LCC__
+    mkdir(spooldir);
+#else
+    mkdir(spooldir, set_dirmode);
+#endif
+    trio_asprintf(&tmpname, "%s/.%ld.tmp", spooldir, (long)getpid());
+    trio_asprintf(&name, "%s/%010ld.%06ld.%ld", spooldir,
+		  (long)now.tv_sec, (long)now.tv_usec, (long)getpid());
+    if ((fp = fopen(tmpname, "wb")) == NULL) {
+	snprintf(errmsg, sizeof(errmsg), "%s \"%s\".", lang[MSG_COULD_NOT_WRITE], tmpname);
+	progerr(errmsg);
+    }
+    failed = 0;
+    while ((len = fread(buffer, 1, sizeof(buffer), stdin)) > 0)
+	if (fwrite(buffer, 1, len, fp) != len)
+	    failed = 1;
+    if (fclose(fp) || failed || ferror(stdin) || rename(tmpname, name)) {
+	remove(tmpname);
+	snprintf(errmsg, sizeof(errmsg), "%s \"%s\".", lang[MSG_COULD_NOT_WRITE], name);
+	progerr(errmsg);
+    }
+    chmod(name, set_filemode);
+    free(tmpname);
+    free(name);
+}
+
+/*
+** For the lockspool option: takes the lock of dir, or if another run
+** has it, leaves the input of this run in the spool for that run and
+** exits. Returns FALSE if this run only has the spool left to read.
+*/
+
+int lock_or_spool(char *dir)
+{
+    int c;
+
+    i_locked_it = 0;
+    set_names(dir);
+    if ((c = getc(stdin)) != EOF)
+	ungetc(c, stdin);
+    if (take_lock(FALSE)) {
+	if (c != EOF && spool_waiting()) {
+	    spool_stdin();	/* to come after the ones spooled before */
+	    return FALSE;
+	}
+	return c != EOF;
+    }
+    if (c == EOF)
+	exit(0);		/* nothing to add */
+    spool_stdin();
+    if (set_showprogress)
+	printf("Archive locked, input spooled in \"%s\".\n", spooldir);
+    /* the run that had the lock may have finished before the message
+       was spooled */
+    if (!take_lock(FALSE))
+	exit(0);
+    return FALSE;
+}
+
+static int cmp_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+** Lists the spooled messages, oldest first. remove_spooled() deletes
+** them once they are in the archive.
+*/
+
+char **read_spool(int *num)
+{
+    DIR *dir;
+#ifdef HAVE_DIRENT_H
+    struct dirent *entry;
+#else
+    struct direct *entry;
+#endif
+    int size = 0;
+
+    num_spooled = 0;
+    if ((dir = opendir(spooldir)) != NULL) {
+	while ((entry = readdir(dir))) {
+	    if (entry->d_name[0] == '.')
+		continue;	/* also the ones still being written */
+	    if (num_spooled == size) {
+		char **more;
+		size = size ? size * 2 : 16;
+		more = (char **)emalloc(size * sizeof(char *));
+		if (num_spooled)
+		    memcpy(more, spooled, num_spooled * sizeof(char *));
+		free(spooled);
+		spooled = more;
+	    }
+	    trio_asprintf(&spooled[num_spooled++], "%s/%s", spooldir, entry->d_name);
+	}
+	closedir(dir);
+    }
+    if (num_spooled)
+	qsort(spooled, num_spooled, sizeof(char *), cmp_names);
+    *num = num_spooled;
+    return spooled;
+}
+
+void remove_spooled(void)
+{
+    int i;
+
+    for (i = 0; i < num_spooled; i++) {
+	if (remove(spooled[i])) {
+	    snprintf(errmsg, sizeof(errmsg), "Couldn't remove \"%s\".", spooled[i]);
+	    progerr(errmsg);
+	}
+	free(spooled[i]);
+    }
+    num_spooled = 0;
+}
+
+/*
+** Are there spooled messages that no run has read yet?
+*/
+
+int spool_waiting(void)
+{
+    int num;
+    char **files = read_spool(&num);
+    int i;
+
+    for (i = 0; i < num; i++)
+	free(files[i]);
+    num_spooled = 0;
+    return num != 0;
+}
+
+/*
+** Ends a lockspool run: removes the spooled messages it read, releases
+** the lock and, if more messages were spooled meanwhile, starts over
+** with no input of its own to read them.
+*/
+
+void unlock_spool(char **argv)
+{
+    remove_spooled();
+    unlock_archive();
+    if (!spool_waiting())
+	return;
+#ifndef __LCC__
+    fflush(stdout);
+    fflush(stderr);
+    if (freopen("/dev/null", "r", stdin))
+	execvp(argv[0], argv);
+#endif
+    /* failing that, the next run reads them */
+}
@@ -0,0 +1,143 @@
+/*
+** Plain stdio output for the index and article loops.
+**
+** The equivalent fprintf() calls go through trio (TRIO_REPLACE_STDIO in
+** hypermail.h) and parse their format string every time, which is most
+** of the cost of writing an index line. These write the pieces with
+** fwrite() directly and produce exactly the same bytes.
+*/
+
+#include "hypermail.h"
+#include "setup.h"
+#include "output.h"
+
+/*
+** Writes s as is, like fprintf(fp, "%s", s).
+*/
+
+void out_str(FILE *fp, const char *s)
+{
+    fputs(s, fp);
+}
+
+/*
+** Writes s HTML-escaped, exactly like fputs(convchars(s, charset), fp)
+** but without building the converted copy. The rarely used ISO-2022
+** and Windows-1252 conversions are left to convchars().
+*/
+
+void out_html(FILE *fp, const char *s, const char *charset)
+{
+    bool seen_at = FALSE;
+
+    if (set_iso2022jp || (charset && !strcasecmp("iso-8859-1", charset))) {
+	char *conv = convchars((char *)s, (char *)charset);
+	fputs(conv, fp);
+	free(conv);
+	return;
+    }
+
+    while (*s) {
+	size_t n = strcspn(s, (seen_at && set_spamprotect)
+			   ? "<>&\"@." : "<>&\"@");
+	if (n) {
+	    fwrite(s, 1, n, fp);
+	    s += n;
+	    if (!*s)
+		break;
+	}
+	switch (*s) {
+	case '<':
+	    out_lit(fp, "&lt;");
+	    break;
+	case '>':
+	    out_lit(fp, "&gt;");
+	    break;
+	case '&':
+	    out_lit(fp, "&amp;");
+	    break;
+	case '\"':
+	    out_lit(fp, "&quot;");
+	    break;
+	case '@':
+	    out_lit(fp, "&#64;");
+	    seen_at = TRUE;
+	    break;
+	case '.':		/* only searched for after an '@' */
+	    out_lit(fp, "&#46;<!--nospam-->");
+	    seen_at = FALSE;
+	    break;
+	}
+	s++;
+    }
+}
+
+/*
+** Formats n in decimal into buf, like sprintf(buf, "%ld", n), which
+** must have room for the digits and the '\0'. Returns the length.
+*/
+
+int fmt_int(char *buf, long n)
+{
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long u = n < 0 ? -(unsigned long)n : (unsigned long)n;
+    int len;
+
+    do {
+	*--p = '0' + (char)(u % 10);
+	u /= 10;
+    } while (u);
+    if (n < 0)
+	*--p = '-';
+    len = (int)(tmp + sizeof(tmp) - p);
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    return len;
+}
+
+/*
+** Like fprintf(fp, "%d", n).
+*/
+
+void out_int(FILE *fp, long n)
+{
+    char buf[24];
+
+    fwrite(buf, 1, fmt_int(buf, n), fp);
+}
+
+/*
+** A message number the way file names show it, like fprintf(fp, "%.4d", n).
+*/
+
+void out_msgnum(FILE *fp, int n)
+{
+    char buf[24];
+    int len;
+
+    if (n < 0) {
+	putc('-', fp);
+	n = -n;
+    }
+    len = fmt_int(buf, n);
+    for (; len < 4; ++len)
+	putc('0', fp);
+    fputs(buf, fp);
+}
+
+/*
+** The name and id of a message's entry in an index:
+** name="<fragment_prefix>N" id="<fragment_prefix>N"
+*/
+
+void out_msg_anchor(FILE *fp, int msgnum)
+{
+    out_lit(fp, "name=\"");
+    fputs(set_fragment_prefix, fp);
+    out_int(fp, msgnum);
+    out_lit(fp, "\" id=\"");
+    fputs(set_fragment_prefix, fp);
+    out_int(fp, msgnum);
+    putc('"', fp);
+}
@@ -0,0 +1,17 @@
+/*
+** output.c functions
+**
+** Plain stdio writers for the loops that print one line per message.
+** hypermail.h maps fprintf() and friends to trio, which parses the
+** format string on every call; these don't.
+*/
+
+/* a string literal, whose length is known at compile time */
+#define out_lit(fp, s) fwrite((s), 1, sizeof(s) - 1, (fp))
+
+void out_str(FILE *, const char *);
+void out_html(FILE *, const char *, const char *);
+void out_int(FILE *, long);
+void out_msgnum(FILE *, int);
+void out_msg_anchor(FILE *, int);
+int fmt_int(char *, long);
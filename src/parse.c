@@ -31,6 +31,7 @@
 #include "getname.h"
 #include "parse.h"
 #include "print.h"
+#include "binindex.h"
 
 #ifdef GDBM
 #include "gdbm.h"
@@ -355,41 +356,56 @@ create_attachname(char *attachname, int max_len)
 ** Cross-indexes - adds to a list of replies. If a message is a reply to
 ** another, the number of the message it's replying to is added to the list.
 ** This list is searched upon printing.
+**
+** The answer of the lookup is kept in reply_to. With usebinindex it is
+** saved in the index, and the old messages are only looked up again if
+** a new message could have changed the answer (see reply_is_current()).
 */
 
 void crossindex(void)
 {
     int num, status, maybereply;
     struct emailinfo *email;
+    struct emailinfo **bynum;
 
-    num = 0;
     if(!set_linkquotes)
         replylist = NULL;
 
-    while (num <= max_msgnum) {
-	if (!hashnumlookup(num, &email)) {
-	    ++num;
+    bynum = hashnumtable(max_msgnum);
+    for (num = 0; num <= max_msgnum; num++) {
+	if ((email = bynum[num]) == NULL)
 	    continue;
+	if ((email->flags & FROM_INDEX) && reply_is_current(email)) {
+	    status = email->reply_to;
+	    maybereply = email->maybereply;
+	}
+	else {
+	    status = hashreplynumlookup(email->msgnum,
+					email->inreplyto, email->subject,
+					&maybereply);
+	    if (status != email->reply_to || maybereply != email->maybereply) {
+		email->reply_to = status;
+		email->maybereply = maybereply;
+		if ((email->flags & FROM_INDEX)
+		    && !(email->flags & STORE_REPLY)) {
+		    email->flags |= STORE_REPLY;
+		    ++num_reply_updates;
+		}
+	    }
 	}
-	status = hashreplynumlookup(email->msgnum,
-				    email->inreplyto, email->subject,
-				    &maybereply);
 	if (status != -1) {
 	    struct emailinfo *email2;
             
-	    if (!hashnumlookup(status, &email2)) {
-		++num;
+	    if (status < 0 || status > max_msgnum
+		|| (email2 = bynum[status]) == NULL)
 		continue;
-	    }
 	    /*  make sure there is no recursion between the message
                 and reply lookup if a message and its reply-to were
                 archived in reverse, both messages share the same
                 subject (regardless of Re), and the message itself was
                 a reply to a non-archived message. */
-	    if (maybereply && !strcmp (email2->inreplyto, email->msgid)) {
-                ++num;
+	    if (maybereply && !strcmp (email2->inreplyto, email->msgid))
                 continue;
-            }
             
 	    if (set_linkquotes) {
 	        struct reply *rp;
@@ -410,16 +426,17 @@ void crossindex(void)
 	    }
 	    else {
 #ifdef FASTREPLYCODE
-		replylist = addreply2(replylist, email2, email, maybereply,
-				      &replylist_end);
-#else
+		/* replylist started out empty and each message comes
+		   once, so addreply2()'s search for duplicates is moot */
+		email2->replylist = addreply(email2->replylist, status, email,
+					     maybereply, NULL);
+#endif		
 		replylist = addreply(replylist, status, email, maybereply,
 				     &replylist_end);
-#endif		
 	    }
 	}
-	num++;
     }
+    free(bynum);
 #if DEBUG_THREAD
     {
 	struct reply *r;
@@ -443,28 +460,33 @@ void crossindex(void)
 */
 
 #ifdef FASTREPLYCODE
-void crossindexthread2(int num)
+static void crossindexthread3(struct emailinfo *ep)
 {
     struct reply *rp;
-    struct emailinfo *ep;
-    if(!hashnumlookup(num, &ep)) {
-	char errmsg[512];
-        snprintf(errmsg, sizeof(errmsg), 
-                 "internal error crossindexthread2 %d", num);
-	progerr(errmsg);
-    }
 
     for (rp = ep->replylist; rp != NULL; rp = rp->next) {
 	if (!(rp->data->flags & USED_THREAD)) {
 	    rp->data->flags |= USED_THREAD;
-	    if (0) fprintf(stderr, "add thread.b %d %d %d\n", num, rp->data->msgnum, rp->msgnum);
-	    threadlist = addreply(threadlist, num, rp->data, 0,
+	    if (0) fprintf(stderr, "add thread.b %d %d %d\n", ep->msgnum, rp->data->msgnum, rp->msgnum);
+	    threadlist = addreply(threadlist, ep->msgnum, rp->data, 0,
 				  &threadlist_end);
 	    printedlist = markasprinted(printedthreadlist, rp->msgnum);
-	    crossindexthread2(rp->msgnum);
+	    crossindexthread3(rp->data);
 	}
     }
 }
+
+void crossindexthread2(int num)
+{
+    struct emailinfo *ep;
+    if(!hashnumlookup(num, &ep)) {
+	char errmsg[512];
+        snprintf(errmsg, sizeof(errmsg), 
+                 "internal error crossindexthread2 %d", num);
+	progerr(errmsg);
+    }
+    crossindexthread3(ep);
+}
 #else
 void crossindexthread2(int num)
 {
@@ -521,7 +543,11 @@ void crossindexthread1(struct header *hp)
 	    hp->data->flags |= USED_THREAD;
 	    threadlist = addreply(threadlist, hp->data->msgnum, hp->data,
 				  0, &threadlist_end);
+#ifdef FASTREPLYCODE
+	    crossindexthread3(hp->data);
+#else
 	    crossindexthread2(hp->data->msgnum);
+#endif
 	    threadlist = addreply(threadlist, -1, NULL, 0, &threadlist_end);
 	}
 
@@ -1482,6 +1508,21 @@ static int do_uudecode(FILE *fp, char *line, char *line_buf,
     return 1;
 }
 
+/*
+** Closes an attachment file, writing its compressed copies if it's text.
+*/
+
+static int close_attachment(int binfile, char **compress_name)
+{
+    close(binfile);
+    if (*compress_name) {
+	compress_page(*compress_name);
+	free(*compress_name);
+	*compress_name = NULL;
+    }
+    return -1;
+}
+
 static void write_txt_file(struct emailinfo *emp, struct Push *raw_text_buf)
 {
     char *txt_filename;
@@ -1499,12 +1540,144 @@ static void write_txt_file(struct emailinfo *emp, struct Push *raw_text_buf)
 	if (fp) {
 	    fwrite(p, strlen(p), 1, fp);
 	    fclose(fp);
+	    compress_data(txt_filename, p, strlen(p));
 	}
     }
     free(p);
     INIT_PUSH(*raw_text_buf);
 }
 
+/*
+** The mbox checkpoint (mbox_checkpoint). The index remembers where the
+** last message read from the mbox began and ended and a checksum of
+** its bytes. If they are still there, followed by the next message or
+** by nothing, everything before was read already and parsemail() can
+** start at the end of them.
+*/
+
+static long resume_offset = -1;
+
+/* FNV-1a of the bytes from start to end; fp is left at end */
+
+static int checksum_mbox(FILE *fp, long start, long end, uint64_t *sum)
+{
+    char buf[BUFSIZ];
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t n, i;
+
+    if (fseek(fp, start, SEEK_SET))
+	return 0;
+    while (start < end) {
+	n = (size_t)(end - start) < sizeof(buf) ? (size_t)(end - start) : sizeof(buf);
+	if (fread(buf, 1, n, fp) != n)
+	    return 0;
+	for (i = 0; i < n; i++) {
+	    hash ^= (unsigned char)buf[i];
+	    hash *= 0x100000001b3ULL;
+	}
+	start += (long)n;
+    }
+    *sum = hash;
+    return 1;
+}
+
+static void save_checkpoint(FILE *fp, long start, long end)
+{
+    uint64_t sum;
+
+    if (start >= 0 && end > start && checksum_mbox(fp, start, end, &sum))
+	binindex_set_checkpoint(start, end, sum);
+}
+
+/*
+** Checks the checkpoint of the archive against mbox. Returns TRUE if
+** the next parsemail() only needs to read what was appended since,
+** as an incremental update.
+*/
+
+int resume_mbox(char *mbox)
+{
+    struct binindex *bi;
+    FILE *fp;
+    long start, end;
+    uint64_t sum, now;
+    char next[5];
+    size_t got;
+    int found;
+
+    resume_offset = -1;
+    if ((bi = binindex_map(set_dir)) == NULL)
+	return FALSE;
+    found = binindex_checkpoint(bi, &start, &end, &sum);
+    binindex_unmap(bi);
+    if (!found || (fp = fopen(mbox, "rb")) == NULL)
+	return FALSE;
+    if (checksum_mbox(fp, start, end, &now) && now == sum) {
+	got = fread(next, 1, sizeof(next), fp);
+	if (got == 0 || (got == sizeof(next) && !strncmp(next, "From ", 5)))
+	    resume_offset = end;
+    }
+    fclose(fp);
+    return resume_offset != -1;
+}
+
+/*
+** Files for the next parsemail() to read after its input, each of them
+** starting a new message whatever readone says. This is how the
+** messages that lock_or_spool() left in the spool are added.
+*/
+
+static char **more_input = NULL;
+static int num_more_input = 0;
+static int more_input_opened;	/* how many of them */
+static int read_anything;	/* this parsemail() */
+
+#define NEW_FILE_FROM  1	/* the file starts with a From_ line */
+#define NEW_FILE_BARE  2	/* it doesn't, and the line is made up */
+
+void parse_more_input(char **files, int num)
+{
+    more_input = files;
+    num_more_input = num;
+}
+
+/*
+** fgets() for parsemail(), going on with more_input at the end of *fp.
+** *new_file is set on the first line of a file that doesn't come first;
+** a file without a From_ line gets an empty one, so that the line ends
+** the message before it in any case.
+*/
+
+static char *next_line(char *buf, FILE **fp, int *new_file)
+{
+    *new_file = 0;
+    while (fgets(buf, MAXLINE, *fp) == NULL) {
+	if (more_input_opened >= num_more_input)
+	    return NULL;
+	if (*fp != stdin)
+	    fclose(*fp);
+	if ((*fp = fopen(more_input[more_input_opened], "rb")) == NULL) {
+	    snprintf(errmsg, sizeof(errmsg), "%s \"%s\".",
+		     lang[MSG_CANNOT_OPEN_MAIL_ARCHIVE],
+		     more_input[more_input_opened]);
+	    progerr(errmsg);
+	}
+	++more_input_opened;
+	if (!read_anything || fgets(buf, MAXLINE, *fp) == NULL)
+	    continue;
+	if (strncmp(buf, "From ", 5)) {
+	    rewind(*fp);
+	    strcpy(buf, "From \n");
+	    *new_file = NEW_FILE_BARE;
+	}
+	else
+	    *new_file = NEW_FILE_FROM;
+	return buf;
+    }
+    read_anything = TRUE;
+    return buf;
+}
+
 /*
 ** Parsing...the heart of Hypermail!
 ** This loads in the articles from stdin or a mailbox, adding the right
@@ -1627,7 +1800,15 @@ int parsemail(char *mbox,	/* file name */
     bool continue_previous_flow_flag = FALSE;
     bool delsp_flag = FALSE;
 
+    int new_file = 0;		/* see next_line() */
+    int checkpoint;		/* remember where this mbox was read up to */
+    long msg_start = -1;	/* where the message being read began */
+    long last_start = -1;	/* and the one before it */
+
     int binfile = -1;
+    char *binfile_name = NULL;	/* text attachment to compress once written */
+    struct attach *attachlist = NULL;	/* attachments of this message */
+    struct attach *cur_attach = NULL;	/* the one binfile is writing */
 
     char *charset = NULL;	/* this is the LOCAL charset used in the mail */
     char *charsetsave;      /* charset in MIME encoded text */
@@ -1659,6 +1840,17 @@ int parsemail(char *mbox,	/* file name */
                  lang[MSG_CANNOT_OPEN_MAIL_ARCHIVE], mbox);
 	progerr(errmsg);
     }
+    else if (resume_offset > 0 && fseek(fp, resume_offset, SEEK_SET)) {
+        snprintf(errmsg, sizeof(errmsg), "%s \"%s\".", 
+                 lang[MSG_CANNOT_OPEN_MAIL_ARCHIVE], mbox);
+	progerr(errmsg);
+    }
+    resume_offset = -1;
+    checkpoint = set_mbox_checkpoint && set_usebinindex && fp != stdin
+	&& !readone && increment != -1 && !num_more_input
+	&& (msg_start = ftell(fp)) != -1;
+    more_input_opened = 0;
+    read_anything = FALSE;
     if(set_append) {
     
 	/* add to an mbox as we read */
@@ -1744,8 +1936,9 @@ int parsemail(char *mbox,	/* file name */
 	}
     }
 
-    for ( ; fgets(line_buf, MAXLINE, fp) != NULL; 
-	  set_txtsuffix ? PushString(&raw_text_buf, line_buf) : 0) {
+    for ( ; next_line(line_buf, &fp, &new_file) != NULL;
+	  set_txtsuffix && new_file != NEW_FILE_BARE
+	  ? PushString(&raw_text_buf, line_buf) : 0) {
 #if DEBUG_PARSE
         fprintf(stderr,"\n^IN: %s", line_buf);
         fprintf(stderr, "^  BP %.0s: %.40s|\n^  LP %.0s: %.40s|\n^ ABP %.0s: %.40s|\n^ ALP %.0s: %.40s|\n^ OBP %.0s: %.40s|\n^ "
@@ -1758,13 +1951,18 @@ int parsemail(char *mbox,	/* file name */
                 "origlp", (origlp) ? origlp->line : "",
                 "headp", (headp) ? headp->line : "");	
 #endif 
-	if(set_append) {
+	if(set_append && new_file != NEW_FILE_BARE) {
 	    if(fputs(line_buf, fpo) < 0) {
 	        progerr("Can't write to \"mbox\""); /* revisit me */
 	    }
 	}
 	line = line_buf + set_ietf_mbox;
 
+	if (new_file) {
+	    isinheader = 0;
+	    goto leave_header;	/* the message before ends here */
+	}
+
         if (skip_mime_epilogue) {
             if (line[0] == '\n') {
                 continue;
@@ -2188,6 +2386,8 @@ int parsemail(char *mbox,	/* file name */
 				if (alternative_lastfile[0] != '\0') {
 				    /* remove the previous attachment */
 				    unlink(alternative_lastfile);
+				    remove_attachment(&attachlist, alternative_lastfile);
+				    cur_attach = NULL;
 				    alternative_lastfile[0] = '\0';
 				}
 			    }
@@ -2556,13 +2756,14 @@ int parsemail(char *mbox,	/* file name */
 	     * Daniel: I don't like this. I don't think there is something like
 	     * "a valid date field" in that line 100%.
 	     */
-	    if (!readone &&
-		!strncmp(line_buf, "From ", 5) &&
-		(*(dp = getfromdate(line)) != '\0')) {
-		if (-1 != binfile) {
-		    close(binfile);
-		    binfile = -1;
+	    if ((new_file || (!readone && !strncmp(line_buf, "From ", 5))) &&
+		(*(dp = getfromdate(line)) != '\0' || new_file)) {
+		if (checkpoint) {
+		    last_start = msg_start;
+		    msg_start = ftell(fp) - (long)strlen(line_buf);
 		}
+		if (-1 != binfile)
+		    binfile = close_attachment(binfile, &binfile_name);
 
                 /* as long as we don't handle UTF-8 throughout), use the prefered
                    content charset if we got one  */
@@ -2688,6 +2889,9 @@ msgid);
 		    emp->is_deleted = is_deleted;
 		    emp->annotation_robot = annotation_robot;
 		    emp->annotation_content = annotation_content;
+		    free_attachments(emp->attachlist);
+		    emp->attachlist = attachlist;
+		    attachlist = NULL;
 
 		    if (insert_in_lists(emp, require_filter,
 					require_filter_len + require_filter_full_len))
@@ -2698,6 +2902,8 @@ msgid);
 		    emptydir(att_dir);
 		    rmdir(att_dir);
 		}
+		free_attachments(attachlist);
+		attachlist = NULL;
 		for (pos = 0; pos < require_filter_len; ++pos)
 		    require_filter[pos] = FALSE;
 		for (pos = 0; pos < require_filter_full_len; ++pos)
@@ -2991,10 +3197,8 @@ msgid);
                             printf("New section: restoring charset %s and charsetsave %s\n", charset, charsetsave);
 #endif
                         }
-			if (-1 != binfile) {
-			    close(binfile);
-			    binfile = -1;
-			}
+			if (-1 != binfile)
+			    binfile = close_attachment(binfile, &binfile_name);
                         
 			continue;
 		    }
@@ -3225,6 +3429,12 @@ msgid);
 #endif
 				if (-1 != binfile) {
 				    chmod(binname, set_filemode);
+				    cur_attach = add_attachment(&attachlist,
+					strrchr(binname, PATH_SEPARATOR) + 1,
+					fname, type);
+				    if ((set_gzip_pages || set_brotli_pages)
+					&& !strncasecmp(type, "text/", 5))
+					binfile_name = strsav(binname);
 				    if (set_showprogress)
 					print_progress(num, lang
 					       [MSG_CREATED_ATTACHMENT_FILE],
@@ -3415,6 +3625,8 @@ msgid);
 			    datalen = strlen(data);
 
 			write(binfile, data, datalen);
+			if (cur_attach)
+			    cur_attach->size += datalen;
 		    }
 		}
 
@@ -3423,6 +3635,8 @@ msgid);
 	    }
 	}
     }
+    if (-1 != binfile)
+	binfile = close_attachment(binfile, &binfile_name);
     if(set_append && fclose(fpo)) {
 	progerr("Can't close \"mbox\"");
     }
@@ -3515,6 +3729,9 @@ msgid);
 	    emp->is_deleted = is_deleted;
 	    emp->annotation_robot = annotation_robot;
 	    emp->annotation_content = annotation_content;
+	    free_attachments(emp->attachlist);
+	    emp->attachlist = attachlist;
+	    attachlist = NULL;
 	    if (insert_in_lists(emp, require_filter,
 				require_filter_len + require_filter_full_len))
 	        ++num_added;
@@ -3525,6 +3742,8 @@ msgid);
 
 	/* @@@ if we didn't add the message, we should consider erasing the attdir
 	   if it's there */
+	free_attachments(attachlist);
+	attachlist = NULL;
 
 	if (hasdate)
 	    free(date);
@@ -3624,11 +3843,22 @@ msgid);
     printf("\b\b\b\b%4d %s.\n", num, lang[MSG_ARTICLES]);
 #endif
 
+    /* a message that was still in its header at the end of the mbox
+       wasn't added; it may not have been completely written yet */
+    if (checkpoint) {
+	if (!isinheader)
+	    save_checkpoint(fp, msg_start, ftell(fp));
+	else
+	    save_checkpoint(fp, last_start, msg_start);
+    }
+
     /* kpm - this is to prevent the closing of std and hypermail crashing
      * if the input is from stdin
      */
     if (fp != stdin)
 	fclose(fp);
+    more_input = NULL;
+    num_more_input = 0;
 
 #ifdef FASTREPLYCODE
     threadlist_by_msgnum = (struct reply **)emalloc((num + 1)*sizeof(struct reply *));
@@ -3681,19 +3911,31 @@ static void check_expiry(struct emailinfo *emp)
 {
     time_t email_time;
     const char *option = "expires";
+    /* the same for every old message, so only worked out once */
+    static int have_limits = 0;
+    static time_t now, older_limit, newer_limit;
+
+    if (!have_limits) {
+	now = time(NULL);
+	if (set_delete_older)
+	    older_limit = convtoyearsecs(set_delete_older);
+	if (set_delete_newer)
+	    newer_limit = convtoyearsecs(set_delete_newer);
+	have_limits = 1;
+    }
     if (!emp->is_deleted) {
-        if (emp->exp_time != -1 && emp->exp_time < time(NULL))
+        if (emp->exp_time != -1 && emp->exp_time < now)
 	    emp->is_deleted = FILTERED_EXPIRE;
 	email_time = emp->fromdate;
 	if (email_time == -1)
 	    email_time = emp->date;
 	if (email_time != -1 && set_delete_older
-	    && email_time < convtoyearsecs(set_delete_older)) {
+	    && email_time < older_limit) {
 	    emp->is_deleted = FILTERED_OLD;
 	    option = "delete_older";
 	}
 	if (email_time != -1 && set_delete_newer
-	    && email_time < convtoyearsecs(set_delete_newer)) {
+	    && email_time < newer_limit) {
 	    emp->is_deleted = FILTERED_NEW;
 	    option = "delete_newer";
 	}
@@ -3971,6 +4213,71 @@ int parse_old_html(int num, struct emailinfo *ep, int parse_body,
     return (cmp_msgid ? msgids_are_same : num_added);
 }
 
+/*
+** Reads the "In reply to" links of the page of ep the way both readers
+** of old pages look for them: find_replyto_from_html() takes any link
+** after those words up to the thread links, parse_old_html() only the
+** one it recognizes before the body, which leaves out maybe replies
+** and replies to deleted messages. Sets ep->reply_links and
+** ep->sure_reply_link, -1 where there is no link, and returns 1; or
+** returns 0, leaving them unknown, if the page has more than two links
+** of the first kind.
+*/
+
+int read_reply_links(struct emailinfo *ep)
+{
+    char line[MAXLINE];
+    char command[100];
+    char inreply_start[256];
+    static const char *inreply_start_old = "<li><dfn>In reply to</dfn>: <a href=\"";
+    static const char *href_str = "<a href=\"";
+    char *filename;
+    char *ptr;
+    FILE *fp;
+    int in_links = 1;
+    int in_header = 1;
+    int num_links = 0;
+    int reply_links[3];
+    int sure_reply_link = -1;
+
+    snprintf(inreply_start, sizeof(inreply_start),
+	     "<dfn>%s</dfn>: <a href=\"", lang[MSG_IN_REPLY_TO]);
+    filename = articlehtmlfilename(ep);
+    if ((fp = fopen(filename, "r")) != NULL) {
+	while ((in_links || in_header) && fgets(line, sizeof(line), fp)) {
+	    if (in_links) {
+		if ((ptr = strcasestr(line, lang[MSG_IN_REPLY_TO])) != NULL
+		    && (ptr = strcasestr(ptr, href_str)) != NULL) {
+		    reply_links[num_links < 2 ? num_links : 2] =
+			atoi(ptr + strlen(href_str));
+		    ++num_links;
+		}
+		if (!strcmp(line, "<!-- lnextthread=\"start\" -->\n"))
+		    in_links = 0;
+	    }
+	    if (!in_header)
+		continue;
+	    if (1 == sscanf(line, "<!-- %99[^=]=", command)) {
+		if (!strcasecmp(command, "body"))
+		    in_header = 0;
+	    }
+	    else if ((ptr = strcasestr(line, inreply_start)) != NULL)
+		sure_reply_link = atoi(ptr + strlen(inreply_start));
+	    else if ((ptr = strstr(line, inreply_start_old)) != NULL)
+		sure_reply_link = atoi(ptr + strlen(inreply_start_old));
+	}
+	fclose(fp);
+    }
+    free(filename);
+    if (num_links > 2)
+	return 0;
+    ep->reply_links[0] = num_links > 0 ? reply_links[0] : -1;
+    ep->reply_links[1] = num_links > 1 ? reply_links[1] : -1;
+    /* without a body, not a page parse_old_html() takes */
+    ep->sure_reply_link = in_header ? -1 : sure_reply_link;
+    return 1;
+}
+
 /*
 ** All this does is get all the relevant header information from the
 ** comment fields in existing archive files. Everything is loaded into
@@ -4032,27 +4339,28 @@ static int loadoldheadersfrommessages(char *dir, int num_from_gdbm)
     if (set_folder_by_date) {
 	if (!num_from_gdbm)
 	    return 0;
-#ifdef GDBM
-	if (set_usegdbm && !hashnumlookup(first_read_body, &e0)
+	if ((set_usegdbm || set_usebinindex)
+	    && !hashnumlookup(first_read_body, &e0)
 	    && set_startmsgnum == 0 && first_read_body == 0
 	    && num_from_gdbm != -1 && hashnumlookup(1, &e0)) {
 	    /* kludge to handle old archives that mistakenly started with 0001 */
 	    first_read_body = 1;
 	}
-#endif
 	if (!hashnumlookup(first_read_body, &e0)) {
-#ifdef GDBM
-	    if (set_usegdbm) {
+	    if (set_usegdbm || set_usebinindex) {
 	        if (num_from_gdbm == -1) {
 		    if (is_empty_archive())
 		        return 0;
                     snprintf(errmsg, sizeof(errmsg),
 			    "Error: This archive does not appear to be empty, "
-			    "and it has no gdbm file\n(%s). If you want to "
+			    "and it has no %s file\n(%s). If you want to "
 			    "use incremental updates with the folder_by_date\n"
 			    "option, you must start with an empty archive or "
 			    "with an archive\nthat was generated using the "
-			    "usegdbm option.", GDBM_INDEX_NAME);
+			    "%s option.",
+			    set_usebinindex ? "index" : "gdbm",
+			    set_usebinindex ? BIN_INDEX_NAME : GDBM_INDEX_NAME,
+			    set_usebinindex ? "usebinindex" : "usegdbm");
 		}
 		else
                     snprintf(errmsg, sizeof(errmsg),
@@ -4060,13 +4368,13 @@ static int loadoldheadersfrommessages(char *dir, int num_from_gdbm)
 			    first_read_body, num_from_gdbm);
 	    }
 	    else
-                snprintf(errmsg, sizeof(errmsg), "folder_by_date with incremental update requires usegdbm option");
+#ifdef GDBM
+                snprintf(errmsg, sizeof(errmsg), "folder_by_date with incremental update requires usegdbm or usebinindex option");
 #else
                 snprintf(errmsg, sizeof(errmsg),
-	                "folder_by_date requires usegdbm option"
-			". gdbm support has not been compiled into this"
-			" copy of hypermail. You probably need to install"
-			"gdbm and rerun configure.");
+	                "folder_by_date requires usebinindex option"
+			" (or usegdbm, but gdbm support has not been compiled"
+			" into this copy of hypermail).");
 #endif
 	    progerr(errmsg);
 	}
@@ -4090,7 +4398,8 @@ static int loadoldheadersfrommessages(char *dir, int num_from_gdbm)
 
     while (num <= max_num) {
 	struct emailinfo *ep0 = NULL;
-	int parse_body = (set_linkquotes && num >= first_read_body);
+	int parse_body = (set_linkquotes && num >= first_read_body
+			  && !quote_index_loaded());
 	if (num_from_gdbm != -1 || set_folder_by_date) {
 	    if (!hashnumlookup(num, &ep0)) {
 	        if (++num > max_num)
@@ -4098,8 +4407,23 @@ static int loadoldheadersfrommessages(char *dir, int num_from_gdbm)
 	        continue;
 	    }
 	}
-	num_added += parse_old_html(num, ep0, parse_body, num_from_gdbm == -1,
-				    &replylist_tmp, 0);
+	if (num_from_gdbm != -1 && !parse_body
+	    && ep0->sure_reply_link != REPLY_UNKNOWN) {
+	    /* the index has the link from an earlier run */
+#ifdef FASTREPLYCODE
+	    struct emailinfo *email2;
+	    if (ep0->sure_reply_link != -1
+		&& hashnumlookup(ep0->sure_reply_link, &email2))
+		replylist_tmp = addreply2(replylist_tmp, email2, ep0, 0, NULL);
+#else
+	    if (ep0->sure_reply_link != -1)
+		replylist_tmp = addreply(replylist_tmp, ep0->sure_reply_link,
+					 ep0, 0, NULL);
+#endif
+	}
+	else
+	    num_added += parse_old_html(num, ep0, parse_body, num_from_gdbm == -1,
+					&replylist_tmp, 0);
 
 	num++;
 
@@ -4325,6 +4649,101 @@ int loadoldheadersfromGDBMindex(char *dir, int get_count_only)
 } /* end loadoldheadersfromGDBMindex() */
 #endif
 
+/*
+** Load message summary information from the binary index (usebinindex).
+** The dates are stored as seconds and the strings are used from the
+** mapped file as they are, so nothing needs to be parsed. The replies
+** found by earlier runs come along, see crossindex(). An archive
+** without an index gets one, from its gdbm index if there is one.
+*/
+
+static int loadoldheadersfrombinindex(char *dir)
+{
+    struct binindex *bi;
+    struct binindex_msg msg;
+    int num;
+    int max_num;
+    int num_added = 0;
+    int old_delete_level;
+
+    if ((bi = binindex_map(dir)) == NULL) {
+#ifdef GDBM
+	char *gdbmname;
+	trio_asprintf(&gdbmname, (dir[strlen(dir)-1] == '/') ? "%s%s" : "%s/%s",
+		      dir, GDBM_INDEX_NAME);
+	if (isfile(gdbmname)) {
+	    if (set_showprogress)
+		printf("Converting %s to %s...\n", GDBM_INDEX_NAME, BIN_INDEX_NAME);
+	    num_added = loadoldheadersfromGDBMindex(dir, 0);
+	}
+	else
+#endif
+	    num_added = loadoldheadersfrommessages(dir, -1);
+#ifdef GDBM
+	free(gdbmname);
+#endif
+	binindex_write_all(max_msgnum + 1);
+	return num_added;
+    }
+
+    authorlist = subjectlist = datelist = NULL;
+    max_num = binindex_max_msgnum(bi);
+    old_delete_level = binindex_delete_level(bi);
+
+    for (num = 0; num <= max_num; num++) {
+	struct emailinfo *emp;
+	struct body *bp = NULL;
+	struct body *lp = NULL;
+
+	if (!binindex_fetch(bi, num, &msg))
+	    continue;
+	bp = addbody(bp, &lp, "\0", 0);
+	if ((emp = addhash_dated(num, msg.datestr, msg.name, msg.email,
+				 msg.msgid, msg.subject, msg.inreplyto,
+				 msg.fromdatestr, msg.charset, msg.date,
+				 msg.fromdate, bp))) {
+	    emp->exp_time = msg.exp_time;
+	    emp->is_deleted = msg.is_deleted;
+	    emp->deletion_completed = old_delete_level;
+	    emp->reply_to = msg.reply_to;
+	    emp->maybereply = msg.maybereply;
+	    emp->reply_links[0] = msg.reply_links[0];
+	    emp->reply_links[1] = msg.reply_links[1];
+	    emp->sure_reply_link = msg.sure_reply_link;
+	    emp->flags |= FROM_INDEX;
+	    check_expiry(emp);
+	    if (insert_in_lists(emp, NULL, 0))
+		++num_added;
+	    if (num == max_num) {
+		char *filename = articlehtmlfilename(emp);
+		if (!isfile(filename) && !msg.is_deleted) {
+		    trio_snprintf(errmsg, sizeof(errmsg),
+				  "%s \"%s\". If you deleted files,"
+				  " you need to delete the %s and %s files as well.",
+				  lang[MSG_CANNOT_OPEN_MAIL_ARCHIVE], filename,
+				  BIN_INDEX_NAME, BIN_INDEX_STRINGS_NAME);
+		    progerr(errmsg);
+		}
+		free(filename);
+	    }
+	}
+
+	if (!(num % 10) && set_showprogress) {
+	    printf("\r%4d", num);
+	    fflush(stdout);
+	}
+    }
+    binindex_unmap(bi);
+    forget_new_messages();
+
+    if (set_linkquotes) {
+	load_quote_index(dir, max_num);
+	loadoldheadersfrommessages(dir, num);
+    }
+
+    return num_added;
+}
+
 /* All this does is get all the relevant header information.
 ** Everything is loaded into structures in the exact same way as if
 ** articles were being read from stdin or a mailbox.
@@ -4337,12 +4756,17 @@ int loadoldheaders(char *dir)
 
   if (set_showprogress)
     printf("%s...\n", lang[MSG_READING_OLD_HEADERS]);
+  queue_header_lists();
 #ifdef GDBM
   if(set_usegdbm)
     num = loadoldheadersfromGDBMindex(dir, 0);
   else
 #endif
+  if (set_usebinindex)
+    num = loadoldheadersfrombinindex(dir);
+  else
     num = loadoldheadersfrommessages(dir, -1);
+  build_header_lists();
 
   if (set_showprogress)
     printf("\b\b\b\b%4d %s.\n", num, lang[MSG_ARTICLES]);
@@ -4391,8 +4815,8 @@ void fixnextheader(char *dir, int num, int direction)
 
 #ifdef HAVE_ICONV
     char *numsubject,*numname;
-    numsubject=i18n_utf2numref(email->subject,1);
-    numname=i18n_utf2numref(email->name,1);
+    numsubject=msg_link_subject(email);
+    numname=msg_link_name(email);
 #endif
 
     fp = fopen(filename, "w+");
@@ -4466,6 +4890,7 @@ void fixnextheader(char *dir, int num, int direction)
 	}
     }
     fclose(fp);
+    compress_page(filename);
 
     /* can we clean up a bit please... */
     free_body(cp);
@@ -4530,7 +4955,7 @@ void fixreplyheader(char *dir, int num, int remove_maybes, int max_update)
                 "<li><a name=\"replies\" id=\"replies\"></a><dfn>%s</dfn>: <a href=", 
 		 lang[MSG_MAYBE_REPLY]);
         snprintf(current_reply_pattern, sizeof(current_reply_pattern), 
-                "<li><dfn>%s</dfn>: <a href=", lang[MSG_REPLY]);
+                "<dfn>%s</dfn>: ", lang[MSG_REPLY]);
         snprintf(current_link_reply_pattern, sizeof(current_reply_pattern), 
                 "<li><a name=\"replies\" id=\"replies\"></a><dfn>%s</dfn>: <a href=",
 		 lang[MSG_REPLY]);
@@ -4543,8 +4968,14 @@ void fixreplyheader(char *dir, int num, int remove_maybes, int max_update)
 	/* backwards compatiblity */
 	snprintf(old2_maybe_pattern, sizeof(old2_maybe_pattern), 
                 "<li><strong>%s:</strong> <a href=", lang[MSG_MAYBE_REPLY]);
+	snprintf(old2_link_maybe_pattern, sizeof(old2_link_maybe_pattern), 
+                "<li><a name=\"replies\"></a><strong>%s:</strong> <a href=",
+		 lang[MSG_MAYBE_REPLY]);
         snprintf(old2_reply_pattern, sizeof(old2_reply_pattern), 
                 "<li><strong>%s:</strong> <a href=", lang[MSG_REPLY]);
+        snprintf(old2_link_reply_pattern, sizeof(old2_link_reply_pattern), 
+                "<li><a name=\"replies\"></a><strong>%s:</strong> <a href=",
+		 lang[MSG_REPLY]);
         snprintf(old2_nextinthread_pattern, 
                 sizeof(old2_nextinthread_pattern), 
                 "<li><strong>%s:</strong> <a href=", lang[MSG_NEXT_IN_THREAD]);
@@ -4624,8 +5055,8 @@ void fixreplyheader(char *dir, int num, int remove_maybes, int max_update)
 
 #ifdef HAVE_ICONV
     char *numsubject,*numname;
-    numsubject=i18n_utf2numref(email->subject,1);
-    numname=i18n_utf2numref(email->name,1);
+    numsubject=msg_link_subject(email);
+    numname=msg_link_name(email);
 #endif
 
     fp = fopen(filename, "w+");
@@ -4745,6 +5176,7 @@ void fixreplyheader(char *dir, int num, int remove_maybes, int max_update)
 	}
     }
     fclose(fp);
+    compress_page(filename);
 
     /* can we clean up a bit please... */
     free_body(cp);
@@ -4760,8 +5192,6 @@ void fixthreadheader(char *dir, int num, int max_update)
 {
     char *filename;
     char line[MAXLINE];
-    char *name = NULL;
-    char *subject = NULL;
     FILE *fp;
     struct reply *rp;
     struct body *bp, *cp;
@@ -4776,8 +5206,6 @@ void fixthreadheader(char *dir, int num, int max_update)
 	    ) {
 
 	    threadnum = rp->msgnum;
-	    name = rp->next->data->name;
-	    subject = rp->next->data->subject;
 	    break;
 	}
     }
@@ -4804,8 +5232,8 @@ void fixthreadheader(char *dir, int num, int max_update)
 #ifdef HAVE_ICONV
     char *numsubject,*numname;
     ptr=NULL;
-    numsubject=i18n_utf2numref(subject,1);
-    numname=i18n_utf2numref(name,1);
+    numsubject=msg_link_subject(rp->next->data);
+    numname=msg_link_name(rp->next->data);
 #endif
 
     if ((fp = fopen(filename, "w+")) != NULL) {
@@ -4827,7 +5255,8 @@ void fixthreadheader(char *dir, int num, int max_update)
 #ifdef HAVE_ICONV
 			 numname, numsubject,
 #else
-			 name, ptr = convchars(subject, NULL),
+			 rp->next->data->name,
+			 ptr = convchars(rp->next->data->subject, NULL),
 #endif
 			 lang[MSG_NEXT_IN_THREAD]);
 		if (ptr)
@@ -4847,7 +5276,8 @@ void fixthreadheader(char *dir, int num, int max_update)
 		  numname, numsubject);
                 ptr=NULL;
 #else
-			name, ptr = convchars(subject, NULL));
+			rp->next->data->name,
+			ptr = convchars(rp->next->data->subject, NULL));
 #endif
 		if (ptr)
 		  free(ptr);
@@ -4866,7 +5296,8 @@ void fixthreadheader(char *dir, int num, int max_update)
 			    numname, numsubject);
                     ptr=NULL;
 #else
-			    name, ptr = convchars(subject, NULL));
+			    rp->next->data->name,
+			    ptr = convchars(rp->next->data->subject, NULL));
 #endif
 		    free(ptr);
 		    if (bp->next && strstr(bp->next->line, lang[MSG_NEXT_IN_THREAD]))
@@ -4877,6 +5308,7 @@ void fixthreadheader(char *dir, int num, int max_update)
 	}
     }
     fclose(fp);
+    compress_page(filename);
 
     /* can we clean up a bit please... */
     free_body(cp);
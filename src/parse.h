@@ -12,8 +12,11 @@ char *getid(char *);
 char *getsubject(char *);
 char *getreply(char *);
 void print_progress(int, char *, char *);
+int resume_mbox(char *);
+void parse_more_input(char **, int);
 int parsemail(char *, int, int, int, char *, int, int);
 int parse_old_html(int, struct emailinfo *, int, int, struct reply **, int);
+int read_reply_links(struct emailinfo *);
 int loadoldheaders(char *);
 int loadoldheadersfromGDBMindex(char *, int);
 void crossindex(void);
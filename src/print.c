@@ -27,6 +27,8 @@
 #include "struct.h"
 #include "printfile.h"
 #include "print.h"
+#include "output.h"
+#include "binindex.h"
 #include "parse.h"
 #include "txt2html.h"
 #include "finelink.h"
@@ -260,6 +262,26 @@ void fprint_menu(FILE *fp, mindex_t idx, char *archives, char *currentid, char *
 
 #endif
 
+/*
+** One " [ by date ]" style link of the message menus, pointing to the
+** entry of message num in the index.
+*/
+
+static void print_index_link(FILE *fp, char *index, int num,
+			     char *title, char *label)
+{
+  out_lit(fp, " [ <a href=\"");
+  out_str(fp, index);
+  putc('#', fp);
+  out_str(fp, set_fragment_prefix);
+  out_int(fp, num);
+  out_lit(fp, "\" title=\"");
+  out_str(fp, title);
+  out_lit(fp, "\">");
+  out_str(fp, label);
+  out_lit(fp, "</a> ]");
+}
+
 /* non-tables version of fprint_menu */
 
 void fprint_menu0(FILE *fp, struct emailinfo *email, int pos)
@@ -270,11 +292,6 @@ void fprint_menu0(FILE *fp, struct emailinfo *email, int pos)
   char *ptr;
   char *id= (pos == PAGE_TOP) ? "options2" : "options3";
 
-#ifdef HAVE_ICONV
-  size_t tmplen;
-  char *tmpptr=i18n_convstring(email->subject,"UTF-8",email->charset,&tmplen);
-#endif
-
   if (!(set_show_msg_links && set_show_msg_links != loc_cmp)
       || (set_show_index_links && set_show_index_links != loc_cmp)) {
     fprintf(fp, "<ul class=\"links\">\n");
@@ -284,20 +301,14 @@ void fprint_menu0(FILE *fp, struct emailinfo *email, int pos)
     fprintf(fp, "<li><a name=\"%s\" id=\"%s\"></a><dfn>%s</dfn>:", 
 	    id,id,lang[MSG_MAIL_ACTIONS]);
     if ((email->msgid && email->msgid[0]) || (email->subject && email->subject[0])) {
-#ifdef HAVE_ICONV
-      ptr = makemailcommand(set_replymsg_command, set_hmail, email->msgid, tmpptr);
-#else
-      ptr = makemailcommand(set_replymsg_command, set_hmail, email->msgid, email->subject);
-#endif
+      ptr = makemailcommand(set_replymsg_command, set_hmail, email->msgid,
+			    msg_mail_subject(email));
       fprintf(fp, " [ <a href=\"%s\">%s</a> ]", ptr ? ptr : "", lang[MSG_MA_REPLY]);
       if (ptr)
 	free(ptr);
     }
-#ifdef HAVE_ICONV
-    ptr = makemailcommand(set_newmsg_command, set_hmail, email->msgid, tmpptr);
-#else
-    ptr = makemailcommand(set_newmsg_command, set_hmail, email->msgid, email->subject);
-#endif
+    ptr = makemailcommand(set_newmsg_command, set_hmail, email->msgid,
+			  msg_mail_subject(email));
     fprintf(fp, " [ <a href=\"%s\">%s</a> ]", ptr ? ptr : "", lang[MSG_MA_NEW_MESSAGE]);
     if (ptr)
       free(ptr);
@@ -311,21 +322,17 @@ void fprint_menu0(FILE *fp, struct emailinfo *email, int pos)
       fprintf (fp, "<a name=\"%s\" id=\"%s\"></a>",id,id);
     fprintf(fp, "<dfn>%s</dfn>:", lang[MSG_CONTEMPORARY_MSGS_SORTED]);
     if (show_index[dlev][DATE_INDEX])
-      fprintf(fp, " [ <a href=\"%s#%s%d\" title=\"%s\">%s</a> ]", 
-	      index_name[dlev][DATE_INDEX], set_fragment_prefix, num, 
-	      lang[MSG_LTITLE_BY_DATE], lang[MSG_BY_DATE]);
+      print_index_link(fp, index_name[dlev][DATE_INDEX], num,
+		       lang[MSG_LTITLE_BY_DATE], lang[MSG_BY_DATE]);
     if (show_index[dlev][THREAD_INDEX])
-      fprintf(fp, " [ <a href=\"%s#%s%d\" title=\"%s\">%s</a> ]",
-	      index_name[dlev][THREAD_INDEX], set_fragment_prefix, num, 
-	      lang[MSG_LTITLE_BY_THREAD], lang[MSG_BY_THREAD]);
+      print_index_link(fp, index_name[dlev][THREAD_INDEX], num,
+		       lang[MSG_LTITLE_BY_THREAD], lang[MSG_BY_THREAD]);
     if (show_index[dlev][SUBJECT_INDEX])
-      fprintf(fp, " [ <a href=\"%s#%s%d\" title=\"%s\">%s</a> ]", 
-	      index_name[dlev][SUBJECT_INDEX], set_fragment_prefix, num, 
-	      lang[MSG_LTITLE_BY_SUBJECT], lang[MSG_BY_SUBJECT]);
+      print_index_link(fp, index_name[dlev][SUBJECT_INDEX], num,
+		       lang[MSG_LTITLE_BY_SUBJECT], lang[MSG_BY_SUBJECT]);
     if (show_index[dlev][AUTHOR_INDEX])
-      fprintf(fp, " [ <a href=\"%s#%s%d\" title=\"%s\">%s</a> ]", 
-	      index_name[dlev][AUTHOR_INDEX], set_fragment_prefix, num, 
-	      lang[MSG_LTITLE_BY_AUTHOR], lang[MSG_BY_AUTHOR]);
+      print_index_link(fp, index_name[dlev][AUTHOR_INDEX], num,
+		       lang[MSG_LTITLE_BY_AUTHOR], lang[MSG_BY_AUTHOR]);
     if (show_index[dlev][ATTACHMENT_INDEX])
       fprintf(fp, " [ <a href=\"%s\" title=\"%s\">%s</a> ]", 
 	      index_name[dlev][ATTACHMENT_INDEX], 
@@ -342,11 +349,6 @@ void fprint_menu0(FILE *fp, struct emailinfo *email, int pos)
       || (set_show_index_links && set_show_index_links != loc_cmp)) {
     fprintf (fp,"</ul>\n");
   }
-
-#ifdef HAVE_ICONV
-  if(tmpptr)
-    free(tmpptr);
-#endif
 }
 
 /*----------------------------------------------------------------------------*/
@@ -720,7 +722,11 @@ void printcomment(FILE *fp, char *label, char *value)
 	    ext_value = PUSH_STRING(retbuf);
 	}
 	
-	fprintf(fp, "<!-- %s=\"%s\" -->\n", ext_label, ext_value);
+	out_lit(fp, "<!-- ");
+	out_str(fp, ext_label);
+	out_lit(fp, "=\"");
+	out_str(fp, ext_value);
+	out_lit(fp, "\" -->\n");
 	if (ext_label != label)
 	    free(ext_label);
 	if (ext_value != value)
@@ -767,78 +773,84 @@ void printhtml(FILE *fp, char *line)
 }
 
 /*
-** Pretty-prints the dates in the index files.
+** Prints one message of a date index.
 */
-void printdates(FILE *fp, struct header *hp, int year, int month, struct emailinfo *subdir_email,
-		char *prev_date_str)
+
+static void print_date_entry(FILE *fp, struct emailinfo *em,
+			     struct emailinfo *subdir_email, char *prev_date_str)
 {
-  char *subject=NULL,*name=NULL;
+  const char *charset;
   const char *startline;
   const char *break_str;
   const char *endline;
-  const char *subj_tag;
-  const char *subj_end_tag;
-  static char date_str[DATESTRLEN+40]; /* made static for smaller stack */
+  const char *date_str;
   static char *first_attributes = "<a  accesskey=\"j\" name=\"first\" id=\"first\"></a>";
 
-  if (hp != NULL) {
-    struct emailinfo *em=hp->data;
-    printdates(fp, hp->left, year, month, subdir_email, prev_date_str);
-    if ((year == -1 || year_of_datenum(em->date) == year)
-	&& (month == -1 || month_of_datenum(em->date) == month)
-	&& !em->is_deleted
-	&& (!subdir_email || subdir_email->subdir == em->subdir)) {
-
 #ifdef HAVE_ICONV
-      subject = convchars(em->subject, "utf-8");
-      name = convchars(em->name, "utf-8");
+  charset = "utf-8";
 #else
-      subject = convchars(em->subject, em->charset);
-      name = convchars(em->name, em->charset);
+  charset = em->charset;
 #endif
       
-      if(set_indextable) {
-	startline = "<tr><td>";
-	break_str = "</td><td nowrap>";
-	strcpy(date_str, getdateindexdatestr(hp->data->date));
-	endline = "</td></tr>";
-	subj_tag = "";
-	subj_end_tag = "";
-      }
+  if(set_indextable) {
+    startline = "<tr><td>";
+    break_str = "</td><td nowrap>";
+    date_str = getdateindexdatestr(em->date);
+    endline = "</td></tr>";
+  }
+  else {
+    char *tmp;
+    tmp = getdateindexdatestr(em->date);
+    if (strcmp (prev_date_str, tmp)) {
+      if (*prev_date_str)  /* close the previous date item */
+	out_lit(fp, "</ul></li>\n<li>");
       else {
-	char *tmp;
-	bool is_first;
-	tmp = getdateindexdatestr(hp->data->date);
-	if (strcmp (prev_date_str, tmp)) {
-	  if (*prev_date_str)  { /* close the previous date item */
-	    fprintf (fp, "</ul></li>\n");
-	    is_first = FALSE;
-	  }
-	  else
-	    is_first = TRUE;
-	  snprintf(date_str, sizeof(date_str), "<li>%s<dfn>%s</dfn><ul>\n", 
-		  (is_first) ? first_attributes : "", tmp);
-	  fprintf (fp, "%s", date_str);
-	  strcpy (prev_date_str, tmp);
-	}
-	date_str[0] = 0;
-	startline = "<li>";
-	break_str = "&nbsp;";
-	endline = "</li>";
-	subj_tag = "";
-	subj_end_tag = "";
+	out_lit(fp, "<li>");
+	out_str(fp, first_attributes);
       }
+      out_lit(fp, "<dfn>");
+      out_str(fp, tmp);
+      out_lit(fp, "</dfn><ul>\n");
+      strcpy (prev_date_str, tmp);
+    }
+    date_str = "";
+    startline = "<li>";
+    break_str = "&nbsp;";
+    endline = "</li>";
+  }
 
-      fprintf(fp,"%s<a href=\"%s\">%s%s%s</a>%s<a name=\"%s%d\" id=\"%s%d\"><em>%s</em></a>%s%s%s\n",
-	      startline, msg_href(em, subdir_email, FALSE), 
-	      subj_tag, subject, subj_end_tag, break_str, 
-	      set_fragment_prefix, em->msgnum, set_fragment_prefix, em->msgnum, 
-	      name,
-	      break_str, date_str, endline);
+  out_str(fp, startline);
+  out_lit(fp, "<a href=\"");
+  out_str(fp, msg_href(em, subdir_email, FALSE));
+  out_lit(fp, "\">");
+  out_html(fp, em->subject, charset);
+  out_lit(fp, "</a>");
+  out_str(fp, break_str);
+  out_lit(fp, "<a ");
+  out_msg_anchor(fp, em->msgnum);
+  out_lit(fp, "><em>");
+  out_html(fp, em->name, charset);
+  out_lit(fp, "</em></a>");
+  out_str(fp, break_str);
+  out_str(fp, date_str);
+  out_str(fp, endline);
+  out_lit(fp, "\n");
+}
 
-      free(subject);
-      free(name);
-    }
+/*
+** Pretty-prints the dates in the index files.
+*/
+void printdates(FILE *fp, struct header *hp, int year, int month, struct emailinfo *subdir_email,
+		char *prev_date_str)
+{
+  if (hp != NULL) {
+    struct emailinfo *em=hp->data;
+    printdates(fp, hp->left, year, month, subdir_email, prev_date_str);
+    if ((year == -1 || year_of_datenum(em->date) == year)
+	&& (month == -1 || month_of_datenum(em->date) == month)
+	&& !em->is_deleted
+	&& (!subdir_email || subdir_email->subdir == em->subdir))
+      print_date_entry(fp, em, subdir_email, prev_date_str);
     printdates(fp, hp->right, year, month, subdir_email, prev_date_str);
   }
 }
@@ -850,8 +862,6 @@ void printdates(FILE *fp, struct header *hp, int year, int month, struct emailin
 int printattachments(FILE *fp, struct header *hp, struct emailinfo *subdir_email, bool *is_first)
 {
     char *subject=NULL,*name=NULL;
-    char *attdir;
-    char *msgnum;
     int  nb_attach = 0;
     static char *first_attributes = "<a  accesskey=\"j\" name=\"first\" id=\"first\"></a>";
 
@@ -866,13 +876,10 @@ int printattachments(FILE *fp, struct header *hp, struct emailinfo *subdir_email
 	    subject = (set_i18n) ? em->subject : convchars(em->subject, em->charset);
             name = (set_i18n) ? em->name : convchars(em->name,em->charset);
 
-	    /* See if there's a directory corresponding to this message */
-	    msgnum = message_name(em);
-	    trio_asprintf(&attdir, "%s%c" DIR_PREFIXER "%s", set_dir, PATH_SEPARATOR, msgnum);
-	    if (isdir(attdir)) {
-	        DIR *dir = opendir(attdir);
-		
-		/* consider that if there's an attachment directory, there are attachments */
+	    if (em->attachlist) {
+		struct attach *ap;
+		const char *fmt2 = (set_indextable ? "<tr><td>&nbsp;&nbsp;&nbsp;&nbsp;<a href=\"%s%s\">%s</a></td>" "<td colspan=\"2\" align=\"center\">(%ld %s)</td></tr>\n" : "<li><a href=\"%s%s\">%s</a> (%ld %s)</li>\n");
+
 		nb_attach++;
 		if (set_indextable) {
 		  fprintf(fp, "<tr><td>%s%s</a></td><td><a name=\"%s%d\" id=\"%s%d\"><em>%s</em></a></td>" "<td>%s</td></tr>\n", msg_href(em, subdir_email, TRUE), subject, set_fragment_prefix, em->msgnum, set_fragment_prefix, em->msgnum, name, getindexdatestr(em->date));
@@ -888,48 +895,20 @@ int printattachments(FILE *fp, struct header *hp, struct emailinfo *subdir_email
 			  getindexdatestr(em->date));
 		  if (*is_first)
 		    *is_first = FALSE;
+		  fprintf(fp, "<ol>\n");
 		}
-		if (dir) {
-#ifdef HAVE_DIRENT_H
-		    struct dirent *entry;
-#else
-		    struct direct *entry;
-#endif
-		    struct stat fileinfo;
-		    char *filename, *stripped_filename;
-		    const char *fmt2 = (set_indextable ? "<tr><td>&nbsp;&nbsp;&nbsp;&nbsp;<a href=\"%s%s\">%s</a></td>" "<td colspan=\"2\" align=\"center\">(%d %s)</td></tr>\n" : "<li><a href=\"%s%s\">%s</a> (%d %s)</li>\n");
-
-		    int first_time = 1;
-		    while ((entry = readdir(dir))) {
-		        int file_size = -1;
-			if (!strcmp(".", entry->d_name) || !strcmp("..", entry->d_name))
-				continue;
-			nb_attach++;
-			if (first_time && !set_indextable) {
-			    first_time = 0;
-			    fprintf(fp, "<ol>\n");
-			}
-			trio_asprintf(&filename, "%s%c%s", attdir, PATH_SEPARATOR, entry->d_name);
-			if (!stat(filename, &fileinfo))
-			    file_size = (int)fileinfo.st_size;
-			free(filename);
-			trio_asprintf(&filename, DIR_PREFIXER "%s%c%s", message_name(em), PATH_SEPARATOR, entry->d_name);
-			stripped_filename = strchr(entry->d_name, '-');
-			if (stripped_filename)
-				fprintf(fp, fmt2, rel_path_to_top, filename, stripped_filename + 1, file_size, lang[MSG_BYTES]);
-			else if(strcmp(entry->d_name, ".meta"))
-				fprintf(fp, fmt2, rel_path_to_top, filename, entry->d_name, file_size, lang[MSG_BYTES]);
-			free(filename);
-		    }
-		    if (!first_time && !set_indextable) {
-		        fprintf(fp, "</ol></li>\n");
-		    }
-		    closedir(dir);
+		for (ap = em->attachlist; ap != NULL; ap = ap->next) {
+		    char *filename;
+		    nb_attach++;
+		    trio_asprintf(&filename, DIR_PREFIXER "%s%c%s", message_name(em), PATH_SEPARATOR, ap->storedas);
+		    fprintf(fp, fmt2, rel_path_to_top, filename, ap->name, ap->size, lang[MSG_BYTES]);
+		    free(filename);
+		}
+		if (!set_indextable) {
+		    fprintf(fp, "</ol></li>\n");
 		}
 	    }
-            
-	    free(attdir);
-            
+
             if (!set_i18n) {
                 free(subject);
                 free(name);
@@ -1063,35 +1042,58 @@ void ConvURLs(FILE *fp, char *line, char *mailid, char *mailsubject, char *chars
     }
 }
 
+/*
+** Most lines have nothing to link: no '<' that could start an href, no
+** '@' for parseemail() and no ':' that parseurl() would look at. One
+** pass over the line tells, so that those lines are only escaped.
+*/
+
+static int may_have_links(char *line)
+{
+    char *c;
+
+    for (c = line; *c; c++) {
+	if (*c == '<' || *c == '@')
+	    return TRUE;
+	/* the test parseurl() makes for a protocol prefix */
+	if (*c == ':' && c != line && *(c+1) != '\0'
+	    && isalpha(*(c-1)) && isgraph(*(c+1)))
+	    return TRUE;
+    }
+    return FALSE;
+}
+
 char *ConvURLsString(char *line, char *mailid, char *mailsubject, char *charset)
 {
-    char *parsed;
+    char *parsed = NULL;
     char *newparse;
     char *c;
-
+    char *inreply = NULL;
+    int links = may_have_links(line);
 #ifdef HAVE_ICONV
     size_t tmplen;
-    char *tmpptr=i18n_convstring(mailsubject,"UTF-8",charset,&tmplen);
+    char *tmpptr;
+#endif
+
+    if (set_linkquotes)
+	inreply = getreply(line);
+    if (!links && !inreply)
+	return convchars(line, charset);
+
+#ifdef HAVE_ICONV
+    tmpptr=i18n_convstring(mailsubject,"UTF-8",charset,&tmplen);
     mailsubject=tmpptr;
 #endif
 
-    if (set_href_detection) {
-      if ((c = strcasestr(line, "<A HREF=\"")) != NULL && !strcasestr(c + 9, "mailto")) {
+    if (links && set_href_detection) {
+      if ((c = strcasestr(line, "<A HREF=\"")) != NULL && !strcasestr(c + 9, "mailto"))
 	parsed = ConvURLsWithHrefs(line, mailid, mailsubject, c, charset);
-	if (parsed)
-	  return parsed;
-      }
     }
 
-    if (set_linkquotes) {
-	char *inreply = getreply(line);
-	if (inreply) {
-	    parsed = ConvMsgid(line, inreply, mailid, mailsubject, charset);
-	    free(inreply);
-	    if (parsed)
-	        return parsed;
-	}
-    }
+    if (!parsed && inreply)
+	parsed = ConvMsgid(line, inreply, mailid, mailsubject, charset);
+    if (parsed || !links)
+	goto done;
 
     parsed = parseurl(line, charset);
 
@@ -1099,7 +1101,7 @@ char *ConvURLsString(char *line, char *mailid, char *mailsubject, char *charset)
        ones in the same line, we keep frmo doing the mailto convertion if we find a
        complete href */
     if (parsed && strcasestr(parsed, "</a>"))
-      return parsed;
+      goto done;
 
     /* we didn't find any previous href convertion, we try to do a mailto: convertion */
     if (use_mailcommand) {
@@ -1114,6 +1116,11 @@ char *ConvURLsString(char *line, char *mailid, char *mailsubject, char *charset)
 	    parsed = newparse;
 	}
     }
+  done:
+    if (inreply)
+	free(inreply);
+    if (!parsed && !links)
+	parsed = convchars(line, charset);
 #ifdef HAVE_ICONV
     if(tmpptr)
       free(tmpptr);
@@ -1269,12 +1276,12 @@ void printbody(FILE *fp, struct emailinfo *email, int maybe_reply, int is_reply)
     }
 
     if (!set_showhtml) {
-	fprintf(fp, "<pre id=\"body\">\n");
+	out_lit(fp, "<pre id=\"body\">\n");
 	pre = TRUE;
     }
 
     /* tag the start of the message body */
-    fprintf(fp, "<a name=\"start\" accesskey=\"j\" id=\"start\"></a>");
+    out_lit(fp, "<a name=\"start\" accesskey=\"j\" id=\"start\"></a>");
 
     if (set_showhtml == 2)
       init_txt2html();
@@ -1288,7 +1295,7 @@ void printbody(FILE *fp, struct emailinfo *email, int maybe_reply, int is_reply)
 	if (bp->html) {
 	  /* already in HTML, don't touch */
   	  if (pre) {
-	    fprintf(fp, "</pre>\n");
+	    out_lit(fp, "</pre>\n");
 	    pre = FALSE;
 	  }
 	  printhtml(fp, bp->line);
@@ -1302,7 +1309,7 @@ void printbody(FILE *fp, struct emailinfo *email, int maybe_reply, int is_reply)
 	    if (!inheader) {
               /* JK: I'm not sure why, but I had a !set_showhtml here */
 	      if (!set_showhtml && !pre && set_showheaders) {
-		fprintf(fp, "<pre>\n");
+		out_lit(fp, "<pre>\n");
 		pre = TRUE;
 	      }
 	      inheader = TRUE;
@@ -1323,14 +1330,14 @@ void printbody(FILE *fp, struct emailinfo *email, int maybe_reply, int is_reply)
 	    insig = 0;
 	    if (set_showhtml) {
 	      if (pre) {
-		fprintf(fp, "</pre>\n");
+		out_lit(fp, "</pre>\n");
 		pre = FALSE;
 	      }
-	      fprintf(fp, "<br />\n");
+	      out_lit(fp, "<br />\n");
 	    }
 	    else {
 	      if (!pre) {
-		fprintf(fp, "<pre>\n");
+		out_lit(fp, "<pre>\n");
 		pre = TRUE;
 	      }
 	    }
@@ -1350,7 +1357,7 @@ void printbody(FILE *fp, struct emailinfo *email, int maybe_reply, int is_reply)
 	}
 
         if (bp->header && set_showheaders && !pre) {
-	  fprintf(fp, "<pre>\n");
+	  out_lit(fp, "<pre>\n");
 	  pre = TRUE;
 	}
  
@@ -1365,7 +1372,7 @@ void printbody(FILE *fp, struct emailinfo *email, int maybe_reply, int is_reply)
 	  if (is_sig_start(bp->line)) {
 	    insig = 1;
 	    if (!pre) {
-	      fprintf(fp, "<pre>\n");
+	      out_lit(fp, "<pre>\n");
 	      pre = TRUE;
 	    }
 	  }
@@ -1377,7 +1384,7 @@ void printbody(FILE *fp, struct emailinfo *email, int maybe_reply, int is_reply)
 	       Akis Karnouskos <akis@ceid.upatras.gr>     */
 	    {
 	      if (!pre)
-		fprintf(fp, "<br />");
+		out_lit(fp, "<br />");
 	    }
 	  else {
 	    if (insig) {
@@ -1391,11 +1398,19 @@ void printbody(FILE *fp, struct emailinfo *email, int maybe_reply, int is_reply)
 		}
 	      }
 	      else {
-		fprintf(fp, "<%s class=\"%s\">", set_iquotes ? "em" : "span", find_quote_class(bp->line));
+		if (set_iquotes)
+		    out_lit(fp, "<em class=\"");
+		else
+		    out_lit(fp, "<span class=\"");
+		out_str(fp, find_quote_class(bp->line));
+		out_lit(fp, "\">");
 
 		ConvURLs(fp, bp->line, id, subject, email->charset);
 		
-		fprintf(fp, "%s<br />\n", (set_iquotes) ? "</em>" : "</span>");
+		if (set_iquotes)
+		    out_lit(fp, "</em><br />\n");
+		else
+		    out_lit(fp, "</span><br />\n");
 	      }
 	    }
 	    else if ((bp->line)[0] != '\0' && !bp->header) {
@@ -1422,9 +1437,9 @@ void printbody(FILE *fp, struct emailinfo *email, int maybe_reply, int is_reply)
 	       */
 	      
 	      if ((set_showbr && !bp->header) || ((bp->next != NULL) && !isalnum(bp->next->line[0])))
-		fprintf(fp, "<br />");
+		out_lit(fp, "<br />");
 	      if (!bp->header) {
-		fprintf(fp, "\n");
+		out_lit(fp, "\n");
 	      }
 	    }
 	    
@@ -1448,7 +1463,7 @@ void printbody(FILE *fp, struct emailinfo *email, int maybe_reply, int is_reply)
     }
 
     if (pre)
-      fprintf(fp, "</pre>\n");
+      out_lit(fp, "</pre>\n");
     else if (set_showhtml == 2)
       end_txt2html(fp);
 }
@@ -1457,9 +1472,9 @@ char *print_leading_whitespace(FILE *fp, char *sp)
 {
     while (*sp && (*sp == ' ' || *sp == '\t')) {
         if (*sp == '\t')
-	    fprintf(fp, "&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;");
+	    out_lit(fp, "&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;&nbsp;");
 	else
-	    fprintf(fp, "&nbsp;");
+	    out_lit(fp, "&nbsp;");
 	sp++;
     }
     return sp;
@@ -1474,14 +1489,13 @@ void print_headers(FILE *fp, struct emailinfo *email, int in_thread_file)
 
   fprintf(fp, "<address class=\"headers\">\n");
 
+  char *tmpsubject=0;
 #ifdef HAVE_ICONV
   size_t tmplen;
-  char *tmpsubject=i18n_convstring(email->subject,"UTF-8",email->charset,&tmplen);
   char *tmptmpname=i18n_convstring(email->name,"UTF-8",email->charset,&tmplen); 
   char *tmpname=convchars(tmptmpname,"utf-8");
   free(tmptmpname);
 #else
-  char *tmpsubject=0;
   char *tmpname=convchars(email->name, email->charset);
 #endif
   
@@ -1496,11 +1510,7 @@ void print_headers(FILE *fp, struct emailinfo *email, int in_thread_file)
     if (use_mailcommand) {
       char *ptr = makemailcommand(set_mailcommand,
 				  email->emailaddr,
-#ifdef HAVE_ICONV
-				  email->msgid, tmpsubject);
-#else
-				  email->msgid, email->subject);
-#endif
+				  email->msgid, msg_mail_subject(email));
       fprintf(fp, "&lt;<a href=\"%s\">%s</a>&gt;", ptr ? ptr : "",
 	      obfuscate_email_address(email->emailaddr));
       if (ptr)
@@ -1513,11 +1523,7 @@ void print_headers(FILE *fp, struct emailinfo *email, int in_thread_file)
       if (use_mailcommand && strcmp(email->emailaddr, "(no email)") != 0) {
 	char *ptr = makemailcommand(set_mailcommand,
 				    email->emailaddr,
-#ifdef HAVE_ICONV
-				    email->msgid, tmpsubject);
-#else
-				    email->msgid, email->subject);
-#endif
+				    email->msgid, msg_mail_subject(email));
 	fprintf(fp, "%s &lt;<a href=\"%s\">%s</a>&gt;", tmpname, ptr ? ptr : "",
 		obfuscate_email_address(email->emailaddr));
       if (ptr)
@@ -1533,7 +1539,7 @@ void print_headers(FILE *fp, struct emailinfo *email, int in_thread_file)
   /* subject */
   if (in_thread_file)
 #ifdef HAVE_ICONV
-    fprintf(fp, "<span id=\"subject\"><dfn>%s</dfn>: %s</span><br />\n", lang[MSG_SUBJECT], tmpsubject);
+    fprintf(fp, "<span id=\"subject\"><dfn>%s</dfn>: %s</span><br />\n", lang[MSG_SUBJECT], msg_mail_subject(email));
 #else
     fprintf(fp, "<span id=\"subject\"><dfn>%s</dfn>: %s</span><br />\n", lang[MSG_SUBJECT], tmpsubject=convchars(email->subject,email->charset));
 #endif
@@ -1570,7 +1576,6 @@ print_replies(FILE *fp, struct emailinfo *email, int num, int in_thread_file)
 {
     struct reply *rp;
     struct emailinfo *email2;
-    char *ptr;
     bool list_started = FALSE;
 #ifdef FASTREPLYCODE
     for (rp = email->replylist; rp != NULL; rp = rp->next) {
@@ -1594,19 +1599,8 @@ print_replies(FILE *fp, struct emailinfo *email, int num, int in_thread_file)
 	    fprintf(fp, "%s <a href=\"%s\" title=\"%s\">", del_msg, 
 		    href01(email, email2, in_thread_file, FALSE),
 		    lang[MSG_LTITLE_REPLIES]);
-#ifdef HAVE_ICONV
-	    char *tmpptr;
-	    ptr = i18n_utf2numref(email2->subject,1);
-	    tmpptr = i18n_utf2numref(email2->name,1);
-	    fprintf(fp, "%s: \"%s\"</a></li>\n", tmpptr, ptr);
-	    if (tmpptr)
-	      free(tmpptr);
-#else
-	    ptr = convchars(email2->subject, email2->charset);
-	    fprintf(fp, "%s: \"%s\"</a></li>\n", email2->name, ptr);
-#endif
-	    if (ptr)
-		free(ptr);
+	    fprintf(fp, "%s: \"%s\"</a></li>\n", msg_link_name(email2),
+		    msg_link_subject(email2));
 	}
     }
     printcomment(fp, "lreply", "end");
@@ -1642,17 +1636,8 @@ int print_links_up(FILE *fp, struct emailinfo *email, int pos, int in_thread_fil
 		    "%s</a> ]\n", lang[MSG_MSG_BODY]);
 	    if (set_mailcommand && set_hmail) {
 	      if ((email->msgid && email->msgid[0]) || (email->subject && email->subject[0])) {
-#ifdef HAVE_ICONV
-		size_t tmplen;
-		char *tmpptr=i18n_convstring(email->subject,"UTF-8",email->charset,&tmplen);
-		ptr = makemailcommand(set_replymsg_command, set_hmail, email->msgid, 
-				      tmpptr);
-		if (tmpptr)
-		  free(tmpptr);
-#else
 		ptr = makemailcommand(set_replymsg_command, set_hmail, email->msgid, 
-				      email->subject);
-#endif
+				      msg_mail_subject(email));
 		fprintf(fp, " [ <a href=\"%s\" accesskey=\"r\" title=\"%s\">%s</a> ]\n",
 			ptr, lang[MSG_MA_REPLY], lang[MSG_RESPOND]);
 		if (ptr)
@@ -1685,21 +1670,12 @@ int print_links_up(FILE *fp, struct emailinfo *email, int pos, int in_thread_fil
 	    email2 = neighborlookup(num, 1);
 	    if (email2) {
 	      char *tmpptr;
-#ifdef HAVE_ICONV
-	      ptr=i18n_utf2numref(email2->subject,1);
-	      tmpptr=i18n_utf2numref(email2->name,1);
-#else
-	      ptr = convchars(email2->subject, email2->charset);
-	      tmpptr= convchars(email2->name,email2->charset);
-#endif
+	      ptr = msg_link_subject(email2);
+	      tmpptr = msg_link_name(email2);
 	      fprintf(fp, "[ <a href=\"%s\" accesskey=\"d\" title=\"%s: &quot;%s&quot;\">%s</a> ]\n", 
 		      msg_href (email2, email, FALSE), 
 		      tmpptr, ptr ? ptr : "", 
 		      lang[MSG_NEXT_MESSAGE]);
-	      if (tmpptr)
-		free(tmpptr);
-	      if (ptr)
-		free(ptr);
 	    }
 
 	    /*
@@ -1715,21 +1691,12 @@ int print_links_up(FILE *fp, struct emailinfo *email, int pos, int in_thread_fil
 
 	    if (email2) {
 	      char *tmpptr;
-#ifdef HAVE_ICONV
-	      ptr = i18n_utf2numref(email2->subject,1);
-	      tmpptr=i18n_utf2numref(email2->name,1);
-#else
-	      ptr = convchars(email2->subject, email2->charset);
-	      tmpptr=convchars(email2->name,email2->charset);
-#endif
+	      ptr = msg_link_subject(email2);
+	      tmpptr = msg_link_name(email2);
 	      fprintf(fp, "[ <a href=\"%s\" title=\"%s: &quot;%s&quot;\">%s</a> ]\n", 
 		      msg_relpath(email2, email), 
 		      tmpptr, ptr ? ptr : "", 
 		      lang[MSG_PREVIOUS_MESSAGE]);
-	      if (ptr)
-		free(ptr);
-	      if (tmpptr)
-		free(tmpptr);
 	    }
 
 	    /*
@@ -1744,21 +1711,12 @@ int print_links_up(FILE *fp, struct emailinfo *email, int pos, int in_thread_fil
 		is_reply = 1;
 
 		char *tmpptr;
-#ifdef HAVE_ICONV
-		ptr = i18n_utf2numref(email2->subject,1);
-		tmpptr=i18n_utf2numref(email2->name,1);
-#else
-		ptr = convchars(email2->subject, email2->charset);
-		tmpptr=convchars(email2->name,email2->charset);
-#endif
+		ptr = msg_link_subject(email2);
+		tmpptr = msg_link_name(email2);
 		fprintf(fp, "[ <a href=\"%s\" title=\"%s%s: &quot;%s&quot;\">%s</a> ]\n", 
 			 href01(email, email2, in_thread_file, FALSE), 
 			del_msg, tmpptr, ptr ? ptr : "", 
 			(subjmatch) ? lang[MSG_MAYBE_IN_REPLY_TO] : lang[MSG_IN_REPLY_TO]);
-		if (ptr)
-		  free (ptr);
-		if (tmpptr)
-		  free (tmpptr);
 
 	      } else if (set_inreplyto_command) {
 		char *tmpptr;
@@ -1781,21 +1739,12 @@ int print_links_up(FILE *fp, struct emailinfo *email, int pos, int in_thread_fil
 	    printcomment(fp, "unextthread", "start");
 	    if (email_next_in_thread) {
 	      char *tmpptr;
-#ifdef HAVE_ICONV
-	      ptr = i18n_utf2numref(email_next_in_thread->subject,1);
-	      tmpptr=i18n_utf2numref(email_next_in_thread->name,1);
-#else
-	      ptr = convchars(email_next_in_thread->subject, email_next_in_thread->charset);
-	      tmpptr=convchars(email_next_in_thread->name,email_next_in_thread->charset);
-#endif
+	      ptr = msg_link_subject(email_next_in_thread);
+	      tmpptr = msg_link_name(email_next_in_thread);
 	      fprintf(fp, "[ <a href=\"%s\" accesskey=\"t\" title=\"%s: &quot;%s&quot;\">%s</a> ]\n", 
 		      href01(email, email_next_in_thread, in_thread_file, FALSE),
 		      tmpptr, ptr, 
 		      lang[MSG_NEXT_IN_THREAD]);
-	      if (ptr)
-		free(ptr);
-	      if (tmpptr)
-		free(tmpptr);
 	      email->initial_next_in_thread = email_next_in_thread->msgnum;
 	    }
 	
@@ -1861,21 +1810,12 @@ int print_links(FILE *fp, struct emailinfo *email, int pos, int in_thread_file)
 	  
 	  email2 = neighborlookup(num, 1);
 	  if (email2) {
-#ifdef HAVE_ICONV
-	    ptr =  i18n_utf2numref(email2->subject,1);
-	    ptr2 = i18n_utf2numref(email2->name,1);
-#else
-	    ptr = convchars(email2->subject, email2->charset);
-	    ptr2 = convchars(email2->name, email2->charset);
-#endif
+	    ptr = msg_link_subject(email2);
+	    ptr2 = msg_link_name(email2);
 	    fprintf(fp, "<li><dfn>%s</dfn>: ", lang[MSG_NEXT_MESSAGE]);
 	    fprintf(fp, "<a href=\"%s\" title=\"%s\">%s: \"%s\"</a></li>\n", 
 		    msg_href(email2, email, FALSE), lang[MSG_LTITLE_NEXT],
 		    ptr2 ? ptr2 : "", ptr ? ptr : "");
-	    if (ptr)
-	      free(ptr);
-	    if (ptr2)
-	      free(ptr2);
 	  }
 
 	  /*
@@ -1889,21 +1829,12 @@ int print_links(FILE *fp, struct emailinfo *email, int pos, int in_thread_file)
 	    email2 = NULL;
 #endif
 	  if (email2) {
-#ifdef HAVE_ICONV
-	    ptr = i18n_utf2numref(email2->subject,1);
-	    ptr2 = i18n_utf2numref(email2->name,1);
-#else
-	    ptr = convchars(email2->subject, email2->charset);
-	    ptr2 = convchars(email2->name, email2->charset);
-#endif
+	    ptr = msg_link_subject(email2);
+	    ptr2 = msg_link_name(email2);
 	    fprintf(fp, "<li><dfn>%s</dfn>: ", lang[MSG_PREVIOUS_MESSAGE]);
 	    fprintf(fp, "<a href=\"%s\" title=\"%s\">%s: \"%s\"</a></li>\n", 
 		    msg_href(email2, email, FALSE), lang[MSG_LTITLE_PREVIOUS],
 		    ptr2 ? ptr2 : "", ptr);
-	    if (ptr)
-	      free(ptr);
-	    if (ptr2)
-	      free(ptr2);
 	  }
 
 	/*
@@ -1916,13 +1847,8 @@ int print_links(FILE *fp, struct emailinfo *email, int pos, int in_thread_file)
 	    char *del_msg = (email2->is_deleted ? lang[MSG_DEL_SHORT]
 			     : "");
 	    is_reply = 1;
-#ifdef HAVE_ICONV
-	    ptr = i18n_utf2numref(email2->subject,1);
-	    ptr2 = i18n_utf2numref(email2->name,1);
-#else
-	    ptr = convchars(email2->subject, email2->charset);
-	    ptr2 = convchars(email2->name, email2->charset);
-#endif
+	    ptr = msg_link_subject(email2);
+	    ptr2 = msg_link_name(email2);
 	    if (subjmatch)
 	      fprintf(fp, "<li><dfn>%s</dfn>:", lang[MSG_MAYBE_IN_REPLY_TO]);
 	    else
@@ -1930,10 +1856,6 @@ int print_links(FILE *fp, struct emailinfo *email, int pos, int in_thread_file)
 	    fprintf(fp, "%s <a href=\"%s\" title=\"%s\">%s: \"%s\"</a></li>\n", 
 		    del_msg, href01(email, email2, in_thread_file, FALSE), 
 		    lang[MSG_LTITLE_IN_REPLY_TO], ptr2, ptr);
-	    if (ptr)
-	      free(ptr);
-	    if (ptr2)
-	      free(ptr2);
 
 	  } else if (set_inreplyto_command) {
 	    char *tmpptr;
@@ -1957,22 +1879,13 @@ int print_links(FILE *fp, struct emailinfo *email, int pos, int in_thread_file)
 	 */
 	printcomment(fp, "lnextthread", "start");
 	if (email_next_in_thread) {
-#ifdef HAVE_ICONV
-	  ptr = i18n_utf2numref(email_next_in_thread->subject, 1);
-	  ptr2 = i18n_utf2numref(email_next_in_thread->name,1);
-#else
-	  ptr = convchars(email_next_in_thread->subject, email_next_in_thread->charset);
-	  ptr2 = convchars(email_next_in_thread->name, email_next_in_thread->charset);
-#endif
+	  ptr = msg_link_subject(email_next_in_thread);
+	  ptr2 = msg_link_name(email_next_in_thread);
 	  fprintf(fp, "<li><dfn>%s</dfn>: ", lang[MSG_NEXT_IN_THREAD]);
 	  fprintf(fp, "<a href=\"%s\" title=\"%s\">%s: \"%s\"</a></li>\n", 
 		  href01(email, email_next_in_thread, in_thread_file, FALSE), 
 		  lang[MSG_LTITLE_NEXT_IN_THREAD], 
 		  ptr2, ptr);
-	  if (ptr)
-	    free(ptr);
-	  if (ptr2)
-	    free(ptr2);
 	  email->initial_next_in_thread = email_next_in_thread->msgnum;
 	}
 
@@ -2053,6 +1966,9 @@ static GDBM_FILE gdbm_init()
 
 /*
  * Perform deletions on old messages when run in incremental mode.
+ * The pages of the deleted messages and of their replies are
+ * collected first and then written once each, however many of the
+ * deleted messages they are linked to.
  */
 
 void update_deletions(int num_old)
@@ -2060,10 +1976,15 @@ void update_deletions(int num_old)
     struct hashemail *hlist;
     struct reply *rp;
     int save_ov = set_overwrite;
+    char *rewrite;
+    int num, end;
+
+    rewrite = (char *)emalloc(num_old + 1);
+    memset(rewrite, 0, num_old + 1);
     set_overwrite = TRUE;
     for (hlist = deletedlist; hlist != NULL; hlist = hlist->next) {
 	struct emailinfo *ep;
-	int num = hlist->data->msgnum;
+	num = hlist->data->msgnum;
 	if (num >= num_old)
 	    continue;		/* new message - already done */
 	if (hashnumlookup(num, &ep)) {
@@ -2076,10 +1997,11 @@ void update_deletions(int num_old)
 		    struct body *bp = ep->bodylist;
 		    if (bp == NULL)
 		        parse_old_html(num, ep, 1, 0, NULL, 0);
-		    writearticles(num, num + 1);
+		    rewrite[num] = 1;
 		}
 		else if (isfile(filename)) {
 		    unlink(filename);
+		    remove_compressed_page(filename);
 		}
 		free(filename);
 	    }
@@ -2092,11 +2014,21 @@ void update_deletions(int num_old)
 		if (rnum < num_old) {
 		    if (!rp->data->bodylist || !rp->data->bodylist->line[0])
 		        parse_old_html(rnum, rp->data, TRUE, FALSE, NULL, 0);
-			writearticles(rnum, rnum + 1);	/* update MSG_IN_REPLY_TO line */
+		    rewrite[rnum] = 1;	/* update MSG_IN_REPLY_TO line */
 		}
 	    }
 	}
     }
+    for (num = 0; num < num_old; num = end) {
+	if (!rewrite[num]) {
+	    end = num + 1;
+	    continue;
+	}
+	for (end = num + 1; end < num_old && rewrite[end]; end++)
+	    ;
+	writearticles(num, end);
+    }
+    free(rewrite);
 #ifdef GDBM
     if (set_usegdbm) {
         GDBM_FILE gp = gdbm_init();
@@ -2113,6 +2045,17 @@ void update_deletions(int num_old)
 	}
     }
 #endif
+    if (set_usebinindex && binindex_open(FALSE)) {
+	for (hlist = deletedlist; hlist != NULL; hlist = hlist->next) {
+	    struct emailinfo *ep;
+	    int num = hlist->data->msgnum;
+	    if (num >= num_old)
+		continue;		/* new message - already done */
+	    if (hashnumlookup(num, &ep))
+		binindex_store(ep);
+	}
+	binindex_close(max_msgnum);
+    }
     set_overwrite = save_ov;
 }
 
@@ -2121,6 +2064,36 @@ void update_deletions(int num_old)
 ** This writes out the articles, beginning with the number startnum.
 */
 
+/*
+** Has match_quotes() look for the quoted text of the next messages
+** from num that writearticles() will write. Returns the number of the
+** message after them.
+*/
+
+static int match_quotes_ahead(int num, int maxnum)
+{
+    int size = quote_batch_size();
+    struct emailinfo **batch;
+    int count = 0;
+
+    if (!size)
+	return maxnum;
+    batch = (struct emailinfo **)emalloc(size * sizeof(struct emailinfo *));
+    for (; num < maxnum && count < size; ++num) {
+	struct emailinfo *email;
+	char *filename;
+	if (!hashnumlookup(num, &email) || email->is_deleted)
+	    continue;
+	filename = articlehtmlfilename(email);
+	if (set_overwrite || !isfile(filename) || has_new_replies(email))
+	    batch[count++] = email;
+	free(filename);
+    }
+    match_quotes(batch, count);
+    free(batch);
+    return num;
+}
+
 void writearticles(int startnum, int maxnum)
 {
     int num, skip, newfile;
@@ -2146,6 +2119,11 @@ void writearticles(int startnum, int maxnum)
 
     GDBM_FILE gp = gdbm_init();
 #endif
+    /* the same, without gdbm; see binindex.c. A run that isn't
+       incremental makes a new one. */
+    int use_binindex = set_usebinindex
+	&& binindex_open(!set_increment && startnum == 0);
+    int quotes_matched = startnum;	/* match_quotes() has been there */
 
     num = startnum;
 
@@ -2155,19 +2133,14 @@ void writearticles(int startnum, int maxnum)
     while (num < maxnum) {
 
 	char *filename;
+	if (set_linkquotes && num >= quotes_matched)
+	    quotes_matched = match_quotes_ahead(num, maxnum);
 	if ((bp = hashnumlookup(num, &email)) == NULL) {
 	    ++num;
 	    continue;
 	}
 	filename = articlehtmlfilename(email);
 
-#ifdef HAVE_ICONV
-	if(email->subject)
-	  localsubject= i18n_convstring(email->subject,"UTF-8",email->charset,&convlen);
-	if(email->name)
-	  localname= i18n_convstring(email->name,"UTF-8",email->charset,&convlen);
-#endif
-
 	/*
 	 * Determine to overwrite files or not
 	 */
@@ -2184,12 +2157,15 @@ void writearticles(int startnum, int maxnum)
 	if (email->is_deleted && set_delete_level == DELETE_REMOVES_FILES) {
 	    if (!newfile) {
 		unlink(filename);
+		remove_compressed_page(filename);
 	    }
 #ifdef GDBM
 	    else if (gp) {
 		togdbm((void *)gp, email);
 	    }
 #endif
+	    else if (use_binindex)
+		binindex_store(email);
 	    ++num;
 	    free(filename);
 	    continue;
@@ -2213,6 +2189,13 @@ void writearticles(int startnum, int maxnum)
 
 	email_next_in_thread = nextinthread(email->msgnum);
 
+#ifdef HAVE_ICONV
+	if(email->subject)
+	  localsubject= msg_mail_subject(email);
+	if(email->name)
+	  localname= i18n_convstring(email->name,"UTF-8",email->charset,&convlen);
+#endif
+
 
 	/*
 	 * Create the comment fields necessary for incremental updating
@@ -2283,6 +2266,8 @@ void writearticles(int startnum, int maxnum)
 		togdbm((void *)gp, email);
 	}
 #endif
+	if (use_binindex)
+	    binindex_store(email);
 	/*
 	 * This is here because it looks better here. The table looks
 	 * better before the Author info. This stuff should be in 
@@ -2334,6 +2319,7 @@ void writearticles(int startnum, int maxnum)
 	printfooter(fp, mhtmlfooterfile, set_label, set_dir, email->subject, filename, FALSE);
 	
 	fclose(fp);
+	compress_page(filename);
 	
 	if (get_new_reply_to() != -1) {
 	  /* will only be true if set_linkquotes is */
@@ -2392,8 +2378,6 @@ void writearticles(int startnum, int maxnum)
 	num++;
 
 #ifdef HAVE_ICONV
-	if (localsubject)
-	  free(localsubject);
 	if (localname)
 	  free(localname);
 #endif
@@ -2414,11 +2398,59 @@ void writearticles(int startnum, int maxnum)
 	gdbm_close(gp);
     }
 #endif
+    if (use_binindex) {
+	binindex_store_replies(maxnum);
+	binindex_close(max_msgnum);
+    }
+    end_quote_matches();
 
     if (set_showprogress)
       printf("\b\b\b\b    \n");
 } /* end writearticles() */
  
+/*
+** An index page of a period or a folder records which messages it lists
+** as their count and the sum of their numbers, so that it is also
+** rewritten when a message left it, which the new messages alone don't
+** tell.
+*/
+
+static char *index_messages(int count, long sum)
+{
+    static char buf[64];
+    snprintf(buf, sizeof(buf), "%d %ld", count, sum);
+    return buf;
+}
+
+static bool index_messages_match(char *filename, char *messages)
+{
+    FILE *fp;
+    char line[MAXLINE];
+    bool match = FALSE;
+    int n = 0;
+
+    if ((fp = fopen(filename, "r")) == NULL)
+	return FALSE;
+    while (fgets(line, sizeof(line), fp) && n++ < 1000) {
+	if (!strncmp(line, "<!-- messages=\"", 15)) {
+	    char *value = getvalue(line);
+	    match = !strcmp(value, messages);
+	    free(value);
+	    break;
+	}
+    }
+    fclose(fp);
+    return match;
+}
+
+static void print_folder_messages(FILE *fp, struct emailinfo *email)
+{
+    if (email && email->subdir)
+	printcomment(fp, "messages",
+		     index_messages(email->subdir->index_count,
+				    email->subdir->index_sum));
+}
+
 /*
 ** Write the date index...
 ** If email != NULL, write index for the subdir in which that email is.
@@ -2453,6 +2485,7 @@ void writedates(int amountmsgs, struct emailinfo *email)
      * Print out the index file header 
      */
     print_index_header(fp, set_label, set_dir, lang[MSG_BY_DATE], datename);
+    print_folder_messages(fp, email);
 
     /* 
      * Print out archive information links at the top of the index
@@ -2502,6 +2535,7 @@ void writedates(int amountmsgs, struct emailinfo *email)
 	snprintf(errmsg, sizeof(errmsg), "%s \"%s\": %o.", lang[MSG_CANNOT_CHMOD], filename, set_filemode);
 	progerr(errmsg);
     }
+    compress_page(filename);
     free(filename);
 
     if (set_showprogress)
@@ -2541,6 +2575,7 @@ void writeattachments(int amountmsgs, struct emailinfo *email)
      * Print out the index file header 
      */
     print_index_header(fp, set_label, set_dir, lang[MSG_BY_ATTACHMENT], attname);
+    print_folder_messages(fp, email);
 
     /* 
      * Print out archive information links at the top of the index
@@ -2585,6 +2620,7 @@ void writeattachments(int amountmsgs, struct emailinfo *email)
 		snprintf(errmsg, sizeof(errmsg), "%s \"%s\": %o.", lang[MSG_CANNOT_CHMOD], filename, set_filemode);
 	progerr(errmsg);
     }
+    compress_page(filename);
     free(filename);
 
     if (set_showprogress)
@@ -2630,6 +2666,7 @@ void writethreads(int amountmsgs, struct emailinfo *email)
 	printf("%s \"%s\"...", lang[MSG_WRITING_THREAD_INDEX], filename);
 
     print_index_header(fp, set_label, set_dir, lang[MSG_BY_THREAD], thrdname);
+    print_folder_messages(fp, email);
 
     /* 
      * Print out the index page links 
@@ -2640,13 +2677,13 @@ void writethreads(int amountmsgs, struct emailinfo *email)
 
     if (set_indextable) {
 	fprintf(fp, "<div class=\"center\">\n<table>\n<tr><td><strong>%s</strong></td><td><strong>%s</strong></td><td><strong> %s</strong></td></tr>\n", lang[MSG_CSUBJECT], lang[MSG_CAUTHOR], lang[MSG_CDATE]);
-	print_all_threads(fp, -1, -1, email);
+	print_all_threads(fp, -1, -1, email, NULL);
 	fprintf(fp, "</table>\n</div>\n");
     }
     else {
         fprintf (fp, "<div class=\"messages-list\">\n");
 	fprintf(fp, "<ul>\n");
-	print_all_threads(fp, -1, -1, email);
+	print_all_threads(fp, -1, -1, email, NULL);
 	fprintf(fp, "</ul>\n");
 	fprintf (fp, "</div>");
     }
@@ -2666,6 +2703,7 @@ void writethreads(int amountmsgs, struct emailinfo *email)
 		snprintf(errmsg, sizeof(errmsg), "%s \"%s\": %o.", lang[MSG_CANNOT_CHMOD], filename, set_filemode);
 	progerr(errmsg);
     }
+    compress_page(filename);
     free(filename);
 
     if (set_showprogress)
@@ -2673,77 +2711,79 @@ void writethreads(int amountmsgs, struct emailinfo *email)
 }
 
 /*
-** Print the subject index pointers alphabetically.
+** Prints one message of a subject index.
 */
 
-void printsubjects(FILE *fp, struct header *hp, char **oldsubject,
-		   int year, int month, struct emailinfo *subdir_email)
+static void print_subject_entry(FILE *fp, struct emailinfo *em, char **oldsubject,
+				struct emailinfo *subdir_email)
 {
-  char *subject=NULL, *name=NULL;
-  const char *startline;
-  const char *break_str;
-  const char *endline;
-  static char date_str[DATESTRLEN+40]; /* made static for smaller stack */
+  const char *subject, *charset;
   static char *first_attributes = "<a  accesskey=\"j\" name=\"first\" id=\"first\"></a>";
 
-  if (hp != NULL) {
-    printsubjects(fp, hp->left, oldsubject, year, month, subdir_email);
-    if ((year == -1 || year_of_datenum(hp->data->date) == year)
-	&& (month == -1 || month_of_datenum(hp->data->date) == month)
-	&& !hp->data->is_deleted
-	&& (!subdir_email || subdir_email->subdir == hp->data->subdir)) {
-
 #ifdef HAVE_ICONV
-        subject = convchars(hp->data->unre_subject, "utf-8");
-        name = convchars(hp->data->name, "utf-8");
+    subject = em->unre_subject;
+    charset = "utf-8";
 #else
-        subject = convchars(hp->data->subject, hp->data->charset);
-        name = convchars(hp->data->name, hp->data->charset);
+    subject = em->subject;
+    charset = em->charset;
 #endif
 
-	if (strcasecmp(hp->data->unre_subject, *oldsubject)) {
-	    if (set_indextable) {
-		fprintf(fp,
-			"<tr><td colspan=\"3\"><strong>%s</strong></td></tr>\n",
-			subject);
-	    }
-	    else {
-	      bool is_first;
-	        if (*oldsubject && *oldsubject[0] != '\0')  { /* close the previous open list */
-		  fprintf(fp, "</ul></li>\n");
-		  is_first = FALSE;
-		} 
-		else
-		  is_first = TRUE;
-
-		fprintf(fp, "<li>%s<dfn>%s</dfn>\n", 
-			(is_first) ? first_attributes : "", subject);
-		fprintf(fp, "<ul>\n");
-	    }
-	}
-	if(set_indextable) {
-	    startline = "<tr><td>&nbsp;</td><td nowrap>";
-	    break_str = "</td><td nowrap>";
-	    strcpy(date_str, getindexdatestr(hp->data->date));
-	    endline = "</td></tr>";
+    if (strcasecmp(em->unre_subject, *oldsubject)) {
+	if (set_indextable) {
+	    out_lit(fp, "<tr><td colspan=\"3\"><strong>");
+	    out_html(fp, subject, charset);
+	    out_lit(fp, "</strong></td></tr>\n");
 	}
 	else {
-	    startline = "<li>";
-	    break_str = "";
-	    snprintf(date_str, sizeof(date_str), "<em>(%s)</em>", getindexdatestr(hp->data->date));
-	    endline = "</li>";
+	    if (*oldsubject && *oldsubject[0] != '\0')  /* close the previous open list */
+	      out_lit(fp, "</ul></li>\n<li>");
+	    else {
+	      out_lit(fp, "<li>");
+	      out_str(fp, first_attributes);
+	    }
+	    out_lit(fp, "<dfn>");
+	    out_html(fp, subject, charset);
+	    out_lit(fp, "</dfn>\n<ul>\n");
 	}
-	fprintf(fp,
-		"%s%s%s</a>%s <a name=\"%s%d\" id=\"%s%d\">%s</a>%s\n", startline,
-		msg_href(hp->data, subdir_email, TRUE), 
-                name, break_str,        
-		set_fragment_prefix, hp->data->msgnum, 
-		set_fragment_prefix, hp->data->msgnum, date_str, endline);
-	*oldsubject = hp->data->unre_subject;
-
-	free(subject);
-	free(name);
     }
+    if(set_indextable)
+	out_lit(fp, "<tr><td>&nbsp;</td><td nowrap>");
+    else
+	out_lit(fp, "<li>");
+    out_str(fp, msg_href(em, subdir_email, TRUE));
+    out_html(fp, em->name, charset);
+    out_lit(fp, "</a>");
+    if(set_indextable)
+	out_lit(fp, "</td><td nowrap>");
+    out_lit(fp, " <a ");
+    out_msg_anchor(fp, em->msgnum);
+    out_lit(fp, ">");
+    if(set_indextable) {
+	out_str(fp, getindexdatestr(em->date));
+	out_lit(fp, "</a></td></tr>\n");
+    }
+    else {
+	out_lit(fp, "<em>(");
+	out_str(fp, getindexdatestr(em->date));
+	out_lit(fp, ")</em></a></li>\n");
+    }
+    *oldsubject = em->unre_subject;
+}
+
+/*
+** Print the subject index pointers alphabetically.
+*/
+
+void printsubjects(FILE *fp, struct header *hp, char **oldsubject,
+		   int year, int month, struct emailinfo *subdir_email)
+{
+  if (hp != NULL) {
+    printsubjects(fp, hp->left, oldsubject, year, month, subdir_email);
+    if ((year == -1 || year_of_datenum(hp->data->date) == year)
+	&& (month == -1 || month_of_datenum(hp->data->date) == month)
+	&& !hp->data->is_deleted
+	&& (!subdir_email || subdir_email->subdir == hp->data->subdir))
+      print_subject_entry(fp, hp->data, oldsubject, subdir_email);
     printsubjects(fp, hp->right, oldsubject, year, month, subdir_email);
   }
 }
@@ -2777,6 +2817,7 @@ void writesubjects(int amountmsgs, struct emailinfo *email)
 	printf("%s \"%s\"...", lang[MSG_WRITING_SUBJECT_INDEX], filename);
 
 	print_index_header(fp, set_label, set_dir, lang[MSG_BY_SUBJECT], subjname);
+	print_folder_messages(fp, email);
 
 	/* 
 	 * Print out the index page links 
@@ -2821,6 +2862,7 @@ void writesubjects(int amountmsgs, struct emailinfo *email)
 		snprintf(errmsg, sizeof(errmsg), "%s \"%s\": %o.", lang[MSG_CANNOT_CHMOD], filename, set_filemode);
 	progerr(errmsg);
     }
+    compress_page(filename);
     free(filename);
 
     if (set_showprogress)
@@ -2828,78 +2870,79 @@ void writesubjects(int amountmsgs, struct emailinfo *email)
 }
 
 /*
-** Prints the author index links sorted alphabetically.
+** Prints one message of an author index.
 */
 
-void printauthors(FILE *fp, struct header *hp, char **oldname,
-		  int year, int month, struct emailinfo *subdir_email)
+static void print_author_entry(FILE *fp, struct emailinfo *em, char **oldname,
+			       struct emailinfo *subdir_email)
 {
-  char *subj, *tmpname;
-  const char *startline;
-  const char *break_str;
-  const char *endline;
-  static char date_str[DATESTRLEN+40]; /* made static for smaller stack */
+  const char *charset;
   static char *first_attributes = "<a  accesskey=\"j\" name=\"first\" id=\"first\"></a>";
 
-  if (hp != NULL) {
-    printauthors(fp, hp->left, oldname, year, month, subdir_email);
-    if ((year == -1 || year_of_datenum(hp->data->date) == year)
-	&& (month == -1 || month_of_datenum(hp->data->date) == month)
-	&& !hp->data->is_deleted
-	&& (!subdir_email || subdir_email->subdir == hp->data->subdir)) {
-
 #ifdef HAVE_ICONV
-      subj = convchars(hp->data->subject, "utf-8");
-      tmpname = convchars(hp->data->name,"utf-8");
+  charset = "utf-8";
 #else
-      subj = convchars(hp->data->subject, hp->data->charset);
-      tmpname = convchars(hp->data->name,hp->data->charset);
+  charset = em->charset;
 #endif
-      if (strcasecmp(hp->data->name, *oldname)) {
-
-	if(set_indextable)
-	  fprintf(fp,
-		  "<tr><td colspan=\"3\"><strong>%s</strong></td></tr>",
-		  tmpname);
-	else {
-	  bool is_first;
+  if (strcasecmp(em->name, *oldname)) {
 
-	  if (*oldname && *oldname[0] != '\0') { /* close the previous open list */
-	    fprintf(fp, "</ul></li>\n");
-	    is_first = FALSE;
-	  }
-	  else
-	    is_first = TRUE;
-
-	  fprintf(fp, "<li>%s<dfn>%s</dfn>\n", 
-		  (is_first) ? first_attributes : "",
-		  tmpname);
-	  fprintf(fp, "<ul>\n");
-	}
-      }
-      if(set_indextable) {
-	startline = "<tr><td>&nbsp;</td><td>";
-	break_str = "</td><td nowrap>";
-	strcpy(date_str, getindexdatestr(hp->data->date));
-	endline = "</td></tr>";
-      }
+    if(set_indextable) {
+      out_lit(fp, "<tr><td colspan=\"3\"><strong>");
+      out_html(fp, em->name, charset);
+      out_lit(fp, "</strong></td></tr>");
+    }
+    else {
+      if (*oldname && *oldname[0] != '\0') /* close the previous open list */
+	out_lit(fp, "</ul></li>\n<li>");
       else {
-	startline = "<li>";
-	break_str = "&nbsp;";
-	snprintf(date_str, sizeof(date_str), "<em>(%s)</em>", getindexdatestr(hp->data->date));
-	endline = "</li>";
+	out_lit(fp, "<li>");
+	out_str(fp, first_attributes);
       }
-      fprintf(fp,"%s%s%s</a>%s<a name=\"%s%d\" id=\"%s%d\">%s</a>%s\n",
-	      startline, msg_href(hp->data, subdir_email, TRUE), subj, break_str,
-	      set_fragment_prefix, hp->data->msgnum, set_fragment_prefix, hp->data->msgnum, 
-	      date_str, endline);
-      if(subj)
-	free(subj);
-      if(tmpname)
-	free(tmpname);
-
-      *oldname = hp->data->name;	/* avoid copying */
+      out_lit(fp, "<dfn>");
+      out_html(fp, em->name, charset);
+      out_lit(fp, "</dfn>\n<ul>\n");
     }
+  }
+  if(set_indextable)
+    out_lit(fp, "<tr><td>&nbsp;</td><td>");
+  else
+    out_lit(fp, "<li>");
+  out_str(fp, msg_href(em, subdir_email, TRUE));
+  out_html(fp, em->subject, charset);
+  out_lit(fp, "</a>");
+  if(set_indextable)
+    out_lit(fp, "</td><td nowrap><a ");
+  else
+    out_lit(fp, "&nbsp;<a ");
+  out_msg_anchor(fp, em->msgnum);
+  out_lit(fp, ">");
+  if(set_indextable) {
+    out_str(fp, getindexdatestr(em->date));
+    out_lit(fp, "</a></td></tr>\n");
+  }
+  else {
+    out_lit(fp, "<em>(");
+    out_str(fp, getindexdatestr(em->date));
+    out_lit(fp, ")</em></a></li>\n");
+  }
+
+  *oldname = em->name;	/* avoid copying */
+}
+
+/*
+** Prints the author index links sorted alphabetically.
+*/
+
+void printauthors(FILE *fp, struct header *hp, char **oldname,
+		  int year, int month, struct emailinfo *subdir_email)
+{
+  if (hp != NULL) {
+    printauthors(fp, hp->left, oldname, year, month, subdir_email);
+    if ((year == -1 || year_of_datenum(hp->data->date) == year)
+	&& (month == -1 || month_of_datenum(hp->data->date) == month)
+	&& !hp->data->is_deleted
+	&& (!subdir_email || subdir_email->subdir == hp->data->subdir))
+      print_author_entry(fp, hp->data, oldname, subdir_email);
     printauthors(fp, hp->right, oldname, year, month, subdir_email);
   }
 }
@@ -2933,6 +2976,7 @@ void writeauthors(int amountmsgs, struct emailinfo *email)
 	printf("%s \"%s\"...", lang[MSG_WRITING_AUTHOR_INDEX], filename);
 
     print_index_header(fp, set_label, set_dir, lang[MSG_BY_AUTHOR], authname);
+    print_folder_messages(fp, email);
 
     /* 
      * Print out the index page links 
@@ -2978,6 +3022,7 @@ void writeauthors(int amountmsgs, struct emailinfo *email)
 	snprintf(errmsg, sizeof(errmsg), "%s \"%s\": %o.", lang[MSG_CANNOT_CHMOD], filename, set_filemode);
 	progerr(errmsg);
     }
+    compress_page(filename);
     free(filename);
 
     if (set_showprogress)
@@ -3050,6 +3095,7 @@ void writehaof(int amountmsgs, struct emailinfo *email)
 #endif
 	fprintf(fp, "  <!DOCTYPE haof PUBLIC " "\"-//Bernhard Reiter//DTD HOAF 0.2//EN\"\n" "\"http://ffii.org/~breiter/probe/haof-0.2.dtd\">\n\n");
 	fprintf(fp, "  <haof version=\"0.2\">\n\n");
+	print_folder_messages(fp, email);
 	fprintf(fp, "      <archiver name=\"hypermail\" version=\"" VERSION ".pl" PATCHLEVEL "\" />\n\n");
 
     print_haof_indices(fp, email ? email->subdir : NULL);
@@ -3065,6 +3111,7 @@ void writehaof(int amountmsgs, struct emailinfo *email)
 	snprintf(errmsg, sizeof(errmsg), "%s \"%s\": %o.", lang[MSG_CANNOT_CHMOD], filename, set_filemode);
 	progerr(errmsg);
     }
+    compress_page(filename);
     free(filename);
 
     if (set_showprogress)
@@ -3074,50 +3121,363 @@ void writehaof(int amountmsgs, struct emailinfo *email)
 
 
 
-static int count_messages(struct header *hp, int year, int mo, long *first_date, long *last_date)
+/*
+** The summary indexes have one set of index pages per month (or per
+** year). The messages of each period are collected in a single walk of
+** each index tree, so a period's pages are written from its own
+** messages rather than by filtering the whole archive once per period
+** and index. Pages of periods that didn't change in an incremental
+** run are left alone, unless index_messages_match() finds they don't
+** list the messages of their period anymore.
+*/
+
+struct period {
+    int count;			/* messages that are not deleted */
+    long msgnum_sum;		/* and the sum of their numbers */
+    long first_date;
+    long last_date;
+    bool changed;		/* gained or lost messages in this run */
+    bool threads_changed;	/* shares a thread with a changed message */
+    struct emailinfo **by_date;	/* the period's slice of each order */
+    struct emailinfo **by_subject;
+    struct emailinfo **by_author;
+    int num_subjects;
+    int num_authors;
+    struct reply **threads;	/* where its threads start in threadlist */
+    int num_threads;
+    int last_thread;		/* the number of the thread added last */
+};
+
+struct period_table {
+    int first_year;
+    int num_years;
+    int first_new;		/* lowest msgnum added in this run */
+    struct period *periods;
+    int *period_of;		/* period of each msgnum, or -1 */
+    struct emailinfo **messages;
+    int num_messages;
+};
+
+static bool period_msg_changed(struct period_table *pt, struct emailinfo *em)
+{
+    return em->msgnum >= pt->first_new
+	|| (em->is_deleted && em->deletion_completed != set_delete_level);
+}
+
+static int period_lookup(struct period_table *pt, struct emailinfo *em)
+{
+    if (em->msgnum < 0 || em->msgnum > max_msgnum)
+	return -1;
+    return pt->period_of[em->msgnum];
+}
+
+/*
+** The date index is sorted, so the messages of a period are adjacent
+** and each period's date order is a slice of pt->messages.
+*/
+
+static void bucket_dates(struct header *hp, struct period_table *pt)
 {
     if (hp != NULL) {
 	struct emailinfo *em = hp->data;
-	int cnt = count_messages(hp->left, year, mo, first_date, last_date);
-	if ((year == -1 || year_of_datenum(em->date) == year)
-	    && (mo == -1 || month_of_datenum(em->date) == mo)
-	    && !em->is_deleted) {
-	    ++cnt;
-	    if (em->date < *first_date)
-	        *first_date = em->date;
-	    if (em->date > *last_date)
-	        *last_date = em->date;
+	int y;
+	bucket_dates(hp->left, pt);
+	y = year_of_datenum(em->date);
+	if (y >= pt->first_year && y < pt->first_year + pt->num_years
+	    && em->msgnum >= 0 && em->msgnum <= max_msgnum) {
+	    int i = y - pt->first_year;
+	    struct period *p;
+	    if (set_monthly_index)
+		i = i * 12 + month_of_datenum(em->date);
+	    pt->period_of[em->msgnum] = i;
+	    p = &pt->periods[i];
+	    if (period_msg_changed(pt, em))
+		p->changed = TRUE;
+	    if (!em->is_deleted) {
+		if (!p->count++)
+		    p->by_date = pt->messages + pt->num_messages;
+		p->msgnum_sum += em->msgnum;
+		pt->messages[pt->num_messages++] = em;
+		if (em->date < p->first_date)
+		    p->first_date = em->date;
+		if (em->date > p->last_date)
+		    p->last_date = em->date;
+	    }
 	}
-	return cnt + count_messages(hp->right, year, mo, first_date, last_date);
+	bucket_dates(hp->right, pt);
     }
-    return 0;
 }
 
-static void printmonths(FILE *fp, char *summary_filename, int amountmsgs)
+static void bucket_subjects(struct header *hp, struct period_table *pt)
+{
+    if (hp != NULL) {
+	int i;
+	bucket_subjects(hp->left, pt);
+	if (!hp->data->is_deleted && (i = period_lookup(pt, hp->data)) != -1) {
+	    struct period *p = &pt->periods[i];
+	    p->by_subject[p->num_subjects++] = hp->data;
+	}
+	bucket_subjects(hp->right, pt);
+    }
+}
+
+static void bucket_authors(struct header *hp, struct period_table *pt)
+{
+    if (hp != NULL) {
+	int i;
+	bucket_authors(hp->left, pt);
+	if (!hp->data->is_deleted && (i = period_lookup(pt, hp->data)) != -1) {
+	    struct period *p = &pt->periods[i];
+	    p->by_author[p->num_authors++] = hp->data;
+	}
+	bucket_authors(hp->right, pt);
+    }
+}
+
+/*
+** The thread index of a period also carries the thread structure of
+** messages from other periods, so a period's thread page changes when
+** any of its threads does.
+*/
+
+static void mark_thread_periods(struct period_table *pt, struct reply *start,
+				struct reply *end)
+{
+    struct reply *rp;
+    int i;
+    for (rp = start; rp != end; rp = rp->next)
+	if (rp->msgnum != -1 && rp->data
+	    && (i = period_lookup(pt, rp->data)) != -1)
+	    pt->periods[i].threads_changed = TRUE;
+}
+
+static void mark_changed_threads(struct period_table *pt)
+{
+    struct reply *rp;
+    struct reply *start = threadlist;
+    bool changed = FALSE;
+
+    for (rp = threadlist; rp != NULL; rp = rp->next) {
+	if (rp->msgnum != -1 && rp->data) {
+	    if (period_msg_changed(pt, rp->data))
+		changed = TRUE;
+	    continue;
+	}
+	if (changed)
+	    mark_thread_periods(pt, start, rp);
+	start = rp->next;
+	changed = FALSE;
+    }
+    if (changed)
+	mark_thread_periods(pt, start, NULL);
+}
+
+/*
+** Lists, for each period, the threads print_all_threads() would print
+** for it, so that writing its thread index doesn't go through all the
+** threads of the archive.
+*/
+
+static void add_period_thread(struct period *p, struct reply *start,
+			      int thread)
+{
+    if (p->last_thread == thread)
+	return;
+    p->last_thread = thread;
+    if (!(p->num_threads % 64))
+	p->threads = (struct reply **)
+	    realloc(p->threads, (p->num_threads + 65) * sizeof(struct reply *));
+    if (!p->threads)
+	progerr("Out of memory.");
+    p->threads[p->num_threads++] = start;
+    p->threads[p->num_threads] = NULL;
+}
+
+static void bucket_threads(struct period_table *pt)
+{
+    struct reply *rp;
+    struct reply *start = threadlist;
+    int thread = 1;
+
+    for (rp = threadlist; rp != NULL; rp = rp->next) {
+	int y;
+	if (rp->msgnum == -1) {
+	    start = rp->next;
+	    ++thread;
+	    continue;
+	}
+	/* as thread_in_period() in threadprint.c tells */
+	if (rp->data->is_deleted)
+	    continue;
+	y = year_of_datenum(rp->data->date);
+	if (y >= pt->first_year && y < pt->first_year + pt->num_years) {
+	    int i = y - pt->first_year;
+	    if (set_monthly_index)
+		i = i * 12 + month_of_datenum(rp->data->date);
+	    add_period_thread(&pt->periods[i], start, thread);
+	}
+    }
+}
+
+static void build_periods(struct period_table *pt, int first_new)
+{
+    int num_periods;
+    int i;
+    struct emailinfo **subjects, **authors;
+
+    pt->first_year = year_of_datenum(firstdatenum);
+    pt->num_years = year_of_datenum(lastdatenum) - pt->first_year + 1;
+    if (pt->num_years < 1)
+	pt->num_years = 1;
+    pt->first_new = first_new;
+    num_periods = pt->num_years * (set_monthly_index ? 12 : 1);
+    pt->periods = (struct period *)emalloc(num_periods * sizeof(struct period));
+    memset(pt->periods, 0, num_periods * sizeof(struct period));
+    for (i = 0; i < num_periods; ++i) {
+	pt->periods[i].first_date = lastdatenum;
+	pt->periods[i].last_date = firstdatenum;
+    }
+    pt->period_of = (int *)emalloc((max_msgnum + 1) * sizeof(int));
+    for (i = 0; i <= max_msgnum; ++i)
+	pt->period_of[i] = -1;
+    pt->messages = (struct emailinfo **)
+	emalloc(3 * (max_msgnum + 1) * sizeof(struct emailinfo *));
+    pt->num_messages = 0;
+
+    if (datelist && datelist->data)
+	bucket_dates(datelist, pt);
+
+    subjects = pt->messages + pt->num_messages;
+    authors = subjects + pt->num_messages;
+    for (i = 0; i < num_periods; ++i) {
+	struct period *p = &pt->periods[i];
+	p->by_subject = subjects;
+	p->by_author = authors;
+	subjects += p->count;
+	authors += p->count;
+    }
+    bucket_subjects(subjectlist, pt);
+    bucket_authors(authorlist, pt);
+    mark_changed_threads(pt);
+    if (show_index[0][THREAD_INDEX])
+	bucket_threads(pt);
+}
+
+static void free_periods(struct period_table *pt)
 {
-    int first_year = year_of_datenum(firstdatenum);
-    int last_year = year_of_datenum(lastdatenum);
+    int num_periods = pt->num_years * (set_monthly_index ? 12 : 1);
+    int i;
+
+    for (i = 0; i < num_periods; ++i)
+	if (pt->periods[i].threads)
+	    free(pt->periods[i].threads);
+    free(pt->periods);
+    free(pt->period_of);
+    free(pt->messages);
+}
+
+/*
+** Writes index j (by date, thread, subject or author) of one period.
+*/
+
+static void write_period_index(char *filename, int j, struct period *p,
+			       int y, int m, char *month_str_pub,
+			       char **save_name)
+{
+    FILE *fp1;
+    char *prev_text = "";
+    char subject_title[128];
+    int i;
+
+    fp1 = fopen(filename, "w");
+    if (!fp1) {
+	snprintf(errmsg, sizeof(errmsg), "can't open %s", filename);
+	progerr(errmsg);
+    }
+    snprintf(subject_title, sizeof(subject_title), "%s %s", month_str_pub, indextypename[j]);
+    print_index_header(fp1, set_label, set_dir, subject_title, filename);
+    printcomment(fp1, "messages", index_messages(p->count, p->msgnum_sum));
+    /* 
+     * Print out the index page links 
+     */
+    print_index_header_links(fp1, j, p->first_date, p->last_date, p->count, NULL);
+		
+    if (set_indextable) {
+	fprintf(fp1, "<div class=\"center\">\n<table>\n<tr><td><strong>%s</strong></td><td><strong>%s</strong></td><td><strong> %s</strong></td></tr>\n", lang[j == AUTHOR_INDEX ? MSG_CAUTHOR : MSG_CSUBJECT], lang[j == AUTHOR_INDEX ? MSG_CSUBJECT : MSG_CAUTHOR], lang[MSG_CDATE]);
+    }
+    else {
+	fprintf(fp1, "<ul>\n");
+    }
+    switch (j) {
+	case DATE_INDEX:
+	  {
+	    char prev_date_str[DATESTRLEN + 40];
+	    prev_date_str[0] = '\0';
+	    for (i = 0; i < p->count; ++i)
+		print_date_entry(fp1, p->by_date[i], NULL, prev_date_str);
+	    if (*prev_date_str)  /* close the previous date item */
+	      fprintf (fp1, "</ul></li>\n");
+	    break;
+	  }
+	case THREAD_INDEX:
+	    if (p->threads)
+		print_all_threads(fp1, y, m, NULL, p->threads);
+	    break;
+	case SUBJECT_INDEX:
+	    for (i = 0; i < p->num_subjects; ++i)
+		print_subject_entry(fp1, p->by_subject[i], &prev_text, NULL);
+	    break;
+	case AUTHOR_INDEX:
+	    for (i = 0; i < p->num_authors; ++i)
+		print_author_entry(fp1, p->by_author[i], &prev_text, NULL);
+	    break;
+    }
+
+    if (set_indextable) {
+	fprintf(fp1, "</table>\n</div>\n");
+    }
+    else {
+	fprintf(fp1, "</ul>\n");
+    }
+
+    /* 
+     * Print out archive information links at the bottom 
+     * of the index page
+     */
+
+    print_index_footer_links(fp1, j, p->last_date, p->count, NULL);
+
+    printfooter(fp1, ihtmlfooterfile, set_label, set_dir, subject_title, 
+		save_name[j], FALSE);
+    fclose(fp1);
+    chmod(filename, set_filemode);
+    compress_page(filename);
+}
+
+static void printmonths(FILE *fp, char *summary_filename, int first_new)
+{
+    struct period_table pt;
     int y, j, m;
     char *save_name[NO_INDEX];
     char *subject = lang[set_monthly_index ? MSG_MONTHLY_INDEX : MSG_YEARLY_INDEX];
 
+    build_periods(&pt, first_new);
     for (j = 0; j <= AUTHOR_INDEX; ++j)
 	save_name[j] = index_name[0][j];
     print_index_header(fp, set_label, set_dir, subject, summary_filename);
     fprintf(fp, "<table>\n");
-    for (y = first_year; y <= last_year; ++y) {
+    for (y = pt.first_year; y < pt.first_year + pt.num_years; ++y) {
 		for (m = (set_monthly_index ? 0 : -1); m < (set_monthly_index ? 12 : 0); ++m) {
 	    char month_str[80];
 	    char month_str_pub[80];
 	    int started_line = 0;
 	    int empties = 0;
 	    char period_bufs[NO_INDEX][MAXFILELEN];
-	    long first_date = lastdatenum;
-	    long last_date = firstdatenum;
-	    int count;
+	    struct period *p;
 	    if (!datelist->data)
 	        continue;
-	    count = count_messages(datelist, y, m, &first_date, &last_date);
+	    p = &pt.periods[(y - pt.first_year) * (set_monthly_index ? 12 : 1)
+			    + (set_monthly_index ? m : 0)];
 	    if (set_monthly_index) {
 		sprintf(month_str_pub, "%s %d", months[m], y);
 		sprintf(month_str, "%d%.2d", y, m + 1);
@@ -3133,71 +3493,15 @@ static void printmonths(FILE *fp, char *summary_filename, int amountmsgs)
 	    for (j = 0; j <= AUTHOR_INDEX; ++j) {
 		char *filename;
 		char buf1[MAXFILELEN];
-		FILE *fp1;
-		char *prev_text = "";
-		char subject_title[128];
 		if (!show_index[0][j])
 		    continue;
 		snprintf(buf1, sizeof(buf1), "%sby%s", month_str, save_name[j]);
 		filename = htmlfilename(buf1, NULL, "");
-		fp1 = fopen(filename, "w");
-		if (!fp1) {
-	    	    snprintf(errmsg, sizeof(errmsg), "can't open %s", filename);
-		    progerr(errmsg);
-		}
-		snprintf(subject_title, sizeof(subject_title), "%s %s", month_str_pub, indextypename[j]);
-		print_index_header(fp1, set_label, set_dir, subject_title, filename);
-		/* 
-		 * Print out the index page links 
-		 */
-		print_index_header_links(fp1, j, first_date, last_date, count, NULL);
-		
-		if (set_indextable) {
-		    fprintf(fp1, "<div class=\"center\">\n<table>\n<tr><td><strong>%s</strong></td><td><strong>%s</strong></td><td><strong> %s</strong></td></tr>\n", lang[j == AUTHOR_INDEX ? MSG_CAUTHOR : MSG_CSUBJECT], lang[j == AUTHOR_INDEX ? MSG_CSUBJECT : MSG_CAUTHOR], lang[MSG_CDATE]);
-		}
-		else {
-		    fprintf(fp1, "<ul>\n");
-		}
-		switch (j) {
-		    case DATE_INDEX:
-		      {
-			char prev_date_str[DATESTRLEN + 40];
-			prev_date_str[0] = '\0';
-		        printdates(fp1, datelist, y, m, NULL, prev_date_str);
-			if (*prev_date_str)  /* close the previous date item */
-			  fprintf (fp, "</ul></li>\n");
-			break;
-		      }
-		    case THREAD_INDEX:
-		        print_all_threads(fp1, y, m, NULL);
-			break;
-		    case SUBJECT_INDEX:
-			printsubjects(fp1, subjectlist, &prev_text, y, m, NULL);
-			break;
-		    case AUTHOR_INDEX:
-		        printauthors(fp1, authorlist, &prev_text, y, m, NULL);
-			break;
-		}
-
-		if (set_indextable) {
-		    fprintf(fp1, "</table>\n</div>\n");
-		}
-		else {
-		    fprintf(fp1, "</ul>\n");
-		}
-
-		/* 
-		 * Print out archive information links at the bottom 
-		 * of the index page
-		 */
-
-		print_index_footer_links(fp1, j, last_date, count, NULL);
-
-		printfooter(fp1, ihtmlfooterfile, set_label, set_dir, subject_title, 
-			    save_name[j], FALSE);
-		fclose(fp1);
-		if (!count) {
-		    remove(filename);
+		if (!p->count) {
+		    if (isfile(filename)) {
+			remove(filename);
+			remove_compressed_page(filename);
+		    }
 		    if (started_line)
 		        fprintf(fp, "<td></td>");
 		    else
@@ -3205,12 +3509,16 @@ static void printmonths(FILE *fp, char *summary_filename, int amountmsgs)
 		}
 		else {
 		    if (!started_line) {
-			fprintf(fp, "<tr><td>%s</td><td>%d %s</td>", month_str_pub, count, lang[MSG_ARTICLES]);
+			fprintf(fp, "<tr><td>%s</td><td>%d %s</td>", month_str_pub, p->count, lang[MSG_ARTICLES]);
 			while (empties--)
 			    fprintf(fp, "<td></td>");
 			started_line = 1;
 		    }
-		    chmod(filename, set_filemode);
+		    if (p->changed || (j == THREAD_INDEX && p->threads_changed)
+			|| !index_messages_match(filename,
+				index_messages(p->count, p->msgnum_sum)))
+			write_period_index(filename, j, p, y, m, month_str_pub,
+					   save_name);
 		    fprintf(fp, "<td><a href=\"%sby%s\">%s</a></td>", month_str, save_name[j], indextypename[j]);
 		}
 		free(filename);
@@ -3223,6 +3531,7 @@ static void printmonths(FILE *fp, char *summary_filename, int amountmsgs)
 	printfooter(fp, ihtmlfooterfile, set_label, set_dir, subject, summary_filename, FALSE);
     for (j = 0; j <= AUTHOR_INDEX; ++j)
 	index_name[0][j] = save_name[j];
+    free_periods(&pt);
 }
 
 void init_index_names(void)
@@ -3234,7 +3543,7 @@ void init_index_names(void)
     indextypename[ATTACHMENT_INDEX] = lang[MSG_ATTACHMENT];
 }
 
-void write_summary_indices(int amount_new)
+void write_summary_indices(int first_new)
 {
 	if (set_monthly_index || set_yearly_index) {
 		char *filename;
@@ -3245,14 +3554,107 @@ void write_summary_indices(int amount_new)
 			snprintf(errmsg, sizeof(errmsg), "Couldn't write \"%s\".", filename);
 			progerr(errmsg);
 		}
-		printmonths(fp, filename, amount_new);
+		printmonths(fp, filename, first_new);
 		fclose(fp);
 		chmod(filename, set_filemode);
+		compress_page(filename);
 		free(filename);
 	}
 }
 
-void write_toplevel_indices(int amountmsgs)
+/*
+** Folders work like the periods of the summary indexes: a folder's
+** pages are rewritten only when it gained or lost messages, when a
+** folder was added next to it (for its prior and next folder links),
+** or, for its thread index, when one of its threads changed.
+*/
+
+static void mark_changed_folders(int first_new)
+{
+    struct emailsubdir *sd;
+    struct emailinfo *em;
+    struct reply *rp;
+    struct reply *start = threadlist;
+    int changed = 0;
+    int num;
+
+    for (sd = folders; sd != NULL; sd = sd->next_subdir) {
+	sd->changed = 0;
+	sd->threads_changed = 0;
+	sd->index_count = 0;
+	sd->index_sum = 0;
+    }
+    for (num = 0; num <= max_msgnum; ++num) {
+	if (!hashnumlookup(num, &em) || !em->subdir)
+	    continue;
+	if (em->msgnum >= first_new
+	    || (em->is_deleted && em->deletion_completed != set_delete_level))
+	    em->subdir->changed = 1;
+	if (!em->is_deleted) {
+	    ++em->subdir->index_count;
+	    em->subdir->index_sum += em->msgnum;
+	}
+    }
+    for (sd = folders; sd != NULL; sd = sd->next_subdir)
+	if (sd->first_email && sd->first_email->msgnum >= first_new) {
+	    if (sd->prior_subdir)
+		sd->prior_subdir->changed = 1;
+	    if (sd->next_subdir)
+		sd->next_subdir->changed = 1;
+	}
+
+    for (rp = threadlist; rp != NULL; rp = rp->next) {
+	if (rp->msgnum != -1 && rp->data) {
+	    if (rp->data->subdir && rp->data->subdir->changed)
+		changed = 1;
+	    continue;
+	}
+	for (; changed && start != rp; start = start->next)
+	    if (start->msgnum != -1 && start->data && start->data->subdir)
+		start->data->subdir->threads_changed = 1;
+	start = rp->next;
+	changed = 0;
+    }
+    for (; changed && start != NULL; start = start->next)
+	if (start->msgnum != -1 && start->data && start->data->subdir)
+	    start->data->subdir->threads_changed = 1;
+}
+
+static int folder_index_changed(struct emailsubdir *sd, int k)
+{
+    char *filename;
+    int stale;
+
+    if (sd->changed || (k == THREAD_INDEX && sd->threads_changed))
+	return 1;
+    if (!sd->first_email)
+	return 0;
+    filename = htmlfilename(index_name[1][k], sd->first_email, "");
+    stale = !index_messages_match(filename,
+				  index_messages(sd->index_count,
+						 sd->index_sum));
+    free(filename);
+    return stale;
+}
+
+static int folder_haof_changed(struct emailsubdir *sd)
+{
+    char *filename;
+    int stale;
+
+    if (sd->changed)
+	return 1;
+    if (!sd->first_email)
+	return 0;
+    filename = haofname(sd->first_email);
+    stale = !index_messages_match(filename,
+				  index_messages(sd->index_count,
+						 sd->index_sum));
+    free(filename);
+    return stale;
+}
+
+void write_toplevel_indices(int amountmsgs, int first_new)
 {
     int i, j, newfile, offset, k;
     bool first = TRUE;
@@ -3322,8 +3724,10 @@ void write_toplevel_indices(int amountmsgs)
 	while (sd->next_subdir)
 	    sd = sd->next_subdir;
     saved_set_dateformat = set_dateformat;
+    mark_changed_folders(first_new);
     for (; sd != NULL; sd = set_reverse_folders ? sd->prior_subdir : sd->next_subdir) {
 	int started_line = 0;
+	int rewrite;
 	if (!datelist->data)
 	    continue;
 	for (j = 0; j <= ATTACHMENT_INDEX; ++j) {
@@ -3332,32 +3736,38 @@ void write_toplevel_indices(int amountmsgs)
 	    if (!show_index[1][k])
 		continue;
 	    set_dateformat = saved_set_dateformat;
+	    rewrite = folder_index_changed(sd, k);
 	    switch (k) {
 		case DATE_INDEX:
-		    writedates(sd->count, sd->first_email);
+		    if (rewrite)
+			writedates(sd->count, sd->first_email);
 		    index_title = lang[MSG_LTITLE_LISTED_BY_DATE];
 		    break;
 	        case THREAD_INDEX:
-		    writethreads(sd->count, sd->first_email);
+		    if (rewrite)
+			writethreads(sd->count, sd->first_email);
 		    index_title = lang[MSG_LTITLE_DISCUSSION_THREADS];
 		    break;
 	        case SUBJECT_INDEX:
-		    writesubjects(sd->count, sd->first_email);
+		    if (rewrite)
+			writesubjects(sd->count, sd->first_email);
 		    index_title = lang[MSG_LTITLE_LISTED_BY_SUBJECT];
 		    break;
 		case AUTHOR_INDEX:
-		    writeauthors(sd->count, sd->first_email);
+		    if (rewrite)
+			writeauthors(sd->count, sd->first_email);
 		    index_title = lang[MSG_LTITLE_LISTED_BY_AUTHOR];
 		    break;
 		case ATTACHMENT_INDEX:
-		    writeattachments(sd->count, sd->first_email);
+		    if (rewrite)
+			writeattachments(sd->count, sd->first_email);
 		    index_title = lang[MSG_LTITLE_LISTED_BY_ATTACHMENT];
 		    break;
   	        default:
 		    index_title = "";
 		    break;
 	    }
-	    if (set_writehaof)
+	    if (set_writehaof && folder_haof_changed(sd))
 	        writehaof(sd->count, sd->first_email);
 
 	    if (!fp)
@@ -3433,6 +3843,7 @@ void write_toplevel_indices(int amountmsgs)
 		 set_filemode);
 	progerr(errmsg);
 	}
+      compress_page(filename);
     }
     free(filename);
 }
@@ -43,7 +43,7 @@ int showheader(char *);
 void ConvURLs(FILE *, char *, char *, char *, char *);
 char *ConvURLsString(char *, char *, char *, char *);
 void write_summary_indices(int);
-void write_toplevel_indices(int);
+void write_toplevel_indices(int, int);
 struct emailinfo *nextinthread(int);
 void init_index_names(void);
 
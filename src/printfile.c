@@ -38,184 +38,363 @@
 **
 */
 
-int printfile(FILE *fp, char *format, char *label, char *subject,
-	      char *dir, char *name, char *email, char *message_id,
-	      char *charset, char *date, char *filename)
+/*
+** Templates are compiled once into a list of literal runs and
+** substitutions, so rendering a page is a handful of fwrite()s
+** instead of a scan of the whole format string.  Cookies whose value
+** can't change during a run (%%, %a, %b, %G, %h, %m, %p, %u, %v and
+** the \n and \t escapes) are folded into the literal runs when the
+** template is compiled.
+*/
+
+#define TMPL_LITERAL 0
+
+struct tmpl_item {
+    int type;			/* TMPL_LITERAL or the cookie character */
+    char *text;			/* the literal run */
+    size_t len;
+};
+
+struct template {
+    char *format;		/* the string this was compiled from */
+    struct tmpl_item *items;
+    int num_items;
+    struct template *next;
+};
+
+static struct template *templates;
+
+static void add_tmpl_item(struct template *tp, int type, struct Push *lit)
+{
+    struct tmpl_item *ip;
+
+    if (type == TMPL_LITERAL && !PUSH_STRLEN(*lit))
+	return;
+    tp->items = (struct tmpl_item *)realloc(tp->items,
+					    (tp->num_items + 1) * sizeof(struct tmpl_item));
+    if (!tp->items)
+	progerr("Couldn't allocate memory for template.");
+    ip = &tp->items[tp->num_items++];
+    ip->type = type;
+    ip->text = NULL;
+    ip->len = 0;
+    if (type == TMPL_LITERAL) {
+	ip->len = PUSH_STRLEN(*lit);
+	ip->text = PUSH_STRING(*lit);
+	INIT_PUSH(*lit);
+    }
+}
+
+static void push_opt_string(struct Push *lit, char *str)
+{
+    if (str)
+	PushString(lit, str);
+}
+
+static struct template *compile_template(char *format)
 {
-    register char *cp;
-    register char *aptr;
+    struct template *tp;
+    struct Push lit;
+    char *aptr;
     char c;
-    char *ptr,*tmpptr=NULL;
-    size_t tmplen;
 
+    for (tp = templates; tp; tp = tp->next)
+	if (tp->format == format)
+	    return tp;
+
+    tp = (struct template *)emalloc(sizeof(struct template));
+    tp->format = format;
+    tp->items = NULL;
+    tp->num_items = 0;
+
+    INIT_PUSH(lit);
     aptr = format;
 
     while ((c = *aptr++)) {
 	if (c == '\\') {
-	    switch (*aptr++) {
-	    case 'n':		/* Add the \n character */
-		putc('\n', fp);
-		continue;
-	    case 't':		/* Add the \t character */
-		putc('\t', fp);
-		continue;
-	    default:
-		break;
-	    }			/* end switch */
+	    c = *aptr++;
+	    if (c == 'n')
+		PushByte(&lit, '\n');
+	    else if (c == 't')
+		PushByte(&lit, '\t');
+	    else {
+		/* unknown escapes output the backslash and eat the next char */
+		PushByte(&lit, '\\');
+		if (!c)
+		    break;
+	    }
 	}
 	else if (c == '%') {
-            char nextone = *aptr++;
-	    switch (nextone) {
-	    case '%':		/* Add the % character */
-		putc('%', fp);
-		continue;
-	    case '~':		/* %~ - storage directory */
-		for (cp = dir; *cp; cp++)
-		    putc(*cp, fp);
-		continue;
-	    case 'A':		/* %e - email address of message author */
-		if (email && name) {
-#ifdef HAVE_ICONV
-		  tmpptr=i18n_convstring(name,"UTF-8",charset,&tmplen);
-		  cp = convchars(tmpptr,charset);
-		  if(tmpptr)
-		    free(tmpptr);
-		  fprintf(fp,
-			"<meta name=\"Author\" content=\"%s (%s)\" />",
-			cp, obfuscate_email_address(email));
-		  if (cp)
-		    free(cp);
-#else
-		fprintf(fp,
-			"<meta name=\"Author\" content=\"%s (%s)\" />",
-			tmpptr=convchars(name,charset), obfuscate_email_address(email));
-		if (tmpptr)
-		  free(tmpptr);
-#endif
-		}
-		continue;
+	    c = *aptr++;
+	    switch (c) {
+	    case '%':		/* %% - '%' character */
+		PushByte(&lit, '%');
+		break;
 	    case 'a':		/* %a - Other Archives URL */
-		if (set_archives) {
-		    for (cp = set_archives; *cp; cp++)
-			putc(*cp, fp);
-		}
-		continue;
-	    case 'B':
-	      printf("Warning: the %%B option has been disabled. Use a\n"
-		     "style sheet instead. See the INSTALL file for more info.\n");
-	      continue;
+		push_opt_string(&lit, set_archives);
+		break;
 	    case 'b':		/* %b - About this archive URL */
-		if (set_about) {
-		    for (cp = set_about; *cp; cp++)
-			putc(*cp, fp);
-		}
-		continue;
-	    case 'c':
-		if (charset && *charset) {
-		    /* only output this if we have a charset */
-		    fprintf(fp, "<meta http-equiv=\"Content-Type\""
-			    " content=\"text/html; charset=%s\" />\n",
-			    charset);
-		}
-		continue;
-
-	    case 'D':		/* %D - date of message */
-		if (date) {
-		    fprintf(fp,
-			    "<meta name=\"Date\" content=\"%s\" />",
-			    date);
-		}
-		continue;
-	    case 'e':		/* %e - email address of message author */
-		if (email) {
-		    for (cp = email; *cp; cp++)
-			putc(*cp, fp);
-		}
-		continue;
-	    case 'f':		/* %f - file name */
-		if (filename) {
-		    for (cp = filename; *cp; cp++)
-			putc(*cp, fp);
-		}
-		continue;
-	    case 'g':		/* %g - date and time archive generated */
-		for (cp = getlocaltime(); *cp; cp++)
-		    putc(*cp, fp);
-		continue;
+		push_opt_string(&lit, set_about);
+		break;
+	    case 'B':
+		printf("Warning: the %%B option has been disabled. Use a\n"
+		       "style sheet instead. See the INSTALL file for more info.\n");
+		break;
 	    case 'G':		/* %G - Language code */
-		if (set_language) {
-		    for (cp = set_language; *cp; cp++)
-			putc(*cp, fp);
-		}
-		continue;
+		push_opt_string(&lit, set_language);
+		break;
 	    case 'h':		/* %h - Hypermail Resource Center */
-		for (cp = HMURL; *cp; cp++)
-		    putc(*cp, fp);
-		continue;
-	    case 'i':		/* %m - Message-ID of message */
-		if (message_id) {
-		    for (cp = message_id; *cp; cp++)
-			putc(*cp, fp);
-		}
-		continue;
-	    case 'l':		/* %l - Archive label  */
-		for (cp = label; *cp; cp++)
-		    putc(*cp, fp);
-		continue;
+		PushString(&lit, HMURL);
+		break;
 	    case 'm':		/* %m - mailto */
-		if (set_mailto) {
-		    for (cp = set_mailto; *cp; cp++)
-			putc(*cp, fp);
-		}
-		continue;
+		push_opt_string(&lit, set_mailto);
+		break;
 	    case 'p':		/* %p - PROGNAME */
-		for (cp = PROGNAME; *cp; cp++)
-		    putc(*cp, fp);
-		continue;
-	    case 's':		/* %s - Subject of message or Index Title */
-		for (ptr = cp = convchars(subject, charset); *cp; cp++)
-		    putc(*cp, fp);
-		free(ptr);
-		continue;
-	    case 'S':		/* %s - Subject of message or Index Title */
-#ifdef HAVE_ICONV
-	        tmpptr=i18n_convstring(subject,"UTF-8",charset, &tmplen);
-		fprintf(fp, "<meta name=\"Subject\" content=\"%s\" />",
-			cp = convchars(tmpptr,charset));
-#else
-		fprintf(fp, "<meta name=\"Subject\" content=\"%s\" />",
-			cp = convchars(subject, charset));
-#endif
-		free(cp);
-		continue;
-	    case 't':
-	      {
-		struct emailinfo *ep;
-		if(hashnumlookup(0, &ep))
-		    fprintf(fp, ep->subdir ? ep->subdir->rel_path_to_top : "");
-		continue;
-	      }
+		PushString(&lit, PROGNAME);
+		break;
 	    case 'v':		/* %v - VERSION */
-		for (cp = VERSION; *cp; cp++)
-		    putc(*cp, fp);
-		continue;
+		PushString(&lit, VERSION);
+		break;
 	    case 'u':		/* %u - Expanded Version link */
-		fprintf(fp, "<a href=\"%s\">%s %s</a>",
-			HMURL, PROGNAME, VERSION);
-		continue;
+		PushString(&lit, "<a href=\"" HMURL "\">" PROGNAME " " VERSION "</a>");
+		break;
+	    case '~':
+	    case 'A':
+	    case 'c':
+	    case 'D':
+	    case 'e':
+	    case 'f':
+	    case 'g':
+	    case 'i':
+	    case 'l':
+	    case 's':
+	    case 'S':
+	    case 't':
+		/* these depend on the page being written */
+		add_tmpl_item(tp, TMPL_LITERAL, &lit);
+		add_tmpl_item(tp, c, NULL);
+		break;
 	    default:
-		putc('%', fp);
-		putc(nextone, fp);
-		continue;
+		PushByte(&lit, '%');
+		if (!c)
+		    goto done;
+		PushByte(&lit, c);
+		break;
 	    }			/* end switch */
 	}
-	putc(c, fp);
+	else
+	    PushByte(&lit, c);
     }				/* end while */
+  done:
+    add_tmpl_item(tp, TMPL_LITERAL, &lit);
+
+    tp->next = templates;
+    templates = tp;
+    return tp;
+}
+
+/*
+** Compile the header and footer files read at startup.
+*/
+
+void compile_templates(void)
+{
+    if (ihtmlheaderfile)
+	compile_template(ihtmlheaderfile);
+    if (ihtmlfooterfile)
+	compile_template(ihtmlfooterfile);
+    if (mhtmlheaderfile)
+	compile_template(mhtmlheaderfile);
+    if (mhtmlfooterfile)
+	compile_template(mhtmlfooterfile);
+}
+
+void free_templates(void)
+{
+    struct template *tp;
+    int i;
+
+    while ((tp = templates) != NULL) {
+	templates = tp->next;
+	for (i = 0; i < tp->num_items; i++)
+	    if (tp->items[i].text)
+		free(tp->items[i].text);
+	if (tp->items)
+	    free(tp->items);
+	free(tp);
+    }
+}
+
+static void fputs_opt(char *str, FILE *fp)
+{
+    if (str)
+	fwrite(str, 1, strlen(str), fp);
+}
+
+/*
+** Converts a name or subject for use in a meta tag.
+*/
+
+static char *meta_convchars(char *string, char *charset)
+{
+#ifdef HAVE_ICONV
+    char *tmpptr, *cp;
+    size_t tmplen;
+
+    if (!charset)
+	return convchars(string, charset);
+    tmpptr = i18n_convstring(string, "UTF-8", charset, &tmplen);
+    cp = convchars(tmpptr, charset);
+    if (tmpptr)
+	free(tmpptr);
+    return cp;
+#else
+    return convchars(string, charset);
+#endif
+}
+
+/*
+** printfile - print html header/footer file and fill in values 
+**             substituting for magic cookies.
+**
+**      Substitution cookies supported
+**
+**              %% - '%' character
+**              %~ - storage directory
+**              %a - Other Archives URL
+**              %b - About Archive URL
+**              %c - Charset META TAG - Not valid on index pages
+**              %e - email addr of message author - Not valid on index pages
+**              %f - file name of the HTML document
+**              %g - date and time archive generated
+**              %h - HMURL
+**              %i - Message-id - Not valid on index pages
+**              %l - archive label
+**              %m - Mailto address
+**              %p - PROGNAME
+**              %s - Subject of message or Index Title
+**              %t - path to top directory ("" if no folders; usually "../",
+**                                          sometimes "../../" with folders)
+**              %v - VERSION
+**              %u - Expanded version link (HMURL,PROGNAME,VERSION)
+**              %S - Subject META TAG - Not valid on index pages
+**              %A - Author META TAG - Not valid on index pages
+**              %D - Date META TAG - Not valid on index pages
+**              %G - Two character language
+**              \n - newline character
+**              \t - tab character
+**
+*/
+
+int printfile(FILE *fp, char *format, char *label, char *subject,
+	      char *dir, char *name, char *email, char *message_id,
+	      char *charset, char *date, char *filename)
+{
+    struct template *tp;
+    struct tmpl_item *ip;
+    char *cp;
+    int i;
+
+    tp = compile_template(format);
+
+    for (i = 0, ip = tp->items; i < tp->num_items; i++, ip++) {
+	switch (ip->type) {
+	case TMPL_LITERAL:
+	    fwrite(ip->text, 1, ip->len, fp);
+	    break;
+	case '~':		/* %~ - storage directory */
+	    fputs_opt(dir, fp);
+	    break;
+	case 'A':		/* %A - Author META TAG */
+	    if (email && name) {
+		cp = meta_convchars(name, charset);
+		fprintf(fp, "<meta name=\"Author\" content=\"%s (%s)\" />",
+			cp, obfuscate_email_address(email));
+		if (cp)
+		    free(cp);
+	    }
+	    break;
+	case 'c':
+	    if (charset && *charset) {
+		/* only output this if we have a charset */
+		fprintf(fp, "<meta http-equiv=\"Content-Type\""
+			" content=\"text/html; charset=%s\" />\n", charset);
+	    }
+	    break;
+	case 'D':		/* %D - date of message */
+	    if (date)
+		fprintf(fp, "<meta name=\"Date\" content=\"%s\" />", date);
+	    break;
+	case 'e':		/* %e - email address of message author */
+	    fputs_opt(email, fp);
+	    break;
+	case 'f':		/* %f - file name */
+	    fputs_opt(filename, fp);
+	    break;
+	case 'g':		/* %g - date and time archive generated */
+	    fputs_opt(getlocaltime(), fp);
+	    break;
+	case 'i':		/* %i - Message-ID of message */
+	    fputs_opt(message_id, fp);
+	    break;
+	case 'l':		/* %l - Archive label  */
+	    fputs_opt(label, fp);
+	    break;
+	case 's':		/* %s - Subject of message or Index Title */
+	    if (subject) {
+		fputs_opt(cp = convchars(subject, charset), fp);
+		free(cp);
+	    }
+	    break;
+	case 'S':		/* %S - Subject META TAG */
+	    if (subject) {
+		fprintf(fp, "<meta name=\"Subject\" content=\"%s\" />",
+			cp = meta_convchars(subject, charset));
+		free(cp);
+	    }
+	    break;
+	case 't':
+	    {
+		struct emailinfo *ep;
+		if (hashnumlookup(0, &ep) && ep->subdir)
+		    fputs_opt(ep->subdir->rel_path_to_top, fp);
+	    }
+	    break;
+	}
+    }
 
-    fflush(fp);
     return (0);
 }
 
+/*
+** The style sheet emitted when no css url is configured.
+*/
+
+static const char default_style[] =
+    "<style type=\"text/css\">\n"
+    "/*<![CDATA[*/\n"
+    "/* To be incorporated in the main stylesheet, don't code it in hypermail! */\n"
+    "body {color: black; background: #ffffff;}\n"
+    "dfn {font-weight: bold;}\n"
+    "pre { background-color:inherit;}\n"
+    ".head { border-bottom:1px solid black;}\n"
+    ".foot { border-top:1px solid black;}\n"
+    "th {font-style:italic;}\n"
+    "table { margin-left:2em;}"
+    /* JK: This was the WAI rule before */
+    /* "#body {background-color:#fff;}\n" */
+    "map ul {list-style:none;}\n"
+    "#mid { font-size:0.9em;}\n"
+    "#received { float:right;}\n"
+    "address { font-style:inherit;}\n"
+    "/*]]>*/\n"
+    ".quotelev1 {color : #990099;}\n"
+    ".quotelev2 {color : #ff7700;}\n"
+    ".quotelev3 {color : #007799;}\n"
+    ".quotelev4 {color : #95c500;}\n"
+    ".period {font-weight: bold;}\n"
+    "</style>\n";
+
 /*
 ** Prints the standard page header 
 */
@@ -338,31 +517,7 @@ void print_main_header(FILE *fp, bool index_header, char *label, char *name,
        * if style sheets are not specified, emit a default one.
        */
        /* @@ JK: the new css */
-      fprintf (fp, "<style type=\"text/css\">\n");
-      
-      fprintf (fp,"/*<![CDATA[*/\n");
-      fprintf (fp, "/* To be incorporated in the main stylesheet, don't code it in hypermail! */\n");
-      fprintf (fp, "body {color: black; background: #ffffff;}\n");
-      fprintf (fp, "dfn {font-weight: bold;}\n");
-      fprintf (fp, "pre { background-color:inherit;}\n");
-      fprintf (fp, ".head { border-bottom:1px solid black;}\n");
-      fprintf (fp, ".foot { border-top:1px solid black;}\n");
-      fprintf (fp, "th {font-style:italic;}\n");
-      fprintf (fp, "table { margin-left:2em;}");
-
-      /* JK: This was the WAI rule before */
-      /* fprintf (fp, "#body {background-color:#fff;}\n"); */
-      fprintf (fp, "map ul {list-style:none;}\n");
-      fprintf (fp, "#mid { font-size:0.9em;}\n");
-      fprintf (fp, "#received { float:right;}\n");
-      fprintf (fp, "address { font-style:inherit;}\n");
-      fprintf (fp, "/*]]>*/\n");
-      fprintf(fp, ".quotelev1 {color : #990099;}\n");
-      fprintf(fp, ".quotelev2 {color : #ff7700;}\n");
-      fprintf(fp, ".quotelev3 {color : #007799;}\n");
-      fprintf(fp, ".quotelev4 {color : #95c500;}\n");
-      fprintf (fp, ".period {font-weight: bold;}\n");
-      fprintf (fp, "</style>\n");
+      fputs(default_style, fp);
     }
 
     if (ihtmlheadfile)
@@ -402,7 +557,7 @@ void print_index_header(FILE *fp, char *label, char *dir, char *subject,
 #ifdef HAVE_ICONV
       if (set_i18n){
 	printfile(fp, ihtmlheaderfile, label, subject, dir, NULL, NULL,
-		  "UTF-8", NULL, NULL, filename);
+		  NULL, "UTF-8", NULL, filename);
       }else{
 	printfile(fp, ihtmlheaderfile, label, subject, dir, NULL, NULL,
 		  NULL, NULL, NULL, filename);
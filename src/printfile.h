@@ -2,6 +2,9 @@
 ** printfile.c functions
 */
 
+void compile_templates(void);
+void free_templates(void);
+
 int printfile(FILE *, char *, char *, char *, char *, char *, char *, 
               char *, char *, char *, char *);
 
@@ -77,6 +77,11 @@ char **valid_language(char *, char **);
 */
 void lock_archive(char *);
 void unlock_archive(void);
+int lock_or_spool(char *);
+char **read_spool(int *);
+void remove_spooled(void);
+int spool_waiting(void);
+void unlock_spool(char **);
 
 /*
 ** mem.c function
@@ -138,6 +143,24 @@ char *parseurl(char *, char *);
 char *hm_strchr(const char *, int);
 void iso2022_state(const char *str, int *state, int *esc);
 
+/*
+** compress.c
+*/
+void compress_data(const char *, char *, size_t);
+void compress_page(const char *);
+void remove_compressed_page(const char *);
+
+/*
+** attindex.c
+*/
+struct attach *add_attachment(struct attach **, const char *, const char *,
+			      const char *);
+void remove_attachment(struct attach **, const char *);
+void free_attachments(struct attach *);
+char *attachmentindex_name(void);
+void load_attachmentindex(void);
+void write_attachmentindex(int);
+
 /*
 ** quotes.c
 */
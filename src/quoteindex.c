@@ -0,0 +1,412 @@
+/*
+** The quote index (linkquotes with usebinindex).
+**
+** linkquotes finds the source of a quoted line by looking up the
+** bigrams (pairs of consecutive words) of the line. Instead of reading
+** the bodies of the last searchbackmsgnum messages and indexing them
+** again on every run, the token dictionary and the bigram postings are
+** kept in two files, each written once for every message:
+**
+**   .hm3tokens   the tokens (length and CRC-32C) with the number that
+**                search.c gave them
+**   .hm3bigrams  a table of bucket heads followed by the postings,
+**                chained from the newest to the oldest in each bucket
+**
+** Postings are only appended, so a chain is in message number order
+** and a lookup can stop at the first posting that is too old. Both
+** files are mapped at startup like the usebinindex files; the headers
+** record the last message indexed and are written last, and an index
+** that doesn't cover all the old messages is made again from scratch.
+*/
+
+#include "hypermail.h"
+#include "setup.h"
+#include "struct.h"
+#include "proto.h"
+#include "binindex.h"
+#include "quoteindex.h"
+
+#define QTOKENS_MAGIC    "HMQTOKN2"
+#define QBIGRAMS_MAGIC   "HMQBIGR1"
+#define QINDEX_BYTEORDER 0x01020304
+
+#define MIN_BUCKETS      (1 << 16)
+
+struct qtokens_header {
+    char magic[8];
+    uint32_t byteorder;
+    uint32_t count;
+    uint32_t next_itok;		/* the number of the next new token */
+    int32_t covered;		/* the last message indexed, or -1 */
+};
+
+struct qbigrams_header {
+    char magic[8];
+    uint32_t byteorder;
+    uint32_t nbuckets;		/* a power of two */
+    uint32_t count;
+    int32_t covered;
+};
+
+struct quoteindex {
+    char *tokdata;
+    size_t toklen;
+    int tok_mapped;
+    char *bigdata;
+    size_t biglen;
+    int big_mapped;
+    const struct qtokens_header *thdr;
+    const struct qbigrams_header *bhdr;
+    const uint32_t *heads;
+    const struct quote_posting *postings;	/* postings[0] is number 1 */
+};
+
+static uint32_t bigram_bucket(uint32_t b1, uint32_t b2, uint32_t nbuckets)
+{
+    uint32_t h = b1 * 0x9e3779b1U ^ (b2 + 0x7f4a7c15U) * 0x85ebca6bU;
+
+    h ^= h >> 15;
+    return h & (nbuckets - 1);
+}
+
+/*
+** Maps the index of the archive in dir. Returns NULL if there is none
+** or it isn't complete.
+*/
+
+struct quoteindex *quoteindex_map(const char *dir)
+{
+    struct quoteindex *qi;
+    char *filename;
+
+    qi = (struct quoteindex *)emalloc(sizeof(struct quoteindex));
+    memset(qi, 0, sizeof(struct quoteindex));
+
+    filename = binindex_name(dir, QUOTE_TOKENS_NAME);
+    qi->tokdata = map_file(filename, &qi->toklen, &qi->tok_mapped);
+    free(filename);
+    filename = binindex_name(dir, QUOTE_BIGRAMS_NAME);
+    qi->bigdata = map_file(filename, &qi->biglen, &qi->big_mapped);
+    free(filename);
+
+    qi->thdr = (const struct qtokens_header *)qi->tokdata;
+    qi->bhdr = (const struct qbigrams_header *)qi->bigdata;
+    if (!qi->tokdata || !qi->bigdata
+	|| qi->toklen < sizeof(struct qtokens_header)
+	|| qi->biglen < sizeof(struct qbigrams_header)
+	|| memcmp(qi->thdr->magic, QTOKENS_MAGIC, sizeof(qi->thdr->magic))
+	|| memcmp(qi->bhdr->magic, QBIGRAMS_MAGIC, sizeof(qi->bhdr->magic))
+	|| qi->thdr->byteorder != QINDEX_BYTEORDER
+	|| qi->bhdr->byteorder != QINDEX_BYTEORDER
+	|| qi->thdr->covered != qi->bhdr->covered
+	|| (qi->toklen - sizeof(struct qtokens_header))
+	    / sizeof(struct quote_token) < qi->thdr->count
+	|| !qi->bhdr->nbuckets
+	|| (qi->bhdr->nbuckets & (qi->bhdr->nbuckets - 1))
+	|| (qi->biglen - sizeof(struct qbigrams_header))
+	    / sizeof(uint32_t) < qi->bhdr->nbuckets
+	|| (qi->biglen - sizeof(struct qbigrams_header)
+	    - qi->bhdr->nbuckets * sizeof(uint32_t))
+	    / sizeof(struct quote_posting) < qi->bhdr->count) {
+	quoteindex_unmap(qi);
+	return NULL;
+    }
+    qi->heads = (const uint32_t *)(qi->bigdata + sizeof(struct qbigrams_header));
+    qi->postings = (const struct quote_posting *)
+	(qi->heads + qi->bhdr->nbuckets);
+    return qi;
+}
+
+int quoteindex_covered(struct quoteindex *qi)
+{
+    return qi->bhdr->covered;
+}
+
+uint32_t quoteindex_next_itok(struct quoteindex *qi)
+{
+    return qi->thdr->next_itok;
+}
+
+const struct quote_token *quoteindex_tokens(struct quoteindex *qi, int *count)
+{
+    *count = (int)qi->thdr->count;
+    return (const struct quote_token *)(qi->tokdata + sizeof(struct qtokens_header));
+}
+
+/*
+** Follows a chain from posting number num to the first posting of
+** the bigram. The numbers only go down, so a damaged file can't loop.
+*/
+
+static const struct quote_posting *find_posting(struct quoteindex *qi,
+						uint32_t num, uint32_t limit,
+						uint32_t b1, uint32_t b2)
+{
+    const struct quote_posting *p;
+
+    while (num && num < limit && num <= qi->bhdr->count) {
+	p = &qi->postings[num - 1];
+	if (p->bigram1 == b1 && p->bigram2 == b2)
+	    return p;
+	limit = num;
+	num = p->next;
+    }
+    return NULL;
+}
+
+/*
+** The newest posting of a bigram, or NULL.
+*/
+
+const struct quote_posting *quoteindex_lookup(struct quoteindex *qi,
+					      uint32_t b1, uint32_t b2)
+{
+    return find_posting(qi, qi->heads[bigram_bucket(b1, b2, qi->bhdr->nbuckets)],
+			qi->bhdr->count + 1, b1, b2);
+}
+
+/*
+** The posting of the same bigram before p, or NULL.
+*/
+
+const struct quote_posting *quoteindex_next(struct quoteindex *qi,
+					    const struct quote_posting *p)
+{
+    return find_posting(qi, p->next, (uint32_t)(p - qi->postings) + 1,
+			p->bigram1, p->bigram2);
+}
+
+void quoteindex_unmap(struct quoteindex *qi)
+{
+    unmap_file(qi->tokdata, qi->toklen, qi->tok_mapped);
+    unmap_file(qi->bigdata, qi->biglen, qi->big_mapped);
+    free(qi);
+}
+
+/*
+** Updating.
+*/
+
+static FILE *tok_fp;
+static FILE *big_fp;
+static struct qtokens_header tok_hdr;
+static struct qbigrams_header big_hdr;
+static uint32_t *update_heads;
+
+static void write_error(const char *name)
+{
+    char *filename = binindex_name(set_dir, name);
+    snprintf(errmsg, sizeof(errmsg), "%s \"%s\".", lang[MSG_COULD_NOT_WRITE], filename);
+    free(filename);
+    progerr(errmsg);
+}
+
+static FILE *open_file(const char *name, const char *mode)
+{
+    char *filename = binindex_name(set_dir, name);
+    FILE *fp = fopen(filename, mode);
+
+    if (fp && *mode == 'w')
+	chmod(filename, set_filemode);
+    free(filename);
+    return fp;
+}
+
+static int create_index(void)
+{
+    if ((tok_fp = open_file(QUOTE_TOKENS_NAME, "w+b")) == NULL
+	|| (big_fp = open_file(QUOTE_BIGRAMS_NAME, "w+b")) == NULL)
+	return 0;
+
+    memset(&tok_hdr, 0, sizeof(tok_hdr));
+    memcpy(tok_hdr.magic, QTOKENS_MAGIC, sizeof(tok_hdr.magic));
+    tok_hdr.byteorder = QINDEX_BYTEORDER;
+    tok_hdr.covered = -1;
+    memset(&big_hdr, 0, sizeof(big_hdr));
+    memcpy(big_hdr.magic, QBIGRAMS_MAGIC, sizeof(big_hdr.magic));
+    big_hdr.byteorder = QINDEX_BYTEORDER;
+    big_hdr.nbuckets = MIN_BUCKETS;
+    big_hdr.covered = -1;
+
+    update_heads = (uint32_t *)emalloc(big_hdr.nbuckets * sizeof(uint32_t));
+    memset(update_heads, 0, big_hdr.nbuckets * sizeof(uint32_t));
+    return fwrite(&tok_hdr, sizeof(tok_hdr), 1, tok_fp) == 1
+	&& fwrite(&big_hdr, sizeof(big_hdr), 1, big_fp) == 1
+	&& fwrite(update_heads, sizeof(uint32_t), big_hdr.nbuckets, big_fp)
+	    == big_hdr.nbuckets;
+}
+
+static int open_index(void)
+{
+    if ((tok_fp = open_file(QUOTE_TOKENS_NAME, "r+b")) == NULL
+	|| (big_fp = open_file(QUOTE_BIGRAMS_NAME, "r+b")) == NULL
+	|| fread(&tok_hdr, sizeof(tok_hdr), 1, tok_fp) != 1
+	|| fread(&big_hdr, sizeof(big_hdr), 1, big_fp) != 1
+	|| memcmp(tok_hdr.magic, QTOKENS_MAGIC, sizeof(tok_hdr.magic))
+	|| memcmp(big_hdr.magic, QBIGRAMS_MAGIC, sizeof(big_hdr.magic))
+	|| !big_hdr.nbuckets || (big_hdr.nbuckets & (big_hdr.nbuckets - 1)))
+	return 0;
+    update_heads = (uint32_t *)emalloc(big_hdr.nbuckets * sizeof(uint32_t));
+    /* anything after count was left by an interrupted run */
+    return fread(update_heads, sizeof(uint32_t), big_hdr.nbuckets, big_fp)
+	== big_hdr.nbuckets
+	&& !fseek(tok_fp, (long)(sizeof(tok_hdr)
+				 + tok_hdr.count * sizeof(struct quote_token)),
+		  SEEK_SET)
+	&& !fseek(big_fp, (long)(sizeof(big_hdr)
+				 + big_hdr.nbuckets * sizeof(uint32_t)
+				 + big_hdr.count * sizeof(struct quote_posting)),
+		  SEEK_SET);
+}
+
+static void close_files(void)
+{
+    if (tok_fp)
+	fclose(tok_fp);
+    if (big_fp)
+	fclose(big_fp);
+    tok_fp = big_fp = NULL;
+    if (update_heads)
+	free(update_heads);
+    update_heads = NULL;
+}
+
+/*
+** Opens the index of set_dir to add messages to it, or starts a new
+** one if rebuild is set. Returns 0 if that isn't possible.
+*/
+
+int quoteindex_open(int rebuild)
+{
+    if (rebuild ? create_index() : open_index())
+	return 1;
+    close_files();
+    return 0;
+}
+
+void quoteindex_add_token(uint32_t length, uint32_t crc32, uint32_t itok)
+{
+    struct quote_token tok;
+
+    if (!tok_fp)
+	return;
+    tok.length = length;
+    tok.crc32 = crc32;
+    tok.itok = itok;
+    if (fwrite(&tok, sizeof(tok), 1, tok_fp) != 1)
+	write_error(QUOTE_TOKENS_NAME);
+    ++tok_hdr.count;
+}
+
+void quoteindex_add_posting(uint32_t b1, uint32_t b2, int msgnum,
+			    uint32_t line, uint32_t offset)
+{
+    struct quote_posting p;
+    uint32_t h;
+
+    if (!big_fp)
+	return;
+    h = bigram_bucket(b1, b2, big_hdr.nbuckets);
+    p.bigram1 = b1;
+    p.bigram2 = b2;
+    p.msgnum = msgnum;
+    p.line = line;
+    p.offset = offset;
+    p.next = update_heads[h];
+    if (fwrite(&p, sizeof(p), 1, big_fp) != 1)
+	write_error(QUOTE_BIGRAMS_NAME);
+    update_heads[h] = ++big_hdr.count;
+}
+
+/*
+** Writes the postings out again with a table twice as big or more,
+** when the chains have got long.
+*/
+
+static void grow_table(void)
+{
+    struct quote_posting *postings;
+    uint32_t i, h;
+    char *filename, *tmpname;
+    FILE *fp;
+    int failed;
+
+    postings = (struct quote_posting *)
+	emalloc((big_hdr.count + 1) * sizeof(struct quote_posting));
+    if (fseek(big_fp, (long)(sizeof(big_hdr)
+			     + big_hdr.nbuckets * sizeof(uint32_t)), SEEK_SET)
+	|| fread(postings, sizeof(struct quote_posting), big_hdr.count, big_fp)
+	!= big_hdr.count)
+	write_error(QUOTE_BIGRAMS_NAME);
+
+    while (big_hdr.nbuckets < big_hdr.count)
+	big_hdr.nbuckets *= 2;
+    free(update_heads);
+    update_heads = (uint32_t *)emalloc(big_hdr.nbuckets * sizeof(uint32_t));
+    memset(update_heads, 0, big_hdr.nbuckets * sizeof(uint32_t));
+    for (i = 0; i < big_hdr.count; i++) {
+	h = bigram_bucket(postings[i].bigram1, postings[i].bigram2,
+			  big_hdr.nbuckets);
+	postings[i].next = update_heads[h];
+	update_heads[h] = i + 1;
+    }
+
+    filename = binindex_name(set_dir, QUOTE_BIGRAMS_NAME);
+    trio_asprintf(&tmpname, "%s.tmp", filename);
+    if ((fp = fopen(tmpname, "wb")) == NULL) {
+	snprintf(errmsg, sizeof(errmsg), "%s \"%s\".", lang[MSG_COULD_NOT_WRITE], tmpname);
+	progerr(errmsg);
+    }
+    failed = fwrite(&big_hdr, sizeof(big_hdr), 1, fp) != 1
+	|| fwrite(update_heads, sizeof(uint32_t), big_hdr.nbuckets, fp)
+	!= big_hdr.nbuckets
+	|| fwrite(postings, sizeof(struct quote_posting), big_hdr.count, fp)
+	!= big_hdr.count;
+    if (fclose(fp) || failed) {
+	snprintf(errmsg, sizeof(errmsg), "%s \"%s\".", lang[MSG_COULD_NOT_WRITE], tmpname);
+	progerr(errmsg);
+    }
+    fclose(big_fp);
+    big_fp = NULL;
+    chmod(tmpname, set_filemode);
+    if (rename(tmpname, filename) == -1)
+	write_error(QUOTE_BIGRAMS_NAME);
+    free(tmpname);
+    free(filename);
+    free(postings);
+}
+
+/*
+** Commits the messages up to covered: the tokens and postings first,
+** then the bucket heads, then the headers.
+*/
+
+void quoteindex_close(int covered, uint32_t next_itok)
+{
+    if (!tok_fp || !big_fp) {
+	close_files();
+	return;
+    }
+    big_hdr.covered = covered;
+    if (big_hdr.count > 2 * big_hdr.nbuckets)
+	grow_table();
+    else if (fflush(big_fp)
+	     || fseek(big_fp, (long)sizeof(big_hdr), SEEK_SET)
+	     || fwrite(update_heads, sizeof(uint32_t), big_hdr.nbuckets, big_fp)
+	     != big_hdr.nbuckets
+	     || fseek(big_fp, 0L, SEEK_SET)
+	     || fwrite(&big_hdr, sizeof(big_hdr), 1, big_fp) != 1
+	     || fclose(big_fp))
+	write_error(QUOTE_BIGRAMS_NAME);
+    big_fp = NULL;
+
+    tok_hdr.covered = covered;
+    tok_hdr.next_itok = next_itok;
+    if (fflush(tok_fp)
+	|| fseek(tok_fp, 0L, SEEK_SET)
+	|| fwrite(&tok_hdr, sizeof(tok_hdr), 1, tok_fp) != 1
+	|| fclose(tok_fp))
+	write_error(QUOTE_TOKENS_NAME);
+    tok_fp = NULL;
+    close_files();
+}
@@ -0,0 +1,45 @@
+#ifndef QUOTEINDEX_H_INCLUDED
+#define QUOTEINDEX_H_INCLUDED
+
+/*
+** quoteindex.c functions
+*/
+
+#include <stdint.h>
+
+/* an entry of the token dictionary, as search.c keys its tokens */
+struct quote_token {
+    uint32_t length;
+    uint32_t crc32;
+    uint32_t itok;
+};
+
+/* a place a bigram was seen: the end of its second token, as a line
+   of the body parse_old_html() reads back and an offset in that line */
+struct quote_posting {
+    uint32_t bigram1;
+    uint32_t bigram2;
+    int32_t msgnum;
+    uint32_t line;
+    uint32_t offset;
+    uint32_t next;		/* the posting before it in the same bucket */
+};
+
+struct quoteindex;
+
+struct quoteindex *quoteindex_map(const char *);
+int quoteindex_covered(struct quoteindex *);
+uint32_t quoteindex_next_itok(struct quoteindex *);
+const struct quote_token *quoteindex_tokens(struct quoteindex *, int *);
+const struct quote_posting *quoteindex_lookup(struct quoteindex *,
+					      uint32_t, uint32_t);
+const struct quote_posting *quoteindex_next(struct quoteindex *,
+					    const struct quote_posting *);
+void quoteindex_unmap(struct quoteindex *);
+
+int quoteindex_open(int);
+void quoteindex_add_token(uint32_t, uint32_t, uint32_t);
+void quoteindex_add_posting(uint32_t, uint32_t, int, uint32_t, uint32_t);
+void quoteindex_close(int, uint32_t);
+
+#endif				/* QUOTEINDEX_H_INCLUDED */
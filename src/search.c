@@ -25,51 +25,106 @@
 #include "struct.h"
 #include "print.h"
 #include "search.h"
+#include "parse.h"
+#include "quoteindex.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(__LCC__)
+#define HAVE_HW_CRC32C
+#include <nmmintrin.h>
+#endif
 
 static int bigram_count = 0;
 static struct reply *replylist_tmp;
 
 #if 1
 typedef unsigned long BIGRAM_TYPE;
-static const unsigned max_tokens = 400000; /* increase this if you have plenty of RAM */
 #else				/* for systems with little RAM and archives less than 10 megs? */
 typedef unsigned short BIGRAM_TYPE;
-static const unsigned max_tokens = 0xfff0;
 #endif
 
-struct bigram_list {
-    struct body *bp;
-    short offset;
-    struct bigram_list *next;
+/*
+** The bigram postings: for each pair of successive tokens, the places
+** it was seen, as the message, the line of its body and the offset in
+** that line where the second token ends. The postings of a bigram are
+** one slice of bigram_postings, oldest first, and an open addressing
+** hash table on the bigram finds the slice. add_bigram() collects them
+** in the order they come and finish_bigrams() sorts them into slices.
+*/
+struct bigram_posting {
+    int32_t msgnum;
+    uint32_t line;
+    uint32_t offset;
 };
 
-struct bigram_tree_entry {
-    struct bigram_tree_entry *left;
-    struct bigram_tree_entry *right;
-    struct bigram_list list;
+struct bigram_entry {
     BIGRAM_TYPE bigram1;
     BIGRAM_TYPE bigram2;
+    uint32_t first;		/* its slice of bigram_postings */
+    uint32_t count;		/* 0 for a free slot */
 };
-static struct bigram_tree_entry *bigram_tree = NULL;
+
+struct new_posting {
+    uint32_t entry;		/* the slot of its bigram */
+    struct bigram_posting posting;
+};
+
+static struct bigram_entry *bigram_slots = NULL;
+static unsigned bigram_slots_mask = 0;	/* its size - 1 */
+static unsigned num_bigrams = 0;
+static struct bigram_posting *bigram_postings = NULL;
+static struct new_posting *new_postings = NULL;
+static unsigned new_postings_space = 0;
+static unsigned num_postings = 0;
+
+/* the lines of the bodies the postings are in, and where those of
+   each message start, from the first message with postings */
+static struct body **body_lines = NULL;
+static unsigned num_body_lines = 0;
+static unsigned body_lines_space = 0;
+static uint32_t *msg_first_line = NULL;
+static int lines_from_msgnum = 0;
 
 #define MAXSEARCHTOKEN 26
+
+#define LINKQUOTES_SHINGLES 1	/* linkquotes_method, see add_shingles() */
+
 struct search_text {
-    struct search_text *left;
-    struct search_text *right;
 #ifdef BY_TOKEN_STRING
     char token[MAXSEARCHTOKEN];
 #else
     int token_length;
-    unsigned int token_crc32;
 #endif				/* !BY_TOKEN_STRING */
+    unsigned int token_crc32;
     BIGRAM_TYPE itok;
 #ifdef COUNT_TOKEN_FREQ
     int count;
 #endif
 };
-static struct search_text *text_tree = NULL;
 static BIGRAM_TYPE next_itoken = 1;
 
+/*
+** The token dictionary: the tokens in the order they were first seen,
+** and an open addressing hash table on their CRCs that holds their
+** places in that order plus one, so that 0 is a free slot. It is never
+** more than half full.
+*/
+static struct search_text *tokens = NULL;
+static unsigned num_tokens = 0;
+static unsigned tokens_space = 0;
+static unsigned *token_slots = NULL;
+static unsigned token_slots_mask = 0;	/* its size - 1 */
+
+static int search_from_msgnum = 0;
+
+#ifndef BY_TOKEN_STRING
+static struct quoteindex *quote_index = NULL;
+static unsigned num_old_tokens = 0;	/* the ones the quote index has */
+#endif
+
 static int start_time;
 static int tree_alloc = 0;
 
@@ -84,7 +139,7 @@ void set_alt_replylist(struct reply *r)
 /* change the order of itok entries for more balanced tree */
 static BIGRAM_TYPE reverse_bits(BIGRAM_TYPE i)
 {
-    BIGRAM_TYPE r = 0;
+    BIGRAM_TYPE r = i & ~(BIGRAM_TYPE)0xffff;	/* keep tokens apart past 64k */
     int j;
     for (j = 0; j < 16; ++j)
 	if (i & (1 << j))
@@ -92,274 +147,389 @@ static BIGRAM_TYPE reverse_bits(BIGRAM_TYPE i)
     return r;
 }
 
-#ifdef BY_TOKEN_STRING
-#define ENCODE_TOKEN(a)	encode_token(a)
-#define COMPARE_TOKEN(a, b)	strcasecmp(a, (b)->token)
-#else
 #define ENCODE_TOKEN(a)	encode_token((a), strlen(a))
-#define COMPARE_TOKEN(a, b)	token_digest_order(token_length, token_crc32, (b))
 
-static int token_digest_order(const int token_length, const unsigned int token_crc32, const struct search_text *const p)
+/*
+** Token digests are the CRC-32C of the lower case token. Where the CPU
+** has the SSE4.2 crc32 instruction it sums 8 bytes at a time, elsewhere
+** a slicing-by-8 table does. Each 8 bytes are lower cased at once when
+** tolower() only maps 'A' to 'Z', as in the C locale, and through a
+** table otherwise.
+*/
+
+#define CRC32C_POLY 0x82f63b78	/* reversed Castagnoli polynomial */
+
+static uint32_t crc32c_table[8][256];
+static unsigned char lower_table[256];
+static int ascii_tolower;	/* tolower() changes nothing but 'A'-'Z' */
+static unsigned int (*digest_function)(const unsigned char *, int);
+
+static void lower8(unsigned char *dst, const unsigned char *src)
 {
-	return ((token_length > p->token_length) ? 1 : (token_length < p->token_length) ? -1 : (token_crc32 > p->token_crc32) ? 1 : (token_crc32 < p->token_crc32) ? -1 : 0);
+    if (ascii_tolower) {
+	const uint64_t ones = 0x0101010101010101ULL;
+	uint64_t word, low, upper;
+	memcpy(&word, src, 8);
+	/* the high bit of each byte from 'A' to 'Z' */
+	low = word & (0x7f * ones);
+	upper = ((low + (0x80 - 'A') * ones) ^ (low + (0x80 - 'Z' - 1) * ones))
+	    & ~word & (0x80 * ones);
+	word |= upper >> 2;	/* 0x20 */
+	memcpy(dst, &word, 8);
+    }
+    else {
+	int i;
+	for (i = 0; i < 8; ++i)
+	    dst[i] = lower_table[src[i]];
+    }
 }
 
-/* crc32.c -- compute the CRC-32 of a data stream
- * Copyright (C) 1995 Mark Adler
- * For conditions of distribution and use, see copyright notice in zlib.h
- */
-/* zlib.h is available in /usr/include on many systems. I also see a copy at:
-http://sunsite.doc.ic.ac.uk/public/packages//NetBSD-current/src/lib/libz/zlib.h
-*/
+static unsigned int digest_slicing(const unsigned char *buf, int len)
+{
+    uint32_t crc = 0xffffffff;
+    unsigned char b[8];
 
-static unsigned int crc32_lower(register const unsigned char *buf,	/* pointer to bytes to pump through */
-				int len)
-{				/* number of bytes in buf[] */
-    /* Run a set of bytes through the crc shift register.  If buf is a NULL
-       pointer, then initialize the crc shift register contents instead.
-       Return the current crc in either case. */
-    register unsigned int crc = 0;	/* crc shift register */
-#ifdef CRC32
-#  undef CRC32
-#endif
-#define CRC32(c, b) (crc_table[((int)(c) ^ (b)) & 0xff] ^ ((c) >> 8))
-#define DO1(buf)  crc = CRC32(crc, tolower(*buf++))
-
-/* ========================================================================
- * Table of CRC-32's of all single-byte values (made by make_crc_table)
- */
-    static const unsigned int crc_table[] = {
-	0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
-	0x706af48fL, 0xe963a535L, 0x9e6495a3L, 0x0edb8832L, 0x79dcb8a4L,
-	0xe0d5e91eL, 0x97d2d988L, 0x09b64c2bL, 0x7eb17cbdL, 0xe7b82d07L,
-	0x90bf1d91L, 0x1db71064L, 0x6ab020f2L, 0xf3b97148L, 0x84be41deL,
-	0x1adad47dL, 0x6ddde4ebL, 0xf4d4b551L, 0x83d385c7L, 0x136c9856L,
-	0x646ba8c0L, 0xfd62f97aL, 0x8a65c9ecL, 0x14015c4fL, 0x63066cd9L,
-	0xfa0f3d63L, 0x8d080df5L, 0x3b6e20c8L, 0x4c69105eL, 0xd56041e4L,
-	0xa2677172L, 0x3c03e4d1L, 0x4b04d447L, 0xd20d85fdL, 0xa50ab56bL,
-	0x35b5a8faL, 0x42b2986cL, 0xdbbbc9d6L, 0xacbcf940L, 0x32d86ce3L,
-	0x45df5c75L, 0xdcd60dcfL, 0xabd13d59L, 0x26d930acL, 0x51de003aL,
-	0xc8d75180L, 0xbfd06116L, 0x21b4f4b5L, 0x56b3c423L, 0xcfba9599L,
-	0xb8bda50fL, 0x2802b89eL, 0x5f058808L, 0xc60cd9b2L, 0xb10be924L,
-	0x2f6f7c87L, 0x58684c11L, 0xc1611dabL, 0xb6662d3dL, 0x76dc4190L,
-	0x01db7106L, 0x98d220bcL, 0xefd5102aL, 0x71b18589L, 0x06b6b51fL,
-	0x9fbfe4a5L, 0xe8b8d433L, 0x7807c9a2L, 0x0f00f934L, 0x9609a88eL,
-	0xe10e9818L, 0x7f6a0dbbL, 0x086d3d2dL, 0x91646c97L, 0xe6635c01L,
-	0x6b6b51f4L, 0x1c6c6162L, 0x856530d8L, 0xf262004eL, 0x6c0695edL,
-	0x1b01a57bL, 0x8208f4c1L, 0xf50fc457L, 0x65b0d9c6L, 0x12b7e950L,
-	0x8bbeb8eaL, 0xfcb9887cL, 0x62dd1ddfL, 0x15da2d49L, 0x8cd37cf3L,
-	0xfbd44c65L, 0x4db26158L, 0x3ab551ceL, 0xa3bc0074L, 0xd4bb30e2L,
-	0x4adfa541L, 0x3dd895d7L, 0xa4d1c46dL, 0xd3d6f4fbL, 0x4369e96aL,
-	0x346ed9fcL, 0xad678846L, 0xda60b8d0L, 0x44042d73L, 0x33031de5L,
-	0xaa0a4c5fL, 0xdd0d7cc9L, 0x5005713cL, 0x270241aaL, 0xbe0b1010L,
-	0xc90c2086L, 0x5768b525L, 0x206f85b3L, 0xb966d409L, 0xce61e49fL,
-	0x5edef90eL, 0x29d9c998L, 0xb0d09822L, 0xc7d7a8b4L, 0x59b33d17L,
-	0x2eb40d81L, 0xb7bd5c3bL, 0xc0ba6cadL, 0xedb88320L, 0x9abfb3b6L,
-	0x03b6e20cL, 0x74b1d29aL, 0xead54739L, 0x9dd277afL, 0x04db2615L,
-	0x73dc1683L, 0xe3630b12L, 0x94643b84L, 0x0d6d6a3eL, 0x7a6a5aa8L,
-	0xe40ecf0bL, 0x9309ff9dL, 0x0a00ae27L, 0x7d079eb1L, 0xf00f9344L,
-	0x8708a3d2L, 0x1e01f268L, 0x6906c2feL, 0xf762575dL, 0x806567cbL,
-	0x196c3671L, 0x6e6b06e7L, 0xfed41b76L, 0x89d32be0L, 0x10da7a5aL,
-	0x67dd4accL, 0xf9b9df6fL, 0x8ebeeff9L, 0x17b7be43L, 0x60b08ed5L,
-	0xd6d6a3e8L, 0xa1d1937eL, 0x38d8c2c4L, 0x4fdff252L, 0xd1bb67f1L,
-	0xa6bc5767L, 0x3fb506ddL, 0x48b2364bL, 0xd80d2bdaL, 0xaf0a1b4cL,
-	0x36034af6L, 0x41047a60L, 0xdf60efc3L, 0xa867df55L, 0x316e8eefL,
-	0x4669be79L, 0xcb61b38cL, 0xbc66831aL, 0x256fd2a0L, 0x5268e236L,
-	0xcc0c7795L, 0xbb0b4703L, 0x220216b9L, 0x5505262fL, 0xc5ba3bbeL,
-	0xb2bd0b28L, 0x2bb45a92L, 0x5cb36a04L, 0xc2d7ffa7L, 0xb5d0cf31L,
-	0x2cd99e8bL, 0x5bdeae1dL, 0x9b64c2b0L, 0xec63f226L, 0x756aa39cL,
-	0x026d930aL, 0x9c0906a9L, 0xeb0e363fL, 0x72076785L, 0x05005713L,
-	0x95bf4a82L, 0xe2b87a14L, 0x7bb12baeL, 0x0cb61b38L, 0x92d28e9bL,
-	0xe5d5be0dL, 0x7cdcefb7L, 0x0bdbdf21L, 0x86d3d2d4L, 0xf1d4e242L,
-	0x68ddb3f8L, 0x1fda836eL, 0x81be16cdL, 0xf6b9265bL, 0x6fb077e1L,
-	0x18b74777L, 0x88085ae6L, 0xff0f6a70L, 0x66063bcaL, 0x11010b5cL,
-	0x8f659effL, 0xf862ae69L, 0x616bffd3L, 0x166ccf45L, 0xa00ae278L,
-	0xd70dd2eeL, 0x4e048354L, 0x3903b3c2L, 0xa7672661L, 0xd06016f7L,
-	0x4969474dL, 0x3e6e77dbL, 0xaed16a4aL, 0xd9d65adcL, 0x40df0b66L,
-	0x37d83bf0L, 0xa9bcae53L, 0xdebb9ec5L, 0x47b2cf7fL, 0x30b5ffe9L,
-	0xbdbdf21cL, 0xcabac28aL, 0x53b39330L, 0x24b4a3a6L, 0xbad03605L,
-	0xcdd70693L, 0x54de5729L, 0x23d967bfL, 0xb3667a2eL, 0xc4614ab8L,
-	0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL,
-	0x2d02ef8dL
-    };
+    for (; len >= 8; buf += 8, len -= 8) {
+	lower8(b, buf);
+	crc ^= (uint32_t)b[0] | (uint32_t)b[1] << 8
+	    | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
+	crc = crc32c_table[7][crc & 0xff] ^ crc32c_table[6][(crc >> 8) & 0xff]
+	    ^ crc32c_table[5][(crc >> 16) & 0xff] ^ crc32c_table[4][crc >> 24]
+	    ^ crc32c_table[3][b[4]] ^ crc32c_table[2][b[5]]
+	    ^ crc32c_table[1][b[6]] ^ crc32c_table[0][b[7]];
+    }
+    if (len >= 4) {
+	crc ^= (uint32_t)lower_table[buf[0]] | (uint32_t)lower_table[buf[1]] << 8
+	    | (uint32_t)lower_table[buf[2]] << 16
+	    | (uint32_t)lower_table[buf[3]] << 24;
+	crc = crc32c_table[3][crc & 0xff] ^ crc32c_table[2][(crc >> 8) & 0xff]
+	    ^ crc32c_table[1][(crc >> 16) & 0xff] ^ crc32c_table[0][crc >> 24];
+	buf += 4;
+	len -= 4;
+    }
+    while (len--)
+	crc = crc32c_table[0][(crc ^ lower_table[*buf++]) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffff;
+}
 
-    if (buf == NULL)
-	return 0L;
+#ifdef HAVE_HW_CRC32C
+__attribute__((target("sse4.2")))
+static unsigned int digest_sse42(const unsigned char *buf, int len)
+{
+    uint64_t crc = 0xffffffff;
+    uint64_t word;
 
-    crc = crc ^ 0xffffffffL;
-    if (len)
-	do {
-	    DO1(buf);
-	} while (--len);
-    return crc ^ 0xffffffffL;	/* (instead of ~c for 64-bit machines) */
+    for (; len >= 8; buf += 8, len -= 8) {
+	lower8((unsigned char *)&word, buf);
+	crc = _mm_crc32_u64(crc, word);
+    }
+    if (len >= 4) {
+	crc = _mm_crc32_u32((uint32_t)crc, (uint32_t)lower_table[buf[0]]
+			    | (uint32_t)lower_table[buf[1]] << 8
+			    | (uint32_t)lower_table[buf[2]] << 16
+			    | (uint32_t)lower_table[buf[3]] << 24);
+	buf += 4;
+	len -= 4;
+    }
+    while (len--)
+	crc = _mm_crc32_u8((uint32_t)crc, lower_table[*buf++]);
+    return (uint32_t)crc ^ 0xffffffff;
 }
-#endif				/* !BY_TOKEN_STRING */
+#endif
 
-static int encode_token(const char *token
-#ifndef BY_TOKEN_STRING
-			, const int token_length
+static void init_token_digest(void)
+{
+    uint32_t crc;
+    int i, j;
+
+    for (i = 0; i < 256; ++i) {
+	crc = i;
+	for (j = 0; j < 8; ++j)
+	    crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+	crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; ++i)
+	for (j = 1; j < 8; ++j)
+	    crc32c_table[j][i] = crc32c_table[0][crc32c_table[j - 1][i] & 0xff]
+		^ (crc32c_table[j - 1][i] >> 8);
+
+    ascii_tolower = TRUE;
+    for (i = 0; i < 256; ++i) {
+	lower_table[i] = (unsigned char)tolower(i);
+	if (lower_table[i] != ((i >= 'A' && i <= 'Z') ? i + 'a' - 'A' : i))
+	    ascii_tolower = FALSE;
+    }
+
+    digest_function = digest_slicing;
+#ifdef HAVE_HW_CRC32C
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+	digest_function = digest_sse42;
 #endif
-    )
+}
+
+static unsigned int token_digest(const unsigned char *buf, int len)
 {
-    struct search_text *p = text_tree;
-#ifndef BY_TOKEN_STRING
-    unsigned int token_crc32 = crc32_lower((const unsigned char *)token, token_length);
+    if (!digest_function)
+	init_token_digest();
+    return digest_function(buf, len);
+}
+
+/*
+** Returns the slot of the token in token_slots, or the free slot where
+** it would go. Tokens are the same if they have the same length and
+** CRC, which is all the quote index keeps of them.
+*/
+
+static unsigned *find_token_slot(const char *token, const int token_length,
+				 const unsigned int token_crc32)
+{
+    unsigned i = token_crc32 & token_slots_mask;
+    unsigned *slot;
+
+    while (*(slot = &token_slots[i])) {
+	const struct search_text *p = &tokens[*slot - 1];
+#ifdef BY_TOKEN_STRING
+	if (p->token_crc32 == token_crc32 && !strcasecmp(token, p->token))
+	    return slot;
+#else
+	if (p->token_crc32 == token_crc32 && p->token_length == token_length)
+	    return slot;
 #endif
-    int r;
-    while (1) {
-	if (!p) {
-	    return 0;
+	i = (i + 1) & token_slots_mask;
+    }
+    return slot;
+}
+
+static void grow_token_slots(void)
+{
+    unsigned size = token_slots ? 2 * (token_slots_mask + 1) : 4096;
+    unsigned i;
+
+    if (!digest_function)
+	init_token_digest();	/* before any thread of match_quotes() needs it */
+    free(token_slots);
+    token_slots = (unsigned *)calloc(size, sizeof(unsigned));
+    if (!token_slots) {
+	snprintf(errmsg, sizeof(errmsg), "Couldn't allocate %d bytes of memory.", (int)(size * sizeof(unsigned)));
+	progerr(errmsg);
+    }
+    token_slots_mask = size - 1;
+    for (i = 0; i < num_tokens; ++i) {
+	unsigned j = tokens[i].token_crc32 & token_slots_mask;
+	while (token_slots[j])
+	    j = (j + 1) & token_slots_mask;
+	token_slots[j] = i + 1;
+    }
+}
+
+/*
+** Adds a token that find_token_slot() didn't find to the dictionary.
+** The entry returned is only good until the next token is added.
+*/
+
+static struct search_text *new_token(const char *token, const int token_length,
+				     const unsigned int token_crc32,
+				     unsigned *slot)
+{
+    struct search_text *p;
+
+    if (num_tokens == tokens_space) {
+	tokens_space = tokens_space ? 2 * tokens_space : 4096;
+	tokens = (struct search_text *)realloc(tokens, tokens_space * sizeof(struct search_text));
+	if (!tokens) {
+	    snprintf(errmsg, sizeof(errmsg), "Couldn't allocate %d bytes of memory.", (int)(tokens_space * sizeof(struct search_text)));
+	    progerr(errmsg);
 	}
+    }
+    p = &tokens[num_tokens++];
+    memset(p, 0, sizeof(struct search_text));
 #ifdef BY_TOKEN_STRING
-	r = COMPARE_TOKEN(token, p);
+    strncpy(p->token, token, MAXSEARCHTOKEN);
+    p->token[MAXSEARCHTOKEN - 1] = 0;
 #else
-	r = token_length - p->token_length;
-	if (!r)
-			r = ((token_crc32 > p->token_crc32) ? 1 : (token_crc32 < p->token_crc32) ? -1 : 0);
+    p->token_length = token_length;
 #endif				/* !BY_TOKEN_STRING */
-	if (!r)
-	    return p->itok;
-	if (r < 0)
-	    p = p->left;
-	else
-	    p = p->right;
-    }
+    p->token_crc32 = token_crc32;
+    *slot = num_tokens;
+    if (2 * num_tokens > token_slots_mask)
+	grow_token_slots();
+    return p;
+}
+
+static int encode_token(const char *token, const int token_length)
+{
+    unsigned int token_crc32;
+    unsigned *slot;
+
+    if (!token_slots)
+	return 0;
+    token_crc32 = token_digest((const unsigned char *)token, token_length);
+    slot = find_token_slot(token, token_length, token_crc32);
+    return *slot ? tokens[*slot - 1].itok : 0;
 }
 
 static int b_times_entered;
 static int b_loops_done;
 
+/*
+** The quote index is only kept by incremental runs that have the
+** usebinindex index, and it stores message numbers, not names, and
+** bigrams, not shingles.
+*/
+
+static int use_quote_index(void)
+{
+#ifdef BY_TOKEN_STRING
+    return FALSE;
+#else
+    return set_usebinindex && set_linkquotes && !set_nonsequential
+	&& set_linkquotes_method != LINKQUOTES_SHINGLES;
+#endif
+}
+
 static int addb(const char *token, struct body *bp)
 {
-    struct search_text **pp = &text_tree;
-    struct search_text *p = *pp;
-    int r;
-#ifndef BY_TOKEN_STRING
     int token_length = strlen(token);
-    unsigned int token_crc32 = crc32_lower((const unsigned char *)token, token_length);
-#endif
-    static struct search_text *next_token = NULL;
-    if (!text_tree) {
-	next_token = (struct search_text *)malloc(max_tokens * sizeof(struct search_text));
-	if (!next_token) {
-	    snprintf(errmsg, sizeof(errmsg), "Couldn't allocate %d bytes of memory.", max_tokens * sizeof(struct search_text));
-	    progerr(errmsg);
-	}
-	memset(next_token, 0, max_tokens * sizeof(struct search_text));
-    }
+    unsigned int token_crc32 = token_digest((const unsigned char *)token, token_length);
+    struct search_text *p;
+    unsigned *slot;
+
     ++b_times_entered;
-    while (1) {
-	++b_loops_done;
-	p = *pp;
-	if (!p) {
-	    *pp = p = next_token++;
-	    if (next_token >= text_tree + max_tokens) {
-		snprintf(errmsg, sizeof(errmsg), "Too many distinct tokens(%d)", max_tokens);
-		progerr(errmsg);
-	    }
-	    p->left = p->right = NULL;
-#ifdef BY_TOKEN_STRING
-	    strncpy(p->token, token, MAXSEARCHTOKEN);
-	    p->token[MAXSEARCHTOKEN - 1] = 0;
-#else
-	    p->token_length = token_length;
-	    p->token_crc32 = token_crc32;
-#endif				/* !BY_TOKEN_STRING */
-	    p->itok = reverse_bits(next_itoken++);
+    if (!token_slots)
+	grow_token_slots();
+    slot = find_token_slot(token, token_length, token_crc32);
+    if (*slot) {
+	p = &tokens[*slot - 1];
 #ifdef COUNT_TOKEN_FREQ
-	    p->count = 1;
+	++p->count;
 #endif
-	    if (!next_itoken >= max_tokens) {
-		snprintf(errmsg, sizeof(errmsg), "Internal error - too many distinct tokens.");
-		progerr(errmsg);
-	    }
-	    return p->itok;
-	}
-	r = COMPARE_TOKEN(token, p);
-	if (!r) {
+	return p->itok;
+    }
+    p = new_token(token, token_length, token_crc32, slot);
+    p->itok = reverse_bits(next_itoken++);
 #ifdef COUNT_TOKEN_FREQ
-	    ++p->count;
+    p->count = 1;
 #endif
-	    return p->itok;
-	}
-	if (r < 0)
-	    pp = &p->left;
-	else
-	    pp = &p->right;
-    }
+    return p->itok;
 }
 
 static int bi_times_entered;
 
 
-static void add_bigram(BIGRAM_TYPE b1, BIGRAM_TYPE b2, struct body *bp, char *ptr)
+static unsigned bigram_hash(BIGRAM_TYPE b1, BIGRAM_TYPE b2)
 {
-    static struct bigram_tree_entry *next_bigram = NULL;
-    struct bigram_tree_entry **pp = &bigram_tree;
-    struct bigram_tree_entry *p = *pp;
-    int r;
-    if (!bigram_tree) {
-	if (0)
-	    printf("bigram_count %d\n\n", bigram_count);
-		bigram_tree = (struct bigram_tree_entry *)malloc(bigram_count * sizeof(struct bigram_tree_entry));
-	if (!bigram_tree) {
-			snprintf(errmsg, sizeof(errmsg), "Couldn't allocate %d bytes of memory.", bigram_count * sizeof(struct bigram_tree_entry));
+    uint64_t h = ((uint64_t)b1 * 0x9e3779b97f4a7c15ULL + b2) * 0x9e3779b97f4a7c15ULL;
+    return (unsigned)(h >> 32);
+}
+
+static struct bigram_entry *find_bigram_slot(BIGRAM_TYPE b1, BIGRAM_TYPE b2)
+{
+    unsigned i = bigram_hash(b1, b2) & bigram_slots_mask;
+    struct bigram_entry *p;
+    while ((p = &bigram_slots[i])->count
+	   && (p->bigram1 != b1 || p->bigram2 != b2))
+	i = (i + 1) & bigram_slots_mask;
+    return p;
+}
+
+static void grow_bigram_slots(void)
+{
+    struct bigram_entry *old = bigram_slots;
+    unsigned old_size = old ? bigram_slots_mask + 1 : 0;
+    unsigned size = old ? 2 * old_size : 1024;
+    unsigned i;
+
+    bigram_slots = (struct bigram_entry *)emalloc(size * sizeof(struct bigram_entry));
+    memset(bigram_slots, 0, size * sizeof(struct bigram_entry));
+    bigram_slots_mask = size - 1;
+    tree_alloc = size * sizeof(struct bigram_entry);
+    for (i = 0; i < old_size; ++i) {
+	if (old[i].count) {
+	    struct bigram_entry *p = find_bigram_slot(old[i].bigram1, old[i].bigram2);
+	    *p = old[i];
+	    p->first = old[i].first = (uint32_t)(p - bigram_slots);	/* see add_bigram() */
+	}
+    }
+    /* the postings collected so far move with their bigrams */
+    for (i = 0; i < num_postings; ++i)
+	new_postings[i].entry = old[new_postings[i].entry].first;
+    if (old)
+	free(old);
+}
+
+static void add_bigram(BIGRAM_TYPE b1, BIGRAM_TYPE b2, int msgnum, uint32_t line, uint32_t offset)
+{
+    struct bigram_entry *p;
+    struct new_posting *np;
+    if (num_postings == new_postings_space) {
+	/* add_search_text() has counted them */
+	new_postings_space = num_postings < (unsigned)bigram_count ? (unsigned)bigram_count : 2 * num_postings + 1;
+	new_postings = (struct new_posting *)realloc(new_postings, new_postings_space * sizeof(struct new_posting));
+	if (!new_postings) {
+	    snprintf(errmsg, sizeof(errmsg), "Couldn't allocate %lu bytes of memory.",
+		     (unsigned long)(new_postings_space * sizeof(struct new_posting)));
 	    progerr(errmsg);
 	}
-		memset(bigram_tree, 0, bigram_count * sizeof(struct bigram_tree_entry));
-	next_bigram = bigram_tree;
     }
+    if (!bigram_slots || 2 * (num_bigrams + 1) > bigram_slots_mask + 1)
+	grow_bigram_slots();
     ++bi_times_entered;
-    while (1) {
-	p = *pp;
-	if (!p) {
-	    *pp = p = next_bigram++;
-	    tree_alloc += sizeof(struct bigram_tree_entry);
-	    p->bigram1 = b1;
-	    p->bigram2 = b2;
-	    p->left = p->right = NULL;
-	    p->list.offset = ptr - bp->line;
-	    p->list.bp = bp;
-	    p->list.next = NULL;
-	    return;
-	}
-	r = p->bigram1 - b1;
-	if (!r && !(r = p->bigram2 - b2)) {
-	    struct bigram_list *old = p->list.next;
-	    p->list.next = (struct bigram_list *)next_bigram++;
-	    p->list.next->next = old;
-	    p->list.next->offset = p->list.offset;
-	    p->list.next->bp = p->list.bp;
-	    p->list.offset = ptr - bp->line;
-	    p->list.bp = bp;
-	    return;
-	}
-	if (r < 0)
-	    pp = &p->left;
-	else
-	    pp = &p->right;
+    p = find_bigram_slot(b1, b2);
+    if (!p->count) {
+	p->bigram1 = b1;
+	p->bigram2 = b2;
+	++num_bigrams;
     }
+    ++p->count;
+    /* until finish_bigrams(), first is the slot itself, for
+       grow_bigram_slots() to know where a bigram went */
+    p->first = (uint32_t)(p - bigram_slots);
+    np = &new_postings[num_postings++];
+    np->entry = p->first;
+    np->posting.msgnum = msgnum;
+    np->posting.line = line;
+    np->posting.offset = offset;
 }
 
-static struct bigram_list *find_bigram(BIGRAM_TYPE b1, BIGRAM_TYPE b2)
+/*
+** Sorts the postings add_bigram() collected into the slices of their
+** bigrams, keeping the order they came in.
+*/
+
+static void finish_bigrams(void)
 {
-    struct bigram_tree_entry *p = bigram_tree;
-    int r;
-    while (1) {
-	if (!p) {
-	    return NULL;
-	}
-	r = p->bigram1 - b1;
-	if (!r)
-	    r = p->bigram2 - b2;
-	if (!r) {
-	    return &p->list;
-	}
-	if (r < 0)
-	    p = p->left;
-	else
-	    p = p->right;
+    uint32_t next = 0;
+    unsigned i;
+    if (!new_postings)
+	return;
+    for (i = 0; i <= bigram_slots_mask; ++i) {
+	bigram_slots[i].first = next;
+	next += bigram_slots[i].count;
+	bigram_slots[i].count = 0;
+    }
+    bigram_postings = (struct bigram_posting *)emalloc((num_postings + 1) * sizeof(struct bigram_posting));
+    for (i = 0; i < num_postings; ++i) {
+	struct bigram_entry *p = &bigram_slots[new_postings[i].entry];
+	bigram_postings[p->first + p->count++] = new_postings[i].posting;
     }
+    free(new_postings);
+    new_postings = NULL;
+}
+
+static const struct bigram_entry *find_bigram(BIGRAM_TYPE b1, BIGRAM_TYPE b2)
+{
+    const struct bigram_entry *p;
+    if (!bigram_postings)
+	return NULL;
+    p = find_bigram_slot(b1, b2);
+    return p->count ? p : NULL;
+}
+
+/* the line of a body a posting is in */
+static struct body *posting_line(const struct bigram_posting *p)
+{
+    return body_lines[msg_first_line[p->msgnum - lines_from_msgnum] + p->line];
 }
 
 static struct body *next_body_pos(struct body *bp, char **ptr)
@@ -464,6 +634,20 @@ static void add_search_text(struct body *bp, int msgnum)
 		printf("avg b %d avg bi %d (%d) msgnum %d %d allocated %d elapsed %ld\n", b_loops_done / b_times_entered, 0, bi_times_entered, msgnum, tree_alloc / 1024, time(NULL) - start_time, next_itoken);
 }
 
+static void add_body_line(struct body *bp)
+{
+    if (num_body_lines == body_lines_space) {
+	body_lines_space = body_lines_space ? 2 * body_lines_space : 4096;
+	body_lines = (struct body **)realloc(body_lines, body_lines_space * sizeof(struct body *));
+	if (!body_lines) {
+	    snprintf(errmsg, sizeof(errmsg), "Couldn't allocate %lu bytes of memory.",
+		     (unsigned long)(body_lines_space * sizeof(struct body *)));
+	    progerr(errmsg);
+	}
+    }
+    body_lines[num_body_lines++] = bp;
+}
+
 static void add_bigrams(struct body *bp, int msgnum)
 {
     int last_itok = 0;
@@ -474,12 +658,20 @@ static void add_bigrams(struct body *bp, int msgnum)
     char *ptr = bp->line;
     char token[MAXLINE];
     int itok;
+    struct body *line_bp = bp;
+    uint32_t line = 0;
     if (!start_time)
 	start_time = time(NULL);
+    msg_first_line[msgnum - lines_from_msgnum] = num_body_lines;
+    add_body_line(bp);
 	while ((bp = tokenize_body(bp, token, &ptr, &bigram_index, TRUE)) != NULL) {
 	itok = ENCODE_TOKEN(token);
+	for (; line_bp != bp; line_bp = line_bp->next) {
+	    add_body_line(line_bp->next);
+	    ++line;
+	}
 	if (last_itok)
-	    add_bigram(last_itok, itok, bp, ptr);
+	    add_bigram(last_itok, itok, msgnum, line, ptr - bp->line);
 	bp->msgnum = msgnum;
 	last_itok = itok;
     }
@@ -487,6 +679,121 @@ static void add_bigrams(struct body *bp, int msgnum)
 		printf("avg b %d msgnum %d %d allocated %d elapsed %ld\n", b_loops_done / b_times_entered, msgnum, tree_alloc / 1024, time(NULL) - start_time, next_itoken);
 }
 
+/*
+** The shingle matcher, for linkquotes_method 1. A shingle is a run of
+** SHINGLE_TOKENS tokens, hashed with a rolling hash of the digests of
+** its tokens, so it doesn't matter where the lines break. Of each
+** SHINGLE_WINDOW shingles in a row of a body, the one with the lowest
+** hash is kept as a fingerprint (winnowing), so any run of
+** SHINGLE_TOKENS + SHINGLE_WINDOW - 1 tokens a quote shares with a body
+** shares a fingerprint with it. The fingerprints go in the bigram
+** postings table, at the place of the first bigram of their shingle,
+** and search_shingles() looks up every shingle of a quote in it: the
+** messages most of them lead to are tried with check_match().
+*/
+
+#define SHINGLE_TOKENS 3
+#define SHINGLE_WINDOW 4
+#define SHINGLE_BASE 0x100000001b3ULL	/* odd, for the rolling hash */
+#define SHINGLE_MAX_QUERY 48		/* tokens of a quote looked at */
+#define SHINGLE_MAX_POSTINGS 256	/* places of one shingle tried */
+#define SHINGLE_CANDIDATES 4		/* messages check_match() tries */
+
+struct shingle_token {
+    uint64_t digest;
+    uint32_t line;		/* where the token ends */
+    uint32_t offset;
+};
+
+static uint64_t shingle_base_power(void)
+{
+    uint64_t power = 1;
+    int i;
+    for (i = 1; i < SHINGLE_TOKENS; ++i)
+	power *= SHINGLE_BASE;
+    return power;
+}
+
+static uint64_t shingle_digest(const char *token)
+{
+    /* never 0, so that a run of unknown tokens still hashes apart */
+    return (uint64_t)token_digest((const unsigned char *)token, strlen(token)) + 1;
+}
+
+/* the rolling hash mixed up, so that the lowest of a window is random */
+static uint64_t shingle_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static void add_shingles(struct body *bp, int msgnum)
+{
+    struct shingle_token ring[SHINGLE_TOKENS];
+    uint64_t window[SHINGLE_WINDOW];
+    struct shingle_token at[SHINGLE_WINDOW];	/* where each shingle's first bigram ends */
+    uint64_t power = shingle_base_power();
+    uint64_t h = 0;
+    long count = 0;		/* tokens seen */
+    long kept = -1;		/* the shingle last kept */
+    int bigram_index = 0;
+    char *ptr = bp->line;
+    char token[MAXLINE];
+    struct body *line_bp = bp;
+    uint32_t line = 0;
+
+    msg_first_line[msgnum - lines_from_msgnum] = num_body_lines;
+    add_body_line(bp);
+    while ((bp = tokenize_body(bp, token, &ptr, &bigram_index, TRUE)) != NULL) {
+	struct shingle_token *t = &ring[count % SHINGLE_TOKENS];
+	for (; line_bp != bp; line_bp = line_bp->next) {
+	    add_body_line(line_bp->next);
+	    ++line;
+	}
+	bp->msgnum = msgnum;
+	if (count >= SHINGLE_TOKENS)
+	    h -= t->digest * power;
+	t->digest = shingle_digest(token);
+	t->line = line;
+	t->offset = ptr - bp->line;
+	h = h * SHINGLE_BASE + t->digest;
+	if (++count >= SHINGLE_TOKENS) {
+	    long shingle = count - SHINGLE_TOKENS;
+	    int i;
+	    int lowest;
+	    window[shingle % SHINGLE_WINDOW] = shingle_mix(h);
+	    at[shingle % SHINGLE_WINDOW] = ring[(shingle + 1) % SHINGLE_TOKENS];
+	    if (shingle < SHINGLE_WINDOW - 1)
+		continue;
+	    /* the lowest of the window, the rightmost of equal ones */
+	    lowest = shingle % SHINGLE_WINDOW;
+	    for (i = 1; i < SHINGLE_WINDOW; ++i) {
+		int j = (int)((shingle - i) % SHINGLE_WINDOW);
+		if (window[j] < window[lowest])
+		    lowest = j;
+	    }
+	    for (i = 0; i < SHINGLE_WINDOW; ++i)
+		if ((shingle - i) % SHINGLE_WINDOW == lowest)
+		    break;
+	    if (shingle - i != kept) {
+		kept = shingle - i;
+		add_bigram(window[lowest], 0, msgnum, at[lowest].line, at[lowest].offset);
+	    }
+	}
+    }
+    if (count >= SHINGLE_TOKENS && count - SHINGLE_TOKENS < SHINGLE_WINDOW - 1) {
+	/* too short for a whole window */
+	int lowest = 0;
+	int i;
+	for (i = 1; i <= count - SHINGLE_TOKENS; ++i)
+	    if (window[i] <= window[lowest])
+		lowest = i;
+	add_bigram(window[lowest], 0, msgnum, at[lowest].line, at[lowest].offset);
+    }
+}
+
 static void add_old_replies()
 {
     struct reply *rp;
@@ -521,6 +828,25 @@ static void find_replyto_from_html(int num)
     struct emailinfo *ep;
     if (!hashnumlookup(num, &ep))
 	return;
+    if (ep->reply_links[0] == REPLY_UNKNOWN && read_reply_links(ep)
+	&& (ep->flags & FROM_INDEX)) {
+	ep->flags |= STORE_LINK;	/* so the next run needn't read it */
+	++num_reply_updates;
+    }
+    if (ep->reply_links[0] != REPLY_UNKNOWN) {
+	int i;
+	for (i = 0; i < 2 && ep->reply_links[i] != -1; i++) {
+#ifdef FASTREPLYCODE
+	    struct emailinfo *email2;
+	    if (hashnumlookup(ep->reply_links[i], &email2))
+		replylist_tmp = addreply2(replylist_tmp, email2, ep, 0, NULL);
+#else
+	    replylist_tmp = addreply(replylist_tmp, ep->reply_links[i], ep, 0, NULL);
+#endif
+	}
+	return;
+    }
+    /* a page with more links than the index keeps */
     filename = articlehtmlfilename(ep);
     if ((fp = fopen(filename, "r")) != NULL) {
 	while (fgets(line, MAXLINE, fp)) {
@@ -545,14 +871,35 @@ static void find_replyto_from_html(int num)
     free(filename);
 }
 
+#ifdef COUNT_TOKEN_FREQ
+static void print_count(void)
+{
+    unsigned i;
+    for (i = 0; i < num_tokens; ++i)
+#ifdef BY_TOKEN_STRING
+	printf("%d\t%s\n", tokens[i].count, tokens[i].token);
+#else
+	printf("%d\t%lu\n", tokens[i].count, (unsigned long)tokens[i].itok);
+#endif
+}
+#endif
+
 void analyze_headers(int max_num)
 {
     int i;
-    int min_search_msgnum = 0;
+    int min_search_msgnum;
     int num = max_num;
 
-	if (set_searchbackmsgnum > 0 && set_increment && num - set_searchbackmsgnum > min_search_msgnum)
-	min_search_msgnum = num - set_searchbackmsgnum;
+    search_from_msgnum = 0;
+	if (set_searchbackmsgnum > 0 && set_increment && num - set_searchbackmsgnum > search_from_msgnum)
+	search_from_msgnum = num - set_searchbackmsgnum;
+
+    /* the messages in the quote index are searched there */
+    min_search_msgnum = search_from_msgnum;
+#ifndef BY_TOKEN_STRING
+    if (quote_index && quoteindex_covered(quote_index) >= min_search_msgnum)
+	min_search_msgnum = quoteindex_covered(quote_index) + 1;
+#endif
 
     for (i = 0; i < num; ++i)
 	find_replyto_from_html(i);
@@ -564,25 +911,25 @@ void analyze_headers(int max_num)
 	    add_search_text(ep->bodylist, i);
 	}
     }
+    lines_from_msgnum = min_search_msgnum;
+    if (num > min_search_msgnum)
+	msg_first_line = (uint32_t *)emalloc((num - min_search_msgnum) * sizeof(uint32_t));
     for (i = min_search_msgnum; i < num; ++i) {
 	struct emailinfo *ep;
-	if (hashnumlookup(i, &ep) && ep->bodylist)
+	if (!hashnumlookup(i, &ep) || !ep->bodylist)
+	    ;
+	else if (set_linkquotes_method == LINKQUOTES_SHINGLES)
+	    add_shingles(ep->bodylist, i);
+	else
 	    add_bigrams(ep->bodylist, i);
 	if (set_showprogress)
 	    printf("\b\b\b\b%4d articles.\n", i);
     }
-    add_old_replies();
-}
-
-static void print_count(struct search_text *t)
-{
-    if (t->left)
-	print_count(t->left);
+    finish_bigrams();
 #ifdef COUNT_TOKEN_FREQ
-    printf("%d\t%s\n", t->count, t->token);
+    print_count();
 #endif
-    if (t->right)
-	print_count(t->right);
+    add_old_replies();
 }
 
 static int better_match(struct body *bp, const char *matched_string, const char *last_matched_string)
@@ -610,7 +957,7 @@ static int better_match(struct body *bp, const char *matched_string, const char
     return 0;
 }
 
-static void check_match(struct bigram_list *bigram, struct body *bp, char *ptr, int max_msgnum, String_Match * match_info, const char *match_start_ptr, const char *exact_line)
+static void check_match(int msgnum, struct body *match_bp, uint32_t match_offset, struct body *bp, char *ptr, int max_msgnum, String_Match * match_info, const char *match_start_ptr, const char *exact_line)
 {
     int match_len = 1;
     int alloc_len = 0;
@@ -624,10 +971,9 @@ static void check_match(struct bigram_list *bigram, struct body *bp, char *ptr,
     char token3[MAXLINE];
     int b2_index = 0;
     int b_index = 0;
-    int msgnum = bigram->bp->msgnum;
-    bp3 = bigram->bp;
+    bp3 = match_bp;
     if (msgnum < max_msgnum && bp3) {
-	ptr3 = bp3->line + bigram->offset;
+	ptr3 = bp3->line + match_offset;
 	while (1) {
 	    bp2 = tokenize_body(bp2, token2, &ptr2, &b2_index, TRUE);
 	    bp3 = tokenize_body(bp3, token3, &ptr3, &b_index, TRUE);
@@ -659,19 +1005,19 @@ static void check_match(struct bigram_list *bigram, struct body *bp, char *ptr,
 	    match_info->match_len_tokens = match_len;
 	    match_info->match_len_bytes = match_len_bytes;
 	    match_info->msgnum = msgnum;
-	    match_info->start_match = bigram->bp->line + bigram->offset;
+	    match_info->start_match = match_bp->line + match_offset;
 	    match_info->stop_match = ptr3;
 	    if (match_info->last_matched_string)
 		free(match_info->last_matched_string);
-	    match_len = strlen(bigram->bp->line);
+	    match_len = strlen(match_bp->line);
 	    alloc_len = match_len + 1000;
 	    match_info->last_matched_string = (char *)emalloc(alloc_len);
-	    strcpy(match_info->last_matched_string, bigram->bp->line);
+	    strcpy(match_info->last_matched_string, match_bp->line);
 	    if (!strchr(match_info->last_matched_string, '\n')) {
 		strcat(match_info->last_matched_string + match_len, "\n");
 		++match_len;
 	    }
-	    for (bp3 = bigram->bp->next; bp3; bp3 = bp3->next) {
+	    for (bp3 = match_bp->next; bp3; bp3 = bp3->next) {
 		char *p = match_info->last_matched_string;
 		int add_len = strlen(bp3->line);
 				if (match_len + add_len + 2 > alloc_len) {
@@ -684,8 +1030,180 @@ static void check_match(struct bigram_list *bigram, struct body *bp, char *ptr,
 					strcat(match_info->last_matched_string + match_len++, "\n");
 	    }
 	    if (0)
-				printf("%d +++ %s; %s\nbp->line %s\n", bigram->bp->msgnum, match_info->last_matched_string, match_info->stop_match, bp->line);
+				printf("%d +++ %s; %s\nbp->line %s\n", match_bp->msgnum, match_info->last_matched_string, match_info->stop_match, bp->line);
+	}
+    }
+}
+
+#ifndef BY_TOKEN_STRING
+
+/*
+** The body of an old message that has a posting in the quote index,
+** read back from its page the first time it is needed. The threads of
+** match_quotes() take turns at it.
+*/
+
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t old_body_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static struct body *old_body(int msgnum)
+{
+    struct emailinfo *ep;
+    struct body *bp = NULL;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&old_body_lock);
+#endif
+    if (hashnumlookup(msgnum, &ep)) {
+	bp = ep->bodylist;
+	if (!(ep->flags & BODY_READ)) {
+	    ep->flags |= BODY_READ;
+	    if (bp && !bp->line[0] && !bp->next)
+		parse_old_html(ep->msgnum, ep, TRUE, FALSE, NULL, 0);
+	    for (bp = ep->bodylist; bp != NULL; bp = bp->next)
+		bp->msgnum = ep->msgnum;
 	}
+	bp = ep->bodylist;
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&old_body_lock);
+#endif
+    return bp;
+}
+
+/*
+** Tries the places of a bigram that are in the quote index, from the
+** newest to the first message searchbackmsgnum allows. Returns FALSE
+** if there are none.
+*/
+
+static int search_quote_index(BIGRAM_TYPE b1, BIGRAM_TYPE b2, struct body *bp, char *ptr, int max_msgnum, String_Match * match_info, const char *match_start_ptr, const char *exact_line, int search_len)
+{
+    const struct quote_posting *p;
+    struct body *line_bp;
+    uint32_t i;
+    int found = FALSE;
+    for (p = quoteindex_lookup(quote_index, b1, b2); p && p->msgnum >= search_from_msgnum; p = quoteindex_next(quote_index, p)) {
+	found = TRUE;
+	if (p->msgnum >= max_msgnum || (line_bp = old_body(p->msgnum)) == NULL)
+	    continue;
+	for (i = 0; line_bp && i < p->line; ++i)
+	    line_bp = line_bp->next;
+	if (!line_bp || p->offset > strlen(line_bp->line))
+	    continue;		/* the page has changed since */
+	check_match(p->msgnum, line_bp, p->offset, bp, ptr, max_msgnum, match_info, match_start_ptr, exact_line);
+	if (match_info->match_len_bytes == search_len)
+	    break;
+    }
+    return found;
+}
+
+#endif				/* !BY_TOKEN_STRING */
+
+struct shingle_candidate {
+    int msgnum;
+    int votes;			/* shingles of the quote it has */
+    int last_voted;		/* the shingle of the quote it last had */
+    const struct bigram_posting *posting;	/* the first one */
+    int token;			/* of the quote, where that shingle starts */
+};
+
+/*
+** Finds the source of a quote by its shingles, leaving check_match()'s
+** results in match_info.
+*/
+
+static void search_shingles(char *search_line, char *exact_line, int max_msgnum, String_Match *match_info, const char *stop_ptr)
+{
+    uint64_t digests[SHINGLE_MAX_QUERY];
+    char *after[SHINGLE_MAX_QUERY];	/* where each token ends */
+    char *exact_after[SHINGLE_MAX_QUERY];
+    struct shingle_candidate candidates[64];
+    int num_candidates = 0;
+    uint64_t power = shingle_base_power();
+    uint64_t h = 0;
+    char token[MAXLINE];
+    char *ptr = search_line;
+    char *exact_ptr = exact_line;
+    int dummy = 0;
+    int count = 0;
+    int i;
+    struct body *bp;
+    struct body b;
+
+    b.line = search_line;
+    b.next = NULL;
+    bp = &b;
+    while (count < SHINGLE_MAX_QUERY
+	   && (bp = tokenize_body(bp, token, &ptr, &dummy, TRUE)) != NULL) {
+	digests[count] = shingle_digest(token);
+	after[count] = ptr;
+	exact_after[count] = exact_ptr;
+	tokenize_body(bp, token, &exact_ptr, &dummy, TRUE);
+	++count;
+    }
+    for (i = 0; i < count; ++i) {
+	const struct bigram_entry *fingerprint;
+	const struct bigram_posting *p;
+	int tried = 0;
+	if (i >= SHINGLE_TOKENS)
+	    h -= digests[i - SHINGLE_TOKENS] * power;
+	h = h * SHINGLE_BASE + digests[i];
+	if (i < SHINGLE_TOKENS - 1)
+	    continue;
+	if ((fingerprint = find_bigram(shingle_mix(h), 0)) == NULL)
+	    continue;
+	/* the newest first, as search_for_quote() tries them */
+	for (p = bigram_postings + fingerprint->first + fingerprint->count;
+	     p-- > bigram_postings + fingerprint->first && tried < SHINGLE_MAX_POSTINGS; ++tried) {
+	    int start = i - (SHINGLE_TOKENS - 1);
+	    int j;
+	    if (p->msgnum >= max_msgnum || p->msgnum < search_from_msgnum)
+		continue;
+	    for (j = 0; j < num_candidates && candidates[j].msgnum != p->msgnum; ++j)
+		;
+	    if (j < num_candidates) {
+		if (candidates[j].last_voted != i) {
+		    candidates[j].last_voted = i;
+		    ++candidates[j].votes;
+		}
+		continue;
+	    }
+	    if (num_candidates == sizeof(candidates) / sizeof(candidates[0]))
+		continue;
+	    /* only the places a match could start from, as with bigrams */
+	    if ((start ? after[start - 1] : search_line) > stop_ptr)
+		continue;
+	    candidates[num_candidates].msgnum = p->msgnum;
+	    candidates[num_candidates].votes = 1;
+	    candidates[num_candidates].last_voted = i;
+	    candidates[num_candidates].posting = p;
+	    candidates[num_candidates].token = start;
+	    ++num_candidates;
+	}
+    }
+    /* the ones with the most shingles, the newest of equal ones */
+    for (i = 0; i < num_candidates && i < SHINGLE_CANDIDATES; ++i) {
+	struct shingle_candidate best = candidates[i];
+	int start;
+	int j;
+	for (j = i + 1; j < num_candidates; ++j) {
+	    if (candidates[j].votes > best.votes
+		|| (candidates[j].votes == best.votes && candidates[j].msgnum > best.msgnum)) {
+		candidates[i] = candidates[j];
+		candidates[j] = best;
+		best = candidates[i];
+	    }
+	}
+	/* as search_for_quote() would call it for the first bigram of
+	   the shingle */
+	start = best.token;
+	check_match(best.msgnum, posting_line(best.posting), best.posting->offset,
+		    &b, after[start + 1], max_msgnum, match_info,
+		    start ? after[start - 1] : search_line,
+		    start ? exact_after[start - 1] : exact_line);
+	if (match_info->match_len_bytes == (int)strlen(search_line))
+	    break;
     }
 }
 
@@ -700,9 +1218,6 @@ int search_for_quote(char *search_line, char *exact_line, int max_msgnum, String
     int last_itok = 0;
     int search_len = strlen(search_line);
 	const char *stop_ptr = search_line + (search_len >= 80 ? 40 : (search_len + 1) / 2);
-    static int count_tokens = 0;
-    static int count_matches = 0;
-    static int count_searched = 0;
     const char *match_start_ptr = ptr;
     const char *next_match_start_ptr;
     char *next_exact_ptr;
@@ -719,25 +1234,34 @@ int search_for_quote(char *search_line, char *exact_line, int max_msgnum, String
     bp = tokenize_body(&b, token, &ptr, &dummy, TRUE);
     if (!bp)
 	return -1;
-    ++count_searched;
     last_itok = ENCODE_TOKEN(token);
     next_match_start_ptr = ptr;
     next_exact_ptr = exact_line;
 
-    while ((bp = tokenize_body(bp, token, &ptr, &dummy, TRUE)) != NULL) {
+    if (set_linkquotes_method == LINKQUOTES_SHINGLES)
+	search_shingles(search_line, exact_line, max_msgnum, match_info, stop_ptr);
+    else while ((bp = tokenize_body(bp, token, &ptr, &dummy, TRUE)) != NULL) {
 	int itok = ENCODE_TOKEN(token);
-	struct bigram_list *bigram;
+	const struct bigram_entry *bigram;
+	int found;
 	bigram = find_bigram(last_itok, itok);
-	if (!bigram)
-			printf("Warning, internal inconsistency in search_for_quote:\n(%d,%d) %s %d best %d, msg %d %s || %s\n", last_itok, itok, token, dummy, match_info->match_len_tokens, max_msgnum, ptr, search_line);
-	++count_tokens;
-	while (bigram) {
-	    ++count_matches;
-			check_match(bigram, bp, ptr, max_msgnum, match_info, match_start_ptr, exact_line);
-	    if (match_info->match_len_bytes == search_len)
-		break;
-	    bigram = bigram->next;
+	found = (bigram != NULL);
+	if (bigram) {
+	    /* the newest first */
+	    const struct bigram_posting *p = bigram_postings + bigram->first + bigram->count;
+	    while (p-- > bigram_postings + bigram->first) {
+		check_match(p->msgnum, posting_line(p), p->offset, bp, ptr, max_msgnum, match_info, match_start_ptr, exact_line);
+		if (match_info->match_len_bytes == search_len)
+		    break;
+	    }
 	}
+#ifndef BY_TOKEN_STRING
+	if (quote_index && match_info->match_len_bytes != search_len
+	    && search_quote_index(last_itok, itok, bp, ptr, max_msgnum, match_info, match_start_ptr, exact_line, search_len))
+	    found = TRUE;
+#endif
+	if (!found)
+			printf("Warning, internal inconsistency in search_for_quote:\n(%d,%d) %s %d best %d, msg %d %s || %s\n", last_itok, itok, token, dummy, match_info->match_len_tokens, max_msgnum, ptr, search_line);
 		if (match_info->last_matched_string != NULL && strlen(match_info->last_matched_string) > search_len / 2)
 	    break;
 	if (ptr > stop_ptr)	/* very little chance of improving match */
@@ -749,8 +1273,6 @@ int search_for_quote(char *search_line, char *exact_line, int max_msgnum, String
 	exact_line = next_exact_ptr;
 	tokenize_body(bp, token, &next_exact_ptr, &dummy, TRUE);
     }
-    if (0)
-		printf("%d times %d searches %d tokens %d matches tries %f\n", max_msgnum, count_searched, count_tokens, count_matches, (float)count_matches / count_tokens);
     len = match_info->match_len_bytes;
     if (max_msgnum == -1)
 		printf("best_match_len %d (%d) len %d search_len %d %d; %s.\n", match_info->match_len_tokens, match_info->msgnum, len, search_len, match_info->match_len_bytes, match_info->last_matched_string);
@@ -770,3 +1292,118 @@ int search_for_quote(char *search_line, char *exact_line, int max_msgnum, String
     match_info->msgnum = -1;
     return FALSE;
 }
+
+/*
+** Maps the quote index of an archive whose last message is max_num,
+** see quoteindex.c. The token dictionary gets back the numbers it had,
+** so the postings can be looked up.
+*/
+
+void load_quote_index(char *dir, int max_num)
+{
+#ifndef BY_TOKEN_STRING
+    const struct quote_token *old_tokens;
+    int count;
+    int i;
+    if (!use_quote_index() || !set_increment || quote_index)
+	return;
+    if ((quote_index = quoteindex_map(dir)) == NULL)
+	return;
+    if (quoteindex_covered(quote_index) != max_num || num_tokens) {
+	quoteindex_unmap(quote_index);
+	quote_index = NULL;
+	return;
+    }
+    old_tokens = quoteindex_tokens(quote_index, &count);
+    if (!token_slots)
+	grow_token_slots();
+    for (i = 0; i < count; ++i) {
+	unsigned *slot = find_token_slot(NULL, old_tokens[i].length, old_tokens[i].crc32);
+	if (!*slot)
+	    new_token(NULL, old_tokens[i].length, old_tokens[i].crc32, slot)->itok = old_tokens[i].itok;
+    }
+    num_old_tokens = num_tokens;
+    next_itoken = quoteindex_next_itok(quote_index);
+#endif
+}
+
+int quote_index_loaded(void)
+{
+#ifndef BY_TOKEN_STRING
+    return quote_index != NULL;
+#else
+    return FALSE;
+#endif
+}
+
+#ifndef BY_TOKEN_STRING
+
+/*
+** Adds the postings of a message, read from its page the way a later
+** run would read it back.
+*/
+
+static void index_message(int msgnum)
+{
+    struct emailinfo *ep;
+    struct emailinfo copy;
+    struct body *dummy;
+    struct body *lp = NULL;
+    struct body *bp;
+    struct body *line_bp;
+    char *ptr;
+    char token[MAXLINE];
+    int bigram_index = 0;
+    BIGRAM_TYPE itok;
+    BIGRAM_TYPE last_itok = 0;
+    uint32_t line = 0;
+
+    if (!hashnumlookup(msgnum, &ep))
+	return;
+    copy = *ep;
+    copy.bodylist = dummy = addbody(NULL, &lp, "\0", 0);
+    parse_old_html(msgnum, &copy, TRUE, FALSE, NULL, 0);
+    bp = line_bp = copy.bodylist;
+    ptr = bp->line;
+    while ((bp = tokenize_body(bp, token, &ptr, &bigram_index, TRUE)) != NULL) {
+	itok = addb(token, bp);
+	for (; line_bp != bp; line_bp = line_bp->next)
+	    ++line;
+	if (last_itok)
+	    quoteindex_add_posting(last_itok, itok, msgnum, line, ptr - bp->line);
+	last_itok = itok;
+    }
+    if (copy.bodylist != dummy)
+	free_body(copy.bodylist);
+    free_body(dummy);
+}
+
+#endif				/* !BY_TOKEN_STRING */
+
+/*
+** Adds the messages below maxnum to the quote index, or makes it
+** again if this run didn't have one.
+*/
+
+void save_quote_index(int maxnum)
+{
+#ifndef BY_TOKEN_STRING
+    int num = 0;
+    unsigned i;
+    if (!use_quote_index())
+	return;
+    if (quote_index) {
+	num = quoteindex_covered(quote_index) + 1;
+	quoteindex_unmap(quote_index);
+	quote_index = NULL;
+    }
+    if (!quoteindex_open(num == 0))
+	return;
+    for (; num < maxnum; ++num)
+	index_message(num);
+    for (i = num_old_tokens; i < num_tokens; ++i)
+	quoteindex_add_token(tokens[i].token_length,
+			     tokens[i].token_crc32, tokens[i].itok);
+    quoteindex_close(maxnum - 1, next_itoken);
+#endif
+}
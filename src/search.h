@@ -16,5 +16,8 @@ struct body *tokenize_body(struct body *bp, char *token, char **ptr,
 			   int *bigram_index, int ignore);
 void analyze_headers(int amount_new);
 void set_alt_replylist(struct reply *r);
+void load_quote_index(char *dir, int max_num);
+int quote_index_loaded(void);
+void save_quote_index(int maxnum);
 
 #endif				/* SEARCH_H_INCLUDED */
@@ -0,0 +1,968 @@
+/*
+** The full-text search index (searchindex).
+**
+** Rather than having a search engine crawl the message pages again
+** after every run, hypermail can keep an inverted index of the words of
+** the archive itself, in the search folder of the archive, and add the
+** messages of each run to it:
+**
+**   xy.hsi       the words that start with "xy", with the messages they
+**                are in and their positions there (a character other
+**                than a lowercase letter or a digit is a '_')
+**   msgs-N.hsi   the file name, date, author and subject of the
+**                SEARCH_MSGS_PER_FILE messages from N times that on,
+**                and whether they are deleted
+**   meta.hsi     the last message indexed and the number of deleted
+**                messages of each msgs-N.hsi
+**
+** so that a search run by the browser only has to fetch the shards of
+** the words it looks for and the message files of what it found.
+**
+** All numbers are varints: seven bits a byte, the lowest first, with
+** the high bit set in every byte but the last. A shard is the magic and
+** one or more segments, each its number of bytes followed by the number
+** of terms and then, for each term in strcmp() order and by field, its
+** length, the term, a field byte (SEARCH_FIELD_*), the number of
+** messages, the last of them, the number of bytes of its postings and
+** the postings: for each message, the difference to the message before
+** it (to -1 for the first of the segment), the number of positions and
+** the differences between them (the first as is). Positions count the
+** words of the field from 0, including the ones too short or too long
+** to be indexed. The messages of a segment all come after those of the
+** segments before it.
+**
+** A message file is the magic, its first message number, the number
+** of messages and for each of them a flags byte (SEARCH_MSG_*), and if
+** the message is present, its date and the strings (each a length
+** and the bytes) of its file name, relative to the archive, author
+** name, email address and subject.
+**
+** results.html is the page the hmsearch CGI shows its results in, with
+** the header and footer of the index pages of the archive.
+**
+** The text of a message is the body read from the mbox, or read back
+** from its page, as the quote index does it, when the run doesn't have
+** it. An incremental run appends the postings of its new messages to
+** the shards of their words as a segment of their own, and merges the
+** segments of a shard into one when it has SEARCH_MAX_SEGMENTS, so a
+** shard is only written again every so many runs. It also writes the
+** message files of the new and newly deleted messages. meta.hsi is
+** removed before and written after that, so an index that was left
+** half updated is made again from scratch by the next run.
+*/
+
+#include <stdint.h>
+
+#include "hypermail.h"
+#include "setup.h"
+#include "struct.h"
+#include "proto.h"
+#include "parse.h"
+#include "printfile.h"
+#include "search.h"
+#include "binindex.h"
+#include "searchindex.h"
+
+#ifdef HAVE_DIRENT_H
+#ifdef __LCC__
+#include "../lcc/dirent.h"
+#else
+#include <dirent.h>
+#endif
+#else
+#ifdef __LCC__
+#include <direct.h>
+#else
+#include <sys/dir.h>
+#endif
+#endif
+
+struct search_buf {
+    unsigned char *data;
+    size_t len;
+    size_t space;
+};
+
+/* a term of the messages of this run, with their postings */
+struct search_term {
+    char *term;
+    int field;
+    unsigned hash;
+    int first_msgnum;		/* -1 until it has a posting */
+    int last_msgnum;
+    long num_msgs;
+    struct search_buf postings;	/* after the first message number */
+    int *positions;		/* in the message being indexed */
+    int num_positions;
+    int positions_space;
+};
+
+static struct search_term *terms = NULL;
+static int num_terms = 0;
+static int terms_space = 0;
+static unsigned *term_slots = NULL;	/* index + 1 into terms, 0 if free */
+static unsigned term_slots_mask = 0;
+static int *touched = NULL;		/* the terms of the message being indexed */
+static int num_touched = 0;
+static int touched_space = 0;
+
+static char *search_dir = NULL;
+static int index_complete;		/* FALSE after a shard couldn't be read */
+
+static void put_bytes(struct search_buf *b, const void *p, size_t len)
+{
+    if (!len)
+	return;
+    if (b->len + len > b->space) {
+	unsigned char *more;
+	b->space = b->space ? 2 * b->space : 64;
+	while (b->len + len > b->space)
+	    b->space *= 2;
+	more = (unsigned char *)emalloc(b->space);
+	if (b->len)
+	    memcpy(more, b->data, b->len);
+	free(b->data);
+	b->data = more;
+    }
+    memcpy(b->data + b->len, p, len);
+    b->len += len;
+}
+
+static void put_varint(struct search_buf *b, uint64_t v)
+{
+    unsigned char bytes[10];
+    int n = 0;
+
+    while (v >= 0x80) {
+	bytes[n++] = (unsigned char)(v | 0x80);
+	v >>= 7;
+    }
+    bytes[n++] = (unsigned char)v;
+    put_bytes(b, bytes, n);
+}
+
+static void put_string(struct search_buf *b, const char *s)
+{
+    size_t len = s ? strlen(s) : 0;
+
+    put_varint(b, len);
+    put_bytes(b, s, len);
+}
+
+static int varint_len(uint64_t v)
+{
+    int n = 1;
+
+    while (v >= 0x80) {
+	v >>= 7;
+	++n;
+    }
+    return n;
+}
+
+/*
+** Reads a varint at *p, not past end. Returns FALSE if it doesn't end
+** there.
+*/
+
+static int get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+    int shift = 0;
+
+    *v = 0;
+    while (*p < end && shift < 64) {
+	unsigned char c = *(*p)++;
+	*v |= (uint64_t)(c & 0x7f) << shift;
+	if (!(c & 0x80))
+	    return TRUE;
+	shift += 7;
+    }
+    return FALSE;
+}
+
+static char *search_file(const char *name)
+{
+    return binindex_name(search_dir, name);
+}
+
+static void write_error(const char *filename)
+{
+    snprintf(errmsg, sizeof(errmsg), "%s \"%s\".", lang[MSG_COULD_NOT_WRITE], filename);
+    progerr(errmsg);
+}
+
+/*
+** Writes a file of the index under a temporary name and renames it, so
+** a browser never gets half of it.
+*/
+
+static void write_search_file(const char *name, const char *magic, struct search_buf *b)
+{
+    char *filename = search_file(name);
+    char *tmpname;
+    FILE *fp;
+    int failed;
+
+    trio_asprintf(&tmpname, "%s.tmp", filename);
+    if ((fp = fopen(tmpname, "wb")) == NULL)
+	write_error(tmpname);
+    failed = fwrite(magic, 1, SEARCH_MAGIC_LEN, fp) != SEARCH_MAGIC_LEN
+	|| (b->len && fwrite(b->data, 1, b->len, fp) != b->len);
+    if (fclose(fp) || failed)
+	write_error(tmpname);
+    chmod(tmpname, set_filemode);
+    if (rename(tmpname, filename) == -1)
+	write_error(filename);
+    free(tmpname);
+    free(filename);
+}
+
+/*
+** Collecting the terms of the new messages.
+*/
+
+static unsigned term_hash(const char *term, int field)
+{
+    unsigned h = 2166136261U;	/* FNV-1a */
+
+    while (*term)
+	h = (h ^ (unsigned char)*term++) * 16777619U;
+    return (h ^ (unsigned)field) * 16777619U;
+}
+
+static unsigned *find_term_slot(const char *term, int field, unsigned hash)
+{
+    unsigned i = hash & term_slots_mask;
+
+    while (term_slots[i]) {
+	struct search_term *t = &terms[term_slots[i] - 1];
+	if (t->hash == hash && t->field == field && !strcmp(t->term, term))
+	    break;
+	i = (i + 1) & term_slots_mask;
+    }
+    return &term_slots[i];
+}
+
+static void grow_term_slots(void)
+{
+    unsigned size = term_slots ? 2 * (term_slots_mask + 1) : 4096;
+    int i;
+
+    free(term_slots);
+    term_slots = (unsigned *)emalloc(size * sizeof(unsigned));
+    memset(term_slots, 0, size * sizeof(unsigned));
+    term_slots_mask = size - 1;
+    for (i = 0; i < num_terms; ++i)
+	*find_term_slot(terms[i].term, terms[i].field, terms[i].hash) = i + 1;
+}
+
+static struct search_term *get_term(const char *term, int field)
+{
+    unsigned hash = term_hash(term, field);
+    unsigned *slot;
+    struct search_term *t;
+
+    if (!term_slots || 2 * (unsigned)(num_terms + 1) > term_slots_mask + 1)
+	grow_term_slots();
+    slot = find_term_slot(term, field, hash);
+    if (*slot)
+	return &terms[*slot - 1];
+    if (num_terms == terms_space) {
+	struct search_term *more;
+	terms_space = terms_space ? 2 * terms_space : 1024;
+	more = (struct search_term *)emalloc(terms_space * sizeof(struct search_term));
+	if (num_terms)
+	    memcpy(more, terms, num_terms * sizeof(struct search_term));
+	free(terms);
+	terms = more;
+    }
+    t = &terms[num_terms];
+    memset(t, 0, sizeof(struct search_term));
+    t->term = strsav(term);
+    t->field = field;
+    t->hash = hash;
+    t->first_msgnum = -1;
+    *slot = ++num_terms;
+    return t;
+}
+
+static void add_position(const char *token, int field, int position)
+{
+    char term[SEARCH_MAX_TERM + 1];
+    struct search_term *t;
+    int i;
+
+    for (i = 0; token[i]; ++i) {
+	if (i == SEARCH_MAX_TERM)
+	    return;		/* encoded data more likely than a word */
+	term[i] = tolower((unsigned char)token[i]);
+    }
+    if (i < 2)
+	return;
+    term[i] = '\0';
+    t = get_term(term, field);
+    if (!t->num_positions) {
+	if (num_touched == touched_space) {
+	    int *more;
+	    touched_space = touched_space ? 2 * touched_space : 256;
+	    more = (int *)emalloc(touched_space * sizeof(int));
+	    if (num_touched)
+		memcpy(more, touched, num_touched * sizeof(int));
+	    free(touched);
+	    touched = more;
+	}
+	touched[num_touched++] = t - terms;
+    }
+    if (t->num_positions == t->positions_space) {
+	int *more;
+	t->positions_space = t->positions_space ? 2 * t->positions_space : 4;
+	more = (int *)emalloc(t->positions_space * sizeof(int));
+	if (t->num_positions)
+	    memcpy(more, t->positions, t->num_positions * sizeof(int));
+	free(t->positions);
+	t->positions = more;
+    }
+    t->positions[t->num_positions++] = position;
+}
+
+/*
+** Adds the words of s, numbered from position. Returns the position
+** after them.
+*/
+
+static int add_field_string(char *s, int field, int position)
+{
+    char token[MAXLINE];
+    char *ptr = s;
+    int dummy = 0;
+    int more;
+    struct body b;
+
+    if (!s)
+	return position;
+    b.line = s;
+    b.next = NULL;
+    do {
+	/* the last word comes with NULL, as the end of the body */
+	*token = '\0';
+	more = tokenize_body(&b, token, &ptr, &dummy, FALSE) != NULL;
+	if (*token)
+	    add_position(token, field, position++);
+    } while (more);
+    return position;
+}
+
+/*
+** Adds the text of a body: what follows the "start" anchor after the
+** headers if it was read back from its page, without the tags that are
+** left.
+*/
+
+static void add_body_text(struct body *bp)
+{
+    struct body *start;
+    char text[MAXLINE];
+    int in_tag = FALSE;
+    int position = 0;
+
+    for (start = bp; start; start = start->next)
+	if (strstr(start->line, "<a name=\"start\""))
+	    break;
+    for (bp = start ? start->next : bp; bp; bp = bp->next) {
+	const char *p;
+	int i = 0;
+	if (bp->header)
+	    continue;
+	for (p = bp->line; *p && i < MAXLINE - 1; ++p) {
+	    if (*p == '<')
+		in_tag = TRUE;
+	    else if (*p == '>' && in_tag) {
+		in_tag = FALSE;
+		text[i++] = ' ';
+	    }
+	    else if (!in_tag)
+		text[i++] = *p;
+	}
+	text[i] = '\0';
+	position = add_field_string(text, SEARCH_FIELD_BODY, position);
+    }
+}
+
+/*
+** Moves the positions the message had for each term to its postings.
+*/
+
+static void end_message(int msgnum)
+{
+    int i, j;
+
+    for (i = 0; i < num_touched; ++i) {
+	struct search_term *t = &terms[touched[i]];
+	if (t->first_msgnum < 0)
+	    t->first_msgnum = msgnum;
+	else
+	    put_varint(&t->postings, (uint64_t)(msgnum - t->last_msgnum));
+	t->last_msgnum = msgnum;
+	++t->num_msgs;
+	put_varint(&t->postings, t->num_positions);
+	for (j = 0; j < t->num_positions; ++j)
+	    put_varint(&t->postings, t->positions[j] - (j ? t->positions[j - 1] : 0));
+	t->num_positions = 0;
+    }
+    num_touched = 0;
+}
+
+static void index_message(struct emailinfo *ep)
+{
+    if (ep->is_deleted || (ep->annotation_robot & ANNOTATION_ROBOT_NO_INDEX))
+	return;
+    if (ep->bodylist && ep->bodylist->line[0])
+	add_body_text(ep->bodylist);
+    else {
+	struct emailinfo copy;
+	struct body *dummy;
+	struct body *lp = NULL;
+	copy = *ep;
+	copy.bodylist = dummy = addbody(NULL, &lp, "\0", 0);
+	parse_old_html(ep->msgnum, &copy, TRUE, FALSE, NULL, 0);
+	add_body_text(copy.bodylist);
+	if (copy.bodylist != dummy)
+	    free_body(copy.bodylist);
+	free_body(dummy);
+    }
+    add_field_string(ep->subject, SEARCH_FIELD_SUBJECT, 0);
+    /* the address goes on from the name */
+    add_field_string(ep->emailaddr, SEARCH_FIELD_AUTHOR,
+		     add_field_string(ep->name, SEARCH_FIELD_AUTHOR, 0));
+    end_message(ep->msgnum);
+}
+
+/*
+** Writing the shards.
+*/
+
+/* the terms are two characters or more */
+static void shard_name(const char *term, char *name)
+{
+    int i;
+
+    for (i = 0; i < 2; ++i) {
+	int c = (unsigned char)term[i];
+	name[i] = ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z')) ? c : '_';
+    }
+    name[2] = '\0';
+}
+
+static int compare_terms(const void *a, const void *b)
+{
+    const struct search_term *t1 = *(const struct search_term *const *)a;
+    const struct search_term *t2 = *(const struct search_term *const *)b;
+    char s1[3], s2[3];
+    int c;
+
+    shard_name(t1->term, s1);
+    shard_name(t2->term, s2);
+    if ((c = strcmp(s1, s2)) != 0)
+	return c;
+    if ((c = strcmp(t1->term, t2->term)) != 0)
+	return c;
+    return t1->field - t2->field;
+}
+
+/* a term of a segment that is already written */
+struct old_term {
+    const unsigned char *term;
+    uint64_t len;
+    int field;
+    uint64_t num_msgs;
+    uint64_t last_msgnum;
+    uint64_t num_bytes;
+    const unsigned char *postings;
+};
+
+static int read_old_term(const unsigned char **p, const unsigned char *end, struct old_term *ot)
+{
+    if (!get_varint(p, end, &ot->len) || ot->len > (uint64_t)(end - *p))
+	return FALSE;
+    ot->term = *p;
+    *p += ot->len;
+    if (*p == end)
+	return FALSE;
+    ot->field = *(*p)++;
+    if (!get_varint(p, end, &ot->num_msgs)
+	|| !get_varint(p, end, &ot->last_msgnum)
+	|| !get_varint(p, end, &ot->num_bytes)
+	|| ot->num_bytes > (uint64_t)(end - *p))
+	return FALSE;
+    ot->postings = *p;
+    *p += ot->num_bytes;
+    return TRUE;
+}
+
+static int compare_old_terms(const struct old_term *a, const struct old_term *b)
+{
+    int c = memcmp(a->term, b->term, a->len < b->len ? a->len : b->len);
+
+    if (c)
+	return c;
+    if (a->len != b->len)
+	return a->len < b->len ? -1 : 1;
+    return a->field - b->field;
+}
+
+static void put_new_term(struct search_buf *b, const struct search_term *t)
+{
+    unsigned char field = (unsigned char)t->field;
+    uint64_t gap = (uint64_t)(t->first_msgnum + 1);
+
+    put_string(b, t->term);
+    put_bytes(b, &field, 1);
+    put_varint(b, t->num_msgs);
+    put_varint(b, t->last_msgnum);
+    put_varint(b, varint_len(gap) + t->postings.len);
+    put_varint(b, gap);
+    put_bytes(b, t->postings.data, t->postings.len);
+}
+
+/*
+** The terms of one segment, read in order.
+*/
+
+struct segment {
+    const unsigned char *p;
+    const unsigned char *end;
+    uint64_t left;
+    struct old_term ot;
+    int have;
+};
+
+static void next_term(struct segment *seg)
+{
+    seg->have = seg->left && read_old_term(&seg->p, seg->end, &seg->ot);
+    if (seg->left && !seg->have)
+	index_complete = FALSE;
+    if (seg->have)
+	--seg->left;
+}
+
+static void start_segment(struct segment *seg, const unsigned char *p, const unsigned char *end)
+{
+    seg->p = p;
+    seg->end = end;
+    seg->left = 0;
+    if (!get_varint(&seg->p, end, &seg->left))
+	index_complete = FALSE;
+    next_term(seg);
+}
+
+/*
+** Merges segments, the ones of the earlier messages first, into one:
+** the postings of a term that is in several of them are put one after
+** the other, the first message of each then counted from the last one
+** before it.
+*/
+
+static void merge_segments(struct segment *segs, int num_segs, struct search_buf *out)
+{
+    struct search_buf body = { NULL, 0, 0 };
+    uint64_t num_out = 0;
+    int i;
+
+    for (;;) {
+	struct old_term *first = NULL;
+	uint64_t num_msgs = 0, num_bytes = 0;
+	int64_t last = -1;
+	unsigned char field;
+
+	for (i = 0; i < num_segs; ++i)
+	    if (segs[i].have && (!first || compare_old_terms(&segs[i].ot, first) < 0))
+		first = &segs[i].ot;
+	if (!first)
+	    break;
+	/* what the postings of the term add up to */
+	for (i = 0; i < num_segs; ++i) {
+	    struct old_term *ot = &segs[i].ot;
+	    const unsigned char *q = ot->postings;
+	    uint64_t gap;
+	    if (!segs[i].have || (ot != first && compare_old_terms(ot, first)))
+		continue;
+	    num_msgs += ot->num_msgs;
+	    if (last < 0)
+		num_bytes += ot->num_bytes;
+	    else if (get_varint(&q, ot->postings + ot->num_bytes, &gap))
+		num_bytes += varint_len(gap - 1 - last)
+		    + ot->num_bytes - (q - ot->postings);
+	    last = (int64_t)ot->last_msgnum;
+	}
+	field = (unsigned char)first->field;
+	put_varint(&body, first->len);
+	put_bytes(&body, first->term, first->len);
+	put_bytes(&body, &field, 1);
+	put_varint(&body, num_msgs);
+	put_varint(&body, (uint64_t)last);
+	put_varint(&body, num_bytes);
+	/* and the postings themselves */
+	last = -1;
+	for (i = 0; i < num_segs; ++i) {
+	    struct old_term *ot = &segs[i].ot;
+	    const unsigned char *q = ot->postings;
+	    uint64_t gap;
+	    if (!segs[i].have || (ot != first && compare_old_terms(ot, first)))
+		continue;
+	    if (last < 0)
+		put_bytes(&body, ot->postings, ot->num_bytes);
+	    else if (get_varint(&q, ot->postings + ot->num_bytes, &gap)) {
+		put_varint(&body, gap - 1 - last);
+		put_bytes(&body, q, ot->num_bytes - (q - ot->postings));
+	    }
+	    last = (int64_t)ot->last_msgnum;
+	    if (ot != first)
+		next_term(&segs[i]);
+	}
+	++num_out;
+	for (i = 0; i < num_segs; ++i)
+	    if (&segs[i].ot == first)
+		next_term(&segs[i]);
+    }
+    put_varint(out, num_out);
+    put_bytes(out, body.data, body.len);
+    free(body.data);
+}
+
+/*
+** Writes the shard of the terms from list[0] to list[count - 1]. With
+** merge set, they are appended to it as a segment of their own while it
+** has fewer than SEARCH_MAX_SEGMENTS, or else all its segments are
+** merged with them into one.
+*/
+
+static void write_shard(struct search_term **list, int count, int merge)
+{
+    char name[3 + sizeof(SEARCH_SUFFIX)];
+    char *filename;
+    char *data = NULL;
+    size_t len = 0;
+    int mapped = 0;
+    struct segment segs[SEARCH_MAX_SEGMENTS + 1];
+    int num_segs = 0;
+    struct search_buf seg = { NULL, 0, 0 };
+    struct search_buf shard = { NULL, 0, 0 };
+    int i;
+
+    shard_name(list[0]->term, name);
+    strcat(name, SEARCH_SUFFIX);
+    put_varint(&seg, count);
+    for (i = 0; i < count; ++i)
+	put_new_term(&seg, list[i]);
+
+    filename = search_file(name);
+    if (merge)
+	data = map_file(filename, &len, &mapped);
+    if (data) {
+	const unsigned char *p = (const unsigned char *)data + SEARCH_MAGIC_LEN;
+	const unsigned char *end = (const unsigned char *)data + len;
+	uint64_t seg_len;
+	if (len < SEARCH_MAGIC_LEN || memcmp(data, SEARCH_SHARD_MAGIC, SEARCH_MAGIC_LEN))
+	    index_complete = FALSE;
+	else {
+	    while (p < end && num_segs < SEARCH_MAX_SEGMENTS) {
+		if (!get_varint(&p, end, &seg_len) || seg_len > (uint64_t)(end - p)) {
+		    index_complete = FALSE;
+		    break;
+		}
+		start_segment(&segs[num_segs++], p, p + seg_len);
+		p += seg_len;
+	    }
+	    if (p < end)
+		index_complete = FALSE;
+	}
+    }
+
+    if (num_segs && num_segs < SEARCH_MAX_SEGMENTS && index_complete) {
+	FILE *fp;
+	int failed;
+	put_varint(&shard, seg.len);
+	if ((fp = fopen(filename, "ab")) == NULL)
+	    write_error(filename);
+	failed = fwrite(shard.data, 1, shard.len, fp) != shard.len
+	    || fwrite(seg.data, 1, seg.len, fp) != seg.len;
+	if (fclose(fp) || failed)
+	    write_error(filename);
+    }
+    else {
+	struct search_buf body = { NULL, 0, 0 };
+	start_segment(&segs[num_segs++], seg.data, seg.data + seg.len);
+	merge_segments(segs, num_segs, &body);
+	put_varint(&shard, body.len);
+	put_bytes(&shard, body.data, body.len);
+	write_search_file(name, SEARCH_SHARD_MAGIC, &shard);
+	free(body.data);
+    }
+    free(filename);
+    free(seg.data);
+    free(shard.data);
+    unmap_file(data, len, mapped);
+}
+
+static void write_shards(int merge)
+{
+    struct search_term **list;
+    int i, j;
+
+    if (!num_terms)
+	return;
+    list = (struct search_term **)emalloc(num_terms * sizeof(struct search_term *));
+    for (i = 0; i < num_terms; ++i)
+	list[i] = &terms[i];
+    qsort(list, num_terms, sizeof(struct search_term *), compare_terms);
+    for (i = 0; i < num_terms; i = j) {
+	char s1[3], s2[3];
+	shard_name(list[i]->term, s1);
+	for (j = i + 1; j < num_terms; ++j) {
+	    shard_name(list[j]->term, s2);
+	    if (strcmp(s1, s2))
+		break;
+	}
+	write_shard(list + i, j - i, merge);
+    }
+    free(list);
+}
+
+/*
+** The message files.
+*/
+
+static int block_deleted(int block, int maxnum)
+{
+    int num = block * SEARCH_MSGS_PER_FILE;
+    int count = 0;
+    struct emailinfo *ep;
+
+    for (; num < maxnum && num < (block + 1) * SEARCH_MSGS_PER_FILE; ++num)
+	if (hashnumlookup(num, &ep) && ep->is_deleted)
+	    ++count;
+    return count;
+}
+
+static void write_msgs(int block, int maxnum)
+{
+    char name[32];
+    struct search_buf b = { NULL, 0, 0 };
+    int first = block * SEARCH_MSGS_PER_FILE;
+    int last = first + SEARCH_MSGS_PER_FILE;
+    int num;
+
+    if (last > maxnum)
+	last = maxnum;
+    put_varint(&b, first);
+    put_varint(&b, last - first);
+    for (num = first; num < last; ++num) {
+	struct emailinfo *ep;
+	unsigned char flags = 0;
+	if (!hashnumlookup(num, &ep)) {
+	    put_bytes(&b, &flags, 1);
+	    continue;
+	}
+	flags = SEARCH_MSG_PRESENT | (ep->is_deleted ? SEARCH_MSG_DELETED : 0);
+	put_bytes(&b, &flags, 1);
+	put_varint(&b, ep->date > 0 ? (uint64_t)ep->date : 0);
+	put_string(&b, msg_relpath(ep, NULL));
+	put_string(&b, ep->name);
+	put_string(&b, ep->emailaddr);
+	put_string(&b, ep->subject);
+    }
+    snprintf(name, sizeof(name), "msgs-%d%s", block, SEARCH_SUFFIX);
+    write_search_file(name, SEARCH_MSGS_MAGIC, &b);
+    free(b.data);
+}
+
+/*
+** Reads meta.hsi: the last message indexed and the deleted messages of
+** each message file. Returns -1 if there is no usable one.
+*/
+
+static int read_meta(int **deleted, int *num_blocks)
+{
+    char *filename = search_file(SEARCH_META_NAME);
+    size_t len;
+    int mapped;
+    char *data = map_file(filename, &len, &mapped);
+    const unsigned char *p, *end;
+    uint64_t covered, per_file, blocks, v;
+    int i;
+
+    free(filename);
+    *deleted = NULL;
+    *num_blocks = 0;
+    if (!data)
+	return -1;
+    p = (const unsigned char *)data + SEARCH_MAGIC_LEN;
+    end = (const unsigned char *)data + len;
+    if (len < SEARCH_MAGIC_LEN || memcmp(data, SEARCH_META_MAGIC, SEARCH_MAGIC_LEN)
+	|| !get_varint(&p, end, &covered) || !get_varint(&p, end, &per_file)
+	|| !get_varint(&p, end, &blocks) || per_file != SEARCH_MSGS_PER_FILE
+	|| blocks > (uint64_t)(end - p) || !covered) {
+	unmap_file(data, len, mapped);
+	return -1;
+    }
+    *deleted = (int *)emalloc((blocks + 1) * sizeof(int));
+    for (i = 0; i < (int)blocks; ++i) {
+	if (!get_varint(&p, end, &v)) {
+	    free(*deleted);
+	    *deleted = NULL;
+	    unmap_file(data, len, mapped);
+	    return -1;
+	}
+	(*deleted)[i] = (int)v;
+    }
+    *num_blocks = (int)blocks;
+    unmap_file(data, len, mapped);
+    return (int)covered - 1;
+}
+
+static void write_meta(int covered, int *deleted, int num_blocks)
+{
+    struct search_buf b = { NULL, 0, 0 };
+    int i;
+
+    put_varint(&b, covered + 1);
+    put_varint(&b, SEARCH_MSGS_PER_FILE);
+    put_varint(&b, num_blocks);
+    for (i = 0; i < num_blocks; ++i)
+	put_varint(&b, deleted[i]);
+    write_search_file(SEARCH_META_NAME, SEARCH_META_MAGIC, &b);
+    free(b.data);
+}
+
+static void write_template(void)
+{
+    char *filename = search_file(SEARCH_TEMPLATE_NAME);
+    FILE *fp;
+
+    if ((fp = fopen(filename, "w")) == NULL)
+	write_error(filename);
+    print_index_header(fp, set_label, set_dir, SEARCH_QUERY_MARK, SEARCH_TEMPLATE_NAME);
+    fprintf(fp, "</div>\n");
+    fputs(SEARCH_RESULTS_MARK, fp);
+    printfooter(fp, ihtmlfooterfile, set_label, set_dir, SEARCH_QUERY_MARK,
+		SEARCH_TEMPLATE_NAME, FALSE);
+    if (fclose(fp))
+	write_error(filename);
+    chmod(filename, set_filemode);
+    free(filename);
+}
+
+/*
+** Removes the files of an index that is made again, so no shard of a
+** word that is gone is left behind.
+*/
+
+static void remove_index(void)
+{
+    DIR *dir;
+#ifdef HAVE_DIRENT_H
+    struct dirent *entry;
+#else
+    struct direct *entry;
+#endif
+    size_t suffix_len = strlen(SEARCH_SUFFIX);
+
+    if ((dir = opendir(search_dir)) == NULL)
+	return;
+    while ((entry = readdir(dir))) {
+	size_t len = strlen(entry->d_name);
+	if (len > suffix_len
+	    && !strcmp(entry->d_name + len - suffix_len, SEARCH_SUFFIX)) {
+	    char *filename = search_file(entry->d_name);
+	    remove(filename);
+	    free(filename);
+	}
+    }
+    closedir(dir);
+}
+
+static void free_terms(void)
+{
+    int i;
+
+    for (i = 0; i < num_terms; ++i) {
+	free(terms[i].term);
+	free(terms[i].postings.data);
+	free(terms[i].positions);
+    }
+    free(terms);
+    free(term_slots);
+    free(touched);
+    terms = NULL;
+    term_slots = NULL;
+    touched = NULL;
+    num_terms = terms_space = 0;
+    num_touched = touched_space = 0;
+    term_slots_mask = 0;
+}
+
+/*
+** Adds the messages below maxnum that aren't in the index of set_dir
+** yet, or makes it again if this isn't an incremental run.
+*/
+
+void write_search_index(int maxnum)
+{
+    int *old_deleted;
+    int num_old_blocks;
+    int *deleted;
+    int num_blocks = (maxnum + SEARCH_MSGS_PER_FILE - 1) / SEARCH_MSGS_PER_FILE;
+    int covered;
+    int merge;
+    int i;
+
+    search_dir = binindex_name(set_dir, SEARCH_INDEX_DIR);
+    if (!isdir(search_dir)) {
+#ifdef __LCC__
+	mkdir(search_dir);
+#else
+	mkdir(search_dir, set_dirmode);
+#endif
+	chmod(search_dir, set_dirmode);
+    }
+    covered = read_meta(&old_deleted, &num_old_blocks);
+    merge = set_increment && covered >= 0 && covered < maxnum;
+    if (!merge) {
+	remove_index();
+	covered = -1;
+	num_old_blocks = 0;
+    }
+    else {
+	char *filename = search_file(SEARCH_META_NAME);
+	remove(filename);	/* until it is complete again */
+	free(filename);
+    }
+    if (set_showprogress)
+	printf("Writing search index in \"%s\"\n", search_dir);
+
+    index_complete = TRUE;
+    for (i = covered + 1; i < maxnum; ++i) {
+	struct emailinfo *ep;
+	if (hashnumlookup(i, &ep))
+	    index_message(ep);
+    }
+    write_shards(merge);
+    free_terms();
+
+    deleted = (int *)emalloc((num_blocks + 1) * sizeof(int));
+    for (i = 0; i < num_blocks; ++i) {
+	deleted[i] = block_deleted(i, maxnum);
+	if (i >= num_old_blocks || (i + 1) * SEARCH_MSGS_PER_FILE > covered + 1
+	    || deleted[i] != old_deleted[i])
+	    write_msgs(i, maxnum);
+    }
+    write_template();
+    /* without it the next run makes the index again */
+    if (index_complete)
+	write_meta(maxnum - 1, deleted, num_blocks);
+    free(deleted);
+    if (old_deleted)
+	free(old_deleted);
+    free(search_dir);
+    search_dir = NULL;
+}
@@ -0,0 +1,41 @@
+#ifndef SEARCHINDEX_H_INCLUDED
+#define SEARCHINDEX_H_INCLUDED
+
+/*
+** searchindex.c functions, and the layout of the files it writes
+*/
+
+/* the folder of the archive the files are in */
+#define SEARCH_INDEX_DIR    "search"
+
+#define SEARCH_SHARD_MAGIC  "HMSRCH2\n"
+#define SEARCH_MSGS_MAGIC   "HMSMSG1\n"
+#define SEARCH_META_MAGIC   "HMSMETA\n"
+#define SEARCH_MAGIC_LEN    8
+
+#define SEARCH_META_NAME    "meta.hsi"
+#define SEARCH_SUFFIX       ".hsi"
+
+/* the page hmsearch shows its results in, made with the index page
+   header and footer of the archive; it puts the query in place of
+   SEARCH_QUERY_MARK and the results in place of SEARCH_RESULTS_MARK */
+#define SEARCH_TEMPLATE_NAME "results.html"
+#define SEARCH_QUERY_MARK   "{hmsearch-query}"
+#define SEARCH_RESULTS_MARK "<!-- hmsearch results -->\n"
+
+#define SEARCH_MSGS_PER_FILE 1000	/* messages in each msgs-N.hsi */
+#define SEARCH_MAX_TERM     32		/* longer words aren't indexed */
+#define SEARCH_MAX_SEGMENTS 16		/* in a shard before they are merged */
+
+/* the part of a message a term was found in */
+#define SEARCH_FIELD_BODY    0
+#define SEARCH_FIELD_SUBJECT 1
+#define SEARCH_FIELD_AUTHOR  2
+
+/* the flags byte of a message in msgs-N.hsi */
+#define SEARCH_MSG_PRESENT   1
+#define SEARCH_MSG_DELETED   2
+
+void write_search_index(int);
+
+#endif				/* SEARCHINDEX_H_INCLUDED */
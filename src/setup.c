@@ -13,6 +13,7 @@
 #include "setup.h"
 #include "struct.h"
 #include "print.h"
+#include "searchindex.h"
 
 char *set_fragment_prefix;
 char *set_antispam_at;
@@ -58,6 +59,7 @@ bool set_discard_dup_msgids;
 bool set_usemeta;
 bool set_userobotmeta;
 bool set_uselock;
+bool set_lockspool;
 bool set_ietf_mbox;
 bool set_linkquotes;
 bool set_monthly_index;
@@ -66,7 +68,11 @@ bool set_spamprotect;
 bool set_spamprotect_id;
 bool set_attachmentsindex;
 bool set_usegdbm;
+bool set_usebinindex;
 bool set_writehaof;
+bool set_searchindex;
+bool set_gzip_pages;
+bool set_brotli_pages;
 bool set_append;
 char *set_append_filename;
 bool set_nonsequential;
@@ -74,6 +80,7 @@ bool set_warn_suppressions;
 bool set_files_by_thread;
 bool set_href_detection;
 bool set_mbox_shortened;
+bool set_mbox_checkpoint;
 bool set_report_new_file;
 bool set_report_new_folder;
 bool set_use_sender_date;
@@ -89,6 +96,8 @@ int set_filemode;
 int set_locktime;
 
 int set_searchbackmsgnum;
+int set_linkquotes_threads;
+int set_linkquotes_method;
 int set_quote_hide_threshold;
 int set_thread_file_depth;
 
@@ -401,10 +410,41 @@ struct Config cfg[] = {
 #endif
     , FALSE},
 
+    {"usebinindex", &set_usebinindex, BFALSE, CFG_SWITCH,
+     "# Set this to On to keep a header cache like usegdbm does, in the\n"
+     "# binary " BIN_INDEX_NAME " and " BIN_INDEX_STRINGS_NAME " files, which are\n"
+     "# read back without parsing and don't need gdbm. An existing\n"
+     "# " GDBM_INDEX_NAME " is converted the first time. May not be used\n"
+     "# together with usegdbm.\n", FALSE},
+
     {"writehaof", &set_writehaof, BFALSE, CFG_SWITCH,
      "# Set this to On to let hypermail write an XML archive overview file\n"
      "# in each directory. The filename is " HAOF_NAME ".\n", FALSE},
 
+    {"searchindex", &set_searchindex, BFALSE, CFG_SWITCH,
+     "# Set this to On to keep a full-text index of the archive in its\n"
+     "# " SEARCH_INDEX_DIR " folder, split by the first two letters of the words\n"
+     "# so that a search needs only a few of its files. Each run adds\n"
+     "# its messages to it; without the -u option it is made again.\n", FALSE},
+
+    {"gzip_pages", &set_gzip_pages, BFALSE, CFG_SWITCH,
+     "# Set this to On to write a gzip compressed copy (.gz) of every\n"
+     "# page and text attachment next to it, for web servers that can\n"
+     "# serve precompressed files, such as nginx's gzip_static.\n"
+     "# A copy is only recompressed when its page changed.\n"
+#ifndef HAVE_LIBZ
+     "# (This particular binary has been built without zlib.)\n"
+#endif
+    , FALSE},
+
+    {"brotli_pages", &set_brotli_pages, BFALSE, CFG_SWITCH,
+     "# Set this to On to write a brotli compressed copy (.br) of every\n"
+     "# page and text attachment next to it. See gzip_pages.\n"
+#ifndef HAVE_LIBBROTLI
+     "# (This particular binary has been built without brotli.)\n"
+#endif
+    , FALSE},
+
     {"append",  &set_append,  BFALSE,    CFG_SWITCH,
      "# Set this to On to maintain a parallel mbox archive. The file\n"
      "# name defaults to mbox in the directory specified by -d or dir.\n", FALSE},
@@ -590,6 +630,12 @@ struct Config cfg[] = {
      "# Specify number of seconds to wait for a lock before we\n"
      "# override it! .\n", FALSE},
 
+    {"lockspool", &set_lockspool, BFALSE, CFG_SWITCH,
+     "# Set this to On to have a run that adds messages from stdin (-u -i)\n"
+     "# and finds the archive locked leave them in the .hypermail.spool\n"
+     "# directory of the archive and exit, instead of waiting for the\n"
+     "# lock. The run that has the lock adds them before it ends.\n", FALSE},
+
     {"dateformat", &set_dateformat, NULL, CFG_STRING,
      "# Format (see strftime(3)) for displaying dates.\n", FALSE},
 
@@ -628,7 +674,8 @@ struct Config cfg[] = {
 
     {"attachmentsindex", &set_attachmentsindex, BTRUE, CFG_SWITCH,
      "# Set this to  Off to make hypermail not output an index of\n"
-     "# messages with attachments.\n", FALSE},
+     "# messages with attachments. The attachments of each message\n"
+     "# are listed in the attindex file of the archive.\n", FALSE},
 
     {"linkquotes", &set_linkquotes, BFALSE, CFG_SWITCH, 
      "# Set this to On to create fine-grained links from quoted\n"
@@ -642,7 +689,23 @@ struct Config cfg[] = {
      "# done (-u option), this controls the tradeoff between speed and\n"
      "# the reliability of finding the right source for quoted text.\n"
      "# Try to set it to the largest number of messages between a\n"
-     "# message and the final direct reply to that message.\n", FALSE},
+     "# message and the final direct reply to that message. With the\n"
+     "# usebinindex option the words of the archived messages are kept\n"
+     "# in the " QUOTE_TOKENS_NAME " and " QUOTE_BIGRAMS_NAME " files, so their\n"
+     "# bodies are only read back when they are quoted.\n", FALSE},
+
+    {"linkquotes_threads", &set_linkquotes_threads, INT(0), CFG_INTEGER,
+     "# If the linkquotes option is on, the number of threads that\n"
+     "# look for the sources of quoted text while the message pages\n"
+     "# are written. 0 uses one per processor, 1 looks for each quote\n"
+     "# only as its page is written.\n", FALSE},
+
+    {"linkquotes_method", &set_linkquotes_method, INT(0), CFG_INTEGER,
+     "# If the linkquotes option is on, how the sources of quoted\n"
+     "# text are looked up: 0 by each pair of words in the quote, 1 by\n"
+     "# fingerprints of runs of three words (shingles), which keeps\n"
+     "# fewer places per message. The usebinindex word files are only\n"
+     "# kept with 0.\n", FALSE},
 
     {"link_to_replies", &set_link_to_replies, NULL, CFG_STRING,
      "# If the linkquotes option is on, specifying a string here\n"
@@ -701,7 +764,7 @@ struct Config cfg[] = {
      "# yearly, \"%G/%V\" for weekly. Do not alter this for an existing\n"
      "# archive without removing the old html files. If you use this\n"
      "# and update the archive incrementally (e.g. with -u), you must\n"
-     "# use the usegdbm option.\n", FALSE},
+     "# use the usegdbm or usebinindex option.\n", FALSE},
 
     {"msgsperfolder", &set_msgsperfolder, INT(0), CFG_INTEGER,
      "# Put messages in subdirectories with this many messages per\n"
@@ -878,7 +941,8 @@ struct Config cfg[] = {
 
     {"mbox_shortened", &set_mbox_shortened, BFALSE, CFG_SWITCH,
      "# Set this to On to enable use of mbox that has had some of its\n"
-     "# initial messages deleted. Requires usegdbm = 1 and increment = 0.\n"
+     "# initial messages deleted. Requires usegdbm = 1 (or usebinindex = 1)\n"
+     "# and increment = 0.\n"
      "# The first message in the shortened mbox must have a Message-Id header.\n"
      "# If discard_dup_msgids is 0, the first message in the shortened mbox\n"
      "# may not have the same Message-Id as a message that was deleted.\n"
@@ -886,6 +950,13 @@ struct Config cfg[] = {
      "# beginning of the mbox or appending new messages to the end (unless\n"
      "# you rebuild the archive from scratch using a complete mbox).\n", FALSE},
 
+    {"mbox_checkpoint", &set_mbox_checkpoint, BFALSE, CFG_SWITCH,
+     "# Set this to On to have hypermail remember in the " BIN_INDEX_NAME "\n"
+     "# where it stopped reading the mbox, so that the next run with\n"
+     "# increment = 0 or -1 only reads the messages appended since then.\n"
+     "# If the mbox was changed in any other way, it is read from the\n"
+     "# start as usual. Requires usebinindex = 1.\n", FALSE},
+
     {"report_new_folder", &set_report_new_folder, BFALSE, CFG_SWITCH,
      "# Set this to On to have it print (on stdout) the names of any\n"
      "# new directories created pursuant to the folder_by_date or\n"
@@ -1380,9 +1451,15 @@ void dump_config(void)
     printf("set_userobotmeta = %d\n",set_userobotmeta);
     printf("set_uselock = %d\n",set_uselock);
     printf("set_locktime = %d\n",set_locktime);
+    printf("set_lockspool = %d\n",set_lockspool);
     printf("set_ietf_mbox = %d\n",set_ietf_mbox);
     printf("set_usegdbm = %d\n",set_usegdbm);
+    printf("set_usebinindex = %d\n",set_usebinindex);
+    printf("set_mbox_checkpoint = %d\n",set_mbox_checkpoint);
     printf("set_writehaof = %d\n",set_writehaof);
+    printf("set_searchindex = %d\n",set_searchindex);
+    printf("set_gzip_pages = %d\n",set_gzip_pages);
+    printf("set_brotli_pages = %d\n",set_brotli_pages);
     printf("set_append = %d\n",set_append);
     printf("set_nonsequential = %d\n",set_nonsequential);
     printf("set_thrdlevels = %d\n",set_thrdlevels);
@@ -1392,6 +1469,8 @@ void dump_config(void)
     printf("set_attachmentsindex = %04o\n",set_attachmentsindex);
     printf("set_linkquotes = %d\n",set_linkquotes);
     printf("set_searchbackmsgnum = %d\n",set_searchbackmsgnum);
+    printf("set_linkquotes_threads = %d\n",set_linkquotes_threads);
+    printf("set_linkquotes_method = %d\n",set_linkquotes_method);
     printf("set_quote_hide_threshold = %d\n",set_quote_hide_threshold);
     printf("set_thread_file_depth = %d\n",set_thread_file_depth);
     printf("set_monthly_index = %d\n",set_monthly_index);
@@ -77,6 +77,7 @@ extern bool set_discard_dup_msgids;
 extern bool set_usemeta;
 extern bool set_userobotmeta;
 extern bool set_uselock;
+extern bool set_lockspool;
 extern bool set_ietf_mbox;
 extern bool set_linkquotes;
 extern bool set_monthly_index;
@@ -85,7 +86,11 @@ extern bool set_spamprotect;
 extern bool set_spamprotect_id;
 extern bool set_attachmentsindex;
 extern bool set_usegdbm;
+extern bool set_usebinindex;
 extern bool set_writehaof;
+extern bool set_searchindex;
+extern bool set_gzip_pages;
+extern bool set_brotli_pages;
 extern bool set_append;
 extern char *set_append_filename;
 extern bool set_nonsequential;
@@ -93,6 +98,7 @@ extern bool set_warn_suppressions;
 extern bool set_files_by_thread;
 extern bool set_href_detection;
 extern bool set_mbox_shortened;
+extern bool set_mbox_checkpoint;
 extern bool set_report_new_file;
 extern bool set_report_new_folder;
 extern bool set_use_sender_date;
@@ -106,6 +112,8 @@ extern int set_dirmode;
 extern int set_filemode;
 extern int set_locktime;
 extern int set_searchbackmsgnum;
+extern int set_linkquotes_threads;
+extern int set_linkquotes_method;
 extern int set_quote_hide_threshold;
 extern int set_thread_file_depth;
 extern int set_startmsgnum;
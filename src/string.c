@@ -1049,54 +1049,74 @@ char *convdash (char *line)
 } /* end convdash() */
 
 /*
-** Converts <, >, and & to &lt;, &gt; and &amp;.
-** It was ugly. Now its better. And probably faster.
-**
-** Returns an ALLOCATED string!
+** The WinLatin1 bytes 0x80 to 0x9f of an iso-8859-1 text, as the
+** Unicode entities convcharsreal() writes for them.
 */
+static const char *winlatin1_entity(unsigned char c)
+{
+    static char entities[32][12];
 
-char *convcharsreal(char *line, char *charset, int spamprotect)
+    if (!entities[c - 0x80][0])
+	sprintf(entities[c - 0x80], "&#x%x;", WIN1252CP[c - WIN1252CP_length]);
+    return entities[c - 0x80];
+}
+
+/*
+** The bytes convcharsreal() has to replace, indexed by whether the text
+** is iso-8859-1 and whether a '.' has to be spam protected. The '\0'
+** that ends the line is in all of them.
+*/
+static char convchars_special[2][2][256];
+
+static void init_convchars_special(void)
+{
+    const char *escaped = "<>&\"@";
+    int latin1, dot, c;
+
+    for (latin1 = 0; latin1 < 2; latin1++)
+	for (dot = 0; dot < 2; dot++) {
+	    char *special = convchars_special[latin1][dot];
+	    special[0] = 1;
+	    for (c = 0; escaped[c]; c++)
+		special[(unsigned char)escaped[c]] = 1;
+	    if (dot)
+		special['.'] = 1;
+	    if (latin1)
+		for (c = 0x80; c <= 0x9f; c++)
+		    special[c] = 1;
+	}
+}
+
+/*
+** The ISO-2022-JP version of convcharsreal(), which has to follow the
+** escape sequences byte by byte.
+*/
+static char *convchars_iso2022jp(char *line, bool is_iso_8859_1,
+				 int spamprotect)
 {
     struct Push buff;
     int in_ascii = TRUE, esclen = 0;
     int seen_at = FALSE;
-    bool is_iso_8859_1;
-
-    if (charset && !strcasecmp ("iso-8859-1", charset))
-      is_iso_8859_1 = TRUE;
-    else
-      is_iso_8859_1 = FALSE;
 
     INIT_PUSH(buff);		/* init macro */
 
-    /* avoid strlen() for speed */
-
     for (; *line; line++) {
 
-	if (set_iso2022jp) {
+	iso2022_state(line, &in_ascii, &esclen);
+	if (esclen && in_ascii == FALSE) {
+	    for (; in_ascii == FALSE && *line; line++) {
+		PushByte(&buff, *line);
 		iso2022_state(line, &in_ascii, &esclen);
-		if (esclen && in_ascii == FALSE) {
-			for (; in_ascii == FALSE && *line; line++) {
-				PushByte(&buff, *line);
-				iso2022_state(line, &in_ascii, &esclen);
-			}
-			line--;
-			continue;
-		}
+	    }
+	    line--;
+	    continue;
 	}
 
 	/* @@ JK : try to convert from the WinLatin1 code */
 	if (is_iso_8859_1
 	    && (unsigned char) (*line) >= 0x80 && (unsigned char) (*line) <= 0x9f) {
-	  char *unicode_entity;
-	  trio_asprintf (&unicode_entity, 
-			 "&#x%x;", WIN1252CP[(unsigned char) (*line) - WIN1252CP_length]);
-
-	  if (unicode_entity) {
-	    PushString(&buff, (const char *) unicode_entity);
-	    free (unicode_entity);
-	  }
-	  continue;
+	    PushString(&buff, winlatin1_entity((unsigned char) (*line)));
+	    continue;
 	}
 
 	switch (*line) {
@@ -1129,6 +1149,82 @@ char *convcharsreal(char *line, char *charset, int spamprotect)
 	}
     }
     RETURN_PUSH(buff);
+}
+
+/*
+** Converts <, >, and & to &lt;, &gt; and &amp;.
+** It was ugly. Now its better. And probably faster.
+**
+** Runs of bytes that need no escaping are found with a table lookup
+** per byte and copied in one go, so most of a line never goes through
+** PushByte().
+**
+** Returns an ALLOCATED string!
+*/
+
+char *convcharsreal(char *line, char *charset, int spamprotect)
+{
+    struct Push buff;
+    int seen_at = FALSE;
+    bool is_iso_8859_1;
+    const char *special;
+    char *end;
+    static int have_special = FALSE;
+
+    if (charset && !strcasecmp ("iso-8859-1", charset))
+      is_iso_8859_1 = TRUE;
+    else
+      is_iso_8859_1 = FALSE;
+
+    if (set_iso2022jp)
+	return convchars_iso2022jp(line, is_iso_8859_1, spamprotect);
+
+    if (!have_special) {
+	init_convchars_special();
+	have_special = TRUE;
+    }
+
+    INIT_PUSH(buff);		/* init macro */
+
+    while (*line) {
+	special = convchars_special[is_iso_8859_1][seen_at && spamprotect];
+	for (end = line; !special[(unsigned char)*end]; end++)
+	    ;
+	if (end != line) {
+	    PushNString(&buff, line, end - line);
+	    line = end;
+	    if (!*line)
+		break;
+	}
+
+	switch (*line) {
+	case '<':
+	    PushString(&buff, "&lt;");
+	    break;
+	case '>':
+	    PushString(&buff, "&gt;");
+	    break;
+	case '&':
+	    PushString(&buff, "&amp;");
+	    break;
+	case '\"':
+	    PushString(&buff, "&quot;");
+	    break;
+	case '@': /* pkn added: simple "antispam" measure */
+	    PushString(&buff, "&#64;");
+	    seen_at = TRUE;
+	    break;
+	case '.': /* only looked for after a '@' */
+	    PushString(&buff, "&#46;<!--nospam-->");
+	    seen_at = FALSE;
+	    break;
+	default: /* WinLatin1 */
+	    PushString(&buff, winlatin1_entity((unsigned char) (*line)));
+	    break;
+	}
+	line++;
+    }
+    RETURN_PUSH(buff);
 } /* end convcharsreal() */
 
 char *convcharsnospamprotect(char *line, char *charset)
@@ -24,12 +24,15 @@
 int rbs = 0;
 int rbs_bigtime = 0;
 
+#include <limits.h>
+
 #include "hypermail.h"
 #include "dmatch.h"
 #include "setup.h"
 #include "struct.h"
 #include "parse.h"
 #include "getname.h"
+#include "output.h"
 
 #define HAVE_PCRE
 #ifdef HAVE_PCRE
@@ -146,6 +149,97 @@ void fill_email_dates(struct emailinfo *e, char *date, char *fromdate, char *iso
     }
 }
 
+/*
+** The buckets that messages were added to since forget_new_messages(),
+** and the lowest number among those messages; see reply_is_current().
+*/
+
+static char new_in_bucket[HASHSIZE];
+static int first_new_msgnum = INT_MAX;
+
+static void add_to_bucket(unsigned hashval, struct emailinfo *e)
+{
+    struct hashemail *h;
+
+    h = (struct hashemail *)emalloc(sizeof(struct hashemail));
+    h->next = etable[hashval];
+    h->data = e;
+    etable[hashval] = h;
+    new_in_bucket[hashval] = 1;
+}
+
+/*
+** Called once the old messages of an archive are loaded, so that
+** only the messages added after that count as new.
+*/
+
+void forget_new_messages(void)
+{
+    memset(new_in_bucket, 0, sizeof(new_in_bucket));
+    first_new_msgnum = INT_MAX;
+}
+
+/*
+** Is the reply_to of an old message, as read from the archive index,
+** still what hashreplynumlookup() would answer? The in-reply-to part
+** of the lookup only looks at the hash bucket of the in-reply-to
+** string, so that answer can only have changed if a new message was
+** put in that bucket. The subject part only looks for matches with a
+** lower number than the message's own, and new messages come after
+** the old ones.
+*/
+
+int reply_is_current(struct emailinfo *e)
+{
+    return e->reply_to != REPLY_UNKNOWN
+	&& !new_in_bucket[hash(e->inreplyto)]
+	&& e->msgnum < first_new_msgnum;
+}
+
+/*
+** The subject and author of a message as the links to it from other
+** pages show them, and the subject as the mail commands of its page
+** get it. A message is linked to from the pages of its neighbours, its
+** replies and the messages it replies to, so these are made the first
+** time they are needed and kept: the subject, name and charset they
+** come from don't change once addhash() has set them.
+*/
+
+char *msg_link_subject(struct emailinfo *e)
+{
+    if (!e->link_subject)
+#ifdef HAVE_ICONV
+	e->link_subject = i18n_utf2numref(e->subject, 1);
+#else
+	e->link_subject = convchars(e->subject, e->charset);
+#endif
+    return e->link_subject;
+}
+
+char *msg_link_name(struct emailinfo *e)
+{
+    if (!e->link_name)
+#ifdef HAVE_ICONV
+	e->link_name = i18n_utf2numref(e->name, 1);
+#else
+	e->link_name = convchars(e->name, e->charset);
+#endif
+    return e->link_name;
+}
+
+char *msg_mail_subject(struct emailinfo *e)
+{
+#ifdef HAVE_ICONV
+    size_t len;
+
+    if (!e->mail_subject)
+	e->mail_subject = i18n_convstring(e->subject, "UTF-8", e->charset, &len);
+    return e->mail_subject;
+#else
+    return e->subject;
+#endif
+}
+
 /*
 ** The structure most of everything else depends on.
 ** Hashes a message - header info, pointer to a list of body lines -
@@ -153,12 +247,11 @@ void fill_email_dates(struct emailinfo *e, char *date, char *fromdate, char *iso
 ** handily looked up and retrieved using any of these criteria.
 */
 
-struct emailinfo *addhash(int num, char *date, char *name, char *email, char *msgid, char *subject, char *inreply, char *fromdate, char *charset, char *isodate, char *isofromdate, struct body *sp)
+static struct emailinfo *addhash0(int num, char *date, char *name, char *email, char *msgid, char *subject, char *inreply, char *fromdate, char *charset, char *isodate, char *isofromdate, time_t *secs, struct body *sp)
 {
     struct emailinfo *e;
     struct hashemail *h;
 
-    unsigned hashval;
     char numstr[NUMSTRLEN];
     bool msgid_dup = 0;
     bool msgid_missing = 0;
@@ -251,7 +344,14 @@ struct emailinfo *addhash(int num, char *date, char *name, char *email, char *ms
     else
 	e->name = strsav(name);
 
-    fill_email_dates(e, date, fromdate, isodate, isofromdate);
+    if (secs) {
+	e->date = secs[0];
+	e->fromdate = secs[1];
+	e->fromdatestr = strsav(fromdate);
+	e->datestr = strsav(date);
+    }
+    else
+	fill_email_dates(e, date, fromdate, isodate, isofromdate);
     e->subdir = msg_subdir(e->msgnum, set_use_sender_date ? e->date
 			   : e->fromdate);
     if (e->subdir && set_increment != -1) {
@@ -263,52 +363,200 @@ struct emailinfo *addhash(int num, char *date, char *name, char *email, char *ms
     e->msgid = strsav(msgid);
     e->subject = strsav(subject);
     e->unre_subject = unre(subject);
+    e->link_subject = e->link_name = e->mail_subject = NULL;
     e->inreplyto = strsav(inreply);
     e->charset = strsav(charset);
     e->flags = 0;
     e->is_deleted = 0;
     e->deletion_completed = -1;
     e->exp_time = -1;
+    e->annotation_robot = ANNOTATION_ROBOT_NONE;
+    e->annotation_content = ANNOTATION_CONTENT_NONE;
     e->bodylist = sp;
+    e->attachlist = NULL;
     e->initial_next_in_thread = -1;
+    e->reply_to = REPLY_UNKNOWN;
+    e->maybereply = 0;
+    e->reply_links[0] = e->reply_links[1] = REPLY_UNKNOWN;
+    e->sure_reply_link = REPLY_UNKNOWN;
 
     /* Added by Daniel 1999-03-19, we need this hash later to find the mail
        we replied to */
-    h = (struct hashemail *)emalloc(sizeof(struct hashemail));
-    hashval = hash(inreply);
-    h->next = etable[hashval];
-    h->data = e;
-    etable[hashval] = h;
-
-    h = (struct hashemail *)emalloc(sizeof(struct hashemail));
-    hashval = hash(date);
-    h->next = etable[hashval];
-    h->data = e;
-    etable[hashval] = h;
-
-    h = (struct hashemail *)emalloc(sizeof(struct hashemail));
+    add_to_bucket(hash(inreply), e);
+    add_to_bucket(hash(date), e);
 #if 0
     printf("ADD msgid %s to HASH!\n", msgid);
 #endif
-    hashval = hash(msgid);
-    h->next = etable[hashval];
-    h->data = e;
-    etable[hashval] = h;
+    add_to_bucket(hash(msgid), e);
+    add_to_bucket(hash(subject), e);
+    fmt_int(numstr, num);
+    add_to_bucket(hash(numstr), e);
+    if (num < first_new_msgnum)
+	first_new_msgnum = num;
 
-    h = (struct hashemail *)emalloc(sizeof(struct hashemail));
-    hashval = hash(subject);
-    h->next = etable[hashval];
-    h->data = e;
-    etable[hashval] = h;
+    return e;			/* the actual mail struct pointer */
+}
 
-    h = (struct hashemail *)emalloc(sizeof(struct hashemail));
-    sprintf(numstr, "%d", num);
-    hashval = hash(numstr);
-    h->next = etable[hashval];
-    h->data = e;
-    etable[hashval] = h;
+struct emailinfo *addhash(int num, char *date, char *name, char *email, char *msgid, char *subject, char *inreply, char *fromdate, char *charset, char *isodate, char *isofromdate, struct body *sp)
+{
+    return addhash0(num, date, name, email, msgid, subject, inreply,
+		    fromdate, charset, isodate, isofromdate, NULL, sp);
+}
 
-    return e;			/* the actual mail struct pointer */
+/*
+** Like addhash(), for a message whose dates are already known as
+** seconds, so they don't have to be parsed again.
+*/
+
+struct emailinfo *addhash_dated(int num, char *date, char *name, char *email, char *msgid, char *subject, char *inreply, char *fromdate, char *charset, time_t datesecs, time_t fromdatesecs, struct body *sp)
+{
+    time_t secs[2];
+
+    secs[0] = datesecs;
+    secs[1] = fromdatesecs;
+    return addhash0(num, date, name, email, msgid, subject, inreply,
+		    fromdate, charset, NULL, NULL, secs, sp);
+}
+
+/*
+** While old headers are loaded, insert_in_lists() only queues the
+** messages for the author, subject and date trees, and
+** build_header_lists() makes the trees in one go. Inserted one at a
+** time in message number order, the messages of an author or a
+** subject (and the dates, which mostly go up) make long chains that
+** each new message has to walk.
+*/
+
+struct queued_header {
+    struct emailinfo *email;
+    int seq;			/* the order insert_in_lists() saw them in */
+};
+
+static struct queued_header *queued_headers = NULL;
+static int num_queued_headers = 0;
+static int queued_headers_space = 0;
+static int queue_headers = FALSE;
+
+void queue_header_lists(void)
+{
+    queue_headers = TRUE;
+}
+
+static void queue_header(struct emailinfo *emp)
+{
+    if (num_queued_headers == queued_headers_space) {
+	queued_headers_space = queued_headers_space ? 2 * queued_headers_space : 1024;
+	queued_headers = (struct queued_header *)realloc(queued_headers, queued_headers_space * sizeof(struct queued_header));
+	if (!queued_headers) {
+	    snprintf(errmsg, sizeof(errmsg), "Couldn't allocate %d bytes of memory.", (int)(queued_headers_space * sizeof(struct queued_header)));
+	    progerr(errmsg);
+	}
+    }
+    queued_headers[num_queued_headers].email = emp;
+    queued_headers[num_queued_headers].seq = num_queued_headers;
+    ++num_queued_headers;
+}
+
+/*
+** The orders addheader() gives: a message goes before the equal ones
+** already in the author and subject trees, and after them in the
+** date tree (before them with the reverse option).
+*/
+
+static int cmp_queued_authors(const void *a, const void *b)
+{
+    const struct queued_header *qa = (const struct queued_header *)a;
+    const struct queued_header *qb = (const struct queued_header *)b;
+    int r = strcasecmp(qa->email->name, qb->email->name);
+    return r ? r : qb->seq - qa->seq;
+}
+
+static int cmp_queued_subjects(const void *a, const void *b)
+{
+    const struct queued_header *qa = (const struct queued_header *)a;
+    const struct queued_header *qb = (const struct queued_header *)b;
+    int r = strcasecmp(qa->email->unre_subject, qb->email->unre_subject);
+    return r ? r : qb->seq - qa->seq;
+}
+
+static int cmp_queued_dates(const void *a, const void *b)
+{
+    const struct queued_header *qa = (const struct queued_header *)a;
+    const struct queued_header *qb = (const struct queued_header *)b;
+    long da = qa->email->datenum;
+    long db = qb->email->datenum;
+    if (set_reverse)
+	return (da != db) ? (da > db ? -1 : 1) : qb->seq - qa->seq;
+    return (da != db) ? (da < db ? -1 : 1) : qa->seq - qb->seq;
+}
+
+static struct header *header_tree(struct queued_header *q, int n)
+{
+    struct header *hp;
+    int mid = n / 2;
+    if (n <= 0)
+	return NULL;
+    hp = (struct header *)emalloc(sizeof(struct header));
+    hp->data = q[mid].email;
+    hp->left = header_tree(q, mid);
+    hp->right = header_tree(q + mid + 1, n - mid - 1);
+    return hp;
+}
+
+static struct header *queued_header_tree(int (*cmp) (const void *, const void *), int skip_deleted)
+{
+    struct queued_header *q;
+    struct header *hp;
+    int i, n = 0;
+
+    q = (struct queued_header *)emalloc((num_queued_headers + 1) * sizeof(struct queued_header));
+    for (i = 0; i < num_queued_headers; ++i)
+	if (!skip_deleted || !queued_headers[i].email->is_deleted)
+	    q[n++] = queued_headers[i];
+    qsort(q, n, sizeof(struct queued_header), cmp);
+    hp = header_tree(q, n);
+    free(q);
+    return hp;
+}
+
+/*
+** Makes the author, subject and date trees of the queued messages,
+** balanced, with the same order addheader() would have given them.
+*/
+
+void build_header_lists(void)
+{
+    int i;
+
+    queue_headers = FALSE;
+    if (authorlist || subjectlist || datelist) {
+	for (i = 0; i < num_queued_headers; ++i) {
+	    struct emailinfo *emp = queued_headers[i].email;
+	    if (!emp->is_deleted) {
+		authorlist = addheader(authorlist, emp, 1, 0);
+		subjectlist = addheader(subjectlist, emp, 0, 0);
+	    }
+	    datelist = addheader(datelist, emp, 2, 0);
+	}
+    }
+    else if (num_queued_headers) {
+	for (i = 0; i < num_queued_headers; ++i) {
+	    struct emailinfo *emp = queued_headers[i].email;
+	    long yearsecs = set_use_sender_date ? emp->date : emp->fromdate;
+	    emp->datenum = yearsecs;
+	    if (!firstdatenum || yearsecs < firstdatenum)
+		firstdatenum = yearsecs;
+	    if (yearsecs > lastdatenum)
+		lastdatenum = yearsecs;
+	}
+	authorlist = queued_header_tree(cmp_queued_authors, TRUE);
+	subjectlist = queued_header_tree(cmp_queued_subjects, TRUE);
+	datelist = queued_header_tree(cmp_queued_dates, FALSE);
+    }
+    if (queued_headers)
+	free(queued_headers);
+    queued_headers = NULL;
+    num_queued_headers = queued_headers_space = 0;
 }
 
 int insert_in_lists(struct emailinfo *emp, const bool * require_filter, int rlen)
@@ -364,13 +612,17 @@ int insert_in_lists(struct emailinfo *emp, const bool * require_filter, int rlen
 			printf("message %d deleted under option %s. msgid: %s\n", emp->msgnum + 1, option, emp->msgid);
 	}
     }
+    if (queue_headers)
+	queue_header(emp);
     else {
-        authorlist = addheader(authorlist, emp, 1, 0);
+	if (!emp->is_deleted) {
+	    authorlist = addheader(authorlist, emp, 1, 0);
 
-	subjectlist = addheader(subjectlist, emp, 0, 0);
+	    subjectlist = addheader(subjectlist, emp, 0, 0);
 
+	}
+	datelist = addheader(datelist, emp, 2, 0);
     }
-    datelist = addheader(datelist, emp, 2, 0);
     return !emp->is_deleted;
 }
 
@@ -600,7 +852,7 @@ struct body *hashnumlookup(int num, struct emailinfo **emailp)
     struct body *lp_tmp;
     char numstr[NUMSTRLEN];
 
-    sprintf(numstr, "%d", num);
+    fmt_int(numstr, num);
     for (ep = etable[hash(numstr)]; ep != NULL; ep = ep->next) {
 	if (ep->data && (num == ep->data->msgnum)) {
 	    /* return a mere pointer to it! */
@@ -613,6 +865,37 @@ struct body *hashnumlookup(int num, struct emailinfo **emailp)
     return NULL;
 }
 
+/*
+ * Returns an array of the messages from 0 to maxnum by number, as
+ * hashnumlookup() would find them, for the loops that go over the
+ * whole archive. The caller frees it.
+ */
+
+struct emailinfo **hashnumtable(int maxnum)
+{
+    struct emailinfo **table;
+    struct hashemail *ep;
+    char numstr[NUMSTRLEN];
+    unsigned i;
+    int num;
+
+    /* one more than needed, so that maxnum -1 is no special case */
+    table = (struct emailinfo **)emalloc((maxnum + 2) * sizeof(struct emailinfo *));
+    for (num = 0; num <= maxnum; num++)
+	table[num] = NULL;
+    for (i = 0; i < HASHSIZE; i++)
+	for (ep = etable[i]; ep != NULL; ep = ep->next) {
+	    num = ep->data ? ep->data->msgnum : -1;
+	    if (num < 0 || num > maxnum || table[num])
+		continue;
+	    /* the first entry of its number bucket, as hashnumlookup() */
+	    fmt_int(numstr, num);
+	    if (hash(numstr) == i)
+		table[num] = ep->data;
+	}
+    return table;
+}
+
 /*
  * returns info about the first message associated with the given msgid.
  */
@@ -661,7 +944,7 @@ struct emailinfo *neighborlookup(int num, int direction)
     num += direction;
 
     while (num >= 0 && num <= max_msgnum) {
-	sprintf(numstr, "%d", num);
+	fmt_int(numstr, num);
 	for (ep = etable[hash(numstr)]; ep != NULL; ep = ep->next)
 	    if (ep->data && (num == ep->data->msgnum)) {
 	        if (ep->data->is_deleted)
@@ -1264,6 +1547,10 @@ struct emailsubdir *new_subdir(char *subdir, struct emailsubdir *last_subdir, ch
     new_sd->subdir = strsav(subdir);
     new_sd->description = description;
     new_sd->a_date = date;
+    new_sd->changed = 0;
+    new_sd->threads_changed = 0;
+    new_sd->index_count = 0;
+    new_sd->index_sum = 0;
     if (set_base_url != NULL) {
 		if (set_base_url[strlen(set_base_url) - 1] != '/')
 	    trio_asprintf(&new_sd->rel_path_to_top, "%s/", set_base_url);
@@ -8,7 +8,18 @@ void fill_email_dates(struct emailinfo *, char *, char *, char *, char *);
 
 struct emailinfo *addhash(int, char *, char *, char *, char *, char *, char *,
 			  char *, char *, char *, char *, struct body *);
+struct emailinfo *addhash_dated(int, char *, char *, char *, char *, char *,
+				char *, char *, char *, time_t, time_t,
+				struct body *);
 
+void forget_new_messages(void);
+int reply_is_current(struct emailinfo *);
+char *msg_link_subject(struct emailinfo *);
+char *msg_link_name(struct emailinfo *);
+char *msg_mail_subject(struct emailinfo *);
+
+void queue_header_lists(void);
+void build_header_lists(void);
 int insert_in_lists(struct emailinfo *, const bool *, int);
 
 struct emailinfo *hashreplylookup(int, char *, char *, int *);
@@ -19,6 +30,7 @@ struct emailinfo *hashlookupbymsgid(char *);
 int insert_older_msgs(int);
 
 struct body *hashnumlookup(int, struct emailinfo **);
+struct emailinfo **hashnumtable(int);
 struct emailinfo *neighborlookup(int, int);
 
 struct body *addbody(struct body *, struct body **, char *, int);
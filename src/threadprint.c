@@ -4,6 +4,7 @@
 #include "threadprint.h"
 #include "printfile.h"
 #include "print.h"
+#include "output.h"
 
 static void format_thread_info(FILE *, struct emailinfo *, int, int *,
 			       struct emailinfo *, FILE *, int, bool);
@@ -21,12 +22,29 @@ static void finish_thread_file(FILE *, struct emailinfo *, char *);
 static int num_open_li[MAXSTACK + 1];
 
 
+/*
+** Does the thread that starts at rp have a message within the period?
+*/
+
+static bool thread_in_period(struct reply *rp, int year, int month)
+{
+    for (; rp != NULL && rp->msgnum != -1; rp = rp->next)
+	if ((year == -1 || year_of_datenum(rp->data->date) == year)
+	    && (month == -1 || month_of_datenum(rp->data->date) == month)
+	    && !rp->data->is_deleted)
+	    return TRUE;
+    return FALSE;
+}
+
 /*
 ** If year and/or month are != -1, only messages within the specified time
-** period will be printed.
+** period will be printed, and threads without such messages are skipped.
+** If starts isn't NULL, it lists where in threadlist the threads to print
+** start, ending with NULL, and the rest of threadlist isn't looked at.
 */
 
-void print_all_threads(FILE *fp, int year, int month, struct emailinfo *email)
+void print_all_threads(FILE *fp, int year, int month, struct emailinfo *email,
+		       struct reply **starts)
 {
     int level = 0;
     int newlevel;
@@ -47,6 +65,7 @@ void print_all_threads(FILE *fp, int year, int month, struct emailinfo *email)
     char *filenameb = NULL;
     int threadnum = 0;
     bool is_first = TRUE;
+    bool thread_start = TRUE;
 
     struct reply *rp = threadlist;
     last_email = rp->data;
@@ -57,6 +76,9 @@ void print_all_threads(FILE *fp, int year, int month, struct emailinfo *email)
     for (i = 0; i <= MAXSTACK; i++)
       num_replies[i] = num_open_li[i] = 0;
 
+    if (starts)
+	rp = *starts++;
+
     while (rp != NULL) {
 #if DEBUG_THREAD
 	fprintf(stderr, "print_all_threads: message %d prev %d level %d\n",
@@ -69,10 +91,20 @@ void print_all_threads(FILE *fp, int year, int month, struct emailinfo *email)
 				     thread_file_depth, email, last_email,
 				     filenameb, fp_body);
 	    filenameb = NULL;
-	    rp = rp->next;
+	    thread_start = TRUE;
+	    rp = starts ? *starts++ : rp->next;
 	    continue;
 	}
-	else if(level == 0 && subdir && rp->data->subdir != subdir) {
+	else if (thread_start && (year != -1 || month != -1)
+		 && !thread_in_period(rp, year, month)) {
+	    while (rp != NULL && rp->msgnum != -1)
+		rp = rp->next;
+	    if (rp != NULL)
+		rp = rp->next;
+	    continue;
+	}
+	thread_start = FALSE;
+	if(level == 0 && subdir && rp->data->subdir != subdir) {
 	    rp = rp->next;
 	    continue;
 	}
@@ -242,23 +274,25 @@ static void format_thread_info(FILE *fp, struct emailinfo *email,
 			       struct emailinfo* subdir_email, FILE *fp_body,
 			       int threadnum, bool is_first)
 {
-    char *subj, *tmpname;
+    const char *charset;
     char *href = NULL;
     char buffer[256];
     char *first_attributes = (is_first) ? " accesskey=\"j\" name=\"first\" id=\"first\"" : "";
 
 #ifdef HAVE_ICONV
-    subj = convchars(email->subject, "utf-8");
-    tmpname = convchars(email->name, "utf-8");
+    charset = "utf-8";
 #else
-    subj = convchars(email->subject, email->charset);
-    tmpname = convchars(email->name, email->charset);
+    charset = email->charset;
 #endif
 
     if (set_files_by_thread) {
 	int maybe_reply = 0;
 	int is_reply = 1;
-	fprintf(fp_body, "<a name =\"%.4d\" id=\"%.4d\"></a>", email->msgnum, email->msgnum);
+	out_lit(fp_body, "<a name =\"");
+	out_msgnum(fp_body, email->msgnum);
+	out_lit(fp_body, "\" id=\"");
+	out_msgnum(fp_body, email->msgnum);
+	out_lit(fp_body, "\"></a>");
 	print_headers(fp_body, email, TRUE);
 	if ((set_show_msg_links && set_show_msg_links != 4) || !set_usetable) {
 	    fprintf(fp_body, "</ul>\n");
@@ -277,27 +311,42 @@ static void format_thread_info(FILE *fp, struct emailinfo *email,
 
     /* Print the thread info */
     if (set_indextable) {
-	fprintf(fp,
-		"<tr><td>%s<a href=\"%s\"%s><strong>%s</strong></a></td>"
-		"<td nowrap><a name=\"%s%d\" id=\"%s%d\">%s</a></td>" "<td nowrap>%s</td></tr>\n",
-		level > 1 ? "--&gt; " : "", 
-		href, first_attributes,
-		subj, set_fragment_prefix, email->msgnum, set_fragment_prefix, email->msgnum, tmpname, getindexdatestr(email->date));
+	out_lit(fp, "<tr><td>");
+	if (level > 1)
+	    out_lit(fp, "--&gt; ");
+	out_lit(fp, "<a href=\"");
+	out_str(fp, href);
+	out_lit(fp, "\"");
+	out_str(fp, first_attributes);
+	out_lit(fp, "><strong>");
+	out_html(fp, email->subject, charset);
+	out_lit(fp, "</strong></a></td><td nowrap><a ");
+	out_msg_anchor(fp, email->msgnum);
+	out_lit(fp, ">");
+	out_html(fp, email->name, charset);
+	out_lit(fp, "</a></td><td nowrap>");
+	out_str(fp, getindexdatestr(email->date));
+	out_lit(fp, "</td></tr>\n");
     }
     else {
         if (num_open_li[level] != 0) {
-	  fprintf (fp, "</li>\n");
+	  out_lit(fp, "</li>\n");
 	  num_open_li[level]--;
 	}
-	fprintf(fp, "<li><a href=\"%s\"%s>%s</a>&nbsp;"
-		"<a name=\"%s%d\" id=\"%s%d\"><em>%s</em></a>&nbsp;<em>(%s)</em>\n", 
-		href, first_attributes, 
-		subj, set_fragment_prefix, email->msgnum, set_fragment_prefix, email->msgnum, tmpname, getindexdatestr(email->date));
+	out_lit(fp, "<li><a href=\"");
+	out_str(fp, href);
+	out_lit(fp, "\"");
+	out_str(fp, first_attributes);
+	out_lit(fp, ">");
+	out_html(fp, email->subject, charset);
+	out_lit(fp, "</a>&nbsp;<a ");
+	out_msg_anchor(fp, email->msgnum);
+	out_lit(fp, "><em>");
+	out_html(fp, email->name, charset);
+	out_lit(fp, "</em></a>&nbsp;<em>(");
+	out_str(fp, getindexdatestr(email->date));
+	out_lit(fp, ")</em>\n");
     }
-    if (subj)
-      free(subj);
-    if (tmpname)
-      free(tmpname);
     ++num_replies[level];
     if (!set_indextable)
       ++num_open_li[level];
@@ -332,6 +381,7 @@ finish_thread_file(FILE *fp_body, struct emailinfo *email, char *filenameb)
                      filenameb, set_filemode);
 	    progerr(errmsg);
 	}
+	compress_page(filenameb);
 	free(filenameb);
 }
 
@@ -386,10 +436,13 @@ static int finish_thread_levels(FILE **fp, int level, int newlevel,
                                      filename, set_filemode);
 			    progerr(errmsg);
 			}
+			compress_page(filename);
 			num_open_li[level]++;
 		    }
-		    else
+		    else {
 			remove(filename);
+			remove_compressed_page(filename);
+		    }
 		    free(filename_stack[level]);
 		    free(filename);
 		}
@@ -1,2 +1,2 @@
-void print_all_threads(FILE *, int, int, struct emailinfo *);
+void print_all_threads(FILE *, int, int, struct emailinfo *, struct reply **);
 int isreplyto(int, int);